@@ -17,6 +17,52 @@
 #include <memory>
 #include <cmath>
 #include <cstring>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cctype>
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <list>
+#include <map>
+#include <bitset>
+#include <mutex>
+#include <unordered_map>
+#include <stdexcept>
+#include <fstream>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <future>
+
+// POSIX memory mapping for model files, thread affinity, NUMA placement
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// SIMD kernels are selected at compile time (e.g. -march=native)
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+// C++20 coroutine awaitables for the Scheduler (-DLLAMALEX_NO_COROUTINES to leave out)
+#if defined(__cpp_impl_coroutine) && defined(__has_include) && !defined(LLAMALEX_NO_COROUTINES)
+#if __has_include(<coroutine>)
+#include <coroutine>
+#define LLAMALEX_COROUTINES 1
+#endif
+#endif
 
 // GGML would be included here
 // #include "ggml.h"
@@ -24,235 +70,7378 @@
 namespace llamalex {
 
 /**
- * LegalTokenizer - Tokenization for legal text
+ * Weight storage types (values are the GGML/GGUF type ids)
+ *
+ * Q8_0: blocks of 32 int8 values with one fp16 scale (34 bytes / 32).
+ * Q4_K: super-blocks of 256 4-bit values in eight 32-value sub-blocks,
+ *       each with a 6-bit scale and min (144 bytes / 256).
  */
-class LegalTokenizer {
+enum class TensorType : uint32_t {
+    F32 = 0,
+    F16 = 1,
+    Q8_0 = 8,
+    Q4_K = 12
+};
+
+struct BlockQ8_0 {
+    uint16_t d;        // fp16 scale
+    int8_t qs[32];
+};
+
+struct BlockQ4_K {
+    uint16_t d;        // fp16 super-block scale for the sub-block scales
+    uint16_t dmin;     // fp16 super-block scale for the sub-block mins
+    uint8_t scales[12]; // 8 x (6-bit scale, 6-bit min), packed
+    uint8_t qs[128];   // 256 x 4-bit values
+};
+
+static_assert(sizeof(BlockQ8_0) == 34, "BlockQ8_0 must match the GGML layout");
+static_assert(sizeof(BlockQ4_K) == 144, "BlockQ4_K must match the GGML layout");
+
+// Values per block of a storage type
+inline size_t type_block_size(TensorType type) {
+    switch (type) {
+        case TensorType::Q8_0: return 32;
+        case TensorType::Q4_K: return 256;
+        default: return 1;
+    }
+}
+
+// Bytes per block of a storage type (0 if unsupported)
+inline size_t type_block_bytes(TensorType type) {
+    switch (type) {
+        case TensorType::F32: return sizeof(float);
+        case TensorType::F16: return sizeof(uint16_t);
+        case TensorType::Q8_0: return sizeof(BlockQ8_0);
+        case TensorType::Q4_K: return sizeof(BlockQ4_K);
+        default: return 0;
+    }
+}
+
+inline const char* type_name(TensorType type) {
+    switch (type) {
+        case TensorType::F32: return "f32";
+        case TensorType::F16: return "f16";
+        case TensorType::Q8_0: return "q8_0";
+        case TensorType::Q4_K: return "q4_k";
+        default: return "unknown";
+    }
+}
+
+/**
+ * WeightTensor - Non-owning view of a row-major [rows x cols] weight matrix
+ *
+ * Points either into a model-owned buffer (random init) or straight into a
+ * memory-mapped model file. Vectors (norm weights) have rows == 1 and are
+ * always F32; matrices may be stored in any TensorType. With NUMA
+ * replication, `replicas` holds one copy of the data per node.
+ */
+struct WeightTensor {
+    const void* data = nullptr;
+    TensorType type = TensorType::F32;
+    size_t rows = 0;
+    size_t cols = 0;
+    const void* const* replicas = nullptr;  // per NUMA node, owned by the WeightStore
+    
+    // The same tensor reading node `node`'s copy, if it has one
+    WeightTensor on_node(size_t node) const {
+        WeightTensor w = *this;
+        if (replicas) w.data = replicas[node];
+        return w;
+    }
+    
+    size_t size() const { return rows * cols; }
+    size_t row_bytes() const { return cols / type_block_size(type) * type_block_bytes(type); }
+    size_t bytes() const { return rows * row_bytes(); }
+    const uint8_t* row(size_t r) const { return static_cast<const uint8_t*>(data) + r * row_bytes(); }
+    const float* f32() const { return static_cast<const float*>(data); }
+};
+
+/**
+ * AlignedBuffer - Owned byte buffer aligned for SIMD loads (cache-line aligned)
+ *
+ * pages() instead maps whole pages of its own, so a memory policy set on
+ * them (numa_bind) covers nothing else on the heap.
+ */
+class AlignedBuffer {
 public:
-    LegalTokenizer(size_t vocab_size = 50000) : vocab_size_(vocab_size) {
-        // Initialize vocabulary with legal terms
-        init_vocab();
+    static const size_t kAlignment = 64;
+    
+    AlignedBuffer() {}
+    explicit AlignedBuffer(size_t bytes, size_t alignment = kAlignment) : size_(bytes) {
+        void* ptr = nullptr;
+        if (posix_memalign(&ptr, alignment, std::max<size_t>(bytes, 1)) != 0) throw std::bad_alloc();
+        data_.reset(static_cast<uint8_t*>(ptr));
     }
     
-    std::vector<int> tokenize(const std::string& text) {
-        // Simple word-level tokenization (production would use BPE)
-        std::vector<int> tokens;
-        tokens.push_back(1); // BOS token
+    // At least bytes, rounded up to whole pages from mmap (untouched, so
+    // placed by the first policy applied); size() is the rounded size
+    static AlignedBuffer pages(size_t bytes) {
+        const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        const size_t rounded = (std::max<size_t>(bytes, 1) + page - 1) / page * page;
+        void* ptr = ::mmap(nullptr, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ptr == MAP_FAILED) throw std::bad_alloc();
+        AlignedBuffer buffer;
+        buffer.data_ = std::unique_ptr<uint8_t, Free>(static_cast<uint8_t*>(ptr), Free(rounded));
+        buffer.size_ = rounded;
+        return buffer;
+    }
+    
+    uint8_t* data() { return data_.get(); }
+    const uint8_t* data() const { return data_.get(); }
+    size_t size() const { return size_; }
+
+private:
+    struct Free {
+        size_t mapped;  // bytes to munmap; 0: from posix_memalign
         
-        // Split text into words and convert to token IDs
-        std::string word;
-        for (char c : text) {
-            if (c == ' ' || c == '\n' || c == '\t') {
-                if (!word.empty()) {
-                    tokens.push_back(get_token_id(word));
-                    word.clear();
-                }
+        Free() : mapped(0) {}
+        explicit Free(size_t mapped_bytes) : mapped(mapped_bytes) {}
+        void operator()(uint8_t* ptr) const {
+            if (mapped) {
+                ::munmap(ptr, mapped);
             } else {
-                word += c;
+                std::free(ptr);
+            }
+        }
+    };
+    std::unique_ptr<uint8_t, Free> data_;
+    size_t size_ = 0;
+};
+
+/**
+ * ScratchArena - Bump allocator for the activations of one forward step
+ *
+ * Buffers are carved from one aligned block and given back all at once:
+ * reset() at the start of a step, or a Scope that rewinds to where it was
+ * opened (e.g. per layer). A buffer that does not fit is served from an
+ * overflow block and the next reset() grows the main block to the step's
+ * high-water mark, so once a shape has been seen no further heap memory is
+ * requested. allocations() counts every block taken from the heap.
+ */
+class ScratchArena {
+public:
+    explicit ScratchArena(size_t bytes = 0) {
+        if (bytes > 0) grow(bytes);
+    }
+    
+    ScratchArena(const ScratchArena&) = delete;
+    ScratchArena& operator=(const ScratchArena&) = delete;
+    
+    // Uninitialized, cache-line aligned room for n values of T
+    template <typename T>
+    T* alloc(size_t n) {
+        const size_t bytes = (n * sizeof(T) + AlignedBuffer::kAlignment - 1) & ~(AlignedBuffer::kAlignment - 1);
+        uint8_t* ptr;
+        if (used_ + bytes <= block_.size()) {
+            ptr = block_.data() + used_;
+            used_ += bytes;
+        } else {
+            overflow_.push_back(AlignedBuffer(bytes));
+            ++allocations_;
+            overflow_bytes_ += bytes;
+            ptr = overflow_.back().data();
+        }
+        high_water_ = std::max(high_water_, used_ + overflow_bytes_);
+        return reinterpret_cast<T*>(ptr);
+    }
+    
+    float* floats(size_t n) { return alloc<float>(n); }
+    
+    // Invalidates every buffer handed out so far
+    void reset() {
+        if (!overflow_.empty()) {
+            overflow_.clear();
+            overflow_bytes_ = 0;
+            grow(high_water_);
+        }
+        used_ = 0;
+    }
+    
+    // Buffers allocated while a Scope is open are released when it closes
+    class Scope {
+    public:
+        explicit Scope(ScratchArena& arena) : arena_(arena), mark_(arena.used_) {}
+        ~Scope() { arena_.used_ = mark_; }
+        
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+    
+    private:
+        ScratchArena& arena_;
+        size_t mark_;
+    };
+    
+    size_t capacity() const { return block_.size(); }
+    size_t high_water() const { return high_water_; }
+    size_t allocations() const { return allocations_; }
+
+private:
+    AlignedBuffer block_;
+    std::vector<AlignedBuffer> overflow_;  // until the next reset()
+    size_t used_ = 0;
+    size_t overflow_bytes_ = 0;
+    size_t high_water_ = 0;
+    size_t allocations_ = 0;
+    
+    void grow(size_t bytes) {
+        block_ = AlignedBuffer(bytes);
+        ++allocations_;
+    }
+};
+
+/**
+ * Tensor helpers shared by the transformer layers.
+ *
+ * Activations are row-major [n_tokens x dim]; weight matrices are row-major
+ * [out_dim x in_dim] so every output element is one contiguous dot product.
+ */
+namespace {
+
+// Deterministic uniform init in [-scale, scale] (xorshift64*)
+void fill_random(std::vector<float>& data, float scale, uint64_t seed) {
+    uint64_t state = seed * 0x9E3779B97F4A7C15ull + 1;
+    for (float& x : data) {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        const uint32_t bits = static_cast<uint32_t>((state * 0x2545F4914F6CDD1Dull) >> 40);
+        x = scale * (2.0f * (bits / 16777216.0f) - 1.0f);
+    }
+}
+
+// FNV-1a over n bytes, continuing from h
+inline uint64_t fnv1a(const void* data, size_t n, uint64_t h = 1469598103934665603ull) {
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < n; ++i) {
+        h ^= p[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+// Hash of n bytes, continuing from h: four multiply-xorshift lanes over
+// 8-byte words, for buffers too large for fnv1a (whole weight tensors)
+inline uint64_t hash_words(const void* data, size_t n, uint64_t h = 0) {
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    const uint64_t k = 0x9E3779B97F4A7C15ull;
+    uint64_t lane[4] = {h ^ n, h + k, h - k, ~h};
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        for (int l = 0; l < 4; ++l) {
+            uint64_t w;
+            std::memcpy(&w, p + i + 8 * l, sizeof(w));
+            lane[l] = (lane[l] ^ w) * k;
+            lane[l] ^= lane[l] >> 31;
+        }
+    }
+    uint64_t out = fnv1a(p + i, n - i, lane[0]);
+    for (int l = 1; l < 4; ++l) {
+        out = (out ^ lane[l]) * k;
+        out ^= out >> 29;
+    }
+    return out;
+}
+
+inline uint32_t fp32_to_bits(float f) {
+    uint32_t bits;
+    std::memcpy(&bits, &f, sizeof(bits));
+    return bits;
+}
+
+inline float fp32_from_bits(uint32_t bits) {
+    float f;
+    std::memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+// IEEE half -> float (handles subnormals, inf and NaN)
+inline float fp16_to_fp32(uint16_t h) {
+    const uint32_t w = static_cast<uint32_t>(h) << 16;
+    const uint32_t sign = w & 0x80000000u;
+    const uint32_t two_w = w + w;
+    const float exp_scale = fp32_from_bits(0x07800000u);  // 2^-112
+    const float normalized = fp32_from_bits((two_w >> 4) + (0xE0u << 23)) * exp_scale;
+    const float denormalized = fp32_from_bits((two_w >> 17) | (126u << 23)) - 0.5f;
+    const uint32_t result = sign | (two_w < (1u << 27) ? fp32_to_bits(denormalized)
+                                                       : fp32_to_bits(normalized));
+    return fp32_from_bits(result);
+}
+
+// float -> IEEE half, round to nearest even
+inline uint16_t fp32_to_fp16(float f) {
+    const float scale_to_inf = fp32_from_bits(0x77800000u);   // 2^112
+    const float scale_to_zero = fp32_from_bits(0x08800000u);  // 2^-110
+    float base = (std::fabs(f) * scale_to_inf) * scale_to_zero;
+    const uint32_t w = fp32_to_bits(f);
+    const uint32_t shl1_w = w + w;
+    const uint32_t sign = w & 0x80000000u;
+    uint32_t bias = shl1_w & 0xFF000000u;
+    if (bias < 0x71000000u) bias = 0x71000000u;
+    base = fp32_from_bits((bias >> 1) + 0x07800000u) + base;
+    const uint32_t bits = fp32_to_bits(base);
+    const uint32_t nonsign = ((bits >> 13) & 0x00007C00u) + (bits & 0x00000FFFu);
+    return static_cast<uint16_t>((sign >> 16) | (shl1_w > 0xFF000000u ? 0x7E00u : nonsign));
+}
+
+#if defined(__AVX2__)
+inline float hsum256(__m256 v) {
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_movehdup_ps(s));
+    return _mm_cvtss_f32(s);
+}
+
+// 8 unsigned bytes -> 8 floats
+inline __m256 u8x8_to_ps(__m128i bytes) {
+    return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(bytes));
+}
+#endif
+
+// Dot product of two float vectors
+inline float dot(const float* a, const float* b, size_t n) {
+    size_t i = 0;
+    float sum = 0.0f;
+    size_t step = 1;  // the vector loops cover n rounded down to this
+#if defined(__AVX512F__)
+    __m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps();
+    for (; i + 32 <= n; i += 32) {
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+        acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), acc1);
+    }
+    for (; i + 16 <= n; i += 16) {
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+    }
+    sum = _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+    step = 16;
+#elif defined(__AVX2__) && defined(__FMA__)
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+    for (; i + 16 <= n; i += 16) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
+    }
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+    }
+    sum = hsum256(_mm256_add_ps(acc0, acc1));
+    step = 8;
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    float32x4_t acc0 = vdupq_n_f32(0.0f), acc1 = vdupq_n_f32(0.0f);
+    for (; i + 8 <= n; i += 8) {
+        acc0 = vfmaq_f32(acc0, vld1q_f32(a + i), vld1q_f32(b + i));
+        acc1 = vfmaq_f32(acc1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+    }
+    sum = vaddvq_f32(vaddq_f32(acc0, acc1));
+    step = 8;
+#else
+    // Independent partial sums so the compiler can vectorize
+    float s0 = 0.0f, s1 = 0.0f, s2 = 0.0f, s3 = 0.0f;
+    for (; i + 4 <= n; i += 4) {
+        s0 += a[i] * b[i];
+        s1 += a[i + 1] * b[i + 1];
+        s2 += a[i + 2] * b[i + 2];
+        s3 += a[i + 3] * b[i + 3];
+    }
+    sum = (s0 + s1) + (s2 + s3);
+    step = 4;
+#endif
+    // Tail from a remainder rather than the loop counter, so with n a
+    // compile-time constant (the ShapeKernels paths) the bound cannot wrap
+    for (size_t t = n - n % step; t < n; ++t) sum += a[t] * b[t];
+    return sum;
+}
+
+/**
+ * Quantized dot-product kernels: w is one weight row in its storage
+ * format, x is an F32 activation row. Weights are dequantized in
+ * registers; nothing is expanded to memory.
+ */
+
+float dot_f32(const void* w, const float* x, size_t n) {
+    return dot(static_cast<const float*>(w), x, n);
+}
+
+float dot_f16(const void* w, const float* x, size_t n) {
+    const uint16_t* h = static_cast<const uint16_t*>(w);
+    size_t i = 0;
+    float sum = 0.0f;
+#if defined(__F16C__) && defined(__AVX2__) && defined(__FMA__)
+    __m256 acc = _mm256_setzero_ps();
+    for (; i + 8 <= n; i += 8) {
+        const __m256 wv = _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(h + i)));
+        acc = _mm256_fmadd_ps(wv, _mm256_loadu_ps(x + i), acc);
+    }
+    sum = hsum256(acc);
+#endif
+    for (; i < n; ++i) sum += fp16_to_fp32(h[i]) * x[i];
+    return sum;
+}
+
+float dot_q8_0(const void* w, const float* x, size_t n) {
+    const BlockQ8_0* blocks = static_cast<const BlockQ8_0*>(w);
+    const size_t nb = n / 32;
+#if defined(__AVX512F__)
+    __m512 acc = _mm512_setzero_ps();
+    for (size_t b = 0; b < nb; ++b) {
+        const BlockQ8_0& blk = blocks[b];
+        const float* xb = x + b * 32;
+        const __m512 q0 = _mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(blk.qs))));
+        const __m512 q1 = _mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(blk.qs + 16))));
+        __m512 s = _mm512_mul_ps(q0, _mm512_loadu_ps(xb));
+        s = _mm512_fmadd_ps(q1, _mm512_loadu_ps(xb + 16), s);
+        acc = _mm512_fmadd_ps(_mm512_set1_ps(fp16_to_fp32(blk.d)), s, acc);
+    }
+    return _mm512_reduce_add_ps(acc);
+#elif defined(__AVX2__) && defined(__FMA__)
+    __m256 acc = _mm256_setzero_ps();
+    for (size_t b = 0; b < nb; ++b) {
+        const BlockQ8_0& blk = blocks[b];
+        const float* xb = x + b * 32;
+        __m256 s = _mm256_setzero_ps();
+        for (size_t k = 0; k < 32; k += 8) {
+            const __m256 q = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(
+                _mm_loadl_epi64(reinterpret_cast<const __m128i*>(blk.qs + k))));
+            s = _mm256_fmadd_ps(q, _mm256_loadu_ps(xb + k), s);
+        }
+        acc = _mm256_fmadd_ps(_mm256_set1_ps(fp16_to_fp32(blk.d)), s, acc);
+    }
+    return hsum256(acc);
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    float32x4_t acc = vdupq_n_f32(0.0f);
+    for (size_t b = 0; b < nb; ++b) {
+        const BlockQ8_0& blk = blocks[b];
+        const float* xb = x + b * 32;
+        float32x4_t s = vdupq_n_f32(0.0f);
+        for (size_t k = 0; k < 32; k += 16) {
+            const int8x16_t q = vld1q_s8(blk.qs + k);
+            const int16x8_t lo = vmovl_s8(vget_low_s8(q));
+            const int16x8_t hi = vmovl_s8(vget_high_s8(q));
+            s = vfmaq_f32(s, vcvtq_f32_s32(vmovl_s16(vget_low_s16(lo))), vld1q_f32(xb + k));
+            s = vfmaq_f32(s, vcvtq_f32_s32(vmovl_s16(vget_high_s16(lo))), vld1q_f32(xb + k + 4));
+            s = vfmaq_f32(s, vcvtq_f32_s32(vmovl_s16(vget_low_s16(hi))), vld1q_f32(xb + k + 8));
+            s = vfmaq_f32(s, vcvtq_f32_s32(vmovl_s16(vget_high_s16(hi))), vld1q_f32(xb + k + 12));
+        }
+        acc = vfmaq_n_f32(acc, s, fp16_to_fp32(blk.d));
+    }
+    return vaddvq_f32(acc);
+#else
+    float sum = 0.0f;
+    for (size_t b = 0; b < nb; ++b) {
+        float s = 0.0f;
+        for (size_t k = 0; k < 32; ++k) s += blocks[b].qs[k] * x[b * 32 + k];
+        sum += fp16_to_fp32(blocks[b].d) * s;
+    }
+    return sum;
+#endif
+}
+
+// Unpack the 6-bit scale and min of Q4_K sub-block j
+inline void q4_k_scale_min(const uint8_t* scales, size_t j, uint8_t& sc, uint8_t& m) {
+    if (j < 4) {
+        sc = scales[j] & 63;
+        m = scales[j + 4] & 63;
+    } else {
+        sc = (scales[j + 4] & 0xF) | ((scales[j - 4] >> 6) << 4);
+        m = (scales[j + 4] >> 4) | ((scales[j] >> 6) << 4);
+    }
+}
+
+float dot_q4_k(const void* w, const float* x, size_t n) {
+    const BlockQ4_K* blocks = static_cast<const BlockQ4_K*>(w);
+    const size_t nb = n / 256;
+    float sum = 0.0f;
+#if defined(__AVX512F__)
+    __m512 acc = _mm512_setzero_ps();
+    const __m128i mask = _mm_set1_epi8(0x0F);
+#elif defined(__AVX2__) && defined(__FMA__)
+    __m256 acc = _mm256_setzero_ps();
+    const __m128i mask = _mm_set1_epi8(0x0F);
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    float32x4_t acc = vdupq_n_f32(0.0f);
+    const uint8x16_t mask = vdupq_n_u8(0x0F);
+#endif
+    for (size_t b = 0; b < nb; ++b) {
+        const BlockQ4_K& blk = blocks[b];
+        const float d = fp16_to_fp32(blk.d);
+        const float dmin = fp16_to_fp32(blk.dmin);
+        const float* xb = x + b * 256;
+        // Each 32 bytes of qs hold sub-block 2j (low nibbles) and 2j+1 (high nibbles)
+        for (size_t j = 0; j < 4; ++j) {
+            const uint8_t* q = blk.qs + j * 32;
+            const float* x_lo = xb + j * 64;
+            const float* x_hi = x_lo + 32;
+            uint8_t sc_lo, m_lo, sc_hi, m_hi;
+            q4_k_scale_min(blk.scales, 2 * j, sc_lo, m_lo);
+            q4_k_scale_min(blk.scales, 2 * j + 1, sc_hi, m_hi);
+#if defined(__AVX512F__)
+            __m512 qx_lo = _mm512_setzero_ps(), qx_hi = _mm512_setzero_ps();
+            __m512 sx_lo = _mm512_setzero_ps(), sx_hi = _mm512_setzero_ps();
+            for (size_t k = 0; k < 32; k += 16) {
+                const __m128i raw = _mm_loadu_si128(reinterpret_cast<const __m128i*>(q + k));
+                const __m512 lo = _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(_mm_and_si128(raw, mask)));
+                const __m512 hi = _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(
+                    _mm_and_si128(_mm_srli_epi16(raw, 4), mask)));
+                const __m512 xl = _mm512_loadu_ps(x_lo + k), xh = _mm512_loadu_ps(x_hi + k);
+                qx_lo = _mm512_fmadd_ps(lo, xl, qx_lo);
+                qx_hi = _mm512_fmadd_ps(hi, xh, qx_hi);
+                sx_lo = _mm512_add_ps(sx_lo, xl);
+                sx_hi = _mm512_add_ps(sx_hi, xh);
+            }
+            acc = _mm512_fmadd_ps(_mm512_set1_ps(d * sc_lo), qx_lo, acc);
+            acc = _mm512_fmadd_ps(_mm512_set1_ps(d * sc_hi), qx_hi, acc);
+            acc = _mm512_fnmadd_ps(_mm512_set1_ps(dmin * m_lo), sx_lo, acc);
+            acc = _mm512_fnmadd_ps(_mm512_set1_ps(dmin * m_hi), sx_hi, acc);
+#elif defined(__AVX2__) && defined(__FMA__)
+            __m256 qx_lo = _mm256_setzero_ps(), qx_hi = _mm256_setzero_ps();
+            __m256 sx_lo = _mm256_setzero_ps(), sx_hi = _mm256_setzero_ps();
+            for (size_t k = 0; k < 32; k += 16) {
+                const __m128i raw = _mm_loadu_si128(reinterpret_cast<const __m128i*>(q + k));
+                const __m128i lo = _mm_and_si128(raw, mask);
+                const __m128i hi = _mm_and_si128(_mm_srli_epi16(raw, 4), mask);
+                for (size_t h = 0; h < 16; h += 8) {
+                    const __m128i lo8 = h ? _mm_srli_si128(lo, 8) : lo;
+                    const __m128i hi8 = h ? _mm_srli_si128(hi, 8) : hi;
+                    const __m256 xl = _mm256_loadu_ps(x_lo + k + h), xh = _mm256_loadu_ps(x_hi + k + h);
+                    qx_lo = _mm256_fmadd_ps(u8x8_to_ps(lo8), xl, qx_lo);
+                    qx_hi = _mm256_fmadd_ps(u8x8_to_ps(hi8), xh, qx_hi);
+                    sx_lo = _mm256_add_ps(sx_lo, xl);
+                    sx_hi = _mm256_add_ps(sx_hi, xh);
+                }
+            }
+            acc = _mm256_fmadd_ps(_mm256_set1_ps(d * sc_lo), qx_lo, acc);
+            acc = _mm256_fmadd_ps(_mm256_set1_ps(d * sc_hi), qx_hi, acc);
+            acc = _mm256_fnmadd_ps(_mm256_set1_ps(dmin * m_lo), sx_lo, acc);
+            acc = _mm256_fnmadd_ps(_mm256_set1_ps(dmin * m_hi), sx_hi, acc);
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+            float32x4_t qx_lo = vdupq_n_f32(0.0f), qx_hi = vdupq_n_f32(0.0f);
+            float32x4_t sx_lo = vdupq_n_f32(0.0f), sx_hi = vdupq_n_f32(0.0f);
+            for (size_t k = 0; k < 32; k += 16) {
+                const uint8x16_t raw = vld1q_u8(q + k);
+                const uint8x16_t nibbles[2] = {vandq_u8(raw, mask), vshrq_n_u8(raw, 4)};
+                for (size_t half = 0; half < 2; ++half) {
+                    const uint16x8_t lo16 = vmovl_u8(vget_low_u8(nibbles[half]));
+                    const uint16x8_t hi16 = vmovl_u8(vget_high_u8(nibbles[half]));
+                    const float32x4_t qv[4] = {
+                        vcvtq_f32_u32(vmovl_u16(vget_low_u16(lo16))),
+                        vcvtq_f32_u32(vmovl_u16(vget_high_u16(lo16))),
+                        vcvtq_f32_u32(vmovl_u16(vget_low_u16(hi16))),
+                        vcvtq_f32_u32(vmovl_u16(vget_high_u16(hi16)))};
+                    const float* xs = (half ? x_hi : x_lo) + k;
+                    float32x4_t& qx = half ? qx_hi : qx_lo;
+                    float32x4_t& sx = half ? sx_hi : sx_lo;
+                    for (size_t v = 0; v < 4; ++v) {
+                        const float32x4_t xv = vld1q_f32(xs + 4 * v);
+                        qx = vfmaq_f32(qx, qv[v], xv);
+                        sx = vaddq_f32(sx, xv);
+                    }
+                }
+            }
+            acc = vfmaq_n_f32(acc, qx_lo, d * sc_lo);
+            acc = vfmaq_n_f32(acc, qx_hi, d * sc_hi);
+            acc = vfmsq_n_f32(acc, sx_lo, dmin * m_lo);
+            acc = vfmsq_n_f32(acc, sx_hi, dmin * m_hi);
+#else
+            float qx_lo = 0.0f, qx_hi = 0.0f, sx_lo = 0.0f, sx_hi = 0.0f;
+            for (size_t l = 0; l < 32; ++l) {
+                qx_lo += (q[l] & 0xF) * x_lo[l];
+                qx_hi += (q[l] >> 4) * x_hi[l];
+                sx_lo += x_lo[l];
+                sx_hi += x_hi[l];
+            }
+            sum += d * (sc_lo * qx_lo + sc_hi * qx_hi) - dmin * (m_lo * sx_lo + m_hi * sx_hi);
+#endif
+        }
+    }
+#if defined(__AVX512F__)
+    sum = _mm512_reduce_add_ps(acc);
+#elif defined(__AVX2__) && defined(__FMA__)
+    sum = hsum256(acc);
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    sum = vaddvq_f32(acc);
+#endif
+    return sum;
+}
+
+typedef float (*RowDotFn)(const void* w, const float* x, size_t n);
+
+RowDotFn row_dot_fn(TensorType type) {
+    switch (type) {
+        case TensorType::F16: return dot_f16;
+        case TensorType::Q8_0: return dot_q8_0;
+        case TensorType::Q4_K: return dot_q4_k;
+        default: return dot_f32;
+    }
+}
+
+void quantize_row_q8_0(const float* x, BlockQ8_0* y, size_t n) {
+    for (size_t b = 0; b < n / 32; ++b) {
+        const float* xb = x + b * 32;
+        float amax = 0.0f;
+        for (size_t k = 0; k < 32; ++k) amax = std::max(amax, std::fabs(xb[k]));
+        const float d = amax / 127.0f;
+        const float id = d > 0.0f ? 1.0f / d : 0.0f;
+        y[b].d = fp32_to_fp16(d);
+        for (size_t k = 0; k < 32; ++k) {
+            y[b].qs[k] = static_cast<int8_t>(std::lround(xb[k] * id));
+        }
+    }
+}
+
+// Per sub-block affine fit (x ~ scale * q - min, q in [0, 15]); the scales
+// and mins are then quantized to 6 bits against the super-block d / dmin
+void quantize_row_q4_k(const float* x, BlockQ4_K* y, size_t n) {
+    for (size_t b = 0; b < n / 256; ++b) {
+        const float* xb = x + b * 256;
+        float scales[8], mins[8];
+        float max_scale = 0.0f, max_min = 0.0f;
+        for (size_t j = 0; j < 8; ++j) {
+            float lo = 0.0f, hi = 0.0f;
+            for (size_t l = 0; l < 32; ++l) {
+                lo = std::min(lo, xb[j * 32 + l]);
+                hi = std::max(hi, xb[j * 32 + l]);
             }
+            scales[j] = (hi - lo) / 15.0f;
+            mins[j] = -lo;
+            max_scale = std::max(max_scale, scales[j]);
+            max_min = std::max(max_min, mins[j]);
         }
         
-        if (!word.empty()) {
-            tokens.push_back(get_token_id(word));
+        BlockQ4_K& blk = y[b];
+        const float d = max_scale / 63.0f;
+        const float dmin = max_min / 63.0f;
+        blk.d = fp32_to_fp16(d);
+        blk.dmin = fp32_to_fp16(dmin);
+        const float d_q = fp16_to_fp32(blk.d), dmin_q = fp16_to_fp32(blk.dmin);
+        
+        uint8_t ls[8], lm[8];
+        for (size_t j = 0; j < 8; ++j) {
+            ls[j] = static_cast<uint8_t>(std::min(63L, d > 0.0f ? std::lround(scales[j] / d) : 0L));
+            lm[j] = static_cast<uint8_t>(std::min(63L, dmin > 0.0f ? std::lround(mins[j] / dmin) : 0L));
+        }
+        std::memset(blk.scales, 0, sizeof(blk.scales));
+        for (size_t j = 0; j < 8; ++j) {
+            if (j < 4) {
+                blk.scales[j] = ls[j];
+                blk.scales[j + 4] = lm[j];
+            } else {
+                blk.scales[j + 4] = (ls[j] & 0xF) | ((lm[j] & 0xF) << 4);
+                blk.scales[j - 4] |= (ls[j] >> 4) << 6;
+                blk.scales[j] |= (lm[j] >> 4) << 6;
+            }
         }
         
-        tokens.push_back(2); // EOS token
-        return tokens;
+        uint8_t q[256];
+        for (size_t j = 0; j < 8; ++j) {
+            const float sc = d_q * ls[j], m = dmin_q * lm[j];
+            const float inv = sc > 0.0f ? 1.0f / sc : 0.0f;
+            for (size_t l = 0; l < 32; ++l) {
+                const long v = std::lround((xb[j * 32 + l] + m) * inv);
+                q[j * 32 + l] = static_cast<uint8_t>(std::max(0L, std::min(15L, v)));
+            }
+        }
+        for (size_t j = 0; j < 4; ++j) {
+            for (size_t l = 0; l < 32; ++l) {
+                blk.qs[j * 32 + l] = q[j * 64 + l] | (q[j * 64 + 32 + l] << 4);
+            }
+        }
+    }
+}
+
+// Encode n floats into `type` storage (n must be a multiple of the block size)
+void quantize_row(TensorType type, const float* x, void* y, size_t n) {
+    switch (type) {
+        case TensorType::F16:
+            for (size_t i = 0; i < n; ++i) static_cast<uint16_t*>(y)[i] = fp32_to_fp16(x[i]);
+            break;
+        case TensorType::Q8_0: quantize_row_q8_0(x, static_cast<BlockQ8_0*>(y), n); break;
+        case TensorType::Q4_K: quantize_row_q4_k(x, static_cast<BlockQ4_K*>(y), n); break;
+        default: std::memcpy(y, x, n * sizeof(float)); break;
+    }
+}
+
+// Decode one stored row back to floats
+void dequantize_row(TensorType type, const void* x, float* y, size_t n) {
+    switch (type) {
+        case TensorType::F16:
+            for (size_t i = 0; i < n; ++i) y[i] = fp16_to_fp32(static_cast<const uint16_t*>(x)[i]);
+            break;
+        case TensorType::Q8_0: {
+            const BlockQ8_0* blocks = static_cast<const BlockQ8_0*>(x);
+            for (size_t b = 0; b < n / 32; ++b) {
+                const float d = fp16_to_fp32(blocks[b].d);
+                for (size_t k = 0; k < 32; ++k) y[b * 32 + k] = d * blocks[b].qs[k];
+            }
+            break;
+        }
+        case TensorType::Q4_K: {
+            const BlockQ4_K* blocks = static_cast<const BlockQ4_K*>(x);
+            for (size_t b = 0; b < n / 256; ++b) {
+                const float d = fp16_to_fp32(blocks[b].d), dmin = fp16_to_fp32(blocks[b].dmin);
+                float* yb = y + b * 256;
+                for (size_t j = 0; j < 4; ++j) {
+                    uint8_t sc_lo, m_lo, sc_hi, m_hi;
+                    q4_k_scale_min(blocks[b].scales, 2 * j, sc_lo, m_lo);
+                    q4_k_scale_min(blocks[b].scales, 2 * j + 1, sc_hi, m_hi);
+                    const uint8_t* q = blocks[b].qs + j * 32;
+                    for (size_t l = 0; l < 32; ++l) {
+                        yb[j * 64 + l] = d * sc_lo * (q[l] & 0xF) - dmin * m_lo;
+                        yb[j * 64 + 32 + l] = d * sc_hi * (q[l] >> 4) - dmin * m_hi;
+                    }
+                }
+            }
+            break;
+        }
+        default: std::memcpy(y, x, n * sizeof(float)); break;
+    }
+}
+
+// out[j] = dot(w, x + j * stride) for j < 4, loading each w element once
+inline void dot4(const float* w, const float* x, size_t stride, size_t n, float* out) {
+    const float* x0 = x;
+    const float* x1 = x + stride;
+    const float* x2 = x + 2 * stride;
+    const float* x3 = x + 3 * stride;
+    size_t i = 0;
+    float s0 = 0.0f, s1 = 0.0f, s2 = 0.0f, s3 = 0.0f;
+#if defined(__AVX512F__)
+    __m512 a0 = _mm512_setzero_ps(), a1 = _mm512_setzero_ps();
+    __m512 a2 = _mm512_setzero_ps(), a3 = _mm512_setzero_ps();
+    for (; i + 16 <= n; i += 16) {
+        const __m512 wv = _mm512_loadu_ps(w + i);
+        a0 = _mm512_fmadd_ps(wv, _mm512_loadu_ps(x0 + i), a0);
+        a1 = _mm512_fmadd_ps(wv, _mm512_loadu_ps(x1 + i), a1);
+        a2 = _mm512_fmadd_ps(wv, _mm512_loadu_ps(x2 + i), a2);
+        a3 = _mm512_fmadd_ps(wv, _mm512_loadu_ps(x3 + i), a3);
+    }
+    s0 = _mm512_reduce_add_ps(a0);
+    s1 = _mm512_reduce_add_ps(a1);
+    s2 = _mm512_reduce_add_ps(a2);
+    s3 = _mm512_reduce_add_ps(a3);
+#elif defined(__AVX2__) && defined(__FMA__)
+    __m256 a0 = _mm256_setzero_ps(), a1 = _mm256_setzero_ps();
+    __m256 a2 = _mm256_setzero_ps(), a3 = _mm256_setzero_ps();
+    for (; i + 8 <= n; i += 8) {
+        const __m256 wv = _mm256_loadu_ps(w + i);
+        a0 = _mm256_fmadd_ps(wv, _mm256_loadu_ps(x0 + i), a0);
+        a1 = _mm256_fmadd_ps(wv, _mm256_loadu_ps(x1 + i), a1);
+        a2 = _mm256_fmadd_ps(wv, _mm256_loadu_ps(x2 + i), a2);
+        a3 = _mm256_fmadd_ps(wv, _mm256_loadu_ps(x3 + i), a3);
+    }
+    s0 = hsum256(a0);
+    s1 = hsum256(a1);
+    s2 = hsum256(a2);
+    s3 = hsum256(a3);
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    float32x4_t a0 = vdupq_n_f32(0.0f), a1 = vdupq_n_f32(0.0f);
+    float32x4_t a2 = vdupq_n_f32(0.0f), a3 = vdupq_n_f32(0.0f);
+    for (; i + 4 <= n; i += 4) {
+        const float32x4_t wv = vld1q_f32(w + i);
+        a0 = vfmaq_f32(a0, wv, vld1q_f32(x0 + i));
+        a1 = vfmaq_f32(a1, wv, vld1q_f32(x1 + i));
+        a2 = vfmaq_f32(a2, wv, vld1q_f32(x2 + i));
+        a3 = vfmaq_f32(a3, wv, vld1q_f32(x3 + i));
     }
+    s0 = vaddvq_f32(a0);
+    s1 = vaddvq_f32(a1);
+    s2 = vaddvq_f32(a2);
+    s3 = vaddvq_f32(a3);
+#endif
+    for (; i < n; ++i) {
+        s0 += w[i] * x0[i];
+        s1 += w[i] * x1[i];
+        s2 += w[i] * x2[i];
+        s3 += w[i] * x3[i];
+    }
+    out[0] = s0;
+    out[1] = s1;
+    out[2] = s2;
+    out[3] = s3;
+}
+
+} // namespace
+
+/**
+ * Log severities; the values are Python's logging levels, so a C log
+ * callback can hand them straight to logging.Logger.log()
+ */
+enum class LogLevel : int {
+    DEBUG = 10,
+    INFO = 20,
+    WARNING = 30,
+    ERROR = 40,
+    OFF = 100
+};
+
+#if defined(__GNUC__)
+#define LLAMALEX_PRINTF_FORMAT(fmt, args) __attribute__((format(printf, fmt, args)))
+#else
+#define LLAMALEX_PRINTF_FORMAT(fmt, args)
+#endif
+
+/**
+ * Logger - Process-wide leveled log with an asynchronous sink
+ *
+ * LLAMALEX_LOG() tests the level before formatting, so a disabled message
+ * costs one relaxed load. Enabled messages are formatted printf-style
+ * into a fixed ring of slots and a background thread hands them to the
+ * sink: stderr by default (no flush per line), or a callback installed
+ * with set_sink(). The logging thread never waits on the sink; when the
+ * ring is full the message is dropped and the count is reported with the
+ * next one delivered. The default level is WARNING, as in Python.
+ *
+ * A forked child starts with an empty ring and no logger thread (one is
+ * started by its first message), so flush() and set_sink() work there too.
+ * At exit, messages still queued go to stderr rather than a callback,
+ * whose owner (e.g. the Python interpreter) may already be gone.
+ */
+class Logger {
+public:
+    typedef void (*Sink)(int level, const char* message, void* user);
     
-    std::string detokenize(const std::vector<int>& tokens) {
-        std::string text;
-        for (size_t i = 0; i < tokens.size(); ++i) {
-            if (tokens[i] == 1 || tokens[i] == 2) continue; // Skip BOS/EOS
-            
-            std::string word = get_token_str(tokens[i]);
-            if (!text.empty()) text += " ";
-            text += word;
+    static const size_t kSlots = 256;
+    static const size_t kMessageBytes = 256;  // longer messages are truncated
+    
+    static Logger& instance() {
+        static Logger logger;
+        return logger;
+    }
+    
+    ~Logger() {
+        {
+            // Waits for a callback in progress; the rest drain to stderr
+            std::lock_guard<std::mutex> sink_lock(sink_mutex_);
+            sink_ = write_stderr;
+            user_ = nullptr;
         }
-        return text;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        ready_.notify_one();
+        if (thread_.joinable()) thread_.join();
+    }
+    
+    Logger(const Logger&) = delete;
+    Logger& operator=(const Logger&) = delete;
+    
+    bool enabled(LogLevel level) const {
+        return static_cast<int>(level) >= level_.load(std::memory_order_relaxed);
+    }
+    
+    LogLevel level() const { return static_cast<LogLevel>(level_.load(std::memory_order_relaxed)); }
+    void set_level(LogLevel level) { level_.store(static_cast<int>(level), std::memory_order_relaxed); }
+    
+    /**
+     * Routes messages to sink(level, message, user) on the logger thread;
+     * nullptr restores stderr. Messages already queued go to the old sink,
+     * which is not called again once this returns.
+     */
+    void set_sink(Sink sink, void* user) {
+        flush();
+        std::lock_guard<std::mutex> lock(sink_mutex_);
+        sink_ = sink ? sink : write_stderr;
+        user_ = sink ? user : nullptr;
+    }
+    
+    // Format and queue one message (callers check enabled() first)
+    void write(LogLevel level, const char* format, ...) LLAMALEX_PRINTF_FORMAT(3, 4) {
+        Slot slot;
+        slot.level = static_cast<int>(level);
+        va_list args;
+        va_start(args, format);
+        std::vsnprintf(slot.text, sizeof(slot.text), format, args);
+        va_end(args);
+        push(slot);
+    }
+    
+    // Wait until every message queued so far has reached the sink.
+    // Must not be called from a sink.
+    void flush() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        const uint64_t target = head_;
+        idle_.wait(lock, [&] { return delivered_ >= target; });
+        lock.unlock();
+        std::lock_guard<std::mutex> sink_lock(sink_mutex_);
+        if (sink_ == write_stderr) std::fflush(stderr);
     }
+    
+    // Messages dropped because the ring was full (since startup)
+    uint64_t dropped() const { return dropped_total_.load(std::memory_order_relaxed); }
 
 private:
-    size_t vocab_size_;
+    struct Slot {
+        int level;
+        char text[kMessageBytes];
+    };
     
-    void init_vocab() {
-        // Initialize legal vocabulary
-        // In production, load from file
+    std::atomic<int> level_{static_cast<int>(LogLevel::WARNING)};
+    std::vector<Slot> slots_;
+    std::mutex mutex_;
+    std::condition_variable ready_, idle_;
+    uint64_t head_ = 0;       // messages queued
+    uint64_t tail_ = 0;       // messages taken by the logger thread
+    uint64_t delivered_ = 0;  // messages the sink has returned from
+    uint64_t dropped_ = 0;    // dropped since the last delivery
+    std::atomic<uint64_t> dropped_total_{0};
+    bool stop_ = false;
+    std::thread thread_;
+    
+    std::mutex sink_mutex_;
+    Sink sink_ = write_stderr;
+    void* user_ = nullptr;
+    
+    Logger() : slots_(kSlots) {
+        pthread_atfork(before_fork, after_fork_parent, after_fork_child);
     }
     
-    int get_token_id(const std::string& word) {
-        // Simple hash-based ID (production would use proper vocab lookup)
-        return std::hash<std::string>{}(word) % vocab_size_;
+    // mutex_ is held across fork() so the child copies a consistent ring;
+    // sink_mutex_ is not, since a callback may block on the forking thread
+    static void before_fork() { instance().mutex_.lock(); }
+    static void after_fork_parent() { instance().mutex_.unlock(); }
+    
+    // The logger thread does not exist in the child, and it may have left
+    // the sink mutex or the condition variables in use: rebuild them in
+    // place (never destroy: that could wait on the vanished thread) and
+    // drop what the parent will deliver itself
+    static void after_fork_child() {
+        Logger& logger = instance();
+        new (&logger.mutex_) std::mutex();
+        new (&logger.sink_mutex_) std::mutex();
+        new (&logger.ready_) std::condition_variable();
+        new (&logger.idle_) std::condition_variable();
+        new (&logger.thread_) std::thread();
+        logger.tail_ = logger.delivered_ = logger.head_;
+        logger.dropped_ = 0;
+        logger.stop_ = false;
     }
     
-    std::string get_token_str(int token_id) {
-        // Reverse token lookup (simplified)
-        return "<token_" + std::to_string(token_id) + ">";
+    static void write_stderr(int, const char* message, void*) {
+        std::fprintf(stderr, "llamalex: %s\n", message);
+    }
+    
+    void push(const Slot& slot) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (head_ - tail_ == kSlots) {
+            ++dropped_;
+            dropped_total_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        if (!thread_.joinable()) thread_ = std::thread(&Logger::run, this);
+        const bool was_empty = head_ == tail_;
+        slots_[head_++ % kSlots] = slot;
+        if (was_empty) ready_.notify_one();
+    }
+    
+    void run() {
+        Slot slot;
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (;;) {
+            ready_.wait(lock, [this] { return stop_ || tail_ != head_; });
+            if (tail_ == head_) return;
+            slot = slots_[tail_++ % kSlots];
+            const uint64_t dropped = dropped_;
+            dropped_ = 0;
+            lock.unlock();
+            {
+                std::lock_guard<std::mutex> sink_lock(sink_mutex_);
+                if (dropped > 0) {
+                    char text[64];
+                    std::snprintf(text, sizeof(text), "%llu log messages dropped",
+                                  static_cast<unsigned long long>(dropped));
+                    sink_(static_cast<int>(LogLevel::WARNING), text, user_);
+                }
+                sink_(slot.level, slot.text, user_);
+            }
+            lock.lock();
+            ++delivered_;
+            idle_.notify_all();
+        }
     }
 };
 
+const size_t Logger::kSlots;
+const size_t Logger::kMessageBytes;
+
+// LLAMALEX_LOG(INFO, "loaded %zu layers", n): arguments are only evaluated
+// and formatted when the level is enabled
+#define LLAMALEX_LOG(level, ...) \
+    do { \
+        if (::llamalex::Logger::instance().enabled(::llamalex::LogLevel::level)) \
+            ::llamalex::Logger::instance().write(::llamalex::LogLevel::level, __VA_ARGS__); \
+    } while (0)
+
 /**
- * LlamaLexConfig - Configuration for LlamaLex model
+ * How model weights are placed on a multi-socket (NUMA) host
+ *
+ * OFF leaves placement to the kernel (first touch). INTERLEAVE spreads
+ * weight pages round-robin over the nodes in use, so every socket pulls
+ * an equal share over the interconnect. REPLICATE keeps a full copy of
+ * each weight matrix on every node and matmuls read the local one, at
+ * the cost of one copy of the matrices per node.
  */
-struct LlamaLexConfig {
-    size_t vocab_size = 50000;
-    size_t embedding_dim = 768;
-    size_t num_layers = 12;
-    size_t num_heads = 12;
-    size_t ff_dim = 3072;
-    size_t max_seq_length = 2048;
-    
-    // Legal-specific parameters
-    bool use_legal_vocab = true;
-    bool enable_case_law_mode = false;
-    bool enable_statute_mode = false;
+enum class NumaMode : uint32_t {
+    OFF = 0,
+    INTERLEAVE = 1,
+    REPLICATE = 2
 };
 
 /**
- * Attention mechanism for transformer
+ * NumaTopology - NUMA nodes of the host and the CPUs each one holds
+ *
+ * Read once from /sys/devices/system/node, keeping only CPUs the process
+ * may run on and nodes that have any (memory-only nodes are dropped).
+ * Elsewhere, or when sysfs is missing, the host is one node holding
+ * every hardware thread.
  */
-class MultiHeadAttention {
+class NumaTopology {
 public:
-    MultiHeadAttention(size_t embedding_dim, size_t num_heads)
-        : embedding_dim_(embedding_dim), num_heads_(num_heads) {
-        head_dim_ = embedding_dim / num_heads;
-        
-        // Initialize weight matrices
-        init_weights();
+    static const NumaTopology& system() {
+        static const NumaTopology topology;
+        return topology;
+    }
+    
+    size_t nodes() const { return cpus_.size(); }
+    
+    // OS node id of node index `node` (for mbind)
+    int node_id(size_t node) const { return ids_[node]; }
+    
+    // CPUs of node `node`, ascending
+    const std::vector<int>& cpus(size_t node) const { return cpus_[node]; }
+    
+    // CPUs on the first n_nodes nodes (0: all)
+    size_t cpu_count(size_t n_nodes = 0) const {
+        size_t count = 0;
+        for (size_t n = 0; n < resolve(n_nodes); ++n) count += cpus_[n].size();
+        return count;
     }
     
-    // Forward pass (simplified)
-    std::vector<float> forward(const std::vector<float>& input) {
-        // In production, this would perform multi-head attention
-        // For now, return input (identity)
-        return input;
+    // Nodes to use for a requested count (0: all, capped at what exists)
+    size_t resolve(size_t n_nodes) const {
+        return n_nodes > 0 ? std::min(n_nodes, nodes()) : nodes();
     }
 
 private:
-    size_t embedding_dim_;
-    size_t num_heads_;
-    size_t head_dim_;
+    std::vector<int> ids_;
+    std::vector<std::vector<int>> cpus_;
     
-    void init_weights() {
-        // Initialize Q, K, V projection weights
-        // In production, allocate and initialize weight tensors
+    NumaTopology() {
+#if defined(__linux__)
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        const bool have_mask = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+        for (int id : parse_list(read_line("/sys/devices/system/node/online"))) {
+            std::vector<int> cpus;
+            for (int cpu : parse_list(read_line("/sys/devices/system/node/node" + std::to_string(id) + "/cpulist"))) {
+                if (cpu < CPU_SETSIZE && (!have_mask || CPU_ISSET(cpu, &allowed))) cpus.push_back(cpu);
+            }
+            if (cpus.empty()) continue;
+            ids_.push_back(id);
+            cpus_.push_back(cpus);
+        }
+#endif
+        if (cpus_.empty()) {
+            ids_.assign(1, 0);
+            cpus_.assign(1, std::vector<int>());
+            for (unsigned cpu = 0; cpu < std::max(1u, std::thread::hardware_concurrency()); ++cpu) {
+                cpus_[0].push_back(static_cast<int>(cpu));
+            }
+        }
+    }
+    
+    static std::string read_line(const std::string& path) {
+        std::ifstream in(path.c_str());
+        std::string line;
+        std::getline(in, line);
+        return line;
+    }
+    
+    // Kernel list format: "0-3,8,10-11"
+    static std::vector<int> parse_list(const std::string& list) {
+        std::vector<int> values;
+        const char* p = list.c_str();
+        while (std::isdigit(static_cast<unsigned char>(*p))) {
+            char* end;
+            const long first = std::strtol(p, &end, 10);
+            long last = first;
+            if (*end == '-') last = std::strtol(end + 1, &end, 10);
+            for (long v = first; v <= last; ++v) values.push_back(static_cast<int>(v));
+            p = *end == ',' ? end + 1 : end;
+        }
+        return values;
     }
 };
 
 /**
- * LlamaLex - Main inference engine
+ * Memory policy for [addr, addr + bytes) before its pages are first
+ * touched: interleaved over the first n_nodes nodes (node < 0), or
+ * preferring one node. addr must be page aligned. Best effort: returns
+ * false where mbind is unavailable or refused, and the pages then land
+ * wherever the kernel puts them.
  */
-class LlamaLex {
+inline bool numa_bind(const void* addr, size_t bytes, size_t n_nodes, int node = -1) {
+#if defined(__linux__) && defined(SYS_mbind)
+    const NumaTopology& topology = NumaTopology::system();
+    const int kMpolPreferred = 1, kMpolInterleave = 3;
+    unsigned long mask[4] = {0, 0, 0, 0};
+    const size_t bits = 8 * sizeof(unsigned long);
+    for (size_t n = 0; n < topology.resolve(n_nodes); ++n) {
+        if (node >= 0 && n != static_cast<size_t>(node)) continue;
+        const size_t id = static_cast<size_t>(topology.node_id(n));
+        if (id < 4 * bits) mask[id / bits] |= 1ul << (id % bits);
+    }
+    return syscall(SYS_mbind, addr, bytes, node < 0 ? kMpolInterleave : kMpolPreferred,
+                   mask, 4 * bits + 1, 0) == 0;
+#else
+    (void)addr; (void)bytes; (void)n_nodes; (void)node;
+    return false;
+#endif
+}
+
+/**
+ * ThreadPool - Fixed set of worker threads for data-parallel loops
+ *
+ * Workers are started once and wait for work, briefly spinning before
+ * they block so back-to-back ops (one per matmul) do not pay a wake-up
+ * each. parallel_for() partitions the range statically, one contiguous
+ * chunk per thread, so a worker keeps touching the same weight rows from
+ * op to op; the calling thread runs chunk 0 itself. With pinning, worker i
+ * is bound to CPU i (Linux only).
+ *
+ * With NUMA placement over n nodes, threads are split into n contiguous
+ * groups, group g on node g, so each node's threads work on one
+ * contiguous slice of every partitioned range. Workers are bound to their
+ * node's CPUs (to one CPU each with pinning); the calling thread counts
+ * as the first thread of node 0. Kernels ask current_node() which node
+ * the chunk they run belongs to, e.g. to read node-local weight replicas.
+ */
+class ThreadPool {
 public:
-    LlamaLex(const LlamaLexConfig& config)
-        : config_(config), tokenizer_(config.vocab_size) {
-        std::cout << "Initializing LlamaLex inference engine..." << std::endl;
-        init_model();
-        std::cout << "LlamaLex initialized with " << config_.num_layers << " layers" << std::endl;
+    explicit ThreadPool(size_t n_threads, bool pin_threads = false, size_t numa_nodes = 0)
+        : n_threads_(std::max<size_t>(1, n_threads)), node_of_(n_threads_, 0) {
+        const NumaTopology& topology = NumaTopology::system();
+        const size_t n_nodes = numa_nodes > 0 ? topology.resolve(numa_nodes) : 0;
+        for (size_t i = 0; i < n_threads_ && n_nodes > 0; ++i) node_of_[i] = i * n_nodes / n_threads_;
+        for (size_t i = 1; i < n_threads_; ++i) {
+            workers_.emplace_back(&ThreadPool::worker, this, i);
+#if defined(__linux__)
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            if (n_nodes > 0) {
+                // Pinned threads take their node's CPUs in order
+                const std::vector<int>& node_cpus = topology.cpus(node_of_[i]);
+                const size_t first = std::find(node_of_.begin(), node_of_.end(), node_of_[i]) - node_of_.begin();
+                if (pin_threads) {
+                    CPU_SET(node_cpus[(i - first) % node_cpus.size()], &cpus);
+                } else {
+                    for (int cpu : node_cpus) CPU_SET(cpu, &cpus);
+                }
+            } else if (pin_threads) {
+                CPU_SET(i % std::max(1u, std::thread::hardware_concurrency()), &cpus);
+            }
+            if (CPU_COUNT(&cpus) > 0) {
+                pthread_setaffinity_np(workers_.back().native_handle(), sizeof(cpus), &cpus);
+            }
+#else
+            (void)pin_threads;
+#endif
+        }
+        n_nodes_ = std::max<size_t>(1, n_nodes);
+    }
+    
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+            generation_.fetch_add(1, std::memory_order_release);
+        }
+        wake_.notify_all();
+        for (auto& t : workers_) t.join();
+    }
+    
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+    
+    size_t size() const { return n_threads_; }
+    
+    // Nodes the threads are spread over (1 without NUMA placement)
+    size_t nodes() const { return n_nodes_; }
+    
+    // Node of the chunk the calling thread is running (0 outside a task)
+    static size_t current_node() { return current_node_ref(); }
+    
+    // Threads to use for a requested count (0: one per hardware thread, or
+    // per CPU of the first numa_nodes nodes when placing on NUMA nodes)
+    static size_t resolve(size_t n_threads, size_t numa_nodes = 0) {
+        if (n_threads > 0) return n_threads;
+        if (numa_nodes > 0) return NumaTopology::system().cpu_count(numa_nodes);
+        return std::max(1u, std::thread::hardware_concurrency());
+    }
+    
+    /**
+     * Calls fn(begin, end) over a static partition of [0, n), one chunk per
+     * thread, and returns when all chunks are done. Runs inline when
+     * called from inside a pool task.
+     */
+    template <typename Fn>
+    void parallel_for(size_t n, const Fn& fn) {
+        if (n_threads_ == 1 || n <= 1 || in_task()) {
+            fn(0, n);
+            return;
+        }
+        std::lock_guard<std::mutex> submit(submit_mutex_);
+        task_ = &fn;
+        run_ = &invoke<Fn>;
+        n_ = n;
+        pending_.store(n_threads_ - 1, std::memory_order_relaxed);
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            generation_.fetch_add(1, std::memory_order_release);
+        }
+        wake_.notify_all();
+        
+        run_chunk(0);
+        for (size_t spin = 0; pending_.load(std::memory_order_acquire) != 0; ++spin) {
+            if (spin < kSpinCount) {
+                std::this_thread::yield();
+            } else {
+                std::unique_lock<std::mutex> lock(mutex_);
+                done_.wait(lock, [this] { return pending_.load(std::memory_order_acquire) == 0; });
+            }
+        }
+    }
+
+private:
+    static const size_t kSpinCount = 1 << 12;
+    
+    size_t n_threads_;
+    std::vector<size_t> node_of_;  // NUMA node of each thread's chunk
+    size_t n_nodes_ = 1;
+    std::vector<std::thread> workers_;
+    std::mutex submit_mutex_;  // one parallel_for at a time
+    std::mutex mutex_;
+    std::condition_variable wake_, done_;
+    std::atomic<uint64_t> generation_{0};
+    std::atomic<size_t> pending_{0};
+    bool stop_ = false;
+    
+    // Current task (type-erased without allocating)
+    const void* task_ = nullptr;
+    void (*run_)(const void*, size_t, size_t) = nullptr;
+    size_t n_ = 0;
+    
+    template <typename Fn>
+    static void invoke(const void* fn, size_t begin, size_t end) {
+        (*static_cast<const Fn*>(fn))(begin, end);
+    }
+    
+    static bool& in_task() {
+        static thread_local bool flag = false;
+        return flag;
+    }
+    
+    static size_t& current_node_ref() {
+        static thread_local size_t node = 0;
+        return node;
+    }
+    
+    void run_chunk(size_t i) {
+        const size_t begin = n_ * i / n_threads_, end = n_ * (i + 1) / n_threads_;
+        in_task() = true;
+        current_node_ref() = node_of_[i];
+        if (begin < end) run_(task_, begin, end);
+        current_node_ref() = 0;
+        in_task() = false;
+    }
+    
+    void worker(size_t index) {
+        uint64_t seen = 0;
+        for (;;) {
+            for (size_t spin = 0; generation_.load(std::memory_order_acquire) == seen; ++spin) {
+                if (spin < kSpinCount) {
+                    std::this_thread::yield();
+                } else {
+                    std::unique_lock<std::mutex> lock(mutex_);
+                    wake_.wait(lock, [&] { return generation_.load(std::memory_order_acquire) != seen; });
+                }
+            }
+            seen = generation_.load(std::memory_order_acquire);
+            if (stop_) return;
+            
+            run_chunk(index);
+            if (pending_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                done_.notify_one();
+            }
+        }
+    }
+};
+
+const size_t ThreadPool::kSpinCount;
+
+/**
+ * Hot-path ops timed by the profiler (names as in stats and traces)
+ */
+enum class ProfileOp : uint32_t {
+    TOKENIZE,
+    EMBED,
+    NORM,
+    ATTENTION,
+    FEED_FORWARD,
+    LM_HEAD,
+    SAMPLING,
+    COUNT
+};
+
+inline const char* profile_op_name(ProfileOp op) {
+    static const char* names[] = {"tokenize", "embed", "norm", "attention", "feed_forward",
+                                  "lm_head", "sampling"};
+    return op < ProfileOp::COUNT ? names[static_cast<uint32_t>(op)] : "unknown";
+}
+
+#if defined(LLAMALEX_PROFILE)
+/**
+ * Profiler - Process-wide per-op timers, FLOP and byte counters
+ *
+ * Built only with -DLLAMALEX_PROFILE; otherwise the LLAMALEX_PROFILE_*
+ * macros expand to nothing. A ProfileScope times one op on the calling
+ * thread, per layer where it has one, and kernels (matmul, attention,
+ * norm) credit their FLOPs and bytes to the innermost open scope.
+ * Totals are lock-free atomics; with tracing on, every scope is also kept
+ * as a Chrome trace event (chrome://tracing, Perfetto) up to a cap.
+ */
+class Profiler {
+public:
+    static const int kMaxLayers = 128;  // deeper layers share the last slot
+    
+    struct Entry {
+        ProfileOp op;
+        int layer;  // -1: not a per-layer op
+        uint64_t calls, ns, flops, bytes;
+    };
+    
+    static Profiler& instance() {
+        static Profiler profiler;
+        return profiler;
+    }
+    
+    uint64_t now_ns() const {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - epoch_).count();
+    }
+    
+    void add(ProfileOp op, int layer, uint64_t begin_ns, uint64_t end_ns, uint64_t flops, uint64_t bytes) {
+        Slot& slot = slots_[static_cast<uint32_t>(op)][std::min(layer, kMaxLayers - 1) + 1];
+        slot.calls.fetch_add(1, std::memory_order_relaxed);
+        slot.ns.fetch_add(end_ns - begin_ns, std::memory_order_relaxed);
+        slot.flops.fetch_add(flops, std::memory_order_relaxed);
+        slot.bytes.fetch_add(bytes, std::memory_order_relaxed);
+        if (tracing_.load(std::memory_order_relaxed)) {
+            std::lock_guard<std::mutex> lock(trace_mutex_);
+            if (events_.size() < max_events_) {
+                Event e = {op, layer, thread_id(), begin_ns, end_ns - begin_ns};
+                events_.push_back(e);
+            }
+        }
+    }
+    
+    // Ops that ran since the last reset(), by op then layer
+    std::vector<Entry> stats() const {
+        std::vector<Entry> entries;
+        for (uint32_t op = 0; op < static_cast<uint32_t>(ProfileOp::COUNT); ++op) {
+            for (int l = 0; l <= kMaxLayers; ++l) {
+                const Slot& slot = slots_[op][l];
+                const uint64_t calls = slot.calls.load(std::memory_order_relaxed);
+                if (calls == 0) continue;
+                Entry e = {static_cast<ProfileOp>(op), l - 1, calls, slot.ns.load(std::memory_order_relaxed),
+                           slot.flops.load(std::memory_order_relaxed), slot.bytes.load(std::memory_order_relaxed)};
+                entries.push_back(e);
+            }
+        }
+        return entries;
+    }
+    
+    void reset() {
+        for (auto& op_slots : slots_) {
+            for (Slot& slot : op_slots) {
+                slot.calls.store(0, std::memory_order_relaxed);
+                slot.ns.store(0, std::memory_order_relaxed);
+                slot.flops.store(0, std::memory_order_relaxed);
+                slot.bytes.store(0, std::memory_order_relaxed);
+            }
+        }
+        std::lock_guard<std::mutex> lock(trace_mutex_);
+        events_.clear();
+    }
+    
+    // Keep trace events from now on, at most max_events (0: stop, keeping
+    // what was recorded for write_trace)
+    void start_trace(size_t max_events) {
+        std::lock_guard<std::mutex> lock(trace_mutex_);
+        if (max_events > 0) {
+            events_.clear();
+            events_.reserve(std::min<size_t>(max_events, 1 << 20));
+        }
+        max_events_ = max_events;
+        tracing_.store(max_events > 0, std::memory_order_relaxed);
+    }
+    
+    // Write the kept events as Chrome trace JSON
+    void write_trace(const std::string& path) const {
+        std::ofstream out(path);
+        if (!out) throw std::runtime_error("cannot write trace: " + path);
+        std::lock_guard<std::mutex> lock(trace_mutex_);
+        out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+        char line[256];
+        for (size_t i = 0; i < events_.size(); ++i) {
+            const Event& e = events_[i];
+            std::snprintf(line, sizeof(line),
+                          "%s\n{\"name\": \"%s\", \"cat\": \"llamalex\", \"ph\": \"X\", \"pid\": 1, "
+                          "\"tid\": %u, \"ts\": %.3f, \"dur\": %.3f, \"args\": {\"layer\": %d}}",
+                          i ? "," : "", profile_op_name(e.op), e.tid, e.begin_ns / 1e3, e.ns / 1e3, e.layer);
+            out << line;
+        }
+        out << "\n]}\n";
+        if (!out) throw std::runtime_error("cannot write trace: " + path);
+    }
+
+private:
+    struct Slot {
+        std::atomic<uint64_t> calls{0}, ns{0}, flops{0}, bytes{0};
+    };
+    
+    struct Event {
+        ProfileOp op;
+        int layer;
+        uint32_t tid;
+        uint64_t begin_ns, ns;
+    };
+    
+    std::chrono::steady_clock::time_point epoch_ = std::chrono::steady_clock::now();
+    Slot slots_[static_cast<uint32_t>(ProfileOp::COUNT)][kMaxLayers + 1];
+    std::atomic<bool> tracing_{false};
+    mutable std::mutex trace_mutex_;
+    std::vector<Event> events_;
+    size_t max_events_ = 0;
+    
+    // Small stable id per thread, for trace rows
+    static uint32_t thread_id() {
+        static std::atomic<uint32_t> next{0};
+        thread_local uint32_t id = next.fetch_add(1);
+        return id;
+    }
+};
+
+const int Profiler::kMaxLayers;
+
+/**
+ * ProfileScope - Times one op until the end of the enclosing block
+ */
+class ProfileScope {
+public:
+    ProfileScope(ProfileOp op, int layer = -1)
+        : op_(op), layer_(layer), begin_ns_(Profiler::instance().now_ns()), parent_(current()) {
+        current() = this;
+    }
+    
+    ~ProfileScope() {
+        current() = parent_;
+        Profiler::instance().add(op_, layer_, begin_ns_, Profiler::instance().now_ns(), flops_, bytes_);
+    }
+    
+    ProfileScope(const ProfileScope&) = delete;
+    ProfileScope& operator=(const ProfileScope&) = delete;
+    
+    // Credit work to the innermost scope open on this thread, if any
+    static void count(uint64_t flops, uint64_t bytes) {
+        if (ProfileScope* scope = current()) {
+            scope->flops_ += flops;
+            scope->bytes_ += bytes;
+        }
+    }
+
+private:
+    ProfileOp op_;
+    int layer_;
+    uint64_t begin_ns_;
+    ProfileScope* parent_;
+    uint64_t flops_ = 0;
+    uint64_t bytes_ = 0;
+    
+    static ProfileScope*& current() {
+        thread_local ProfileScope* scope = nullptr;
+        return scope;
+    }
+};
+
+#define LLAMALEX_PROFILE_CONCAT2(a, b) a##b
+#define LLAMALEX_PROFILE_CONCAT(a, b) LLAMALEX_PROFILE_CONCAT2(a, b)
+#define LLAMALEX_PROFILE_SCOPE(...) \
+    ::llamalex::ProfileScope LLAMALEX_PROFILE_CONCAT(profile_scope_, __LINE__)(__VA_ARGS__)
+#define LLAMALEX_PROFILE_COUNT(flops, bytes) ::llamalex::ProfileScope::count((flops), (bytes))
+#else
+#define LLAMALEX_PROFILE_SCOPE(...) ((void)0)
+#define LLAMALEX_PROFILE_COUNT(flops, bytes) ((void)0)
+#endif // LLAMALEX_PROFILE
+
+namespace {
+
+/**
+ * Per-thread scratch of at least n values of T, kept for the thread's
+ * lifetime so kernels running on pool threads allocate only on first use.
+ * Each Slot is a separate buffer; a kernel must not call one it is already
+ * using.
+ */
+template <int Slot, typename T = float>
+T* thread_scratch(size_t n) {
+    static thread_local std::vector<T> buffer;
+    if (buffer.size() < n) buffer.resize(n);
+    return buffer.data();
+}
+
+// Tokens per GEMM tile: enough reuse of each weight row to stop being
+// bandwidth-bound, small enough for the activation tile to stay in L2
+const size_t kGemmTokenTile = 32;
+
+// Weight rows per GEMM block: a block is applied to one group of four
+// tokens before moving on, so those four activation rows stay in L1
+const size_t kGemmRowBlock = 8;
+
+// Rows [o_begin, o_end) of matmul(); see below
+void matmul_rows(const WeightTensor& w, const float* x, float* y, size_t n_tokens,
+                 size_t o_begin, size_t o_end) {
+    const size_t in = w.cols, out = w.rows;
+    if (n_tokens == 1) {
+        const RowDotFn row_dot = row_dot_fn(w.type);
+        for (size_t o = o_begin; o < o_end; ++o) y[o] = row_dot(w.row(o), x, in);
+        return;
+    }
+    
+    const bool f32 = w.type == TensorType::F32;
+    float* block_buf = f32 ? nullptr : thread_scratch<0>(kGemmRowBlock * in);
+    const float* rows[kGemmRowBlock];
+    float acc[4];
+    for (size_t t0 = 0; t0 < n_tokens; t0 += kGemmTokenTile) {
+        const size_t tt = std::min(kGemmTokenTile, n_tokens - t0);
+        const float* xt = x + t0 * in;
+        float* yt = y + t0 * out;
+        for (size_t o0 = o_begin; o0 < o_end; o0 += kGemmRowBlock) {
+            const size_t nr = std::min(kGemmRowBlock, o_end - o0);
+#if defined(__AVX2__) || defined(__AVX512F__)
+            // Few tokens (speculative verification, small batches) leave too
+            // little work per row to hide the stream of W; fetch the next
+            // block while this one is multiplied
+            for (size_t r = o0 + nr; r < std::min(o_end, o0 + nr + kGemmRowBlock); ++r) {
+                const char* row = reinterpret_cast<const char*>(w.row(r));
+                for (size_t b = 0, nb = w.row_bytes(); b < nb; b += 64) _mm_prefetch(row + b, _MM_HINT_T0);
+            }
+#endif
+            for (size_t r = 0; r < nr; ++r) {
+                if (f32) {
+                    rows[r] = reinterpret_cast<const float*>(w.row(o0 + r));
+                } else {
+                    dequantize_row(w.type, w.row(o0 + r), &block_buf[r * in], in);
+                    rows[r] = &block_buf[r * in];
+                }
+            }
+            size_t t = 0;
+            for (; t + 4 <= tt; t += 4) {
+                for (size_t r = 0; r < nr; ++r) {
+                    dot4(rows[r], xt + t * in, in, in, acc);
+                    for (size_t j = 0; j < 4; ++j) yt[(t + j) * out + o0 + r] = acc[j];
+                }
+            }
+            for (; t < tt; ++t) {
+                for (size_t r = 0; r < nr; ++r) yt[t * out + o0 + r] = dot(rows[r], xt + t * in, in);
+            }
+        }
+    }
+}
+
+// Multiply-adds below which an op is not worth splitting across threads
+const size_t kParallelMinWork = 1 << 16;
+
+/**
+ * y[t] = W x[t] for every token t; x is [n_tokens x w.cols], y is [n_tokens x w.rows].
+ *
+ * A single token (decode) is a GEMV using the in-register dequantizing
+ * row kernels. Several tokens run as a GEMM: each weight row is read (and
+ * dequantized) once per tile of kGemmTokenTile tokens and applied to four
+ * tokens at a time, instead of being re-streamed for every token.
+ *
+ * With a pool, output rows are split across its threads in whole
+ * kGemmRowBlock blocks; every thread streams a disjoint slice of W, from
+ * its own node's replica when W is replicated.
+ */
+void matmul(const WeightTensor& w, const float* x, float* y, size_t n_tokens,
+            ThreadPool* pool = nullptr) {
+    const size_t out = w.rows;
+    // W is streamed once per token tile, activations read and written once
+    LLAMALEX_PROFILE_COUNT(2ull * out * w.cols * n_tokens,
+                           w.bytes() * ((n_tokens + kGemmTokenTile - 1) / kGemmTokenTile) +
+                               n_tokens * (w.cols + out) * sizeof(float));
+    if (!pool || pool->size() == 1 || out * w.cols * n_tokens < kParallelMinWork) {
+        matmul_rows(w, x, y, n_tokens, 0, out);
+        return;
+    }
+    const size_t n_blocks = (out + kGemmRowBlock - 1) / kGemmRowBlock;
+    pool->parallel_for(n_blocks, [&](size_t b0, size_t b1) {
+        matmul_rows(w.on_node(ThreadPool::current_node()), x, y, n_tokens,
+                    b0 * kGemmRowBlock, std::min(out, b1 * kGemmRowBlock));
+    });
+}
+
+// Root-mean-square normalization (LLaMA pre-norm) with per-channel gain
+void rms_norm(const float* x, float* y, size_t n_tokens, size_t dim,
+              const float* weight, float eps) {
+    LLAMALEX_PROFILE_COUNT(4ull * n_tokens * dim, (2 * n_tokens + 1) * dim * sizeof(float));
+    for (size_t t = 0; t < n_tokens; ++t) {
+        const float* xt = x + t * dim;
+        float* yt = y + t * dim;
+        const float inv_rms = 1.0f / std::sqrt(dot(xt, xt, dim) / dim + eps);
+        for (size_t i = 0; i < dim; ++i) yt[i] = xt[i] * inv_rms * weight[i];
+    }
+}
+
+// rms_norm() for a compile-time row width: the dot product and scaling
+// loops unroll fully (selected per model by ShapeKernels)
+template <size_t Dim>
+void rms_norm_fixed(const float* x, float* y, size_t n_tokens, size_t dim,
+                    const float* weight, float eps) {
+    (void)dim;
+    LLAMALEX_PROFILE_COUNT(4ull * n_tokens * Dim, (2 * n_tokens + 1) * Dim * sizeof(float));
+    for (size_t t = 0; t < n_tokens; ++t) {
+        const float* xt = x + t * Dim;
+        float* yt = y + t * Dim;
+        const float inv_rms = 1.0f / std::sqrt(dot(xt, xt, Dim) / Dim + eps);
+        for (size_t i = 0; i < Dim; ++i) yt[i] = xt[i] * inv_rms * weight[i];
+    }
+}
+
+// Largest element of x (n > 0)
+float max_value(const float* x, size_t n) {
+    size_t i = 0;
+    float m = x[0];
+#if defined(__AVX512F__)
+    if (n >= 16) {
+        __m512 acc = _mm512_loadu_ps(x);
+        for (i = 16; i + 16 <= n; i += 16) acc = _mm512_max_ps(acc, _mm512_loadu_ps(x + i));
+        m = _mm512_reduce_max_ps(acc);
+    }
+#elif defined(__AVX2__)
+    if (n >= 8) {
+        __m256 acc = _mm256_loadu_ps(x);
+        for (i = 8; i + 8 <= n; i += 8) acc = _mm256_max_ps(acc, _mm256_loadu_ps(x + i));
+        __m128 r = _mm_max_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+        r = _mm_max_ps(r, _mm_movehl_ps(r, r));
+        r = _mm_max_ss(r, _mm_movehdup_ps(r));
+        m = _mm_cvtss_f32(r);
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    if (n >= 4) {
+        float32x4_t acc = vld1q_f32(x);
+        for (i = 4; i + 4 <= n; i += 4) acc = vmaxq_f32(acc, vld1q_f32(x + i));
+        m = vmaxvq_f32(acc);
+    }
+#endif
+    for (; i < n; ++i) m = x[i] > m ? x[i] : m;
+    return m;
+}
+
+// Index of the largest element (the first one on ties)
+size_t argmax(const float* x, size_t n) {
+    return std::find(x, x + n, max_value(x, n)) - x;
+}
+
+inline size_t argmax(const std::vector<float>& x) {
+    return argmax(x.data(), x.size());
+}
+
+// exp(x) by range reduction to [-ln2/2, ln2/2] and a degree-5 polynomial
+// (Cephes expf, within a couple of ulp)
+inline float exp_approx(float x) {
+    x = std::min(88.3762626647949f, std::max(-87.3365447504f, x));
+    const float fx = std::nearbyint(x * 1.44269504088896341f);
+    x = x - fx * 0.693359375f + fx * 2.12194440e-4f;
+    float p = 1.9875691500e-4f;
+    p = p * x + 1.3981999507e-3f;
+    p = p * x + 8.3334519073e-3f;
+    p = p * x + 4.1665795894e-2f;
+    p = p * x + 1.6666665459e-1f;
+    p = p * x + 5.0000001201e-1f;
+    const float y = p * x * x + x + 1.0f;
+    return y * fp32_from_bits(static_cast<uint32_t>(static_cast<int32_t>(fx) + 127) << 23);
+}
+
+#if defined(__AVX512F__)
+inline __m512 exp_approx(__m512 x) {
+    x = _mm512_min_ps(_mm512_set1_ps(88.3762626647949f), _mm512_max_ps(_mm512_set1_ps(-87.3365447504f), x));
+    const __m512 fx = _mm512_roundscale_ps(_mm512_mul_ps(x, _mm512_set1_ps(1.44269504088896341f)),
+                                           _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    x = _mm512_add_ps(_mm512_sub_ps(x, _mm512_mul_ps(fx, _mm512_set1_ps(0.693359375f))),
+                      _mm512_mul_ps(fx, _mm512_set1_ps(2.12194440e-4f)));
+    __m512 p = _mm512_set1_ps(1.9875691500e-4f);
+    p = _mm512_add_ps(_mm512_mul_ps(p, x), _mm512_set1_ps(1.3981999507e-3f));
+    p = _mm512_add_ps(_mm512_mul_ps(p, x), _mm512_set1_ps(8.3334519073e-3f));
+    p = _mm512_add_ps(_mm512_mul_ps(p, x), _mm512_set1_ps(4.1665795894e-2f));
+    p = _mm512_add_ps(_mm512_mul_ps(p, x), _mm512_set1_ps(1.6666665459e-1f));
+    p = _mm512_add_ps(_mm512_mul_ps(p, x), _mm512_set1_ps(5.0000001201e-1f));
+    const __m512 y = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(_mm512_mul_ps(p, x), x), x), _mm512_set1_ps(1.0f));
+    const __m512i e = _mm512_slli_epi32(_mm512_add_epi32(_mm512_cvtps_epi32(fx), _mm512_set1_epi32(127)), 23);
+    return _mm512_mul_ps(y, _mm512_castsi512_ps(e));
+}
+#elif defined(__AVX2__)
+inline __m256 exp_approx(__m256 x) {
+    x = _mm256_min_ps(_mm256_set1_ps(88.3762626647949f), _mm256_max_ps(_mm256_set1_ps(-87.3365447504f), x));
+    const __m256 fx = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(1.44269504088896341f)),
+                                      _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    x = _mm256_add_ps(_mm256_sub_ps(x, _mm256_mul_ps(fx, _mm256_set1_ps(0.693359375f))),
+                      _mm256_mul_ps(fx, _mm256_set1_ps(2.12194440e-4f)));
+    __m256 p = _mm256_set1_ps(1.9875691500e-4f);
+    p = _mm256_add_ps(_mm256_mul_ps(p, x), _mm256_set1_ps(1.3981999507e-3f));
+    p = _mm256_add_ps(_mm256_mul_ps(p, x), _mm256_set1_ps(8.3334519073e-3f));
+    p = _mm256_add_ps(_mm256_mul_ps(p, x), _mm256_set1_ps(4.1665795894e-2f));
+    p = _mm256_add_ps(_mm256_mul_ps(p, x), _mm256_set1_ps(1.6666665459e-1f));
+    p = _mm256_add_ps(_mm256_mul_ps(p, x), _mm256_set1_ps(5.0000001201e-1f));
+    const __m256 y = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(p, x), x), x), _mm256_set1_ps(1.0f));
+    const __m256i e = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(fx), _mm256_set1_epi32(127)), 23);
+    return _mm256_mul_ps(y, _mm256_castsi256_ps(e));
+}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+inline float32x4_t exp_approx(float32x4_t x) {
+    x = vminq_f32(vdupq_n_f32(88.3762626647949f), vmaxq_f32(vdupq_n_f32(-87.3365447504f), x));
+    const float32x4_t fx = vrndnq_f32(vmulq_f32(x, vdupq_n_f32(1.44269504088896341f)));
+    x = vaddq_f32(vsubq_f32(x, vmulq_f32(fx, vdupq_n_f32(0.693359375f))),
+                  vmulq_f32(fx, vdupq_n_f32(2.12194440e-4f)));
+    float32x4_t p = vdupq_n_f32(1.9875691500e-4f);
+    p = vaddq_f32(vmulq_f32(p, x), vdupq_n_f32(1.3981999507e-3f));
+    p = vaddq_f32(vmulq_f32(p, x), vdupq_n_f32(8.3334519073e-3f));
+    p = vaddq_f32(vmulq_f32(p, x), vdupq_n_f32(4.1665795894e-2f));
+    p = vaddq_f32(vmulq_f32(p, x), vdupq_n_f32(1.6666665459e-1f));
+    p = vaddq_f32(vmulq_f32(p, x), vdupq_n_f32(5.0000001201e-1f));
+    const float32x4_t y = vaddq_f32(vaddq_f32(vmulq_f32(vmulq_f32(p, x), x), x), vdupq_n_f32(1.0f));
+    const int32x4_t e = vshlq_n_s32(vaddq_s32(vcvtq_s32_f32(fx), vdupq_n_s32(127)), 23);
+    return vmulq_f32(y, vreinterpretq_f32_s32(e));
+}
+#endif
+
+// y[i] = exp((x[i] - shift) * scale); returns the sum of y (softmax numerators)
+float exp_sum(const float* x, float* y, size_t n, float scale, float shift) {
+    size_t i = 0;
+    float sum = 0.0f;
+#if defined(__AVX512F__)
+    const __m512 vs = _mm512_set1_ps(scale), vm = _mm512_set1_ps(shift);
+    __m512 acc = _mm512_setzero_ps();
+    for (; i + 16 <= n; i += 16) {
+        const __m512 e = exp_approx(_mm512_mul_ps(_mm512_sub_ps(_mm512_loadu_ps(x + i), vm), vs));
+        _mm512_storeu_ps(y + i, e);
+        acc = _mm512_add_ps(acc, e);
+    }
+    sum = _mm512_reduce_add_ps(acc);
+#elif defined(__AVX2__)
+    const __m256 vs = _mm256_set1_ps(scale), vm = _mm256_set1_ps(shift);
+    __m256 acc = _mm256_setzero_ps();
+    for (; i + 8 <= n; i += 8) {
+        const __m256 e = exp_approx(_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(x + i), vm), vs));
+        _mm256_storeu_ps(y + i, e);
+        acc = _mm256_add_ps(acc, e);
+    }
+    sum = hsum256(acc);
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const float32x4_t vs = vdupq_n_f32(scale), vm = vdupq_n_f32(shift);
+    float32x4_t acc = vdupq_n_f32(0.0f);
+    for (; i + 4 <= n; i += 4) {
+        const float32x4_t e = exp_approx(vmulq_f32(vsubq_f32(vld1q_f32(x + i), vm), vs));
+        vst1q_f32(y + i, e);
+        acc = vaddq_f32(acc, e);
+    }
+    sum = vaddvq_f32(acc);
+#endif
+    for (; i < n; ++i) {
+        y[i] = exp_approx((x[i] - shift) * scale);
+        sum += y[i];
+    }
+    return sum;
+}
+
+// Rotary position embedding over adjacent pairs within each head
+void apply_rope(float* x, size_t n_tokens, size_t dim, size_t head_dim, size_t pos_offset,
+                float freq_base) {
+    for (size_t t = 0; t < n_tokens; ++t) {
+        const float pos = static_cast<float>(pos_offset + t);
+        float* xt = x + t * dim;
+        for (size_t i = 0; i < head_dim; i += 2) {
+            const float theta = pos * std::pow(freq_base, -static_cast<float>(i) / head_dim);
+            const float c = std::cos(theta), s = std::sin(theta);
+            for (size_t h = 0; h < dim; h += head_dim) {
+                const float x0 = xt[h + i], x1 = xt[h + i + 1];
+                xt[h + i] = x0 * c - x1 * s;
+                xt[h + i + 1] = x0 * s + x1 * c;
+            }
+        }
+    }
+}
+
+} // namespace
+
+/**
+ * VocabTrie - Byte trie over vocabulary pieces, flattened into arrays
+ *
+ * Each node's outgoing edges are stored contiguously and sorted by byte,
+ * so a walk touches a couple of cache lines per step instead of chasing
+ * per-node allocations; the root keeps a direct 256-entry table since
+ * every lookup starts there.
+ */
+class VocabTrie {
+public:
+    VocabTrie() : nodes_(1), root_(256, 0) {}
+    
+    // keys[i] maps to ids[i]; on duplicate keys the first one wins
+    void build(const std::vector<std::string>& keys, const std::vector<int>& ids) {
+        // Pointer-based trie first, then breadth-first flattening so that
+        // the children of every node get adjacent indices
+        std::vector<std::map<uint8_t, uint32_t>> children(1);
+        std::vector<int> node_ids(1, -1);
+        for (size_t k = 0; k < keys.size(); ++k) {
+            uint32_t node = 0;
+            for (char c : keys[k]) {
+                const uint8_t b = static_cast<uint8_t>(c);
+                auto it = children[node].find(b);
+                if (it == children[node].end()) {
+                    it = children[node].insert(std::make_pair(b, static_cast<uint32_t>(children.size()))).first;
+                    children.emplace_back();
+                    node_ids.push_back(-1);
+                }
+                node = it->second;
+            }
+            if (node != 0 && node_ids[node] < 0) node_ids[node] = ids[k];
+        }
+        
+        std::vector<uint32_t> order(1, 0), index(children.size(), 0);
+        for (size_t i = 0; i < order.size(); ++i) {
+            for (const auto& edge : children[order[i]]) {
+                index[edge.second] = static_cast<uint32_t>(order.size());
+                order.push_back(edge.second);
+            }
+        }
+        
+        nodes_.assign(order.size(), Node());
+        edge_bytes_.clear();
+        edge_nodes_.clear();
+        std::fill(root_.begin(), root_.end(), 0);
+        for (size_t i = 0; i < order.size(); ++i) {
+            Node& node = nodes_[i];
+            node.id = node_ids[order[i]];
+            node.first_edge = static_cast<uint32_t>(edge_bytes_.size());
+            node.n_edges = static_cast<uint32_t>(children[order[i]].size());
+            for (const auto& edge : children[order[i]]) {
+                edge_bytes_.push_back(edge.first);
+                edge_nodes_.push_back(index[edge.second]);
+                if (i == 0) root_[edge.first] = index[edge.second];
+            }
+        }
+    }
+    
+    // Id of the piece equal to s[0, n), or -1
+    int find(const char* s, size_t n) const {
+        uint32_t node = 0;
+        for (size_t i = 0; i < n && (i == 0 || node != 0); ++i) {
+            node = child(node, static_cast<uint8_t>(s[i]));
+        }
+        return n > 0 && node != 0 ? nodes_[node].id : -1;
+    }
+    
+    // Calls fn(length, id) for every piece that is a prefix of s[0, n)
+    template <typename Fn>
+    void prefixes(const char* s, size_t n, Fn fn) const {
+        uint32_t node = 0;
+        for (size_t i = 0; i < n; ++i) {
+            node = child(node, static_cast<uint8_t>(s[i]));
+            if (node == 0) return;
+            if (nodes_[node].id >= 0) fn(i + 1, nodes_[node].id);
+        }
+    }
+
+private:
+    struct Node {
+        int32_t id = -1;
+        uint32_t first_edge = 0;
+        uint32_t n_edges = 0;
+    };
+    
+    std::vector<Node> nodes_;          // nodes_[0] is the root
+    std::vector<uint8_t> edge_bytes_;  // per node, sorted
+    std::vector<uint32_t> edge_nodes_;
+    std::vector<uint32_t> root_;       // byte -> child of the root (0: none)
+    
+    // Child of node along byte b (0: none; the root is never a child)
+    uint32_t child(uint32_t node, uint8_t b) const {
+        if (node == 0) return root_[b];
+        const Node& n = nodes_[node];
+        const uint8_t* first = edge_bytes_.data() + n.first_edge;
+        const uint8_t* last = first + n.n_edges;
+        const uint8_t* it = std::lower_bound(first, last, b);
+        return it != last && *it == b ? edge_nodes_[it - edge_bytes_.data()] : 0;
+    }
+};
+
+/**
+ * PatternDFA - Longest-match recognizer for a set of patterns, compiled to
+ * one byte-indexed DFA
+ *
+ * Patterns use a small regex syntax: literals (metacharacters escaped with
+ * a backslash), the classes \d (digit), \u (upper), \l (lower), \a
+ * (alphanumeric), sets `[...]` of those and literals, groups `( | )` and
+ * the ? * + quantifiers.
+ * They are compiled once (Thompson NFA, then subset construction), so
+ * matching costs one table lookup per input byte whatever the number of
+ * patterns.
+ */
+class PatternDFA {
+public:
+    void compile(const std::vector<std::string>& patterns) {
+        nfa_.clear();
+        table_.clear();
+        accept_.clear();
+        if (patterns.empty()) return;
+        
+        // Union of all patterns under one start state
+        const int start = new_state();
+        for (const auto& pattern : patterns) {
+            const char* p = pattern.c_str();
+            Fragment f = parse_alternation(p);
+            if (*p != '\0') throw std::runtime_error("bad pattern: " + pattern);
+            nfa_[start].eps.push_back(f.start);
+            nfa_[f.end].accept = true;
+        }
+        build_dfa(start);
+    }
+    
+    bool empty() const { return accept_.empty(); }
+    
+    /**
+     * Length of the longest match at s[0, n) that ends on a word boundary
+     * (end of input or a byte that is not alphanumeric), or 0
+     */
+    size_t match(const char* s, size_t n) const {
+        if (empty()) return 0;
+        int state = 0;
+        size_t longest = 0;
+        for (size_t i = 0; i < n; ++i) {
+            state = table_[state * 256 + static_cast<uint8_t>(s[i])];
+            if (state < 0) break;
+            if (accept_[state] && (i + 1 == n || !std::isalnum(static_cast<uint8_t>(s[i + 1])))) {
+                longest = i + 1;
+            }
+        }
+        return longest;
+    }
+
+private:
+    typedef std::bitset<256> ByteSet;
+    
+    struct NfaState {
+        std::vector<std::pair<ByteSet, int>> edges;
+        std::vector<int> eps;
+        bool accept = false;
+    };
+    
+    struct Fragment {
+        int start, end;
+    };
+    
+    std::vector<NfaState> nfa_;
+    std::vector<int32_t> table_;  // [state x 256] -> next state, -1 dead
+    std::vector<bool> accept_;
+    
+    int new_state() {
+        nfa_.push_back(NfaState());
+        return static_cast<int>(nfa_.size()) - 1;
+    }
+    
+    static ByteSet literal_set(char c) {
+        ByteSet set;
+        set[static_cast<uint8_t>(c)] = true;
+        return set;
+    }
+    
+    // Set for an escape: a class letter or an escaped literal
+    static ByteSet class_set(char c) {
+        ByteSet set;
+        for (int b = 0; b < 256; ++b) {
+            const bool digit = b >= '0' && b <= '9';
+            const bool upper = b >= 'A' && b <= 'Z';
+            const bool lower = b >= 'a' && b <= 'z';
+            switch (c) {
+                case 'd': set[b] = digit; break;
+                case 'u': set[b] = upper; break;
+                case 'l': set[b] = lower; break;
+                case 'a': set[b] = digit || upper || lower; break;
+                default: set[b] = b == static_cast<uint8_t>(c); break;  // escaped literal
+            }
+        }
+        return set;
+    }
+    
+    Fragment atom(const ByteSet& set) {
+        Fragment f = {new_state(), new_state()};
+        nfa_[f.start].edges.push_back(std::make_pair(set, f.end));
+        return f;
+    }
+    
+    Fragment parse_alternation(const char*& p) {
+        Fragment f = parse_sequence(p);
+        while (*p == '|') {
+            ++p;
+            Fragment g = parse_sequence(p);
+            Fragment alt = {new_state(), new_state()};
+            nfa_[alt.start].eps.push_back(f.start);
+            nfa_[alt.start].eps.push_back(g.start);
+            nfa_[f.end].eps.push_back(alt.end);
+            nfa_[g.end].eps.push_back(alt.end);
+            f = alt;
+        }
+        return f;
+    }
+    
+    Fragment parse_sequence(const char*& p) {
+        const int start = new_state();
+        int end = start;
+        while (*p != '\0' && *p != '|' && *p != ')') {
+            Fragment f = parse_repeat(p);
+            nfa_[end].eps.push_back(f.start);
+            end = f.end;
+        }
+        Fragment f = {start, end};
+        return f;
+    }
+    
+    Fragment parse_repeat(const char*& p) {
+        Fragment f = parse_atom(p);
+        while (*p == '?' || *p == '*' || *p == '+') {
+            const char q = *p++;
+            Fragment r = {new_state(), new_state()};
+            nfa_[r.start].eps.push_back(f.start);
+            nfa_[f.end].eps.push_back(r.end);
+            if (q != '+') nfa_[r.start].eps.push_back(r.end);  // may be skipped
+            if (q != '?') nfa_[f.end].eps.push_back(f.start);  // may repeat
+            f = r;
+        }
+        return f;
+    }
+    
+    Fragment parse_atom(const char*& p) {
+        if (*p == '(') {
+            ++p;
+            Fragment f = parse_alternation(p);
+            if (*p++ != ')') throw std::runtime_error("unbalanced pattern group");
+            return f;
+        }
+        if (*p == '[') {
+            ByteSet set;
+            for (++p; *p != ']'; ++p) {
+                if (*p == '\0') throw std::runtime_error("unterminated pattern set");
+                set |= *p == '\\' ? class_set(*++p) : literal_set(*p);
+            }
+            ++p;
+            return atom(set);
+        }
+        if (*p == '\\') {
+            ++p;
+            return atom(class_set(*p++));
+        }
+        return atom(literal_set(*p++));
+    }
+    
+    void closure(std::vector<int>& states) const {
+        std::vector<bool> seen(nfa_.size(), false);
+        for (int s : states) seen[s] = true;
+        for (size_t i = 0; i < states.size(); ++i) {
+            for (int t : nfa_[states[i]].eps) {
+                if (!seen[t]) {
+                    seen[t] = true;
+                    states.push_back(t);
+                }
+            }
+        }
+        std::sort(states.begin(), states.end());
+    }
+    
+    // Subset construction; DFA state 0 is the closure of the NFA start
+    void build_dfa(int start) {
+        std::map<std::vector<int>, int> ids;
+        std::vector<std::vector<int>> sets(1, std::vector<int>(1, start));
+        closure(sets[0]);
+        ids[sets[0]] = 0;
+        for (size_t d = 0; d < sets.size(); ++d) {
+            table_.resize((d + 1) * 256, -1);
+            bool accepting = false;
+            for (int s : sets[d]) accepting = accepting || nfa_[s].accept;
+            accept_.push_back(accepting);
+            
+            for (int b = 0; b < 256; ++b) {
+                std::vector<int> next;
+                for (int s : sets[d]) {
+                    for (const auto& edge : nfa_[s].edges) {
+                        if (edge.first[b]) next.push_back(edge.second);
+                    }
+                }
+                if (next.empty()) continue;
+                closure(next);
+                next.erase(std::unique(next.begin(), next.end()), next.end());
+                auto it = ids.find(next);
+                if (it == ids.end()) {
+                    it = ids.insert(std::make_pair(next, static_cast<int>(sets.size()))).first;
+                    sets.push_back(next);
+                }
+                table_[d * 256 + b] = it->second;
+            }
+        }
+        nfa_.clear();
+    }
+};
+
+/**
+ * LegalTokenizer - Subword tokenization for legal text
+ *
+ * With a vocabulary loaded (SentencePiece-style pieces, "▁" marking a
+ * space), text is segmented by unigram Viterbi over the piece scores, or by
+ * BPE when merges are given. Pieces are matched through a VocabTrie while
+ * the input is scanned in place, and bytes that no piece covers fall back
+ * to <0xNN> byte tokens, so detokenize() reproduces the input exactly.
+ * Without a vocabulary, words are hashed into vocab_size ids (enough for
+ * the randomly initialized model, but not reversible).
+ *
+ * Case-law and statute modes add a pre-tokenization pass: citations and
+ * section references ("2019 (3) SA 123 (CC)", "s 34(1)(b)") are recognized
+ * by a PatternDFA at each word start and emitted as one token. With a
+ * vocabulary these atoms take ids in the spare embedding rows above it
+ * (up to kMaxAtoms of them): each atom hashes to one row, claimed by the
+ * first atom seen there and remembered for detokenize(). An atom whose
+ * row another atom holds is tokenized as ordinary subwords / bytes, so
+ * detokenize() still reproduces the input. Spare rows are untrained in a
+ * pretrained model (padding as far as it knows), so an atom id saves
+ * tokens but carries no learned meaning unless the model was fine-tuned
+ * with the same atom table; with no spare rows the modes have no effect.
+ */
+class LegalTokenizer {
+public:
+    // GGUF token types (tokenizer.ggml.token_type)
+    enum TokenType : int32_t { NORMAL = 1, UNKNOWN = 2, CONTROL = 3, USER_DEFINED = 4, BYTE = 6 };
+    
+    struct Vocab {
+        std::vector<std::string> pieces;
+        std::vector<float> scores;         // empty: every piece scores -1 (fewest tokens)
+        std::vector<int32_t> types;        // empty: inferred from the piece text
+        std::vector<std::string> merges;   // "left right", highest priority first; empty: unigram
+        int bos_id = -1, eos_id = -1, unk_id = -1;  // -1: <s>, </s>, <unk> by name
+        bool add_space_prefix = true;      // tokenize as if the text started with a space
+    };
+    
+    LegalTokenizer(size_t vocab_size = 50000, bool case_law_mode = false, bool statute_mode = false)
+        : vocab_size_(vocab_size), atoms_(std::make_shared<AtomTable>(0)) {
+        // Initialize vocabulary with legal terms
+        init_vocab();
+        set_legal_modes(case_law_mode, statute_mode);
+    }
+    
+    // Citation forms kept as single tokens in case-law mode
+    static std::vector<std::string> case_law_patterns() {
+        return {
+            // Law reports: 2019 (3) SA 123 (CC), 2001 (1) All SA 12 (A)
+            "\\d\\d\\d\\d \\(\\d+\\) \\u[\\u\\l]*( \\u[\\u\\l]*)? \\d+( \\(\\u+\\))?",
+            // Neutral citations: [2019] ZACC 12
+            "\\[\\d\\d\\d\\d\\] \\u+ \\d+",
+            // Case names: Smith v. Jones, S v Makwanyane
+            "\\u[\\a'\\-]* v\\.? \\u[\\a'\\-]*"
+        };
+    }
+    
+    // Reference forms kept as single tokens in statute mode
+    static std::vector<std::string> statute_patterns() {
+        return {
+            // Sections: s 34(1)(b), ss 12-14, section 12A(3), reg 5(2)
+            "(s|ss|section|sections|Section|Sections|reg|regulation|art|article|rule|para|item|clause) "
+            "\\d+\\u*(\\(\\a+\\))*(\\-\\d+\\u*(\\(\\a+\\))*)?",
+            // Sub-references: subsection (2), paragraph (a)(ii)
+            "(subsection|paragraph|subparagraph|item) \\(\\a+\\)(\\(\\a+\\))*",
+            // Acts: Act 108 of 1996, Act No. 4 of 2000
+            "Act (No\\. )?\\d+ of \\d\\d\\d\\d"
+        };
+    }
+    
+    // Choose which pattern sets the pre-tokenizer recognizes
+    void set_legal_modes(bool case_law_mode, bool statute_mode) {
+        std::vector<std::string> patterns;
+        if (case_law_mode) patterns = case_law_patterns();
+        if (statute_mode) {
+            const std::vector<std::string> statute = statute_patterns();
+            patterns.insert(patterns.end(), statute.begin(), statute.end());
+        }
+        patterns_.compile(patterns);
+        warn_no_atom_rows();
+    }
+    
+    /**
+     * Load a vocabulary file (one piece per line, optionally followed by a
+     * tab and its score, as written by spm_export_vocab) and an optional
+     * merges file ("left right" per line, highest priority first).
+     */
+    void load(const std::string& vocab_path, const std::string& merges_path = "") {
+        Vocab vocab;
+        std::ifstream in(vocab_path.c_str());
+        if (!in) throw std::runtime_error("cannot open vocab file: " + vocab_path);
+        std::string line;
+        bool has_scores = true;
+        while (std::getline(in, line)) {
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            const size_t tab = line.find('\t');
+            vocab.pieces.push_back(line.substr(0, tab));
+            if (tab == std::string::npos) {
+                has_scores = false;
+            } else {
+                vocab.scores.push_back(std::strtof(line.c_str() + tab + 1, nullptr));
+            }
+        }
+        if (!has_scores) vocab.scores.clear();
+        
+        if (!merges_path.empty()) {
+            std::ifstream merges(merges_path.c_str());
+            if (!merges) throw std::runtime_error("cannot open merges file: " + merges_path);
+            while (std::getline(merges, line)) {
+                if (!line.empty() && line.back() == '\r') line.pop_back();
+                if (line.empty() || line[0] == '#') continue;
+                vocab.merges.push_back(line);
+            }
+        }
+        set_vocab(vocab);
+    }
+    
+    void set_vocab(const Vocab& vocab) {
+        const size_t n = vocab.pieces.size();
+        if (n == 0) throw std::runtime_error("empty vocabulary");
+        if (!vocab.scores.empty() && vocab.scores.size() != n) {
+            throw std::runtime_error("vocabulary scores do not match the pieces");
+        }
+        
+        vocab_ = vocab;
+        text_.assign(n, std::string());
+        scores_.assign(n, -1.0f);
+        std::fill(byte_ids_, byte_ids_ + 256, -1);
+        bos_id_ = vocab.bos_id;
+        eos_id_ = vocab.eos_id;
+        unk_id_ = vocab.unk_id;
+        
+        std::vector<std::string> keys;
+        std::vector<int> ids;
+        float min_score = 0.0f;
+        for (size_t i = 0; i < n; ++i) {
+            const std::string& piece = vocab.pieces[i];
+            const int id = static_cast<int>(i);
+            if (!vocab.scores.empty()) scores_[i] = vocab.scores[i];
+            min_score = std::min(min_score, scores_[i]);
+            
+            const int32_t type = i < vocab.types.size() ? vocab.types[i] : infer_type(piece);
+            if (type == BYTE) {
+                const unsigned value = std::strtoul(piece.c_str() + 3, nullptr, 16) & 0xFF;
+                byte_ids_[value] = id;
+                text_[i] = std::string(1, static_cast<char>(value));
+            } else if (type == NORMAL || type == USER_DEFINED) {
+                text_[i] = replace_all(piece, kSpaceMarker, " ");
+                keys.push_back(text_[i]);
+                ids.push_back(id);
+            } else {
+                if (piece == "<s>" && bos_id_ < 0) bos_id_ = id;
+                if (piece == "</s>" && eos_id_ < 0) eos_id_ = id;
+                if (type == UNKNOWN && unk_id_ < 0) unk_id_ = id;
+            }
+        }
+        if (bos_id_ < 0) bos_id_ = 1;
+        if (eos_id_ < 0) eos_id_ = 2;
+        if (unk_id_ < 0) unk_id_ = 0;
+        byte_score_ = min_score - 10.0f;  // only when no piece covers a byte
+        trie_.build(keys, ids);
+        atoms_ = std::make_shared<AtomTable>(std::min(kMaxAtoms, vocab_size_ > n ? vocab_size_ - n : 0));
+        warn_no_atom_rows();
+        
+        merge_ranks_.clear();
+        for (size_t r = 0; r < vocab.merges.size(); ++r) {
+            const std::string& merge = vocab.merges[r];
+            const size_t sep = merge.find(' ', 1);
+            if (sep == std::string::npos) continue;
+            const std::string left = replace_all(merge.substr(0, sep), kSpaceMarker, " ");
+            const std::string right = replace_all(merge.substr(sep + 1), kSpaceMarker, " ");
+            const int l = trie_.find(left.data(), left.size());
+            const int rt = trie_.find(right.data(), right.size());
+            const std::string joined = left + right;
+            const int merged = trie_.find(joined.data(), joined.size());
+            if (l < 0 || rt < 0 || merged < 0) continue;
+            merge_ranks_.insert(std::make_pair(pair_key(l, rt),
+                                               std::make_pair(static_cast<uint32_t>(r), merged)));
+        }
+    }
+    
+    bool has_vocab() const { return !text_.empty(); }
+    const Vocab& vocab() const { return vocab_; }
+    size_t vocab_count() const { return text_.size(); }
+    int bos_id() const { return bos_id_; }
+    int eos_id() const { return eos_id_; }
+    
+    std::vector<int> tokenize(const std::string& text, bool add_eos = true) const {
+        std::vector<int> tokens;
+        tokenize(text, tokens, add_eos);
+        return tokens;
+    }
+    
+    /**
+     * tokenize() into `tokens` (replacing its contents, keeping its
+     * capacity). With `offsets`, offsets[i] is the byte of text where
+     * token i's word or citation starts (0 for BOS, text.size() for EOS).
+     */
+    void tokenize(const std::string& text, std::vector<int>& tokens, bool add_eos,
+                  std::vector<uint32_t>* offsets = nullptr) const {
+        LLAMALEX_PROFILE_SCOPE(ProfileOp::TOKENIZE);
+        LLAMALEX_PROFILE_COUNT(0, text.size());
+        tokens.clear();
+        tokens.push_back(bos_id_); // BOS token
+        if (offsets) offsets->assign(1, 0);
+        auto mark = [&](const char* from) {
+            if (offsets) offsets->resize(tokens.size(), static_cast<uint32_t>(from - text.data()));
+        };
+        
+        const char* p = text.data();
+        const char* end = p + text.size();
+        if (!has_vocab()) {
+            // Hash whitespace-separated words (or whole citations) in place
+            while (p < end) {
+                while (p < end && is_space(*p)) ++p;
+                const bool word_start = p == text.data() || is_space(p[-1]);
+                const size_t atom = word_start ? patterns_.match(p, end - p) : 0;
+                if (atom > 0) {
+                    tokens.push_back(get_token_id(p, atom));
+                    mark(p);
+                    p += atom;
+                    continue;
+                }
+                const char* word = p;
+                while (p < end && !is_space(*p)) ++p;
+                if (p > word) tokens.push_back(get_token_id(word, p - word));
+                mark(word);
+            }
+        } else {
+            // Segments are a space plus the run of non-space bytes after it;
+            // the first one gets the dummy-prefix space if enabled. A
+            // citation starting a word is one segment and one token.
+            Scratch scratch;
+            std::string first;
+            const bool atoms = !patterns_.empty() && atoms_->size() > 0;
+            while (p < end) {
+                const bool at_start = p == text.data();
+                const char* q = p + 1;
+                if (atoms && (at_start || *p == ' ')) {
+                    const char* word = at_start ? p : p + 1;
+                    const size_t atom = patterns_.match(word, end - word);
+                    if (atom > 0) q = word + atom;
+                }
+                bool atom = q > p + 1;
+                int atom_id = -1;
+                const char* seg;
+                size_t seg_len;
+                for (;;) {
+                    if (!atom) {
+                        while (q < end && *q != ' ') ++q;
+                    }
+                    seg = p;
+                    seg_len = q - p;
+                    if (at_start && vocab_.add_space_prefix) {
+                        first.assign(1, ' ').append(p, q);
+                        seg = first.data();
+                        seg_len = first.size();
+                    }
+                    if (!atom || (atom_id = atom_token(seg, seg_len)) >= 0) break;
+                    // Row held by another atom: plain subwords for this word
+                    atom = false;
+                    q = p + 1;
+                }
+                if (atom) {
+                    tokens.push_back(atom_id);
+                } else {
+                    encode_segment(seg, seg_len, tokens, scratch);
+                }
+                mark(*p == ' ' && p + 1 < end ? p + 1 : p);
+                p = q;
+            }
+        }
+        
+        if (add_eos) tokens.push_back(eos_id_); // EOS token
+        mark(end);
+    }
+    
+    std::string detokenize(const std::vector<int>& tokens) const {
+        std::string text;
+        bool started = false;
+        for (int id : tokens) append_text(id, text, started);
+        return text;
+    }
+    
+    /**
+     * Append the text of one token to `text`, the detokenization of the
+     * tokens before it; a token at a time builds exactly what detokenize
+     * returns for the whole sequence (used to stream generated text).
+     * `started` is false before the first token and set once a piece has
+     * been appended, so only that piece loses the dummy-prefix space.
+     */
+    void append_text(int id, std::string& text, bool& started) const {
+        if (!has_vocab()) {
+            if (id == bos_id_ || id == eos_id_) return; // Skip BOS/EOS
+            if (!text.empty()) text += " ";
+            text += get_token_str(id);
+            return;
+        }
+        
+        // Pieces carry their own spacing; control tokens decode to nothing
+        const size_t start = text.size();
+        if (id >= 0 && static_cast<size_t>(id) < text_.size()) {
+            text += text_[id];
+        } else if (id >= 0) {
+            if (const std::string* atom = atoms_->text(static_cast<size_t>(id) - text_.size())) text += *atom;
+        }
+        if (started || text.size() == start) return;
+        started = true;
+        if (vocab_.add_space_prefix && text[start] == ' ') text.erase(start, 1);
+    }
+
+private:
+    static const char* const kSpaceMarker;
+    
+    // Spare embedding rows available to citation atoms at most
+    static const size_t kMaxAtoms = 1 << 16;
+    
+    /**
+     * Text of the citation atoms by row above the vocabulary (shared by
+     * copies): a fixed table, each row claimed once by the first atom
+     * hashed to it and never changed after, so lookups take no lock.
+     */
+    class AtomTable {
+    public:
+        explicit AtomTable(size_t rows) : rows_(rows), state_(new std::atomic<int>[rows]()), text_(rows) {}
+        
+        size_t size() const { return rows_; }
+        
+        // Row of atom s (claiming it if free), or -1 if another atom has it
+        long claim(uint64_t hash, const char* s, size_t n) {
+            const size_t row = hash % rows_;
+            int expected = kFree;
+            if (state_[row].compare_exchange_strong(expected, kWriting, std::memory_order_acquire)) {
+                text_[row].assign(s, n);
+                state_[row].store(kReady, std::memory_order_release);
+                return static_cast<long>(row);
+            }
+            while (state_[row].load(std::memory_order_acquire) != kReady) std::this_thread::yield();
+            const std::string& held = text_[row];
+            return held.size() == n && std::memcmp(held.data(), s, n) == 0 ? static_cast<long>(row) : -1;
+        }
+        
+        // Text of a claimed row, nullptr otherwise
+        const std::string* text(size_t row) const {
+            return row < rows_ && state_[row].load(std::memory_order_acquire) == kReady ? &text_[row] : nullptr;
+        }
+    
+    private:
+        enum { kFree = 0, kWriting = 1, kReady = 2 };
+        size_t rows_;
+        std::unique_ptr<std::atomic<int>[]> state_;
+        std::vector<std::string> text_;
+    };
+    
+    // Per-call buffers reused across segments
+    struct Scratch {
+        std::vector<float> best;
+        std::vector<uint32_t> back_len;
+        std::vector<int> back_id;
+        std::vector<int> symbols;
+    };
+    
+    size_t vocab_size_;
+    Vocab vocab_;
+    std::vector<std::string> text_;   // id -> decoded bytes (reverse table)
+    std::vector<float> scores_;
+    VocabTrie trie_;
+    std::unordered_map<uint64_t, std::pair<uint32_t, int>> merge_ranks_;  // (left, right) -> (rank, merged)
+    int byte_ids_[256];
+    int bos_id_ = 1, eos_id_ = 2, unk_id_ = 0;
+    float byte_score_ = -10.0f;
+    PatternDFA patterns_;
+    std::shared_ptr<AtomTable> atoms_;
+    
+    void init_vocab() {
+        // A real vocabulary comes from load() / set_vocab() or the model file
+        std::fill(byte_ids_, byte_ids_ + 256, -1);
+    }
+    
+    static bool is_space(char c) {
+        return c == ' ' || c == '\n' || c == '\t';
+    }
+    
+    static uint64_t pair_key(int left, int right) {
+        return (static_cast<uint64_t>(static_cast<uint32_t>(left)) << 32) | static_cast<uint32_t>(right);
+    }
+    
+    static std::string replace_all(std::string str, const std::string& from, const std::string& to) {
+        for (size_t pos = str.find(from); pos != std::string::npos; pos = str.find(from, pos + to.size())) {
+            str.replace(pos, from.size(), to);
+        }
+        return str;
+    }
+    
+    static int32_t infer_type(const std::string& piece) {
+        if (piece.size() == 6 && piece.compare(0, 3, "<0x") == 0 && piece[5] == '>') return BYTE;
+        if (piece == "<unk>") return UNKNOWN;
+        if (piece.size() > 2 && piece.front() == '<' && piece.back() == '>') return CONTROL;
+        return NORMAL;
+    }
+    
+    // Byte-fallback token for a byte no piece covers
+    int byte_token(char c) const {
+        const int id = byte_ids_[static_cast<uint8_t>(c)];
+        return id >= 0 ? id : unk_id_;
+    }
+    
+    void encode_segment(const char* s, size_t n, std::vector<int>& tokens, Scratch& scratch) const {
+        if (vocab_.merges.empty()) {
+            encode_unigram(s, n, tokens, scratch);
+        } else {
+            encode_bpe(s, n, tokens, scratch);
+        }
+    }
+    
+    // Highest-scoring segmentation of s[0, n) into pieces (Viterbi)
+    void encode_unigram(const char* s, size_t n, std::vector<int>& tokens, Scratch& scratch) const {
+        std::vector<float>& best = scratch.best;
+        std::vector<uint32_t>& back_len = scratch.back_len;
+        std::vector<int>& back_id = scratch.back_id;
+        best.assign(n + 1, -std::numeric_limits<float>::infinity());
+        back_len.resize(n + 1);
+        back_id.resize(n + 1);
+        best[0] = 0.0f;
+        
+        for (size_t i = 0; i < n; ++i) {
+            const float base = best[i];
+            if (base == -std::numeric_limits<float>::infinity()) continue;
+            trie_.prefixes(s + i, n - i, [&](size_t len, int id) {
+                const float score = base + scores_[id];
+                if (score > best[i + len]) {
+                    best[i + len] = score;
+                    back_len[i + len] = static_cast<uint32_t>(len);
+                    back_id[i + len] = id;
+                }
+            });
+            if (base + byte_score_ > best[i + 1]) {
+                best[i + 1] = base + byte_score_;
+                back_len[i + 1] = 1;
+                back_id[i + 1] = byte_token(s[i]);
+            }
+        }
+        
+        const size_t first = tokens.size();
+        for (size_t i = n; i > 0; i -= back_len[i]) tokens.push_back(back_id[i]);
+        std::reverse(tokens.begin() + first, tokens.end());
+    }
+    
+    // Characters of s[0, n), then repeated merging of the best-ranked pair
+    void encode_bpe(const char* s, size_t n, std::vector<int>& tokens, Scratch& scratch) const {
+        std::vector<int>& symbols = scratch.symbols;
+        symbols.clear();
+        for (size_t i = 0; i < n;) {
+            const uint8_t lead = static_cast<uint8_t>(s[i]);
+            size_t len = lead < 0x80 ? 1 : lead < 0xE0 ? 2 : lead < 0xF0 ? 3 : 4;
+            len = std::min(len, n - i);
+            const int id = trie_.find(s + i, len);
+            if (id >= 0) {
+                symbols.push_back(id);
+            } else {
+                for (size_t j = 0; j < len; ++j) symbols.push_back(byte_token(s[i + j]));
+            }
+            i += len;
+        }
+        
+        while (symbols.size() > 1) {
+            uint32_t best_rank = std::numeric_limits<uint32_t>::max();
+            size_t best_pos = 0;
+            int merged = -1;
+            for (size_t i = 0; i + 1 < symbols.size(); ++i) {
+                auto it = merge_ranks_.find(pair_key(symbols[i], symbols[i + 1]));
+                if (it != merge_ranks_.end() && it->second.first < best_rank) {
+                    best_rank = it->second.first;
+                    best_pos = i;
+                    merged = it->second.second;
+                }
+            }
+            if (merged < 0) break;
+            symbols[best_pos] = merged;
+            symbols.erase(symbols.begin() + best_pos + 1);
+        }
+        tokens.insert(tokens.end(), symbols.begin(), symbols.end());
+    }
+    
+    // Id of a citation atom: its row above the vocabulary, or -1 when
+    // another atom holds that row
+    int atom_token(const char* s, size_t n) const {
+        const long row = atoms_->claim(fnv1a(s, n), s, n);
+        return row < 0 ? -1 : static_cast<int>(text_.size() + row);
+    }
+    
+    void warn_no_atom_rows() const {
+        if (!patterns_.empty() && has_vocab() && atoms_->size() == 0) {
+            LLAMALEX_LOG(WARNING, "legal modes have no effect: the model embeds no ids beyond its %zu-token "
+                         "vocabulary for citation atoms", text_.size());
+        }
+    }
+    
+    int get_token_id(const char* word, size_t n) const {
+        // Hash-based ID (no vocabulary loaded)
+        return static_cast<int>(fnv1a(word, n) % vocab_size_);
+    }
+    
+    std::string get_token_str(int token_id) const {
+        // Reverse token lookup (no vocabulary loaded)
+        return "<token_" + std::to_string(token_id) + ">";
+    }
+};
+
+const char* const LegalTokenizer::kSpaceMarker = "\xE2\x96\x81";  // U+2581, SentencePiece's space
+const size_t LegalTokenizer::kMaxAtoms;
+
+/**
+ * Where offloaded transformer layers run (see LayerBackend); values are
+ * the C ABI's backend codes
+ */
+enum class BackendType : uint32_t {
+    CPU = 0,
+    CUDA = 1,
+    VULKAN = 2,
+    METAL = 3
+};
+
+inline const char* backend_name(BackendType type) {
+    static const char* names[] = {"cpu", "cuda", "vulkan", "metal"};
+    return type <= BackendType::METAL ? names[static_cast<uint32_t>(type)] : "unknown";
+}
+
+/**
+ * LlamaLexConfig - Configuration for LlamaLex model
+ *
+ * The shape, weight type, vocabulary, legal modes, kernels and threads
+ * are fixed by the LlamaLexModel; a session over a shared model takes
+ * only its context length, KV paging, batch/window sizes and caches from
+ * its own config (see LlamaLex::session_config).
+ */
+struct LlamaLexConfig {
+    size_t vocab_size = 50000;
+    size_t embedding_dim = 768;
+    size_t num_layers = 12;
+    size_t num_heads = 12;
+    size_t ff_dim = 3072;
+    size_t max_seq_length = 2048;
+    float rms_norm_eps = 1e-5f;
+    float rope_freq_base = 10000.0f;
+    
+    // Storage for attention/feed-forward matrices built in memory (model
+    // files keep the types they were written with)
+    TensorType weight_type = TensorType::F32;
+    
+    // Keep the KV cache between generate() calls and reuse shared prefixes
+    bool reuse_kv_cache = true;
+    
+    // Worker threads for matmuls and attention (0: one per hardware
+    // thread); pinning binds worker i to CPU i
+    size_t n_threads = 0;
+    bool pin_threads = false;
+    
+    // NUMA placement on multi-socket hosts: threads are spread over the
+    // first numa_nodes nodes (0: all; n_threads 0 then means one per CPU
+    // of those nodes) and bound to their node's CPUs, and weights are
+    // interleaved or replicated across them (see NumaMode)
+    NumaMode numa_mode = NumaMode::OFF;
+    size_t numa_nodes = 0;
+    
+    // Layer offload: the last gpu_layers layers (at most num_layers) run
+    // on `backend` with their weights uploaded once, the rest on the CPU.
+    // Without a registered backend of that type (see BackendRegistry), or
+    // when it fails to start, every layer runs on the CPU.
+    BackendType backend = BackendType::CPU;
+    size_t gpu_layers = 0;
+    
+    // Token budget of one packed encode_batch() forward pass; larger batches
+    // stop adding weight reuse and push activations out of cache
+    size_t max_batch_tokens = 512;
+    
+    // encode_document() windows: tokens per window (at most max_seq_length)
+    // and tokens shared by consecutive windows
+    size_t chunk_tokens = 512;
+    size_t chunk_overlap = 64;
+    
+    // Use the kernels compiled for the shipped shapes when the model
+    // matches one (see ShapeKernels); false forces the generic ones
+    bool specialized_kernels = true;
+    
+    // KV cache paging: positions per page, and a cap on pages across all
+    // sequences (0: grow as needed)
+    size_t kv_page_size = 64;
+    size_t kv_max_pages = 0;
+    
+    // Prefix cache (PrefixCache) for prefill(): KV pages of recent prompts
+    // kept for later prompts that start the same way (0: off)
+    size_t prefix_cache_bytes = 0;
+    
+    // Subword vocabulary (LegalTokenizer::load formats); the model file's
+    // own vocabulary is used when this is empty
+    std::string vocab_path;
+    std::string merges_path;
+    
+    // Persistent embedding cache (EmbeddingCache) for encode(): file path
+    // (empty: no cache) and its size on disk
+    std::string cache_path;
+    size_t cache_bytes = 256 << 20;
+    
+    // Legal-specific parameters
+    bool use_legal_vocab = true;
+    bool enable_case_law_mode = false;
+    bool enable_statute_mode = false;
+    
+    // Throws std::invalid_argument unless the shape can be built (heads
+    // must split embedding_dim evenly into even-width heads, as RoPE
+    // rotates pairs of channels) and the backend is a known one
+    void validate() const {
+        if (vocab_size == 0 || embedding_dim == 0 || num_layers == 0 || ff_dim == 0 || max_seq_length == 0) {
+            throw std::invalid_argument("model dimensions must be non-zero");
+        }
+        if (num_heads == 0 || embedding_dim % num_heads != 0 || (embedding_dim / num_heads) % 2 != 0) {
+            throw std::invalid_argument("embedding_dim " + std::to_string(embedding_dim) +
+                                        " does not split into " + std::to_string(num_heads) +
+                                        " heads of even width");
+        }
+        if (backend > BackendType::METAL) {
+            throw std::invalid_argument("unknown backend " + std::to_string(static_cast<uint32_t>(backend)));
+        }
+    }
+};
+
+/**
+ * ShapeKernels - Forward kernels chosen for a model's dimensions at load
+ *
+ * The generic kernels take every dimension at run time. For the shapes
+ * we ship (256/4-head and 768/12-head/3072) the norm row width and the
+ * attention head width (64 for both) are compiled in instead, so their
+ * inner loops unroll and keep the per-query accumulator in registers.
+ * Each kernel is picked by the dimension it depends on, so other models
+ * with 64-wide heads get the attention kernel too; anything else falls
+ * back to the generic code.
+ */
+struct ShapeKernels {
+    typedef void (*RmsNorm)(const float* x, float* y, size_t n_tokens, size_t dim,
+                            const float* weight, float eps);
+    
+    const char* name;       // shipped shape matched, or "generic"
+    RmsNorm rms_norm;
+    size_t head_dim;        // attention head width compiled in (0: generic)
+    
+    static ShapeKernels generic() {
+        ShapeKernels kernels = {"generic", &::llamalex::rms_norm, 0};
+        return kernels;
+    }
+    
+    static ShapeKernels select(const LlamaLexConfig& config) {
+        ShapeKernels kernels = generic();
+        if (!config.specialized_kernels || config.num_heads == 0) return kernels;
+        if (config.embedding_dim == 256) kernels.rms_norm = &rms_norm_fixed<256>;
+        if (config.embedding_dim == 768) kernels.rms_norm = &rms_norm_fixed<768>;
+        if (config.embedding_dim == 64 * config.num_heads) kernels.head_dim = 64;
+        if (config.embedding_dim == 256 && config.num_heads == 4) {
+            kernels.name = "256/4-head";
+        } else if (config.embedding_dim == 768 && config.num_heads == 12 && config.ff_dim == 3072) {
+            kernels.name = "768/12-head/3072";
+        }
+        return kernels;
+    }
+};
+
+/**
+ * MappedFile - Read-only memory mapping of a file
+ *
+ * Pages are shared with the OS page cache, so every process mapping the
+ * same model file shares one physical copy of the weights.
+ */
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) throw std::runtime_error("cannot open model file: " + path);
+        struct stat st;
+        if (::fstat(fd, &st) != 0 || st.st_size <= 0) {
+            ::close(fd);
+            throw std::runtime_error("cannot stat model file: " + path);
+        }
+        size_ = static_cast<size_t>(st.st_size);
+        void* addr = ::mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (addr == MAP_FAILED) throw std::runtime_error("cannot mmap model file: " + path);
+        data_ = static_cast<const uint8_t*>(addr);
+    }
+    
+    ~MappedFile() {
+        ::munmap(const_cast<uint8_t*>(data_), size_);
+    }
+    
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    
+    const uint8_t* data() const { return data_; }
+    size_t size() const { return size_; }
+
+private:
+    const uint8_t* data_ = nullptr;
+    size_t size_ = 0;
+};
+
+/**
+ * EmbeddingCache - Persistent, memory-mapped store of encode() results
+ *
+ * One file of fixed size holds a header, an open-addressing table of keys
+ * and a ring of records (a 64-byte header, then the floats). The owner
+ * derives keys from everything the result depends on (tokens and model
+ * identity), so models can share a file and it survives restarts. When
+ * the ring or the table is full the oldest records are evicted (FIFO).
+ *
+ * Every record also stores a second, independent hash of its inputs
+ * (check) that a lookup must match, so a 64-bit key collision is a miss
+ * rather than another document's floats. A file whose header, table or
+ * records do not fit the mapping is reset on open.
+ *
+ * A hit points straight into the mapping and stays valid until the
+ * record is evicted by later inserts. The file is locked (flock) for the
+ * cache's lifetime: a second engine or process opening it gets an error
+ * instead of sharing unsynchronized writes.
+ */
+class EmbeddingCache {
+public:
+    struct Stats {
+        size_t hits = 0;
+        size_t misses = 0;
+        size_t evictions = 0;
+        size_t entries = 0;
+        
+        double hit_rate() const { return hits + misses > 0 ? static_cast<double>(hits) / (hits + misses) : 0.0; }
+    };
+    
+    EmbeddingCache(const std::string& path, size_t bytes) {
+        const size_t table_bytes = align(std::max<size_t>(kMinSlots, next_pow2(bytes / 8192)) * sizeof(Slot), kPage);
+        if (bytes < kPage + table_bytes + kPage) throw std::invalid_argument("embedding cache too small");
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) throw std::runtime_error("cannot open embedding cache: " + path);
+        if (::flock(fd, LOCK_EX | LOCK_NB) != 0) {
+            ::close(fd);
+            throw std::runtime_error("embedding cache is in use by another engine: " + path);
+        }
+        struct stat st;
+        const bool reuse = ::fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) == bytes;
+        if (!reuse && ::ftruncate(fd, static_cast<off_t>(bytes)) != 0) {
+            ::close(fd);
+            throw std::runtime_error("cannot size embedding cache: " + path);
+        }
+        void* addr = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (addr == MAP_FAILED) {
+            ::close(fd);
+            throw std::runtime_error("cannot mmap embedding cache: " + path);
+        }
+        fd_ = fd;  // held open: closing it drops the lock
+        data_ = static_cast<uint8_t*>(addr);
+        size_ = bytes;
+        
+        header_ = reinterpret_cast<Header*>(data_);
+        slots_ = reinterpret_cast<Slot*>(data_ + kPage);
+        ring_ = data_ + kPage + table_bytes;
+        const uint64_t n_slots = table_bytes / sizeof(Slot);
+        const uint64_t ring_bytes = bytes - kPage - table_bytes;
+        if (!reuse || !valid(n_slots, ring_bytes)) {
+            if (reuse) LLAMALEX_LOG(WARNING, "Embedding cache %s is stale or damaged; resetting", path.c_str());
+            std::memset(data_, 0, kPage + table_bytes);
+            std::memcpy(header_->magic, kMagic, sizeof(kMagic));
+            header_->n_slots = n_slots;
+            header_->ring_bytes = ring_bytes;
+        }
+        mask_ = n_slots - 1;
+    }
+    
+    ~EmbeddingCache() {
+        ::munmap(data_, size_);
+        ::close(fd_);
+    }
+    
+    EmbeddingCache(const EmbeddingCache&) = delete;
+    EmbeddingCache& operator=(const EmbeddingCache&) = delete;
+    
+    // Stored floats of key if their check matches and they are n_floats
+    // long, else nullptr
+    const float* find(uint64_t key, uint64_t check, size_t n_floats) {
+        key = key ? key : 1;  // as insert()
+        const size_t i = find_slot(key);
+        if (i != SIZE_MAX) {
+            const Record* r = record(slots_[i].offset);
+            if (r->key == key && r->check == check && r->n_floats == n_floats) {
+                ++stats_.hits;
+                return payload(slots_[i].offset);
+            }
+        }
+        ++stats_.misses;
+        return nullptr;
+    }
+    
+    // Store n floats under key and check (not if they exceed the ring);
+    // returns the copy
+    const float* insert(uint64_t key, uint64_t check, const float* data, size_t n) {
+        key = key ? key : 1;  // 0 marks an empty slot
+        const uint64_t bytes = align(sizeof(Record) + n * sizeof(float), sizeof(Record));
+        Header& h = *header_;
+        if (bytes > h.ring_bytes) return nullptr;
+        const size_t existing = find_slot(key);
+        if (existing != SIZE_MAX) erase(existing);
+        
+        while (h.count > 0 && h.count >= h.n_slots / 4 * 3) evict();
+        if (h.head + bytes > h.ring_bytes) {
+            // Drop what lies between head and the end of the ring, then wrap
+            while (h.count > 0 && h.tail >= h.head) evict();
+            if (h.head + sizeof(Record) <= h.ring_bytes) record(h.head)->bytes = 0;  // wrap marker
+            h.head = 0;
+        }
+        while (h.count > 0 && h.tail >= h.head && h.tail < h.head + bytes) evict();
+        if (h.count == 0) h.tail = h.head;
+        
+        const uint64_t offset = h.head;
+        Record* r = record(offset);
+        r->key = key;
+        r->check = check;
+        r->bytes = bytes;
+        r->n_floats = n;
+        std::memcpy(payload(offset), data, n * sizeof(float));
+        size_t i = key & mask_;
+        while (slots_[i].key != 0) i = (i + 1) & mask_;
+        slots_[i].key = key;
+        slots_[i].offset = offset;
+        h.head += bytes;
+        ++h.count;
+        return payload(offset);
+    }
+    
+    // Counters of this process; entries is what the file holds
+    Stats stats() const {
+        Stats s = stats_;
+        s.entries = header_->count;
+        return s;
+    }
+
+private:
+    static constexpr char kMagic[8] = {'L', 'L', 'X', 'C', 'A', 'C', 'H', '2'};
+    static const size_t kPage = 4096;
+    static const size_t kMinSlots = 1024;
+    
+    struct Header {
+        char magic[8];
+        uint64_t n_slots;
+        uint64_t ring_bytes;
+        uint64_t head;    // next record offset
+        uint64_t tail;    // oldest record
+        uint64_t count;
+    };
+    
+    struct Slot {
+        uint64_t key;     // 0: empty
+        uint64_t offset;  // of the record in the ring
+    };
+    
+    struct Record {
+        uint64_t key;
+        uint64_t bytes;   // 0: wrap marker, the ring continues at 0
+        uint64_t n_floats;
+        uint64_t check;   // second hash of the inputs, verified on lookup
+        uint64_t reserved[4];
+    };
+    
+    int fd_ = -1;
+    uint8_t* data_ = nullptr;
+    size_t size_ = 0;
+    Header* header_ = nullptr;
+    Slot* slots_ = nullptr;
+    uint8_t* ring_ = nullptr;
+    uint64_t mask_ = 0;
+    Stats stats_;
+    
+    static size_t align(size_t n, size_t a) { return (n + a - 1) / a * a; }
+    static size_t next_pow2(size_t n) {
+        size_t p = 1;
+        while (p < n) p <<= 1;
+        return p;
+    }
+    
+    Record* record(uint64_t offset) const { return reinterpret_cast<Record*>(ring_ + offset); }
+    float* payload(uint64_t offset) const { return reinterpret_cast<float*>(ring_ + offset + sizeof(Record)); }
+    
+    // Whether the record at offset lies inside the ring with a sane size
+    bool record_fits(uint64_t offset) const {
+        const uint64_t ring_bytes = header_->ring_bytes;
+        if (offset % sizeof(Record) != 0 || offset > ring_bytes - sizeof(Record)) return false;
+        const Record* r = record(offset);
+        return r->bytes % sizeof(Record) == 0 && r->bytes >= sizeof(Record) &&
+               r->bytes <= ring_bytes - offset &&
+               r->n_floats <= (r->bytes - sizeof(Record)) / sizeof(float);
+    }
+    
+    // Whether a reused file matches this layout and every header field,
+    // record and slot stays inside the mapping
+    bool valid(uint64_t n_slots, uint64_t ring_bytes) const {
+        const Header& h = *header_;
+        if (std::memcmp(h.magic, kMagic, sizeof(kMagic)) != 0 || h.n_slots != n_slots ||
+            h.ring_bytes != ring_bytes || h.head > ring_bytes || h.tail > ring_bytes || h.count > n_slots) {
+            return false;
+        }
+        // Walk the ring from the oldest record; it wraps at most once
+        uint64_t offset = h.tail;
+        bool wrapped = false;
+        for (uint64_t n = 0; n < h.count;) {
+            if (offset + sizeof(Record) > ring_bytes || record(offset)->bytes == 0) {
+                if (wrapped) return false;
+                wrapped = true;
+                offset = 0;
+                continue;
+            }
+            if (!record_fits(offset)) return false;
+            offset += record(offset)->bytes;
+            ++n;
+        }
+        for (uint64_t i = 0; i < n_slots; ++i) {
+            if (slots_[i].key == 0) continue;
+            if (!record_fits(slots_[i].offset) || record(slots_[i].offset)->key != slots_[i].key) return false;
+        }
+        return true;
+    }
+    
+    size_t find_slot(uint64_t key) const {
+        for (size_t i = key & mask_; slots_[i].key != 0; i = (i + 1) & mask_) {
+            if (slots_[i].key == key) return i;
+        }
+        return SIZE_MAX;
+    }
+    
+    // Remove slot i, shifting later slots of the probe run back into place
+    void erase(size_t i) {
+        for (size_t j = i;;) {
+            slots_[i].key = 0;
+            for (;;) {
+                j = (j + 1) & mask_;
+                if (slots_[j].key == 0) return;
+                const size_t home = slots_[j].key & mask_;
+                // Move j into the hole unless its home lies in (i, j]
+                if (i <= j ? (home <= i || home > j) : (home <= i && home > j)) break;
+            }
+            slots_[i] = slots_[j];
+            i = j;
+        }
+    }
+    
+    // Drop the oldest record (or step over the wrap marker)
+    void evict() {
+        Header& h = *header_;
+        const Record* r = record(h.tail);
+        if (h.tail + sizeof(Record) > h.ring_bytes || r->bytes == 0) {
+            h.tail = 0;
+            return;
+        }
+        const size_t i = find_slot(r->key);
+        if (i != SIZE_MAX && slots_[i].offset == h.tail) erase(i);
+        h.tail += r->bytes;
+        --h.count;
+        ++stats_.evictions;
+    }
+};
+
+constexpr char EmbeddingCache::kMagic[8];
+const size_t EmbeddingCache::kPage;
+const size_t EmbeddingCache::kMinSlots;
+
+/**
+ * GGUFFile - Parser for GGUF model files (as written by llama.cpp tools)
+ *
+ * Only the header, metadata and tensor directory are parsed; tensor data
+ * is referenced in place inside the mapping.
+ */
+class GGUFFile {
+public:
+    enum ValueType : uint32_t {
+        UINT8 = 0, INT8 = 1, UINT16 = 2, INT16 = 3, UINT32 = 4, INT32 = 5,
+        FLOAT32 = 6, BOOL = 7, STRING = 8, ARRAY = 9, UINT64 = 10, INT64 = 11,
+        FLOAT64 = 12
+    };
+    
+    struct Value {
+        uint32_t type = UINT32;
+        uint64_t uint_value = 0;
+        double float_value = 0.0;
+        std::string string_value;
+        uint32_t array_type = 0;
+        uint64_t array_size = 0;
+        const uint8_t* array_data = nullptr;  // raw array payload in the mapping
+    };
+    
+    struct TensorInfo {
+        TensorType type = TensorType::F32;
+        std::vector<uint64_t> dims;  // dims[0] is the contiguous dimension
+        const uint8_t* data = nullptr;
+    };
+    
+    static const uint32_t kMagic = 0x46554747;  // "GGUF" little-endian
+    static const uint64_t kDefaultAlignment = 32;
+    
+    explicit GGUFFile(const std::string& path) : file_(path), pos_(0) {
+        if (read<uint32_t>() != kMagic) throw std::runtime_error("not a GGUF file: " + path);
+        const uint32_t version = read<uint32_t>();
+        if (version < 2 || version > 3) {
+            throw std::runtime_error("unsupported GGUF version " + std::to_string(version));
+        }
+        const uint64_t n_tensors = read<uint64_t>();
+        const uint64_t n_kv = read<uint64_t>();
+        
+        for (uint64_t i = 0; i < n_kv; ++i) {
+            std::string key = read_string();
+            Value value;
+            value.type = read<uint32_t>();
+            read_value(value);
+            metadata_[key] = value;
+        }
+        
+        std::vector<std::pair<std::string, uint64_t>> offsets;
+        for (uint64_t i = 0; i < n_tensors; ++i) {
+            std::string name = read_string();
+            TensorInfo info;
+            const uint32_t n_dims = read<uint32_t>();
+            for (uint32_t d = 0; d < n_dims; ++d) info.dims.push_back(read<uint64_t>());
+            info.type = static_cast<TensorType>(read<uint32_t>());
+            offsets.emplace_back(name, read<uint64_t>());
+            tensors_[name] = info;
+        }
+        
+        // Tensor data starts at the next aligned offset; every tensor must
+        // sit on that alignment, and at least on a float boundary, since
+        // kernels read it in place
+        const uint64_t alignment = get_uint("general.alignment", kDefaultAlignment);
+        if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+            throw std::runtime_error("invalid GGUF alignment " + std::to_string(alignment));
+        }
+        const uint64_t data_start = (pos_ + alignment - 1) / alignment * alignment;
+        for (const auto& entry : offsets) {
+            TensorInfo& info = tensors_[entry.first];
+            const uint64_t bytes = tensor_bytes(info);
+            if (data_start > file_.size() || entry.second > file_.size() - data_start ||
+                bytes > file_.size() - data_start - entry.second) {
+                throw std::runtime_error("tensor out of bounds: " + entry.first);
+            }
+            const uint64_t offset = data_start + entry.second;
+            if (offset % alignment != 0 || offset % alignof(float) != 0) {
+                throw std::runtime_error("misaligned tensor data: " + entry.first);
+            }
+            info.data = file_.data() + offset;
+        }
+    }
+    
+    const Value* value(const std::string& key) const {
+        auto it = metadata_.find(key);
+        return it == metadata_.end() ? nullptr : &it->second;
+    }
+    
+    uint64_t get_uint(const std::string& key, uint64_t default_value) const {
+        const Value* v = value(key);
+        return v ? v->uint_value : default_value;
+    }
+    
+    double get_float(const std::string& key, double default_value) const {
+        const Value* v = value(key);
+        return v ? v->float_value : default_value;
+    }
+    
+    std::string get_string(const std::string& key, const std::string& default_value) const {
+        const Value* v = value(key);
+        return v && v->type == STRING ? v->string_value : default_value;
+    }
+    
+    // Array of strings (empty if the key is missing or of another type)
+    std::vector<std::string> get_string_array(const std::string& key) const {
+        std::vector<std::string> result;
+        const Value* v = value(key);
+        if (!v || v->type != ARRAY || v->array_type != STRING) return result;
+        const uint8_t* p = v->array_data;
+        result.reserve(v->array_size);
+        for (uint64_t i = 0; i < v->array_size; ++i) {
+            uint64_t len;
+            std::memcpy(&len, p, sizeof(len));
+            result.push_back(std::string(reinterpret_cast<const char*>(p + sizeof(len)), len));
+            p += sizeof(len) + len;
+        }
+        return result;
+    }
+    
+    // Array of scalars of type `array_type`, converted to T
+    template <typename T, typename Stored>
+    std::vector<T> get_array(const std::string& key, uint32_t array_type) const {
+        std::vector<T> result;
+        const Value* v = value(key);
+        if (!v || v->type != ARRAY || v->array_type != array_type) return result;
+        result.resize(v->array_size);
+        for (uint64_t i = 0; i < v->array_size; ++i) {
+            Stored x;
+            std::memcpy(&x, v->array_data + i * sizeof(Stored), sizeof(Stored));
+            result[i] = static_cast<T>(x);
+        }
+        return result;
+    }
+    
+    const TensorInfo* tensor(const std::string& name) const {
+        auto it = tensors_.find(name);
+        return it == tensors_.end() ? nullptr : &it->second;
+    }
+    
+    size_t size() const { return file_.size(); }
+    
+    static uint64_t tensor_bytes(const TensorInfo& info) {
+        uint64_t n = 1;
+        for (uint64_t d : info.dims) n *= d;
+        const size_t block_bytes = type_block_bytes(info.type);
+        const size_t block_size = type_block_size(info.type);
+        if (block_bytes == 0) {
+            throw std::runtime_error("unsupported tensor type " +
+                                     std::to_string(static_cast<uint32_t>(info.type)));
+        }
+        if (info.dims.empty() || info.dims[0] % block_size != 0) {
+            throw std::runtime_error("tensor row is not a whole number of blocks");
+        }
+        return n / block_size * block_bytes;
+    }
+
+private:
+    MappedFile file_;
+    size_t pos_;
+    std::map<std::string, Value> metadata_;
+    std::map<std::string, TensorInfo> tensors_;
+    
+    void require(size_t n) {
+        if (pos_ + n > file_.size()) throw std::runtime_error("truncated GGUF file");
+    }
+    
+    template <typename T>
+    T read() {
+        require(sizeof(T));
+        T value;
+        std::memcpy(&value, file_.data() + pos_, sizeof(T));
+        pos_ += sizeof(T);
+        return value;
+    }
+    
+    std::string read_string() {
+        const uint64_t len = read<uint64_t>();
+        require(len);
+        std::string str(reinterpret_cast<const char*>(file_.data() + pos_), len);
+        pos_ += len;
+        return str;
+    }
+    
+    static size_t scalar_size(uint32_t type) {
+        switch (type) {
+            case UINT8: case INT8: case BOOL: return 1;
+            case UINT16: case INT16: return 2;
+            case UINT32: case INT32: case FLOAT32: return 4;
+            case UINT64: case INT64: case FLOAT64: return 8;
+            default: return 0;
+        }
+    }
+    
+    void read_value(Value& value) {
+        switch (value.type) {
+            case UINT8: case BOOL: value.uint_value = read<uint8_t>(); break;
+            case INT8: value.uint_value = static_cast<uint64_t>(read<int8_t>()); break;
+            case UINT16: value.uint_value = read<uint16_t>(); break;
+            case INT16: value.uint_value = static_cast<uint64_t>(read<int16_t>()); break;
+            case UINT32: value.uint_value = read<uint32_t>(); break;
+            case INT32: value.uint_value = static_cast<uint64_t>(read<int32_t>()); break;
+            case UINT64: value.uint_value = read<uint64_t>(); break;
+            case INT64: value.uint_value = static_cast<uint64_t>(read<int64_t>()); break;
+            case FLOAT32: value.float_value = read<float>(); break;
+            case FLOAT64: value.float_value = read<double>(); break;
+            case STRING: value.string_value = read_string(); break;
+            case ARRAY: {
+                value.array_type = read<uint32_t>();
+                value.array_size = read<uint64_t>();
+                value.array_data = file_.data() + pos_;
+                // Skip the payload; arrays are decoded on demand from array_data
+                if (value.array_type == STRING) {
+                    for (uint64_t i = 0; i < value.array_size; ++i) read_string();
+                } else if (scalar_size(value.array_type) != 0) {
+                    require(value.array_size * scalar_size(value.array_type));
+                    pos_ += value.array_size * scalar_size(value.array_type);
+                } else {
+                    throw std::runtime_error("unsupported GGUF array type");
+                }
+                break;
+            }
+            default:
+                throw std::runtime_error("unsupported GGUF value type " + std::to_string(value.type));
+        }
+        if (value.type != FLOAT32 && value.type != FLOAT64) {
+            value.float_value = static_cast<double>(value.uint_value);
+        }
+    }
+};
+
+/**
+ * GGUFWriter - Minimal GGUF v3 writer (metadata + tensors)
+ */
+class GGUFWriter {
+public:
+    void add_uint32(const std::string& key, uint32_t value) {
+        add_kv(key, GGUFFile::UINT32, &value, sizeof(value));
+    }
+    
+    void add_float32(const std::string& key, float value) {
+        add_kv(key, GGUFFile::FLOAT32, &value, sizeof(value));
+    }
+    
+    void add_string(const std::string& key, const std::string& value) {
+        std::string payload = encode_string(value);
+        add_kv(key, GGUFFile::STRING, payload.data(), payload.size());
+    }
+    
+    void add_bool(const std::string& key, bool value) {
+        const uint8_t byte = value ? 1 : 0;
+        add_kv(key, GGUFFile::BOOL, &byte, sizeof(byte));
+    }
+    
+    void add_string_array(const std::string& key, const std::vector<std::string>& values) {
+        std::string payload = array_header(GGUFFile::STRING, values.size());
+        for (const auto& value : values) payload += encode_string(value);
+        add_kv(key, GGUFFile::ARRAY, payload.data(), payload.size());
+    }
+    
+    void add_float32_array(const std::string& key, const std::vector<float>& values) {
+        std::string payload = array_header(GGUFFile::FLOAT32, values.size());
+        payload.append(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(float));
+        add_kv(key, GGUFFile::ARRAY, payload.data(), payload.size());
+    }
+    
+    void add_int32_array(const std::string& key, const std::vector<int32_t>& values) {
+        std::string payload = array_header(GGUFFile::INT32, values.size());
+        payload.append(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(int32_t));
+        add_kv(key, GGUFFile::ARRAY, payload.data(), payload.size());
+    }
+    
+    void add_tensor(const std::string& name, const WeightTensor& tensor) {
+        tensors_.emplace_back(name, tensor);
+    }
+    
+    void write(const std::string& path) const {
+        std::ofstream out(path.c_str(), std::ios::binary);
+        if (!out) throw std::runtime_error("cannot write model file: " + path);
+        
+        std::string header;
+        append(header, GGUFFile::kMagic);
+        append(header, static_cast<uint32_t>(3));
+        append(header, static_cast<uint64_t>(tensors_.size()));
+        append(header, static_cast<uint64_t>(kv_.size() + 1));
+        header += encode_string("general.alignment");
+        append(header, static_cast<uint32_t>(GGUFFile::UINT32));
+        append(header, static_cast<uint32_t>(kAlignment));
+        for (const auto& kv : kv_) header += kv;
+        
+        uint64_t offset = 0;
+        for (const auto& entry : tensors_) {
+            const WeightTensor& t = entry.second;
+            header += encode_string(entry.first);
+            if (t.rows == 1) {
+                append(header, static_cast<uint32_t>(1));
+                append(header, static_cast<uint64_t>(t.cols));
+            } else {
+                append(header, static_cast<uint32_t>(2));
+                append(header, static_cast<uint64_t>(t.cols));
+                append(header, static_cast<uint64_t>(t.rows));
+            }
+            append(header, static_cast<uint32_t>(t.type));
+            append(header, offset);
+            offset += padded(t.bytes());
+        }
+        header.resize(padded(header.size()), '\0');
+        out.write(header.data(), header.size());
+        
+        const std::string padding(kAlignment, '\0');
+        for (const auto& entry : tensors_) {
+            const WeightTensor& t = entry.second;
+            const size_t bytes = t.bytes();
+            out.write(static_cast<const char*>(t.data), bytes);
+            out.write(padding.data(), padded(bytes) - bytes);
+        }
+        if (!out) throw std::runtime_error("failed writing model file: " + path);
+    }
+
+private:
+    static const size_t kAlignment = GGUFFile::kDefaultAlignment;
+    std::vector<std::string> kv_;
+    std::vector<std::pair<std::string, WeightTensor>> tensors_;
+    
+    template <typename T>
+    static void append(std::string& buf, T value) {
+        buf.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+    
+    static std::string encode_string(const std::string& str) {
+        std::string buf;
+        append(buf, static_cast<uint64_t>(str.size()));
+        return buf + str;
+    }
+    
+    static std::string array_header(uint32_t type, size_t n) {
+        std::string buf;
+        append(buf, type);
+        append(buf, static_cast<uint64_t>(n));
+        return buf;
+    }
+    
+    static size_t padded(size_t n) {
+        return (n + kAlignment - 1) / kAlignment * kAlignment;
+    }
+    
+    void add_kv(const std::string& key, uint32_t type, const void* payload, size_t size) {
+        std::string kv = encode_string(key);
+        append(kv, type);
+        kv.append(static_cast<const char*>(payload), size);
+        kv_.push_back(kv);
+    }
+};
+
+/**
+ * WeightStore - Resolves named model tensors (llama.cpp GGUF naming)
+ *
+ * With a model file, tensors are views into the mapped file (in whatever
+ * storage type the file uses) and nothing is copied. Without one, tensors
+ * are deterministic random initializations owned by the store (seeded by
+ * tensor name) in 64-byte aligned buffers; quantizable matrices are then
+ * stored as `layer_type`.
+ *
+ * Over more than one NUMA node, matrices are placed per `numa`: built
+ * straight into interleaved pages, or replicated with one copy bound to
+ * each node (WeightTensor::replicas). Mapped matrices are copied into
+ * placed memory in both modes, since page-cache pages go to whichever
+ * node first faults them whatever the mapping's policy. On one node
+ * nothing changes.
+ */
+class WeightStore {
+public:
+    explicit WeightStore(TensorType layer_type = TensorType::F32, NumaMode numa = NumaMode::OFF,
+                         size_t numa_nodes = 0)
+        : layer_type_(layer_type), numa_(numa), numa_nodes_(placement_nodes(numa, numa_nodes)) {}
+    explicit WeightStore(std::shared_ptr<GGUFFile> file, NumaMode numa = NumaMode::OFF,
+                         size_t numa_nodes = 0)
+        : file_(file), layer_type_(TensorType::F32), numa_(numa),
+          numa_nodes_(placement_nodes(numa, numa_nodes)) {}
+    
+    bool has(const std::string& name) const {
+        return !file_ || file_->tensor(name) != nullptr;
+    }
+    
+    /**
+     * [rows x cols] matrix; random init is uniform in [-init_scale, init_scale].
+     * Quantizable matrices (attention and feed-forward projections) use the
+     * store's layer type when cols is a whole number of its blocks, and
+     * stay F32 otherwise (logged once per store).
+     */
+    WeightTensor matrix(const std::string& name, size_t rows, size_t cols, float init_scale,
+                        bool quantizable = false) {
+        WeightTensor w;
+        w.rows = rows;
+        w.cols = cols;
+        if (file_) {
+            bind_mapped(w, name);
+        } else {
+            std::vector<float> values(rows * cols);
+            // Seeded by name, so random init does not depend on construction order
+            fill_random(values, init_scale, fnv1a(name.data(), name.size()));
+            if (quantizable && cols % type_block_size(layer_type_) == 0) {
+                w.type = layer_type_;
+            } else if (quantizable && !warned_unquantized_) {
+                LLAMALEX_LOG(WARNING, "%s weights need widths that are multiples of %zu; %zu-wide matrices such "
+                             "as %s stay F32", type_name(layer_type_), type_block_size(layer_type_), cols,
+                             name.c_str());
+                warned_unquantized_ = true;
+            }
+            uint8_t* data = allocate(w.bytes(), numa_ == NumaMode::REPLICATE ? 0 : -1);
+            for (size_t r = 0; r < rows; ++r) {
+                quantize_row(w.type, &values[r * cols], data + r * w.row_bytes(), cols);
+            }
+            w.data = data;
+        }
+        place(w);
+        tensors_.emplace_back(name, w);
+        return w;
+    }
+    
+    // Per-channel gain vector (RMSNorm weights); ones when not loaded
+    WeightTensor vector(const std::string& name, size_t n) {
+        WeightTensor w;
+        w.rows = 1;
+        w.cols = n;
+        if (file_) {
+            bind_mapped(w, name);
+            if (w.type != TensorType::F32) throw std::runtime_error("norm weights must be F32: " + name);
+        } else {
+            const std::vector<float> ones(n, 1.0f);
+            owned_.emplace_back(n * sizeof(float));
+            std::memcpy(owned_.back().data(), ones.data(), n * sizeof(float));
+            w.data = owned_.back().data();
+        }
+        tensors_.emplace_back(name, w);
+        return w;
+    }
+    
+    // Bytes of weight data held (mapped or owned), optionally only for
+    // tensors whose name starts with `prefix`
+    size_t total_bytes(const std::string& prefix = "") const {
+        size_t total = 0;
+        for (const auto& entry : tensors_) {
+            if (entry.first.compare(0, prefix.size(), prefix) == 0) total += entry.second.bytes();
+        }
+        return total;
+    }
+    
+    // Bytes held by NUMA replicas on top of total_bytes()
+    size_t replica_bytes() const { return replica_bytes_; }
+    
+    // Nodes the matrices are placed on (1: no placement)
+    size_t numa_nodes() const { return std::max<size_t>(1, numa_nodes_); }
+    
+    // Every tensor handed out so far, in creation order
+    const std::vector<std::pair<std::string, WeightTensor>>& tensors() const {
+        return tensors_;
+    }
+
+private:
+    std::shared_ptr<GGUFFile> file_;
+    TensorType layer_type_;
+    NumaMode numa_;
+    size_t numa_nodes_;  // 0 or 1: no placement
+    std::vector<AlignedBuffer> owned_;
+    std::list<std::vector<const void*>> replica_tables_;  // stable addresses for WeightTensor::replicas
+    size_t replica_bytes_ = 0;
+    bool warned_unquantized_ = false;  // see matrix()
+    std::vector<std::pair<std::string, WeightTensor>> tensors_;
+    
+    static size_t placement_nodes(NumaMode numa, size_t numa_nodes) {
+        return numa == NumaMode::OFF ? 0 : NumaTopology::system().resolve(numa_nodes);
+    }
+    
+    // Owned buffer; when placing on several nodes, pages of its own bound
+    // per numa_bind() (node < 0: interleaved)
+    uint8_t* allocate(size_t bytes, int node) {
+        if (numa_nodes_ < 2) {
+            owned_.emplace_back(bytes);
+            return owned_.back().data();
+        }
+        owned_.push_back(AlignedBuffer::pages(bytes));
+        numa_bind(owned_.back().data(), owned_.back().size(), numa_nodes_, node);
+        return owned_.back().data();
+    }
+    
+    const void* copy_to(const WeightTensor& w, int node) {
+        uint8_t* data = allocate(w.bytes(), node);
+        std::memcpy(data, w.data, w.bytes());
+        return data;
+    }
+    
+    void place(WeightTensor& w) {
+        if (numa_nodes_ < 2) return;
+        if (numa_ == NumaMode::INTERLEAVE) {
+            if (file_) w.data = copy_to(w, -1);
+            return;
+        }
+        replica_tables_.push_back(std::vector<const void*>(numa_nodes_));
+        std::vector<const void*>& replicas = replica_tables_.back();
+        for (size_t n = 0; n < numa_nodes_; ++n) {
+            replicas[n] = n == 0 && !file_ ? w.data : copy_to(w, static_cast<int>(n));
+        }
+        w.data = replicas[0];
+        replica_bytes_ += (numa_nodes_ - 1) * w.bytes();
+        w.replicas = replicas.data();
+    }
+    
+    void bind_mapped(WeightTensor& w, const std::string& name) const {
+        const GGUFFile::TensorInfo* info = file_->tensor(name);
+        if (!info) throw std::runtime_error("missing tensor: " + name);
+        const uint64_t info_rows = info->dims.size() > 1 ? info->dims[1] : 1;
+        if (info->dims.empty() || info->dims[0] != w.cols || info_rows != w.rows) {
+            throw std::runtime_error("shape mismatch for tensor " + name);
+        }
+        w.type = info->type;
+        w.data = info->data;
+    }
+};
+
+/**
+ * Key or value rows of one layer: either contiguous (row i at
+ * base + i * dim) or paged, with row i in pages[i / page_size] at
+ * `offset` floats plus (i % page_size) rows into the page
+ */
+struct KVRows {
+    float* base;
+    float* const* pages;
+    size_t page_size;
+    size_t offset;
+    size_t dim;
+    
+    static KVRows contiguous(float* base, size_t dim) {
+        KVRows rows = {base, nullptr, 0, 0, dim};
+        return rows;
+    }
+    
+    float* row(size_t i) const {
+        if (!pages) return base + i * dim;
+        return pages[i / page_size] + offset + (i % page_size) * dim;
+    }
+    
+    // Rows from i on that are contiguous in memory (to the end of i's page)
+    size_t run(size_t i) const {
+        return pages ? page_size - i % page_size : std::numeric_limits<size_t>::max();
+    }
+};
+
+/**
+ * One sequence of a multi-sequence forward pass: rows [row, row + n_tokens)
+ * of the packed input, appended at position n_past of its own K/V cache
+ * (k/v are that cache's rows for the current layer)
+ */
+struct SequenceKV {
+    size_t row;
+    size_t n_tokens;
+    size_t n_past;
+    KVRows k;
+    KVRows v;
+};
+
+/**
+ * Attention mechanism for transformer
+ *
+ * Causal multi-head self-attention. Scores are computed tile by tile with an
+ * online softmax (FlashAttention-style), so the seq x seq score matrix is
+ * never materialized: working memory is Q/K/V/context (linear in sequence
+ * length) plus one small tile per head.
+ */
+class MultiHeadAttention {
+public:
+    // Tile sizes: one K/V tile (kKeyBlock x head_dim) stays in L1/L2 while
+    // every query row of the current block is scored against it
+    static const size_t kQueryBlock = 32;
+    static const size_t kKeyBlock = 64;
+    
+    MultiHeadAttention(size_t embedding_dim, size_t num_heads, WeightStore& weights,
+                       const std::string& prefix, float rope_freq_base = 10000.0f,
+                       ThreadPool* pool = nullptr, const ShapeKernels& kernels = ShapeKernels::generic())
+        : embedding_dim_(embedding_dim), num_heads_(num_heads), rope_freq_base_(rope_freq_base),
+          pool_(pool) {
+        if (num_heads == 0 || embedding_dim % num_heads != 0 || (embedding_dim / num_heads) % 2 != 0) {
+            throw std::invalid_argument("attention heads must split embedding_dim into even widths");
+        }
+        head_dim_ = embedding_dim / num_heads;
+        attend_kernel_ = kernels.head_dim == 64 && head_dim_ == 64 ? &MultiHeadAttention::attend_heads_fixed<64>
+                                                                   : &MultiHeadAttention::attend_heads_fixed<0>;
+        
+        // Initialize weight matrices
+        init_weights(weights, prefix);
+    }
+    
+    // Forward pass over [n_tokens x embedding_dim] input (standalone: the
+    // engine calls the arena-backed overloads below)
+    std::vector<float> forward(const std::vector<float>& input) const {
+        const size_t n_tokens = input.size() / embedding_dim_;
+        std::vector<float> k(input.size()), v(input.size()), output(input.size());
+        ScratchArena arena;
+        forward(input.data(), output.data(), n_tokens, k.data(), v.data(), 0, arena);
+        return output;
+    }
+    
+    /**
+     * Forward pass for tokens at positions [n_past, n_past + n_tokens).
+     *
+     * k_cache/v_cache hold n_past rows from earlier calls; this call appends
+     * the new tokens' keys and values and attends over all of them.
+     * Temporaries come from `arena` and are released on return.
+     */
+    void forward(const float* input, float* output, size_t n_tokens,
+                 float* k_cache, float* v_cache, size_t n_past, ScratchArena& arena) const {
+        ScratchArena::Scope scope(arena);
+        const size_t n = n_tokens * embedding_dim_;
+        float* k = k_cache + n_past * embedding_dim_;
+        float* v = v_cache + n_past * embedding_dim_;
+        float* q = arena.floats(n);
+        
+        // Q, K, V projections (K/V written straight into the cache)
+        matmul(wq_, input, q, n_tokens, pool_);
+        matmul(wk_, input, k, n_tokens, pool_);
+        matmul(wv_, input, v, n_tokens, pool_);
+        apply_rope(q, n_tokens, embedding_dim_, head_dim_, n_past, rope_freq_base_);
+        apply_rope(k, n_tokens, embedding_dim_, head_dim_, n_past, rope_freq_base_);
+        
+        // Scaled dot-product attention
+        float* context = arena.floats(n);
+        attend(q, KVRows::contiguous(k_cache, embedding_dim_), KVRows::contiguous(v_cache, embedding_dim_),
+               context, n_tokens, n_past + n_tokens, n_past);
+        
+        // Output projection
+        matmul(wo_, context, output, n_tokens, pool_);
+    }
+    
+    /**
+     * Forward pass over several independent sequences packed back to back.
+     *
+     * Sequence d occupies rows [offsets[d], offsets[d + 1]) and starts at
+     * position 0. Projections run as one GEMM over all packed tokens;
+     * attention runs per sequence, which is the block-diagonal causal mask
+     * without any padding. k/v are scratch buffers of one row per token.
+     */
+    void forward_packed(const float* input, float* output, const std::vector<size_t>& offsets,
+                        float* k, float* v, ScratchArena& arena) const {
+        ScratchArena::Scope scope(arena);
+        const size_t n_tokens = offsets.back() - offsets.front();
+        float* q = arena.floats(n_tokens * embedding_dim_);
+        matmul(wq_, input, q, n_tokens, pool_);
+        matmul(wk_, input, k, n_tokens, pool_);
+        matmul(wv_, input, v, n_tokens, pool_);
+        
+        // Sequences are independent: spread them (all heads each) across threads
+        float* context = arena.floats(n_tokens * embedding_dim_);
+        auto attend_sequences = [&](size_t d0, size_t d1) {
+            for (size_t d = d0; d < d1; ++d) {
+                const size_t row = offsets[d] * embedding_dim_;
+                const size_t len = offsets[d + 1] - offsets[d];
+                apply_rope(q + row, len, embedding_dim_, head_dim_, 0, rope_freq_base_);
+                apply_rope(k + row, len, embedding_dim_, head_dim_, 0, rope_freq_base_);
+                attend_heads(q + row, KVRows::contiguous(k + row, embedding_dim_),
+                             KVRows::contiguous(v + row, embedding_dim_), context + row, len, len, 0, 0, num_heads_);
+            }
+        };
+        if (pool_) {
+            pool_->parallel_for(offsets.size() - 1, attend_sequences);
+        } else {
+            attend_sequences(0, offsets.size() - 1);
+        }
+        
+        matmul(wo_, context, output, n_tokens, pool_);
+    }
+    
+    /**
+     * Forward pass over packed sequences that each continue their own KV
+     * cache (batched decode: typically one token per sequence).
+     *
+     * Projections run as one GEMM over all rows; RoPE, the cache append
+     * and attention run per sequence, spread across threads when there
+     * are enough sequences to go round (otherwise across heads).
+     */
+    void forward_sequences(const float* input, float* output, size_t n_tokens,
+                           const SequenceKV* seqs, size_t n_seqs, ScratchArena& arena) const {
+        ScratchArena::Scope scope(arena);
+        const size_t dim = embedding_dim_;
+        float* q = arena.floats(n_tokens * dim);
+        float* k = arena.floats(n_tokens * dim);
+        float* v = arena.floats(n_tokens * dim);
+        matmul(wq_, input, q, n_tokens, pool_);
+        matmul(wk_, input, k, n_tokens, pool_);
+        matmul(wv_, input, v, n_tokens, pool_);
+        
+        float* context = arena.floats(n_tokens * dim);
+        const bool by_sequence = pool_ && n_seqs >= pool_->size();
+        auto attend_sequences = [&](size_t s0, size_t s1) {
+            for (size_t s = s0; s < s1; ++s) {
+                const SequenceKV& seq = seqs[s];
+                const size_t row = seq.row * dim;
+                apply_rope(q + row, seq.n_tokens, dim, head_dim_, seq.n_past, rope_freq_base_);
+                apply_rope(k + row, seq.n_tokens, dim, head_dim_, seq.n_past, rope_freq_base_);
+                for (size_t t = 0; t < seq.n_tokens; ++t) {
+                    std::copy(k + row + t * dim, k + row + (t + 1) * dim, seq.k.row(seq.n_past + t));
+                    std::copy(v + row + t * dim, v + row + (t + 1) * dim, seq.v.row(seq.n_past + t));
+                }
+                const size_t n_kv = seq.n_past + seq.n_tokens;
+                if (by_sequence) {
+                    attend_heads(q + row, seq.k, seq.v, context + row, seq.n_tokens, n_kv,
+                                 seq.n_past, 0, num_heads_);
+                } else {
+                    attend(q + row, seq.k, seq.v, context + row, seq.n_tokens, n_kv, seq.n_past);
+                }
+            }
+        };
+        if (by_sequence) {
+            pool_->parallel_for(n_seqs, attend_sequences);
+        } else {
+            attend_sequences(0, n_seqs);
+        }
+        
+        matmul(wo_, context, output, n_tokens, pool_);
+    }
+    
+    /**
+     * Tiled causal attention.
+     *
+     * Query row i sits at absolute position q_pos + i and attends to keys
+     * [0, q_pos + i]. K/V rows (contiguous or paged) hold all heads
+     * interleaved along the row. Heads are independent and are spread
+     * across the pool's threads.
+     */
+    void attend(const float* q, const KVRows& k, const KVRows& v, float* out,
+                size_t n_q, size_t n_kv, size_t q_pos) const {
+        // Causal: query i sees q_pos + i + 1 keys; K and V are read once
+        LLAMALEX_PROFILE_COUNT(4ull * embedding_dim_ * (n_q * q_pos + n_q * (n_q + 1) / 2),
+                               (2 * n_kv + 2 * n_q) * embedding_dim_ * sizeof(float));
+        if (!pool_ || pool_->size() == 1 || n_q * n_kv * embedding_dim_ < kParallelMinWork) {
+            attend_heads(q, k, v, out, n_q, n_kv, q_pos, 0, num_heads_);
+            return;
+        }
+        pool_->parallel_for(num_heads_, [&](size_t h0, size_t h1) {
+            attend_heads(q, k, v, out, n_q, n_kv, q_pos, h0, h1);
+        });
+    }
+    
+    // attend() for heads [h_begin, h_end)
+    void attend_heads(const float* q, const KVRows& k, const KVRows& v, float* out,
+                      size_t n_q, size_t n_kv, size_t q_pos, size_t h_begin, size_t h_end) const {
+        (this->*attend_kernel_)(q, k, v, out, n_q, n_kv, q_pos, h_begin, h_end);
+    }
+
+private:
+    typedef void (MultiHeadAttention::*AttendKernel)(const float*, const KVRows&, const KVRows&, float*,
+                                                     size_t, size_t, size_t, size_t, size_t) const;
+    
+    size_t embedding_dim_;
+    size_t num_heads_;
+    size_t head_dim_;
+    float rope_freq_base_;
+    ThreadPool* pool_;
+    AttendKernel attend_kernel_;
+    WeightTensor wq_, wk_, wv_, wo_;
+    
+    // One query row's key-tile update: acc = acc * correction + sum_j p[j] * v_j.
+    // With the head width known the accumulator lives in registers for the
+    // whole tile instead of being reloaded per key.
+    template <size_t HD>
+    static void accumulate_values(float* acc, float correction, const float* p, const float* v,
+                                  size_t stride, size_t nk, size_t hd) {
+        if (HD == 0) {
+            for (size_t d = 0; d < hd; ++d) acc[d] *= correction;
+            for (size_t j = 0; j < nk; ++j) {
+                const float* vj = v + j * stride;
+                for (size_t d = 0; d < hd; ++d) acc[d] += p[j] * vj[d];
+            }
+            return;
+        }
+        float a[HD ? HD : 1];
+        for (size_t d = 0; d < HD; ++d) a[d] = acc[d] * correction;
+        for (size_t j = 0; j < nk; ++j) {
+            const float* vj = v + j * stride;
+            for (size_t d = 0; d < HD; ++d) a[d] += p[j] * vj[d];
+        }
+        for (size_t d = 0; d < HD; ++d) acc[d] = a[d];
+    }
+    
+    // attend_heads() with head width HD compiled in (0: head_dim_ at run time)
+    template <size_t HD>
+    void attend_heads_fixed(const float* q, const KVRows& k, const KVRows& v, float* out,
+                            size_t n_q, size_t n_kv, size_t q_pos, size_t h_begin, size_t h_end) const {
+        const size_t dim = embedding_dim_;
+        const size_t hd = HD ? HD : head_dim_;
+        const float scale = 1.0f / std::sqrt(static_cast<float>(hd));
+        const float neg_inf = -std::numeric_limits<float>::infinity();
+        
+        float* scores = thread_scratch<1>(kKeyBlock + 2 * kQueryBlock + kQueryBlock * hd);
+        float* row_max = scores + kKeyBlock;
+        float* row_sum = row_max + kQueryBlock;
+        float* acc = row_sum + kQueryBlock;
+        
+        for (size_t h = h_begin; h < h_end; ++h) {
+            const size_t off = h * hd;
+            for (size_t q0 = 0; q0 < n_q; q0 += kQueryBlock) {
+                const size_t nq = std::min(kQueryBlock, n_q - q0);
+                const size_t kv_end = std::min(n_kv, q_pos + q0 + nq);
+                std::fill(row_max, row_max + kQueryBlock, neg_inf);
+                std::fill(row_sum, row_sum + kQueryBlock, 0.0f);
+                std::fill(acc, acc + kQueryBlock * hd, 0.0f);
+                
+                // Key tiles never straddle a KV page
+                for (size_t k0 = 0, nk = 0; k0 < kv_end; k0 += nk) {
+                    nk = std::min(std::min(kKeyBlock, kv_end - k0), k.run(k0));
+                    const float* kb = k.row(k0);
+                    const float* vb = v.row(k0);
+                    for (size_t i = 0; i < nq; ++i) {
+                        // Causal mask: skip keys past this query's position
+                        const size_t visible = std::min(n_kv, q_pos + q0 + i + 1);
+                        if (k0 >= visible) continue;
+                        const size_t nk_i = std::min(nk, visible - k0);
+                        const float* qi = q + (q0 + i) * dim + off;
+                        
+                        float block_max = neg_inf;
+                        for (size_t j = 0; j < nk_i; ++j) {
+                            scores[j] = scale * dot(qi, kb + j * dim + off, hd);
+                            block_max = std::max(block_max, scores[j]);
+                        }
+                        
+                        // Online softmax: rescale what has been accumulated so far
+                        const float new_max = std::max(row_max[i], block_max);
+                        const float correction = std::exp(row_max[i] - new_max);
+                        row_sum[i] *= correction;
+                        for (size_t j = 0; j < nk_i; ++j) {
+                            scores[j] = std::exp(scores[j] - new_max);
+                            row_sum[i] += scores[j];
+                        }
+                        accumulate_values<HD>(&acc[i * hd], correction, scores, vb + off, dim, nk_i, hd);
+                        row_max[i] = new_max;
+                    }
+                }
+                
+                for (size_t i = 0; i < nq; ++i) {
+                    const float inv_sum = row_sum[i] > 0.0f ? 1.0f / row_sum[i] : 0.0f;
+                    float* oi = out + (q0 + i) * dim + off;
+                    for (size_t d = 0; d < hd; ++d) oi[d] = acc[i * hd + d] * inv_sum;
+                }
+            }
+        }
+    }
+    
+    void init_weights(WeightStore& weights, const std::string& prefix) {
+        // Q, K, V and output projection weights
+        const size_t d = embedding_dim_;
+        const float scale = 1.0f / std::sqrt(static_cast<float>(d));
+        wq_ = weights.matrix(prefix + "attn_q.weight", d, d, scale, true);
+        wk_ = weights.matrix(prefix + "attn_k.weight", d, d, scale, true);
+        wv_ = weights.matrix(prefix + "attn_v.weight", d, d, scale, true);
+        wo_ = weights.matrix(prefix + "attn_output.weight", d, d, scale, true);
+    }
+};
+
+const size_t MultiHeadAttention::kQueryBlock;
+const size_t MultiHeadAttention::kKeyBlock;
+
+/**
+ * Feed-forward block (SwiGLU, as in LLaMA)
+ */
+class FeedForward {
+public:
+    FeedForward(size_t embedding_dim, size_t ff_dim, WeightStore& weights, const std::string& prefix,
+                ThreadPool* pool = nullptr)
+        : embedding_dim_(embedding_dim), ff_dim_(ff_dim), pool_(pool) {
+        init_weights(weights, prefix);
+    }
+    
+    // Forward pass over [n_tokens x embedding_dim] input; temporaries come
+    // from `arena` and are released on return
+    void forward(const float* input, float* output, size_t n_tokens, ScratchArena& arena) const {
+        ScratchArena::Scope scope(arena);
+        const size_t n = n_tokens * ff_dim_;
+        float* gate = arena.floats(n);
+        float* up = arena.floats(n);
+        matmul(w_gate_, input, gate, n_tokens, pool_);
+        matmul(w_up_, input, up, n_tokens, pool_);
+        for (size_t i = 0; i < n; ++i) {
+            gate[i] = gate[i] / (1.0f + std::exp(-gate[i])) * up[i];
+        }
+        
+        matmul(w_down_, gate, output, n_tokens, pool_);
+    }
+
+private:
+    size_t embedding_dim_;
+    size_t ff_dim_;
+    ThreadPool* pool_;
+    WeightTensor w_gate_, w_up_, w_down_;
+    
+    void init_weights(WeightStore& weights, const std::string& prefix) {
+        const float in_scale = 1.0f / std::sqrt(static_cast<float>(embedding_dim_));
+        const float ff_scale = 1.0f / std::sqrt(static_cast<float>(ff_dim_));
+        w_gate_ = weights.matrix(prefix + "ffn_gate.weight", ff_dim_, embedding_dim_, in_scale, true);
+        w_up_ = weights.matrix(prefix + "ffn_up.weight", ff_dim_, embedding_dim_, in_scale, true);
+        w_down_ = weights.matrix(prefix + "ffn_down.weight", embedding_dim_, ff_dim_, ff_scale, true);
+    }
+};
+
+/**
+ * TransformerLayer - Pre-norm attention + feed-forward block
+ */
+class TransformerLayer {
+public:
+    TransformerLayer(const LlamaLexConfig& config, WeightStore& weights, size_t index,
+                     ThreadPool* pool = nullptr)
+        : embedding_dim_(config.embedding_dim),
+          rms_norm_eps_(config.rms_norm_eps),
+          index_(static_cast<int>(index)),
+          kernels_(ShapeKernels::select(config)),
+          attention_(config.embedding_dim, config.num_heads, weights,
+                     layer_prefix(index), config.rope_freq_base, pool, kernels_),
+          feed_forward_(config.embedding_dim, config.ff_dim, weights, layer_prefix(index), pool) {
+        attn_norm_ = weights.vector(layer_prefix(index) + "attn_norm.weight", embedding_dim_);
+        ffn_norm_ = weights.vector(layer_prefix(index) + "ffn_norm.weight", embedding_dim_);
+    }
+    
+    // GGUF tensor name prefix of layer `index`
+    static std::string layer_prefix(size_t index) {
+        return "blk." + std::to_string(index) + ".";
+    }
+    
+    // Updates hidden [n_tokens x embedding_dim] in place; see MultiHeadAttention::forward
+    void forward(float* hidden, size_t n_tokens, float* k_cache, float* v_cache, size_t n_past,
+                 ScratchArena& arena) const {
+        residual_block(hidden, n_tokens, arena, [&](const float* normed, float* out) {
+            attention_.forward(normed, out, n_tokens, k_cache, v_cache, n_past, arena);
+        });
+    }
+    
+    // Same as forward() for packed independent sequences; see
+    // MultiHeadAttention::forward_packed
+    void forward_packed(float* hidden, const std::vector<size_t>& offsets, float* k, float* v,
+                        ScratchArena& arena) const {
+        residual_block(hidden, offsets.back() - offsets.front(), arena, [&](const float* normed, float* out) {
+            attention_.forward_packed(normed, out, offsets, k, v, arena);
+        });
+    }
+    
+    // Same as forward() for packed sequences with their own caches; see
+    // MultiHeadAttention::forward_sequences
+    void forward_sequences(float* hidden, size_t n_tokens, const SequenceKV* seqs, size_t n_seqs,
+                           ScratchArena& arena) const {
+        residual_block(hidden, n_tokens, arena, [&](const float* normed, float* out) {
+            attention_.forward_sequences(normed, out, n_tokens, seqs, n_seqs, arena);
+        });
+    }
+
+private:
+    size_t embedding_dim_;
+    float rms_norm_eps_;
+    int index_;  // layer number, for profiling
+    ShapeKernels kernels_;
+    MultiHeadAttention attention_;
+    FeedForward feed_forward_;
+    WeightTensor attn_norm_, ffn_norm_;
+    
+    // Pre-norm attention and feed-forward, each added back to hidden
+    template <typename Attend>
+    void residual_block(float* hidden, size_t n_tokens, ScratchArena& arena, Attend attend) const {
+        ScratchArena::Scope scope(arena);
+        const size_t n = n_tokens * embedding_dim_;
+        float* normed = arena.floats(n);
+        float* out = arena.floats(n);
+        
+        {
+            LLAMALEX_PROFILE_SCOPE(ProfileOp::NORM, index_);
+            kernels_.rms_norm(hidden, normed, n_tokens, embedding_dim_, attn_norm_.f32(), rms_norm_eps_);
+        }
+        {
+            LLAMALEX_PROFILE_SCOPE(ProfileOp::ATTENTION, index_);
+            attend(normed, out);
+            for (size_t i = 0; i < n; ++i) hidden[i] += out[i];
+        }
+        {
+            LLAMALEX_PROFILE_SCOPE(ProfileOp::NORM, index_);
+            kernels_.rms_norm(hidden, normed, n_tokens, embedding_dim_, ffn_norm_.f32(), rms_norm_eps_);
+        }
+        LLAMALEX_PROFILE_SCOPE(ProfileOp::FEED_FORWARD, index_);
+        feed_forward_.forward(normed, out, n_tokens, arena);
+        for (size_t i = 0; i < n; ++i) hidden[i] += out[i];
+    }
+};
+
+/**
+ * LayerBackend - Runs a contiguous span [first, last) of transformer layers
+ *
+ * A model's layers are split into at most two spans: the first on the
+ * CPU, the offloaded rest on a device backend. Every call takes the
+ * host residual stream [n_tokens x embedding_dim] and updates it in
+ * place, so a device backend moves the residual stream only at span
+ * boundaries (in before its first layer, out after its last) and keeps
+ * it on the device in between. Weights are uploaded once, when the backend is
+ * created; the backend belongs to the LlamaLexModel and is shared by its
+ * sessions, so calls may arrive from several threads at once.
+ *
+ * K/V rows of every layer live in the host caches (PagedKVCache), which
+ * prefix sharing and copy-on-write rely on. A device backend may keep a
+ * mirror of them for attention but must write each new row back to the
+ * rows it is given, so on top of the residual stream every call also
+ * moves 2 x n_tokens x embedding_dim floats per offloaded layer to the
+ * host (two rows per layer for a decode step).
+ */
+class LayerBackend {
+public:
+    LayerBackend(size_t first, size_t last) : first_(first), last_(last) {}
+    virtual ~LayerBackend() {}
+    
+    virtual BackendType type() const = 0;
+    
+    size_t first() const { return first_; }
+    size_t last() const { return last_; }
+    
+    // See TransformerLayer::forward, from position 0 with k/v as scratch
+    // of one row per token shared by the span's layers
+    virtual void forward(float* hidden, size_t n_tokens, float* k, float* v, ScratchArena& arena) const = 0;
+    
+    // See TransformerLayer::forward_packed
+    virtual void forward_packed(float* hidden, const std::vector<size_t>& offsets, float* k, float* v,
+                                ScratchArena& arena) const = 0;
+    
+    // See TransformerLayer::forward_sequences; seqs is [last - first][n_seqs],
+    // row i of the span's layer first + l at seqs[l * n_seqs + i]
+    virtual void forward_sequences(float* hidden, size_t n_tokens, const SequenceKV* seqs, size_t n_seqs,
+                                   ScratchArena& arena) const = 0;
+
+private:
+    size_t first_;
+    size_t last_;
+};
+
+/**
+ * CpuBackend - The engine's own kernels over the model's TransformerLayers
+ */
+class CpuBackend : public LayerBackend {
+public:
+    CpuBackend(const std::vector<TransformerLayer>& layers, size_t first, size_t last)
+        : LayerBackend(first, last), layers_(layers) {}
+    
+    BackendType type() const override { return BackendType::CPU; }
+    
+    void forward(float* hidden, size_t n_tokens, float* k, float* v, ScratchArena& arena) const override {
+        for (size_t l = first(); l < last(); ++l) layers_[l].forward(hidden, n_tokens, k, v, 0, arena);
+    }
+    
+    void forward_packed(float* hidden, const std::vector<size_t>& offsets, float* k, float* v,
+                        ScratchArena& arena) const override {
+        for (size_t l = first(); l < last(); ++l) layers_[l].forward_packed(hidden, offsets, k, v, arena);
+    }
+    
+    void forward_sequences(float* hidden, size_t n_tokens, const SequenceKV* seqs, size_t n_seqs,
+                           ScratchArena& arena) const override {
+        for (size_t l = first(); l < last(); ++l) {
+            layers_[l].forward_sequences(hidden, n_tokens, seqs + (l - first()) * n_seqs, n_seqs, arena);
+        }
+    }
+
+private:
+    const std::vector<TransformerLayer>& layers_;  // the model's, outliving this backend
+};
+
+/**
+ * BackendRegistry - Device backends available to LlamaLexModel
+ *
+ * The CPU backend is built in. Device backends (CUDA, Vulkan, Metal) are
+ * compiled separately against their SDKs and register a factory at
+ * static-initialization time:
+ *
+ *   static const bool cuda_registered =
+ *       (BackendRegistry::add(BackendType::CUDA, &make_cuda_backend), true);
+ *
+ * A factory uploads the weights of layers [first, last) (tensors
+ * "blk.<l>.*" of the store) and throws std::runtime_error when it cannot
+ * (no device, out of device memory); the model then runs those layers on
+ * the CPU instead.
+ */
+class BackendRegistry {
+public:
+    typedef std::unique_ptr<LayerBackend> (*Factory)(const LlamaLexConfig& config, const WeightStore& weights,
+                                                     size_t first, size_t last);
+    
+    static void add(BackendType type, Factory factory) {
+        std::lock_guard<std::mutex> lock(mutex());
+        factories()[static_cast<uint32_t>(type)] = factory;
+    }
+    
+    // Registered factory for type, or nullptr
+    static Factory find(BackendType type) {
+        std::lock_guard<std::mutex> lock(mutex());
+        auto it = factories().find(static_cast<uint32_t>(type));
+        return it == factories().end() ? nullptr : it->second;
+    }
+
+private:
+    static std::map<uint32_t, Factory>& factories() {
+        static std::map<uint32_t, Factory> map;
+        return map;
+    }
+    
+    static std::mutex& mutex() {
+        static std::mutex m;
+        return m;
+    }
+};
+
+/**
+ * KVPagePool - Fixed-size pages of key/value rows shared by many caches
+ *
+ * A page holds page_size positions of every layer's keys and values
+ * ([num_layers][K, V][page_size][embedding_dim]). Pages are reference
+ * counted so sequences can share them; released pages go on a free list
+ * and are handed out again before any new memory is allocated, so mixed
+ * short and long sequences do not fragment the heap. The pool is not
+ * thread-safe: caches on one pool must be driven from one thread.
+ */
+class KVPagePool {
+public:
+    KVPagePool(size_t num_layers, size_t embedding_dim, size_t page_size, size_t max_pages = 0)
+        : num_layers_(num_layers), embedding_dim_(embedding_dim),
+          page_size_(std::max<size_t>(1, page_size)), max_pages_(max_pages) {}
+    
+    size_t page_size() const { return page_size_; }
+    size_t embedding_dim() const { return embedding_dim_; }
+    
+    // Float offsets of a layer's key / value rows within a page
+    size_t key_offset(size_t layer) const { return (2 * layer) * page_size_ * embedding_dim_; }
+    size_t value_offset(size_t layer) const { return (2 * layer + 1) * page_size_ * embedding_dim_; }
+    
+    // A page with one reference (contents undefined)
+    uint32_t allocate() {
+        uint32_t page;
+        if (!free_.empty()) {
+            page = free_.back();
+            free_.pop_back();
+        } else {
+            if (max_pages_ && pages_.size() >= max_pages_) throw std::length_error("KV page pool exhausted");
+            page = static_cast<uint32_t>(pages_.size());
+            pages_.push_back(AlignedBuffer());
+            refs_.push_back(0);
+        }
+        if (!pages_[page].data()) {
+            pages_[page] = AlignedBuffer(page_bytes());
+            ++allocations_;
+        }
+        refs_[page] = 1;
+        ++in_use_;
+        return page;
+    }
+    
+    void retain(uint32_t page) { ++refs_[page]; }
+    
+    void release(uint32_t page) {
+        if (--refs_[page] == 0) {
+            free_.push_back(page);
+            --in_use_;
+        }
+    }
+    
+    bool shared(uint32_t page) const { return refs_[page] > 1; }
+    
+    // Every page is in use and max_pages allows no more
+    bool full() const { return max_pages_ && free_.empty() && pages_.size() >= max_pages_; }
+    
+    float* data(uint32_t page) { return reinterpret_cast<float*>(pages_[page].data()); }
+    
+    // Return the memory of free pages to the system
+    void trim() {
+        for (uint32_t page : free_) pages_[page] = AlignedBuffer();
+    }
+    
+    size_t pages_in_use() const { return in_use_; }
+    size_t allocations() const { return allocations_; }  // pages backed with new memory
+    size_t page_bytes() const { return 2 * num_layers_ * page_size_ * embedding_dim_ * sizeof(float); }
+    
+    // Bytes currently allocated for pages, in use or free
+    size_t allocated_bytes() const {
+        size_t n = 0;
+        for (const auto& page : pages_) n += page.size();
+        return n;
+    }
+
+private:
+    size_t num_layers_;
+    size_t embedding_dim_;
+    size_t page_size_;
+    size_t max_pages_;  // 0: unbounded
+    std::vector<AlignedBuffer> pages_;
+    std::vector<uint32_t> refs_;
+    std::vector<uint32_t> free_;
+    size_t in_use_ = 0;
+    size_t allocations_ = 0;
+};
+
+/**
+ * PagedKVCache - Key/value cache of one sequence, held in pool pages
+ *
+ * A page table maps position p to page p / page_size, so memory grows with
+ * the positions actually cached up to `capacity`. tokens() records which
+ * token produced each cached position, so a later prompt that shares the
+ * prefix only has to prefill its suffix. share_prefix() lets sequences
+ * reference the same pages; a shared page is copied before it is written
+ * (copy-on-write), which only ever happens to the page positions are
+ * appended to.
+ */
+class PagedKVCache {
+public:
+    PagedKVCache(KVPagePool& pool, size_t capacity) : pool_(pool), capacity_(capacity) {
+        const size_t max_pages = (capacity + pool.page_size() - 1) / pool.page_size();
+        table_.reserve(max_pages);
+        data_.reserve(max_pages);
+        tokens_.reserve(capacity);
+    }
+    ~PagedKVCache() { clear(); }
+    
+    PagedKVCache(const PagedKVCache&) = delete;
+    PagedKVCache& operator=(const PagedKVCache&) = delete;
+    
+    // Rows of one layer, valid until the page table next changes
+    KVRows keys(size_t layer) const { return rows(pool_.key_offset(layer)); }
+    KVRows values(size_t layer) const { return rows(pool_.value_offset(layer)); }
+    
+    size_t size() const { return tokens_.size(); }
+    size_t capacity() const { return capacity_; }
+    size_t pages() const { return table_.size(); }
+    const std::vector<int>& tokens() const { return tokens_; }
+    
+    /**
+     * Make positions [size(), size() + n) writable: map new pages and give
+     * this sequence its own copy of a shared page it is about to write
+     */
+    void reserve(size_t n) {
+        if (size() + n > capacity_) throw std::length_error("sequence exceeds KV cache capacity");
+        if (n == 0) return;
+        const size_t page_size = pool_.page_size();
+        const size_t first = size() / page_size;
+        if (first < table_.size() && pool_.shared(table_[first])) {
+            const uint32_t copy = pool_.allocate();
+            std::memcpy(pool_.data(copy), pool_.data(table_[first]), pool_.page_bytes());
+            pool_.release(table_[first]);
+            table_[first] = copy;
+            data_[first] = pool_.data(copy);
+        }
+        const size_t needed = (size() + n + page_size - 1) / page_size;
+        while (table_.size() < needed) {
+            table_.push_back(pool_.allocate());
+            data_.push_back(pool_.data(table_.back()));
+        }
+    }
+    
+    // Record tokens whose rows were written after reserve()
+    void append(const std::vector<int>& tokens) {
+        tokens_.insert(tokens_.end(), tokens.begin(), tokens.end());
+    }
+    
+    // Drop cached positions from n onwards, releasing pages past them
+    void truncate(size_t n) {
+        if (n >= tokens_.size()) return;
+        tokens_.resize(n);
+        const size_t keep = (n + pool_.page_size() - 1) / pool_.page_size();
+        while (table_.size() > keep) {
+            pool_.release(table_.back());
+            table_.pop_back();
+            data_.pop_back();
+        }
+    }
+    
+    void clear() {
+        tokens_.clear();
+        for (uint32_t page : table_) pool_.release(page);
+        table_.clear();
+        data_.clear();
+    }
+    
+    // Number of leading tokens whose K/V are already cached
+    size_t common_prefix(const std::vector<int>& tokens) const {
+        const size_t n = std::min(tokens.size(), tokens_.size());
+        size_t i = 0;
+        while (i < n && tokens[i] == tokens_[i]) ++i;
+        return i;
+    }
+    
+    /**
+     * Replace this cache's contents with the first n positions of source
+     * (same pool), referencing its pages instead of copying them
+     */
+    void share_prefix(const PagedKVCache& source, size_t n) {
+        if (&source == this) return truncate(n);
+        clear();
+        n = std::min(n, source.size());
+        tokens_.assign(source.tokens_.begin(), source.tokens_.begin() + n);
+        const size_t pages = (n + pool_.page_size() - 1) / pool_.page_size();
+        for (size_t i = 0; i < pages; ++i) {
+            pool_.retain(source.table_[i]);
+            table_.push_back(source.table_[i]);
+            data_.push_back(source.data_[i]);
+        }
+    }
+
+private:
+    KVPagePool& pool_;
+    size_t capacity_;
+    std::vector<uint32_t> table_;  // page of positions [i * page_size, (i + 1) * page_size)
+    std::vector<float*> data_;     // table_ resolved to page memory
+    std::vector<int> tokens_;
+    
+    KVRows rows(size_t offset) const {
+        KVRows r = {nullptr, data_.data(), pool_.page_size(), offset, pool_.embedding_dim()};
+        return r;
+    }
+};
+
+/**
+ * PrefixCache - KV state of recently prefilled prompt prefixes
+ *
+ * Requests that open with the same instruction block or statute excerpt
+ * prefill the same positions again and again. An entry keeps the full
+ * pages of a prefilled prompt by reference (a PagedKVCache sharing the
+ * source's pages, so storing one copies nothing); a new prompt finds the
+ * longest cached prefix and shares its pages into its own cache, leaving
+ * only the suffix to evaluate. Shared pages are copy-on-write, so neither
+ * side ever sees the other's later positions.
+ *
+ * Keys are chained hashes of page-aligned prefixes: the hash of pages
+ * [0, k] is the hash of page k seeded with that of [0, k - 1], and every
+ * entry is reachable through all of its prefix lengths, so a prompt that
+ * shares only the first pages of an entry still hits. Entries are evicted
+ * least recently used once the pages they hold exceed `budget_bytes`
+ * (pages shared by two entries count for both). Like the page pool, the
+ * cache is not thread-safe.
+ */
+class PrefixCache {
+public:
+    struct Stats {
+        size_t hits = 0;
+        size_t misses = 0;
+        size_t evictions = 0;
+        size_t entries = 0;
+        size_t bytes = 0;  // pages held by entries
+        
+        double hit_rate() const { return hits + misses > 0 ? static_cast<double>(hits) / (hits + misses) : 0.0; }
+    };
+    
+    PrefixCache(KVPagePool& pool, size_t budget_bytes, size_t capacity)
+        : pool_(pool), budget_bytes_(budget_bytes), capacity_(capacity) {}
+    
+    PrefixCache(const PrefixCache&) = delete;
+    PrefixCache& operator=(const PrefixCache&) = delete;
+    
+    /**
+     * The entry holding the longest cached page-aligned prefix of tokens,
+     * with that prefix's length in *n; nullptr (and *n = 0) on a miss.
+     * Share it into a cache with share_prefix(*entry, *n).
+     */
+    const PagedKVCache* find(const std::vector<int>& tokens, size_t* n) {
+        Entry* entry = longest(tokens, n);
+        if (!entry) {
+            ++stats_.misses;
+            return nullptr;
+        }
+        ++stats_.hits;
+        lru_.splice(lru_.begin(), lru_, entry->lru);
+        return entry->cache.get();
+    }
+    
+    /**
+     * Keep the full pages of source's cached positions, unless an entry
+     * already covers them. Entries the new one extends are dropped.
+     */
+    void insert(const PagedKVCache& source) {
+        const size_t page_size = pool_.page_size();
+        const size_t n = source.size() / page_size * page_size;
+        if (n == 0 || n / page_size * pool_.page_bytes() > budget_bytes_) return;
+        size_t cached = 0;
+        if (Entry* entry = longest(source.tokens(), &cached)) {
+            if (cached >= n) {
+                lru_.splice(lru_.begin(), lru_, entry->lru);
+                return;
+            }
+            if (entry->hashes.size() * page_size == cached) remove(entry);  // a prefix of the new one
+        }
+        
+        lru_.emplace_front();
+        Entry& entry = lru_.front();
+        entry.lru = lru_.begin();
+        entry.cache.reset(new PagedKVCache(pool_, capacity_));
+        entry.cache->share_prefix(source, n);
+        uint64_t h = kSeed;
+        for (size_t i = 0; i < n; i += page_size) {
+            h = fnv1a(source.tokens().data() + i, page_size * sizeof(int), h);
+            entry.hashes.push_back(h);
+            index_[h] = &entry;
+        }
+        bytes_ += entry.cache->pages() * pool_.page_bytes();
+        while (bytes_ > budget_bytes_ && evict()) {}
+    }
+    
+    // Drop the least recently used entry; false if there is none
+    bool evict() {
+        if (lru_.empty()) return false;
+        remove(&lru_.back());
+        ++stats_.evictions;
+        return true;
+    }
+    
+    void clear() {
+        index_.clear();
+        lru_.clear();
+        bytes_ = 0;
+    }
+    
+    size_t budget_bytes() const { return budget_bytes_; }
+    
+    Stats stats() const {
+        Stats s = stats_;
+        s.entries = lru_.size();
+        s.bytes = bytes_;
+        return s;
+    }
+
+private:
+    static const uint64_t kSeed = 1469598103934665603ull;
+    
+    struct Entry {
+        std::unique_ptr<PagedKVCache> cache;
+        std::vector<uint64_t> hashes;  // hashes[k]: prefix of pages [0, k]
+        std::list<Entry>::iterator lru;
+    };
+    
+    KVPagePool& pool_;
+    size_t budget_bytes_;
+    size_t capacity_;
+    std::list<Entry> lru_;  // most recently used first
+    std::unordered_map<uint64_t, Entry*> index_;
+    size_t bytes_ = 0;
+    Stats stats_;
+    
+    // Entry with the longest page-aligned prefix of tokens, its length in *n
+    Entry* longest(const std::vector<int>& tokens, size_t* n) const {
+        const size_t page_size = pool_.page_size();
+        Entry* best = nullptr;
+        *n = 0;
+        uint64_t h = kSeed;
+        for (size_t i = 0; i + page_size <= tokens.size(); i += page_size) {
+            h = fnv1a(tokens.data() + i, page_size * sizeof(int), h);
+            auto it = index_.find(h);
+            if (it == index_.end()) break;  // no longer prefix can be cached either
+            best = it->second;
+            *n = i + page_size;
+        }
+        // Guard against hash collisions
+        if (best && !std::equal(tokens.begin(), tokens.begin() + *n, best->cache->tokens().begin())) {
+            *n = 0;
+            return nullptr;
+        }
+        return best;
+    }
+    
+    void remove(Entry* entry) {
+        bytes_ -= entry->cache->pages() * pool_.page_bytes();
+        for (size_t k = 0; k < entry->hashes.size(); ++k) {
+            auto it = index_.find(entry->hashes[k]);
+            if (it == index_.end() || it->second != entry) continue;
+            // Another entry may share this prefix; keep it reachable
+            index_.erase(it);
+            for (Entry& other : lru_) {
+                if (&other != entry && other.hashes.size() > k && other.hashes[k] == entry->hashes[k]) {
+                    index_[other.hashes[k]] = &other;
+                    break;
+                }
+            }
+        }
+        lru_.erase(entry->lru);  // releases its pages
+    }
+};
+
+const uint64_t PrefixCache::kSeed;
+
+/**
+ * Sampling settings of one generation.
+ *
+ * temperature 0 picks the most likely token (greedy); top_k 0 and top_p 1
+ * turn those filters off; repetition_penalty > 1 makes tokens among the
+ * last repetition_window ones (0: the whole sequence) less likely. The
+ * same seed and settings reproduce the same tokens.
+ */
+struct SamplingParams {
+    float temperature = 0.0f;
+    size_t top_k = 0;
+    float top_p = 1.0f;
+    float repetition_penalty = 1.0f;
+    size_t repetition_window = 64;
+    uint64_t seed = 0;
+};
+
+/**
+ * Sampler - Turns next-token logits into a token, per SamplingParams
+ *
+ * Each sampler owns its random stream (SplitMix64 seeded from
+ * params.seed), so concurrent generations are independent and every one
+ * is reproducible. Softmax and the max reduction are vectorized; top-k
+ * and top-p only sort the head of the distribution they keep, found with
+ * one histogram pass, instead of the whole vocabulary. Buffers are kept
+ * between calls, so sampling does not allocate once warmed up.
+ */
+class Sampler {
+public:
+    explicit Sampler(const SamplingParams& params = SamplingParams())
+        : params_(params), state_(params.seed) {}
+    
+    const SamplingParams& params() const { return params_; }
+    
+    // Next token after `history` (the sequence so far) given its logits
+    int sample(const float* logits, size_t n, const std::vector<int>& history) {
+        LLAMALEX_PROFILE_SCOPE(ProfileOp::SAMPLING);
+        LLAMALEX_PROFILE_COUNT(0, n * sizeof(float));
+        if (params_.temperature <= 0.0f) {
+            return static_cast<int>(argmax(penalize(logits, n, history), n));
+        }
+        return draw(probabilities(logits, n, history).data(), n);
+    }
+    
+    /**
+     * Dense next-token distribution over the n-token vocabulary after the
+     * repetition penalty, temperature, top-k and top-p (filtered tokens
+     * are 0, the rest sum to 1). Valid until the next call.
+     */
+    const std::vector<float>& probabilities(const float* logits, size_t n, const std::vector<int>& history) {
+        const float* x = penalize(logits, n, history);
+        probs_.resize(n);
+        if (params_.temperature <= 0.0f) {
+            std::fill(probs_.begin(), probs_.end(), 0.0f);
+            probs_[argmax(x, n)] = 1.0f;
+            return probs_;
+        }
+        
+        float mass = exp_sum(x, probs_.data(), n, 1.0f / params_.temperature, max_value(x, n));
+        const size_t k = params_.top_k > 0 ? std::min(params_.top_k, n) : n;
+        if (k < n || params_.top_p < 1.0f) {
+            select_head(k, k < n ? std::numeric_limits<float>::infinity() : params_.top_p * mass);
+            if (k < n) {
+                head_.resize(k);
+                mass = head_mass();
+            }
+            if (params_.top_p < 1.0f) {
+                // Nucleus: the most likely tokens up to top_p of what is left
+                const float target = params_.top_p * mass;
+                size_t keep = 0;
+                double kept = 0.0;
+                while (keep < head_.size() && (keep == 0 || kept < target)) kept += head_[keep++].second;
+                head_.resize(keep);
+                mass = static_cast<float>(kept);
+            }
+            keep_only_head();
+        }
+        
+        const float inv = 1.0f / mass;
+        for (size_t i = 0; i < n; ++i) probs_[i] *= inv;
+        return probs_;
+    }
+    
+    // Token drawn from a distribution that sums to 1 (inverse CDF)
+    int draw(const float* probs, size_t n) {
+        const float u = uniform();
+        float cdf = 0.0f;
+        size_t last = 0;
+        for (size_t i = 0; i < n; ++i) {
+            if (probs[i] <= 0.0f) continue;
+            cdf += probs[i];
+            last = i;
+            if (u < cdf) return static_cast<int>(i);
+        }
+        return static_cast<int>(last);  // rounding left u just above the total
+    }
+    
+    // Uniform in [0, 1)
+    float uniform() {
+        return static_cast<float>(next() >> 40) * (1.0f / 16777216.0f);
+    }
+
+private:
+    typedef std::pair<int, float> Candidate;  // token id, weight
+    
+    SamplingParams params_;
+    uint64_t state_;
+    std::vector<float> penalized_;
+    std::vector<float> probs_;
+    std::vector<Candidate> head_;
+    std::vector<size_t> bin_count_;
+    std::vector<float> bin_mass_;
+    
+    static const size_t kBins = 2048;  // probabilities are in (0, 1]
+    
+    // SplitMix64
+    uint64_t next() {
+        uint64_t z = (state_ += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
+    }
+    
+    // Logits with recently seen tokens pushed down (CTRL-style penalty)
+    const float* penalize(const float* logits, size_t n, const std::vector<int>& history) {
+        const float penalty = params_.repetition_penalty;
+        if (penalty == 1.0f || history.empty()) return logits;
+        penalized_.assign(logits, logits + n);
+        const size_t window = params_.repetition_window > 0
+                              ? std::min(params_.repetition_window, history.size()) : history.size();
+        for (size_t i = history.size() - window; i < history.size(); ++i) {
+            const int id = history[i];
+            if (id < 0 || static_cast<size_t>(id) >= n) continue;
+            // From the original logit, so repeats in the window count once
+            const float l = logits[id];
+            penalized_[id] = l > 0.0f ? l / penalty : l * penalty;
+        }
+        return penalized_.data();
+    }
+    
+    /**
+     * head_ = the most likely tokens of probs_, most likely first (ties by
+     * lower id), until it holds at least `count` tokens or `mass`.
+     *
+     * Positive floats order like their bit patterns, so one pass bins the
+     * probabilities by exponent and top mantissa bits; walking the bins
+     * from the top finds the boundary bin, and only the tokens at or above
+     * it are gathered and sorted.
+     */
+    void select_head(size_t count, float mass) {
+        const size_t n = probs_.size();
+        bin_count_.assign(kBins, 0);
+        bin_mass_.assign(kBins, 0.0f);
+        for (size_t i = 0; i < n; ++i) {
+            const size_t b = bin(probs_[i]);
+            bin_count_[b]++;
+            bin_mass_[b] += probs_[i];
+        }
+        size_t boundary = kBins, seen = 0;
+        double seen_mass = 0.0;
+        while (boundary > 0 && seen < count && seen_mass < mass) {
+            --boundary;
+            seen += bin_count_[boundary];
+            seen_mass += bin_mass_[boundary];
+        }
+        
+        head_.clear();
+        for (size_t i = 0; i < n; ++i) {
+            if (bin(probs_[i]) >= boundary) head_.push_back(Candidate(static_cast<int>(i), probs_[i]));
+        }
+        std::sort(head_.begin(), head_.end(), [](const Candidate& a, const Candidate& b) {
+            return a.second > b.second || (a.second == b.second && a.first < b.first);
+        });
+    }
+    
+    static size_t bin(float p) {
+        return std::min<size_t>(kBins - 1, fp32_to_bits(p) >> 19);
+    }
+    
+    float head_mass() const {
+        double mass = 0.0;
+        for (const auto& c : head_) mass += c.second;
+        return static_cast<float>(mass);
+    }
+    
+    // Zero every probability outside head_
+    void keep_only_head() {
+        std::fill(probs_.begin(), probs_.end(), 0.0f);
+        for (const auto& c : head_) probs_[c.first] = c.second;
+    }
+};
+
+const size_t Sampler::kBins;
+
+/**
+ * Called with each piece of generated text as soon as it is sampled;
+ * returning false stops generation after that piece
+ */
+typedef std::function<bool(const std::string& piece)> TokenCallback;
+
+/**
+ * TextStream - Generated text a token at a time
+ *
+ * Appends each token's text to the detokenized sequence and hands out the
+ * new part, so the pieces join up to exactly what detokenize returns. A
+ * trailing incomplete UTF-8 sequence (byte fallback can split a character
+ * across tokens) is held back until it completes or the stream ends.
+ */
+class TextStream {
+public:
+    TextStream(const LegalTokenizer& tokenizer, const std::vector<int>& prompt)
+        : tokenizer_(tokenizer), started_(false) {
+        for (int id : prompt) tokenizer_.append_text(id, text_, started_);
+        emitted_ = text_.size();
+    }
+    
+    // Text released by token id (often the token's own text, may be empty)
+    const std::string& push(int id) {
+        tokenizer_.append_text(id, text_, started_);
+        return take(complete_prefix());
+    }
+    
+    // Whatever is still held back
+    const std::string& flush() {
+        return take(text_.size());
+    }
+    
+    const std::string& text() const { return text_; }
+
+private:
+    const LegalTokenizer& tokenizer_;
+    std::string text_;
+    bool started_;  // see LegalTokenizer::append_text
+    size_t emitted_;
+    std::string piece_;
+    
+    const std::string& take(size_t end) {
+        piece_.assign(text_, emitted_, end - emitted_);
+        emitted_ = end;
+        return piece_;
+    }
+    
+    // Length of text_ without a trailing partial UTF-8 character
+    size_t complete_prefix() const {
+        const size_t end = text_.size();
+        size_t i = end;
+        while (i > emitted_ && end - i < 3 && (static_cast<unsigned char>(text_[i - 1]) & 0xC0) == 0x80) --i;
+        if (i == emitted_) return end;  // nothing new, or stray continuation bytes
+        const unsigned char lead = static_cast<unsigned char>(text_[i - 1]);
+        const size_t length = lead >= 0xF0 ? 4 : lead >= 0xE0 ? 3 : lead >= 0xC0 ? 2 : 1;
+        return length > end - i + 1 ? i - 1 : end;
+    }
+};
+
+/**
+ * How final hidden states are reduced to one vector per document
+ */
+enum class PoolingMode : uint32_t {
+    MEAN = 0,  // average over tokens
+    CLS = 1,   // first token (BOS)
+    LAST = 2,  // last token, the only one that attends to the whole text
+    MAX = 3    // element-wise max over tokens
+};
+
+/**
+ * Pooled embedding settings of LlamaLex::encode_pooled.
+ *
+ * normalize scales the vector to unit L2 norm (cosine similarity becomes
+ * a dot product). type is the stored element format: F32, F16, or Q8_0
+ * (int8 in blocks of 32 with an fp16 scale, 34 bytes per 32 values; needs
+ * embedding_dim to be a multiple of 32).
+ */
+struct PoolingParams {
+    PoolingMode mode = PoolingMode::MEAN;
+    bool normalize = false;
+    TensorType type = TensorType::F32;
+};
+
+// Scale x to unit L2 norm (a zero vector is left as is)
+inline void l2_normalize(float* x, size_t n) {
+    const float norm = std::sqrt(dot_f32(x, x, n));
+    if (norm > 0.0f) {
+        const float inv = 1.0f / norm;
+        for (size_t i = 0; i < n; ++i) x[i] *= inv;
+    }
+}
+
+// Reduce [n_tokens x dim] hidden states into out [dim] per params
+inline void pool_hidden(const float* hidden, size_t n_tokens, size_t dim,
+                        const PoolingParams& params, float* out) {
+    switch (params.mode) {
+        case PoolingMode::CLS: std::memcpy(out, hidden, dim * sizeof(float)); break;
+        case PoolingMode::LAST: std::memcpy(out, hidden + (n_tokens - 1) * dim, dim * sizeof(float)); break;
+        case PoolingMode::MAX:
+            std::memcpy(out, hidden, dim * sizeof(float));
+            for (size_t t = 1; t < n_tokens; ++t) {
+                const float* h = hidden + t * dim;
+                for (size_t i = 0; i < dim; ++i) out[i] = h[i] > out[i] ? h[i] : out[i];
+            }
+            break;
+        default: {
+            std::fill(out, out + dim, 0.0f);
+            for (size_t t = 0; t < n_tokens; ++t) {
+                const float* h = hidden + t * dim;
+                for (size_t i = 0; i < dim; ++i) out[i] += h[i];
+            }
+            const float inv = 1.0f / n_tokens;
+            for (size_t i = 0; i < dim; ++i) out[i] *= inv;
+            break;
+        }
+    }
+    if (params.normalize) l2_normalize(out, dim);
+}
+
+/**
+ * EmbeddingIndex - Inner-product nearest-neighbour search over stored vectors
+ *
+ * Vectors are kept in contiguous, cache-line aligned rows of one storage
+ * type (F32, F16 or Q8_0, the int8 format at 34 bytes per 32 values), so
+ * a scan is the engine's matmul: the SIMD row kernels for one query, a
+ * GEMM for a batch, split across the index's threads. Add L2-normalized
+ * vectors (PoolingParams::normalize) to rank by cosine similarity.
+ *
+ * Search is exact until build_ivf() clusters the vectors with spherical
+ * k-means into inverted lists; a query then scans only the n_probe lists
+ * whose centroids score highest, and later add() calls go to their
+ * nearest list. Ids are insertion order.
+ */
+class EmbeddingIndex {
+public:
+    struct Hit {
+        int64_t id;   // -1: fewer than k vectors were scanned
+        float score;
+    };
+    
+    explicit EmbeddingIndex(size_t dim, TensorType type = TensorType::F32, size_t n_threads = 1)
+        : dim_(dim), type_(type), pool_(new ThreadPool(ThreadPool::resolve(n_threads))), lists_(1) {
+        const bool supported = type == TensorType::F32 || type == TensorType::F16 || type == TensorType::Q8_0;
+        if (dim == 0 || !supported || dim % type_block_size(type) != 0) {
+            throw std::invalid_argument(std::string("cannot index ") + std::to_string(dim) +
+                                        "-dim vectors as " + type_name(type));
+        }
+        row_bytes_ = dim / type_block_size(type) * type_block_bytes(type);
+    }
+    
+    size_t dim() const { return dim_; }
+    TensorType type() const { return type_; }
+    size_t size() const { return size_; }
+    size_t n_lists() const { return centroids_.empty() ? 0 : lists_.size(); }
+    size_t row_bytes() const { return row_bytes_; }
+    
+    // Append n vectors [n x dim]; they get ids size() .. size() + n - 1
+    void add(const float* vectors, size_t n) {
+        std::vector<uint8_t> rows(n * row_bytes_);
+        for (size_t i = 0; i < n; ++i) quantize_row(type_, vectors + i * dim_, &rows[i * row_bytes_], dim_);
+        insert(vectors, rows.data(), n);
+    }
+    
+    // add() for vectors already stored as type(), e.g. encode_batch_pooled output
+    void add_encoded(const void* rows, size_t n) {
+        const uint8_t* bytes = static_cast<const uint8_t*>(rows);
+        std::vector<float> vectors(centroids_.empty() ? 0 : n * dim_);
+        for (size_t i = 0; !centroids_.empty() && i < n; ++i) {
+            dequantize_row(type_, bytes + i * row_bytes_, &vectors[i * dim_], dim_);
+        }
+        insert(vectors.data(), bytes, n);
+    }
+    
+    /**
+     * Cluster the stored vectors into n_lists inverted lists (k-means on
+     * an evenly strided sample of at most kTrainPerList vectors per list)
+     * and probe an eighth of them per query unless set_probes() says
+     * otherwise. Rebuilding re-clusters everything.
+     */
+    void build_ivf(size_t n_lists, size_t n_iterations = 10) {
+        if (size_ == 0) throw std::logic_error("cannot cluster an empty index");
+        n_lists = std::max<size_t>(1, std::min(n_lists, size_));
+        const size_t m = std::min(size_, n_lists * kTrainPerList);
+        std::vector<float> sample(m * dim_);
+        size_t g = 0, taken = 0;
+        for (const List& list : lists_) {
+            for (size_t r = 0; r < list.n; ++r, ++g) {
+                if ((g + 1) * m / size_ > taken) {
+                    dequantize_row(type_, list.row(r, row_bytes_), &sample[taken++ * dim_], dim_);
+                }
+            }
+        }
+        
+        centroids_.assign(n_lists * dim_, 0.0f);
+        for (size_t c = 0; c < n_lists; ++c) {
+            std::memcpy(&centroids_[c * dim_], &sample[c * m / n_lists * dim_], dim_ * sizeof(float));
+            l2_normalize(&centroids_[c * dim_], dim_);
+        }
+        std::vector<size_t> assignment(m, SIZE_MAX), next(m), counts(n_lists);
+        for (size_t it = 0; it < n_iterations; ++it) {
+            assign(sample.data(), m, next.data());
+            if (next == assignment) break;
+            assignment.swap(next);
+            std::fill(centroids_.begin(), centroids_.end(), 0.0f);
+            std::fill(counts.begin(), counts.end(), 0);
+            for (size_t i = 0; i < m; ++i) {
+                float* c = &centroids_[assignment[i] * dim_];
+                const float* x = &sample[i * dim_];
+                for (size_t j = 0; j < dim_; ++j) c[j] += x[j];
+                ++counts[assignment[i]];
+            }
+            for (size_t c = 0; c < n_lists; ++c) {
+                // Reseed an empty list from a spread-out sample vector
+                const float* seed = &sample[(c * 2654435761u) % m * dim_];
+                if (counts[c] == 0) std::memcpy(&centroids_[c * dim_], seed, dim_ * sizeof(float));
+                l2_normalize(&centroids_[c * dim_], dim_);
+            }
+        }
+        
+        // Move every row (bytes as stored) to the list of its centroid
+        std::vector<List> lists(n_lists);
+        std::vector<float> block(kBlockRows * dim_);
+        std::vector<size_t> nearest(kBlockRows);
+        for (const List& list : lists_) {
+            for (size_t r0 = 0; r0 < list.n; r0 += kBlockRows) {
+                const size_t nr = std::min(kBlockRows, list.n - r0);
+                for (size_t r = 0; r < nr; ++r) {
+                    dequantize_row(type_, list.row(r0 + r, row_bytes_), &block[r * dim_], dim_);
+                }
+                assign(block.data(), nr, nearest.data());
+                for (size_t r = 0; r < nr; ++r) {
+                    lists[nearest[r]].append(list.row(r0 + r, row_bytes_), list.ids[r0 + r], row_bytes_);
+                }
+            }
+        }
+        lists_.swap(lists);
+        n_probe_ = std::max<size_t>(1, n_lists / 8);
+    }
+    
+    // Lists scanned per query once clustered
+    void set_probes(size_t n_probe) { n_probe_ = std::max<size_t>(1, n_probe); }
+    
+    /**
+     * The k highest-scoring vectors for each of n_queries queries
+     * [n_queries x dim], best first, into hits [n_queries x k]. Without
+     * lists a batch of queries shares one pass over the rows.
+     */
+    void search(const float* queries, size_t n_queries, size_t k, Hit* hits) const {
+        // Each query's k hits are its heap, seeded with empty hits that
+        // any scored row beats; scores live in thread scratch, so a warm
+        // search does not allocate
+        for (size_t i = 0; i < n_queries * k; ++i) {
+            hits[i].id = -1;
+            hits[i].score = -std::numeric_limits<float>::infinity();
+        }
+        if (k == 0) return;
+        if (centroids_.empty()) {
+            scan(lists_[0], queries, n_queries, k, hits);
+        } else {
+            const size_t n_lists = lists_.size();
+            const size_t n_probe = std::min(n_probe_, n_lists);
+            float* list_scores = thread_scratch<3>(n_queries * n_lists);
+            matmul(centroid_tensor(), queries, list_scores, n_queries, pool_.get());
+            size_t* order = thread_scratch<4, size_t>(n_lists);
+            for (size_t q = 0; q < n_queries; ++q) {
+                const float* ls = list_scores + q * n_lists;
+                for (size_t c = 0; c < n_lists; ++c) order[c] = c;
+                std::partial_sort(order, order + n_probe, order + n_lists,
+                                  [ls](size_t a, size_t b) { return ls[a] > ls[b]; });
+                for (size_t p = 0; p < n_probe; ++p) {
+                    scan(lists_[order[p]], queries + q * dim_, 1, k, hits + q * k);
+                }
+            }
+        }
+        for (size_t q = 0; q < n_queries; ++q) std::sort_heap(hits + q * k, hits + (q + 1) * k, worse);
+    }
+
+private:
+    // Rows scored per matmul: bounds the score buffer for large lists
+    static const size_t kBlockRows = 4096;
+    static const size_t kTrainPerList = 256;
+    
+    struct List {
+        AlignedBuffer rows;
+        size_t n = 0;
+        std::vector<int64_t> ids;
+        
+        const uint8_t* row(size_t r, size_t row_bytes) const { return rows.data() + r * row_bytes; }
+        
+        void append(const uint8_t* row_data, int64_t id, size_t row_bytes) {
+            if ((n + 1) * row_bytes > rows.size()) {
+                AlignedBuffer grown(std::max<size_t>(16, 2 * n) * row_bytes);
+                if (n > 0) std::memcpy(grown.data(), rows.data(), n * row_bytes);
+                rows = std::move(grown);
+            }
+            std::memcpy(rows.data() + n * row_bytes, row_data, row_bytes);
+            ids.push_back(id);
+            ++n;
+        }
+    };
+    
+    size_t dim_;
+    TensorType type_;
+    size_t row_bytes_ = 0;
+    std::unique_ptr<ThreadPool> pool_;
+    std::vector<List> lists_;       // one list until build_ivf()
+    std::vector<float> centroids_;  // [n_lists x dim], unit norm; empty when flat
+    size_t n_probe_ = 1;
+    size_t size_ = 0;
+    
+    // Heap order: the worst hit (lowest score, then highest id) on top
+    static bool worse(const Hit& a, const Hit& b) {
+        return a.score > b.score || (a.score == b.score && a.id < b.id);
+    }
+    
+    WeightTensor centroid_tensor() const {
+        WeightTensor t;
+        t.data = centroids_.data();
+        t.rows = centroids_.size() / dim_;
+        t.cols = dim_;
+        return t;
+    }
+    
+    // Nearest centroid of each of n vectors
+    void assign(const float* x, size_t n, size_t* out) const {
+        const size_t n_lists = centroids_.size() / dim_;
+        std::vector<float> scores(std::min(n, kBlockRows) * n_lists);
+        for (size_t i0 = 0; i0 < n; i0 += kBlockRows) {
+            const size_t nb = std::min(kBlockRows, n - i0);
+            matmul(centroid_tensor(), x + i0 * dim_, scores.data(), nb, pool_.get());
+            for (size_t i = 0; i < nb; ++i) out[i0 + i] = argmax(&scores[i * n_lists], n_lists);
+        }
+    }
+    
+    // Appends encoded rows, to their nearest list once clustered (x holds
+    // the same rows as floats)
+    void insert(const float* x, const uint8_t* rows, size_t n) {
+        std::vector<size_t> list(n, 0);
+        if (!centroids_.empty()) assign(x, n, list.data());
+        for (size_t i = 0; i < n; ++i) {
+            lists_[list[i]].append(rows + i * row_bytes_, static_cast<int64_t>(size_++), row_bytes_);
+        }
+    }
+    
+    // Score every row of list against n_queries queries, keeping each
+    // query's k best in its heap (heaps [n_queries x k], each full)
+    void scan(const List& list, const float* queries, size_t n_queries, size_t k, Hit* heaps) const {
+        float* scores = thread_scratch<2>(n_queries * std::min(kBlockRows, list.n));
+        for (size_t r0 = 0; r0 < list.n; r0 += kBlockRows) {
+            WeightTensor rows;
+            rows.data = list.row(r0, row_bytes_);
+            rows.type = type_;
+            rows.rows = std::min(kBlockRows, list.n - r0);
+            rows.cols = dim_;
+            matmul(rows, queries, scores, n_queries, pool_.get());
+            for (size_t q = 0; q < n_queries; ++q) {
+                Hit* heap = heaps + q * k;
+                const float* s = scores + q * rows.rows;
+                for (size_t r = 0; r < rows.rows; ++r) {
+                    const Hit hit = {list.ids[r0 + r], s[r]};
+                    if (worse(hit, heap[0])) {
+                        std::pop_heap(heap, heap + k, worse);
+                        heap[k - 1] = hit;
+                        std::push_heap(heap, heap + k, worse);
+                    }
+                }
+            }
+        }
+    }
+};
+
+const size_t EmbeddingIndex::kBlockRows;
+const size_t EmbeddingIndex::kTrainPerList;
+
+/**
+ * DocumentEmbedding - Result of LlamaLex::encode_document
+ */
+struct DocumentEmbedding {
+    std::vector<float> embedding;      // [embedding_dim], mean over every token
+    std::vector<float> chunks;         // [n_chunks x embedding_dim], mean of each window
+    std::vector<size_t> chunk_starts;  // first token of each window
+    size_t n_tokens = 0;
+    
+    size_t n_chunks() const { return chunk_starts.size(); }
+};
+
+// Legal references analyze_case() extracts from the text
+enum class CaseEntityKind : uint32_t {
+    CITATION,   // law report or neutral citation
+    CASE_NAME,  // Smith v Jones
+    PROVISION,  // section, subsection, regulation, ...
+    ACT         // Act 108 of 1996
+};
+
+inline const char* case_entity_kind_name(CaseEntityKind kind) {
+    static const char* names[] = {"citation", "case_name", "provision", "act"};
+    return static_cast<uint32_t>(kind) < 4 ? names[static_cast<uint32_t>(kind)] : "unknown";
+}
+
+// Issues analyze_case() scores a case against, each described by a short
+// passage whose embedding is compared with the case's
+struct CaseIssueInfo {
+    const char* name;
+    const char* description;
+};
+
+const CaseIssueInfo kCaseIssues[] = {
+    {"contract", "The parties concluded an agreement and the defendant breached the contract, so the plaintiff "
+                 "claims specific performance or damages for the breach."},
+    {"delict", "The defendant acted negligently and wrongfully causing harm, and the plaintiff claims damages "
+               "for the loss suffered."},
+    {"constitutional", "The applicant contends that the law or conduct infringes a right in the Bill of Rights "
+                       "and is inconsistent with the Constitution and invalid."},
+    {"criminal", "The accused was charged and convicted of the offence, and appeals against the conviction and "
+                 "the sentence imposed by the trial court."},
+    {"property", "The owner seeks eviction and the return of the property, and the occupier relies on a right "
+                 "of occupation or a servitude over the land."},
+    {"administrative", "The applicant seeks the review and setting aside of the administrative decision as "
+                       "unlawful, unreasonable and procedurally unfair."},
+    {"labour", "The employee was dismissed and contends that the dismissal was substantively and procedurally "
+               "unfair, seeking reinstatement or compensation."},
+    {"family", "The parties dispute the divorce, the maintenance payable and the care of and contact with the "
+               "minor children in their best interests."},
+};
+const size_t kNumCaseIssues = sizeof(kCaseIssues) / sizeof(kCaseIssues[0]);
+
+/**
+ * What to compute in LlamaLex::analyze_case. Precedents are looked up only
+ * with an index (of normalized document embeddings); 0 skips a stage.
+ */
+struct CaseAnalysisParams {
+    const EmbeddingIndex* precedents = nullptr;
+    size_t n_precedents = 5;
+    size_t n_issues = 3;
+    size_t n_summary = 3;  // sentences
+};
+
+/**
+ * Result of LlamaLex::analyze_case. Text positions are byte ranges of the
+ * analyzed text. Reusing one CaseAnalysis across calls reuses its buffers.
+ */
+struct CaseAnalysis {
+    struct Entity {
+        CaseEntityKind kind;
+        size_t begin, length;
+    };
+    struct Issue {
+        size_t issue;  // index into kCaseIssues
+        float score;   // cosine similarity to its description
+    };
+    struct Sentence {
+        size_t begin, length;
+        float score;  // cosine similarity to the whole case
+    };
+    
+    DocumentEmbedding document;
+    std::vector<Entity> entities;                 // in text order
+    std::vector<Issue> issues;                    // most similar first
+    std::vector<EmbeddingIndex::Hit> precedents;  // most similar first
+    std::vector<Sentence> summary;                // extractive, in text order
+};
+
+namespace {
+
+// Abbreviations whose full stop does not end a sentence
+bool is_abbreviation(const char* word, size_t n) {
+    static const char* abbreviations[] = {"v", "vs", "No", "no", "s", "ss", "para", "paras", "cf", "eg",
+                                          "ie", "Mr", "Mrs", "Ms", "Dr", "Adv", "Prof", "J", "JA", "AJ",
+                                          "CJ", "DP", "Art", "art", "reg", "Reg", "Sch", "Ch", "Pty", "Co"};
+    for (const char* a : abbreviations) {
+        if (std::strlen(a) == n && std::memcmp(a, word, n) == 0) return true;
+    }
+    return false;
+}
+
+/**
+ * Split text into sentences as [begin, end) byte ranges: a sentence ends
+ * at . ? or ! followed by a space and a capital, digit or opening bracket
+ * (or at the end of text), unless the full stop ends an abbreviation such
+ * as "v." or "No."; blank lines also end one
+ */
+void split_sentences(const std::string& text, std::vector<std::pair<size_t, size_t>>& sentences) {
+    sentences.clear();
+    const size_t n = text.size();
+    size_t begin = 0;
+    auto close = [&](size_t end) {
+        while (begin < end && std::isspace(static_cast<uint8_t>(text[begin]))) ++begin;
+        size_t last = end;
+        while (last > begin && std::isspace(static_cast<uint8_t>(text[last - 1]))) --last;
+        if (last > begin) sentences.emplace_back(begin, last);
+        begin = end;
+    };
+    for (size_t i = 0; i < n; ++i) {
+        const char c = text[i];
+        if (c == '\n' && i + 1 < n && text[i + 1] == '\n') {
+            close(i);
+            continue;
+        }
+        if ((c != '.' && c != '?' && c != '!') || (i + 1 < n && !std::isspace(static_cast<uint8_t>(text[i + 1])))) {
+            continue;
+        }
+        size_t next = i + 1;
+        while (next < n && std::isspace(static_cast<uint8_t>(text[next]))) ++next;
+        if (next < n) {
+            const uint8_t start = static_cast<uint8_t>(text[next]);
+            if (!std::isupper(start) && !std::isdigit(start) && start != '(' && start != '[' && start != '"') continue;
+        }
+        if (c == '.') {
+            size_t word = i;
+            while (word > 0 && std::isalpha(static_cast<uint8_t>(text[word - 1]))) --word;
+            if (is_abbreviation(text.data() + word, i - word)) continue;
+        }
+        close(i + 1);
+    }
+    close(n);
+}
+
+/**
+ * Citations, case names, provisions and Acts in text, in order. Uses the
+ * tokenizer's case-law and statute patterns, one DFA per kind, matched at
+ * word starts (a reference may follow an opening bracket); the longest
+ * match wins.
+ */
+void extract_entities(const std::string& text, std::vector<CaseAnalysis::Entity>& entities) {
+    struct Patterns {
+        PatternDFA dfa[4];
+        Patterns() {
+            const std::vector<std::string> cases = LegalTokenizer::case_law_patterns();
+            const std::vector<std::string> statutes = LegalTokenizer::statute_patterns();
+            dfa[0].compile({cases[0], cases[1]});
+            dfa[1].compile({cases[2]});
+            dfa[2].compile({statutes[0], statutes[1]});
+            dfa[3].compile({statutes[2]});
+        }
+    };
+    static const Patterns patterns;
+    
+    entities.clear();
+    const char* s = text.data();
+    const size_t n = text.size();
+    for (size_t i = 0; i < n;) {
+        const uint8_t prev = i ? static_cast<uint8_t>(s[i - 1]) : ' ';
+        if (std::isalnum(prev) || std::isspace(static_cast<uint8_t>(s[i]))) {
+            ++i;
+            continue;
+        }
+        size_t best = 0, kind = 0;
+        for (size_t k = 0; k < 4; ++k) {
+            const size_t len = patterns.dfa[k].match(s + i, n - i);
+            if (len > best) {
+                best = len;
+                kind = k;
+            }
+        }
+        if (best == 0) {
+            ++i;
+            continue;
+        }
+        CaseAnalysis::Entity entity = {static_cast<CaseEntityKind>(kind), i, best};
+        entities.push_back(entity);
+        i += best;
+    }
+}
+
+} // namespace
+
+/**
+ * LlamaLexModel - Weights, vocabulary and thread pool shared by sessions
+ *
+ * Everything a forward pass reads and never writes: the transformer
+ * layers over their weights (random init, or views into a mapped GGUF
+ * file), the output norm and LM head, the tokenizer, the worker pool and
+ * the layer backends (CPU, plus a device for offloaded layers).
+ * A model is immutable once built and is held by reference count
+ * (std::shared_ptr<const LlamaLexModel>). Each LlamaLex over it is a
+ * session with its own KV cache, scratch arena, sampler state and caches,
+ * so N sessions share one copy of the weights and a new session starts
+ * in microseconds. Sessions on different threads share the pool, whose
+ * parallel loops then take turns.
+ */
+class LlamaLexModel {
+public:
+    // Random-init weights of config's shape (vocabulary from vocab_path, if set)
+    static std::shared_ptr<const LlamaLexModel> create(const LlamaLexConfig& config) {
+        return std::shared_ptr<const LlamaLexModel>(new LlamaLexModel(config, nullptr));
+    }
+    
+    // Memory-mapped GGUF model: shape from the file, the rest from config,
+    // with max_seq_length capped at the model's context length
+    static std::shared_ptr<const LlamaLexModel> load(const std::string& path,
+                                                     const LlamaLexConfig& config = LlamaLexConfig()) {
+        std::shared_ptr<GGUFFile> file = std::make_shared<GGUFFile>(path);
+        return std::shared_ptr<const LlamaLexModel>(new LlamaLexModel(config_from_file(*file, config), file));
+    }
+    
+    LlamaLexModel(const LlamaLexModel&) = delete;
+    LlamaLexModel& operator=(const LlamaLexModel&) = delete;
+    
+    const LlamaLexConfig& config() const { return config_; }
+    const std::shared_ptr<const LegalTokenizer>& tokenizer() const { return tokenizer_; }
+    ThreadPool* pool() const { return pool_.get(); }
+    
+    // Nodes the pool spreads its threads over (0: no NUMA placement)
+    size_t numa_nodes() const {
+        return config_.numa_mode == NumaMode::OFF ? 0 : NumaTopology::system().resolve(config_.numa_nodes);
+    }
+    
+    const std::vector<TransformerLayer>& layers() const { return layers_; }
+    
+    // Layer spans in order: CPU layers first, then any offloaded ones
+    const std::vector<std::unique_ptr<LayerBackend>>& backends() const { return backends_; }
+    
+    // Layers running on a device backend (0 when everything is on the CPU)
+    size_t offloaded_layers() const {
+        const LayerBackend& tail = *backends_.back();
+        return tail.type() == BackendType::CPU ? 0 : tail.last() - tail.first();
+    }
+    
+    // Backend of the offloaded layers ("cpu" without offload)
+    BackendType backend() const { return backends_.back()->type(); }
+    const WeightTensor& token_embd() const { return token_embd_; }   // [vocab_size x embedding_dim]
+    const WeightTensor& output_norm() const { return output_norm_; }
+    const WeightTensor& output() const { return output_; }           // LM head, may be token_embd
+    const WeightStore& weights() const { return weights_; }
+    
+    // Milliseconds from the start of construction until the model was
+    // ready, and until now
+    double load_ms() const { return load_ms_; }
+    double elapsed_ms() const {
+        return std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - created_at_).count();
+    }
+    
+    // Hash of what final hidden states depend on besides the tokens: the
+    // shape, norm and rope settings and every byte of every weight tensor.
+    // Computed on first use (reads the whole model once) and kept.
+    uint64_t identity() const {
+        std::call_once(identity_once_, [this] {
+            const uint64_t shape[] = {1, config_.vocab_size, config_.embedding_dim, config_.num_layers,
+                                      config_.num_heads, config_.ff_dim};
+            uint64_t h = fnv1a(shape, sizeof(shape));
+            h = fnv1a(&config_.rms_norm_eps, sizeof(float), h);
+            h = fnv1a(&config_.rope_freq_base, sizeof(float), h);
+            for (const auto& entry : weights_.tensors()) {
+                const WeightTensor& w = entry.second;
+                h = fnv1a(entry.first.data(), entry.first.size(), h);
+                h = fnv1a(&w.type, sizeof(w.type), h);
+                h = hash_words(w.data, w.bytes(), h);
+            }
+            identity_ = h;
+        });
+        return identity_;
+    }
+    
+    // Throws unless every token id of tokenizer has an embedding row
+    void check_vocab(const LegalTokenizer& tokenizer) const {
+        if (tokenizer.vocab_count() > config_.vocab_size) {
+            throw std::runtime_error("vocabulary has " + std::to_string(tokenizer.vocab_count()) +
+                                     " tokens but the model embeds " +
+                                     std::to_string(config_.vocab_size));
+        }
+    }
+
+private:
+    std::chrono::steady_clock::time_point created_at_;  // first member: startup timing
+    LlamaLexConfig config_;
+    std::unique_ptr<ThreadPool> pool_;  // started once, shared by every layer
+    std::shared_ptr<const LegalTokenizer> tokenizer_;
+    WeightStore weights_;
+    std::vector<TransformerLayer> layers_;
+    std::vector<std::unique_ptr<LayerBackend>> backends_;  // spans over layers_
+    WeightTensor token_embd_;   // built once or mapped
+    WeightTensor output_norm_;
+    WeightTensor output_;
+    double load_ms_ = 0.0;
+    mutable std::once_flag identity_once_;  // see identity()
+    mutable uint64_t identity_ = 0;
+    
+    LlamaLexModel(const LlamaLexConfig& config, std::shared_ptr<GGUFFile> file)
+        : created_at_(std::chrono::steady_clock::now()),
+          config_(validated(config)),
+          pool_(new ThreadPool(ThreadPool::resolve(config_.n_threads, numa_nodes()), config_.pin_threads,
+                               numa_nodes())),
+          weights_(file ? WeightStore(file, config_.numa_mode, config_.numa_nodes)
+                        : WeightStore(config_.weight_type, config_.numa_mode, config_.numa_nodes)) {
+        if (file) {
+            LLAMALEX_LOG(INFO, "Loading LlamaLex model (%zu MB mapped)...", file->size() / (1 << 20));
+        } else {
+            LLAMALEX_LOG(INFO, "Initializing LlamaLex inference engine...");
+        }
+        std::shared_ptr<LegalTokenizer> tokenizer = std::make_shared<LegalTokenizer>(
+            config_.vocab_size, config_.enable_case_law_mode, config_.enable_statute_mode);
+        if (!config_.vocab_path.empty()) {
+            tokenizer->load(config_.vocab_path, config_.merges_path);
+        } else if (file) {
+            read_vocab(*file, *tokenizer);
+        }
+        check_vocab(*tokenizer);
+        tokenizer_ = tokenizer;
+        init_weights();
+        load_ms_ = elapsed_ms();
+        if (!file) {
+            LLAMALEX_LOG(INFO, "LlamaLex initialized with %zu layers, %zu threads, %s kernels",
+                         config_.num_layers, pool_->size(), ShapeKernels::select(config_).name);
+        }
+        if (weights_.numa_nodes() > 1) {
+            LLAMALEX_LOG(INFO, "LlamaLex weights %s over %zu NUMA nodes (%zu MB of replicas)",
+                         config_.numa_mode == NumaMode::REPLICATE ? "replicated" : "interleaved",
+                         weights_.numa_nodes(), weights_.replica_bytes() >> 20);
+        }
+    }
+
+    
+    static const LlamaLexConfig& validated(const LlamaLexConfig& config) {
+        config.validate();
+        return config;
+    }
+    
+    // Model shape from GGUF metadata (llama.cpp key names)
+    static LlamaLexConfig config_from_file(const GGUFFile& file, LlamaLexConfig config) {
+        const std::string arch = file.get_string("general.architecture", "llama");
+        const GGUFFile::TensorInfo* embd = file.tensor("token_embd.weight");
+        if (!embd || embd->dims.size() != 2) {
+            throw std::runtime_error("model file has no token_embd.weight");
+        }
+        config.embedding_dim = embd->dims[0];
+        config.vocab_size = embd->dims[1];
+        config.num_layers = file.get_uint(arch + ".block_count", config.num_layers);
+        config.num_heads = file.get_uint(arch + ".attention.head_count", config.num_heads);
+        config.ff_dim = file.get_uint(arch + ".feed_forward_length", config.ff_dim);
+        if (file.get_uint(arch + ".attention.head_count_kv", config.num_heads) != config.num_heads) {
+            throw std::runtime_error("grouped-query attention models are not supported");
+        }
+        config.rms_norm_eps = static_cast<float>(
+            file.get_float(arch + ".attention.layer_norm_rms_epsilon", config.rms_norm_eps));
+        config.rope_freq_base = static_cast<float>(
+            file.get_float(arch + ".rope.freq_base", config.rope_freq_base));
+        const uint64_t context = file.get_uint(arch + ".context_length", LlamaLexConfig().max_seq_length);
+        config.max_seq_length = std::min<uint64_t>(config.max_seq_length, context);
+        return config;
+    }
+    
+    // Vocabulary stored in the model file, if it has one
+    static void read_vocab(const GGUFFile& file, LegalTokenizer& tokenizer) {
+        LegalTokenizer::Vocab vocab;
+        vocab.pieces = file.get_string_array("tokenizer.ggml.tokens");
+        if (vocab.pieces.empty()) return;
+        vocab.scores = file.get_array<float, float>("tokenizer.ggml.scores", GGUFFile::FLOAT32);
+        vocab.types = file.get_array<int32_t, int32_t>("tokenizer.ggml.token_type", GGUFFile::INT32);
+        vocab.merges = file.get_string_array("tokenizer.ggml.merges");
+        const char* special[] = {"tokenizer.ggml.bos_token_id", "tokenizer.ggml.eos_token_id",
+                                 "tokenizer.ggml.unknown_token_id"};
+        int* ids[] = {&vocab.bos_id, &vocab.eos_id, &vocab.unk_id};
+        for (size_t i = 0; i < 3; ++i) {
+            if (file.value(special[i])) *ids[i] = static_cast<int>(file.get_uint(special[i], 0));
+        }
+        vocab.add_space_prefix = file.get_uint("tokenizer.ggml.add_space_prefix", 1) != 0;
+        tokenizer.set_vocab(vocab);
+    }
+    
+    void init_weights() {
+        // Bind model weights: views into the mapped file when one was
+        // loaded, deterministic random initialization otherwise
+        const size_t dim = config_.embedding_dim;
+        const float scale = 1.0f / std::sqrt(static_cast<float>(dim));
+        token_embd_ = weights_.matrix("token_embd.weight", config_.vocab_size, dim, scale);
+        layers_.reserve(config_.num_layers);
+        for (size_t l = 0; l < config_.num_layers; ++l) {
+            layers_.emplace_back(config_, weights_, l, pool_.get());
+        }
+        output_norm_ = weights_.vector("output_norm.weight", dim);
+        // Models without a separate LM head tie it to the token embeddings
+        output_ = weights_.has("output.weight")
+            ? weights_.matrix("output.weight", config_.vocab_size, dim, scale)
+            : token_embd_;
+        init_backends();
+    }
+    
+    // CPU span for the first layers, device span for the last gpu_layers
+    void init_backends() {
+        const size_t n_layers = layers_.size();
+        const size_t offload = config_.backend == BackendType::CPU ? 0 : std::min(config_.gpu_layers, n_layers);
+        std::unique_ptr<LayerBackend> device;
+        if (offload > 0) {
+            const char* name = backend_name(config_.backend);
+            if (BackendRegistry::Factory factory = BackendRegistry::find(config_.backend)) {
+                try {
+                    device = factory(config_, weights_, n_layers - offload, n_layers);
+                } catch (const std::exception& e) {
+                    LLAMALEX_LOG(WARNING, "%s backend unavailable (%s); running all layers on the CPU",
+                                 name, e.what());
+                }
+            } else {
+                LLAMALEX_LOG(WARNING, "built without the %s backend; running all layers on the CPU", name);
+            }
+        }
+        const size_t cpu_layers = device ? n_layers - offload : n_layers;
+        if (cpu_layers > 0 || !device) backends_.emplace_back(new CpuBackend(layers_, 0, cpu_layers));
+        if (device) {
+            LLAMALEX_LOG(INFO, "Offloaded %zu of %zu layers to %s", offload, n_layers, backend_name(device->type()));
+            backends_.push_back(std::move(device));
+        }
+    }
+};
+
+/**
+ * LlamaLex - Main inference engine
+ *
+ * One session over a LlamaLexModel: the weights are shared, while the KV
+ * cache, scratch arena, prefix and embedding caches and the results of
+ * the *_view calls belong to this object. A LlamaLex may be used from one
+ * thread at a time; sessions over the same model are independent.
+ */
+class LlamaLex {
+public:
+    // Engine with its own random-init model (see LlamaLexModel::create)
+    LlamaLex(const LlamaLexConfig& config)
+        : LlamaLex(LlamaLexModel::create(config), config) {}
+    
+    /**
+     * Load pretrained weights from a GGUF model file.
+     *
+     * The file is memory-mapped and tensors are used in place, so startup
+     * does not depend on model size and processes loading the same file
+     * share its pages. Model shape comes from the file; the remaining
+     * settings come from `config`, with max_seq_length capped at the
+     * model's context length.
+     */
+    LlamaLex(const std::string& model_path, const LlamaLexConfig& config = LlamaLexConfig())
+        : LlamaLex(LlamaLexModel::load(model_path, config), config) {
+        // Warm-up step: time to first token includes faulting in the weights
+        // (near zero when another process already has them in page cache)
+        evaluate(std::vector<int>(1, tokenizer_->bos_id()));
+        reset_cache();
+        LLAMALEX_LOG(INFO, "LlamaLex loaded %zu layers in %.1f ms, time to first token %.1f ms",
+                     config_.num_layers, model_->load_ms(), model_->elapsed_ms());
+    }
+    
+    /**
+     * New session over a shared model. Shape, vocabulary, kernels and
+     * threads come from the model; per-session settings (max_seq_length,
+     * capped at the model's, KV paging, batch and window sizes, prefix and
+     * embedding caches) from `config`. Nothing is copied from the model.
+     */
+    LlamaLex(std::shared_ptr<const LlamaLexModel> model, const LlamaLexConfig& config)
+        : model_(std::move(model)),
+          config_(session_config(model_->config(), config)),
+          pool_(model_->pool()),
+          tokenizer_(model_->tokenizer()),
+          kv_pool_(config_.num_layers, config_.embedding_dim, config_.kv_page_size, config_.kv_max_pages),
+          kv_cache_(kv_pool_, config_.max_seq_length),
+          scratch_(scratch_bytes(config_, config_.max_batch_tokens)) {
+        if (!config_.cache_path.empty()) open_cache(config_.cache_path, config_.cache_bytes);
+        set_prefix_cache(config_.prefix_cache_bytes);
+    }
+    
+    // Session with the model's own settings
+    explicit LlamaLex(std::shared_ptr<const LlamaLexModel> model)
+        : LlamaLex(model, model->config()) {}
+    
+    ~LlamaLex() {
+        cleanup();
+    }
+    
+    /**
+     * Encode text into embeddings
+     */
+    std::vector<float> encode(const std::string& text) {
+        // Tokenize input
+        auto tokens = tokenizer_->tokenize(text);
+        
+        std::vector<float> embeddings(tokens.size() * config_.embedding_dim);
+        encode_tokens_cached(tokens, embeddings.data());
+        return embeddings;
+    }
+    
+    /**
+     * Encode text into a caller-provided buffer of `capacity` floats.
+     *
+     * Returns the number of floats the encoding needs (tokens x
+     * embedding_dim); the buffer is only written when that fits.
+     */
+    size_t encode(const std::string& text, float* out, size_t capacity) {
+        auto tokens = tokenizer_->tokenize(text);
+        const size_t required = tokens.size() * config_.embedding_dim;
+        if (out && required <= capacity) encode_tokens_cached(tokens, out);
+        return required;
+    }
+    
+    /**
+     * Encode many documents in packed batches.
+     *
+     * Writes all final hidden states contiguously to `out` and per-document
+     * token offsets to `offsets` (texts.size() + 1 entries; document d owns
+     * rows [offsets[d], offsets[d + 1])). Documents are packed without
+     * padding into batches of up to max_batch_tokens tokens, so every layer
+     * runs as a GEMM over the whole batch.
+     */
+    void encode_batch(const std::vector<std::string>& texts, std::vector<float>& out,
+                      std::vector<size_t>& offsets) {
+        std::vector<std::vector<int>> docs;
+        offsets.assign(1, 0);
+        tokenize_batch(texts, docs, offsets);
+        out.resize(offsets.back() * config_.embedding_dim);
+        encode_batch_tokens(docs, offsets, out.data());
+    }
+    
+    /**
+     * Caller-buffer variant of encode_batch: offsets must hold
+     * texts.size() + 1 entries and is always filled; `out` is written only
+     * if `capacity` floats suffice. Returns the floats needed.
+     */
+    size_t encode_batch(const std::vector<std::string>& texts, float* out, size_t capacity,
+                        size_t* offsets) {
+        std::vector<std::vector<int>> docs;
+        std::vector<size_t> token_offsets(1, 0);
+        tokenize_batch(texts, docs, token_offsets);
+        std::copy(token_offsets.begin(), token_offsets.end(), offsets);
+        const size_t required = token_offsets.back() * config_.embedding_dim;
+        if (out && required <= capacity) encode_batch_tokens(docs, token_offsets, out);
+        return required;
+    }
+    
+    /**
+     * Encode text into an engine-owned buffer and return a view of it.
+     *
+     * The buffer is reused across calls (no allocation once it has grown)
+     * and stays valid until the next encode_view call on this engine. A
+     * hit in the embedding cache returns the mapped record itself, valid
+     * until the next encode call of any kind.
+     */
+    const float* encode_view(const std::string& text, size_t* out_size) {
+        auto tokens = tokenizer_->tokenize(text);
+        *out_size = tokens.size() * config_.embedding_dim;
+        if (const float* hit = cache_lookup(tokens)) return hit;
+        encode_output_.resize(*out_size);
+        encode_tokens(tokens, encode_output_.data());
+        if (cache_) cache_->insert(cache_key(tokens), cache_check(tokens), encode_output_.data(), *out_size);
+        return encode_output_.data();
+    }
+    
+    // Floats that encoding text will produce (tokens x embedding_dim)
+    size_t encode_size(const std::string& text) {
+        return tokenizer_->tokenize(text).size() * config_.embedding_dim;
+    }
+    
+    /**
+     * Encode text into one pooled embedding (see PoolingParams), written
+     * to out as pooled_bytes(params.type) bytes. Only the pooled vector
+     * leaves the engine, not the per-token hidden states.
+     */
+    void encode_pooled(const std::string& text, const PoolingParams& params, void* out) {
+        const size_t dim = config_.embedding_dim;
+        // Validate before running the model
+        if (params.mode > PoolingMode::MAX) throw std::invalid_argument("unknown pooling mode");
+        pooled_bytes(params.type);
+        const std::vector<int> tokens = tokenizer_->tokenize(text);
+        scratch_.reset();
+        float* hidden = scratch_.floats(tokens.size() * dim);
+        run_layers(tokens, hidden, scratch_);
+        float* pooled = scratch_.floats(dim);
+        pool_hidden(hidden, tokens.size(), dim, params, pooled);
+        quantize_row(params.type, pooled, out, dim);
+    }
+    
+    /**
+     * encode_pooled() for many documents, packed into batches as in
+     * encode_batch. Document d is written at out + d * pooled_bytes(type);
+     * hidden states only ever exist for one batch at a time.
+     */
+    void encode_batch_pooled(const std::vector<std::string>& texts, const PoolingParams& params,
+                             void* out) {
+        if (params.mode > PoolingMode::MAX) throw std::invalid_argument("unknown pooling mode");
+        pooled_bytes(params.type);
+        std::vector<std::vector<int>> docs;
+        std::vector<size_t> offsets(1, 0);
+        tokenize_batch(texts, docs, offsets);
+        encode_batch_tokens(docs, offsets, nullptr, &params, static_cast<uint8_t*>(out));
+    }
+    
+    // Bytes of one embedding stored as type (F32, F16 or Q8_0)
+    size_t pooled_bytes(TensorType type) const {
+        const size_t dim = config_.embedding_dim;
+        const bool supported = type == TensorType::F32 || type == TensorType::F16 || type == TensorType::Q8_0;
+        if (!supported || dim % type_block_size(type) != 0) {
+            throw std::invalid_argument(std::string("cannot store ") + std::to_string(dim) +
+                                        "-dim embeddings as " + type_name(type));
+        }
+        return dim / type_block_size(type) * type_block_bytes(type);
+    }
+    
+    /**
+     * Encode a document of any length as overlapping windows of
+     * chunk_tokens tokens, chunk_overlap of them shared with the next
+     * window. Each window runs on its own (positions from 0); its mean is
+     * a chunk embedding, and the document embedding averages every token
+     * once, taking overlapped tokens from the window where they sit
+     * further from the edge.
+     *
+     * Windows are spread across the thread pool when there are at least
+     * as many as threads (each thread owns its activations), otherwise
+     * encoded one after another with every thread on each. Memory is
+     * bounded by the window size and thread count, not the document
+     * length; results do not depend on the thread count.
+     */
+    DocumentEmbedding encode_document(const std::string& text) {
+        DocumentEmbedding result;
+        encode_document_tokens(tokenizer_->tokenize(text), result);
+        return result;
+    }
+    
+    /**
+     * encode_document() of tokenized text, into result (reusing its
+     * buffers). With span_of, token t also adds its final hidden state to
+     * span_sums[span_of[t]] ([n_spans x embedding_dim], zeroed by the
+     * caller), where spans are contiguous runs of tokens such as
+     * sentences; each token is added once, from the window that owns it.
+     */
+    void encode_document_tokens(const std::vector<int>& tokens, DocumentEmbedding& result,
+                                const uint32_t* span_of = nullptr, float* span_sums = nullptr) {
+        const size_t dim = config_.embedding_dim;
+        const size_t n = tokens.size();
+        const size_t window = std::max<size_t>(1, std::min(config_.chunk_tokens, config_.max_seq_length));
+        const size_t overlap = std::min(config_.chunk_overlap, window / 2);
+        const size_t stride = window - overlap;
+        const size_t n_windows = n <= window ? 1 : 1 + (n - window + stride - 1) / stride;
+        
+        result.n_tokens = n;
+        result.chunks.assign(n_windows * dim, 0.0f);
+        result.chunk_starts.resize(n_windows);
+        for (size_t w = 0; w < n_windows; ++w) result.chunk_starts[w] = w * stride;
+        // Window w owns the tokens from halfway into its leading overlap to
+        // halfway into its trailing one
+        auto owned_begin = [&](size_t w) { return w == 0 ? 0 : w * stride + overlap / 2; };
+        // Per-window sums of owned tokens; with spans, also each window's
+        // first and last owned span, which may continue in its neighbours
+        // and are added up afterwards
+        document_sums_.assign((span_of ? 3 : 1) * n_windows * dim, 0.0f);
+        float* owned = document_sums_.data();
+        float* edges = owned + n_windows * dim;
+        
+        auto encode_window = [&](WindowWorker& worker, size_t w) {
+            const size_t start = result.chunk_starts[w];
+            const size_t len = std::min(window, n - start);
+            worker.tokens.assign(tokens.begin() + start, tokens.begin() + start + len);
+            worker.scratch.reset();
+            float* hidden = worker.scratch.floats(len * dim);
+            run_layers(worker.tokens, hidden, worker.scratch);
+            
+            const size_t own_end = (w + 1 == n_windows ? n : owned_begin(w + 1)) - start;
+            float* chunk = &result.chunks[w * dim];
+            float* own = &owned[w * dim];
+            for (size_t t = 0; t < len; ++t) {
+                const float* h = hidden + t * dim;
+                for (size_t i = 0; i < dim; ++i) chunk[i] += h[i];
+                if (t >= owned_begin(w) - start && t < own_end) {
+                    for (size_t i = 0; i < dim; ++i) own[i] += h[i];
+                    if (span_of) {
+                        const uint32_t span = span_of[start + t];
+                        float* sum = span == span_of[owned_begin(w)] ? &edges[2 * w * dim]
+                                   : span == span_of[start + own_end - 1] ? &edges[(2 * w + 1) * dim]
+                                   : span_sums + span * dim;
+                        for (size_t i = 0; i < dim; ++i) sum[i] += h[i];
+                    }
+                }
+            }
+            const float inv = 1.0f / len;
+            for (size_t i = 0; i < dim; ++i) chunk[i] *= inv;
+        };
+        
+        const size_t n_threads = pool_->size();
+        const size_t n_workers = n_windows >= n_threads ? n_threads : 1;
+        const size_t bytes = scratch_bytes(config_, window) + window * dim * sizeof(float);
+        while (window_workers_.size() < n_workers) {
+            window_workers_.emplace_back(new WindowWorker(bytes));
+        }
+        if (n_workers == 1) {
+            for (size_t w = 0; w < n_windows; ++w) encode_window(*window_workers_[0], w);
+        } else {
+            // One slot per thread, each taking every n_workers-th window
+            pool_->parallel_for(n_workers, [&](size_t b, size_t e) {
+                for (size_t slot = b; slot < e; ++slot) {
+                    for (size_t w = slot; w < n_windows; w += n_workers) {
+                        encode_window(*window_workers_[slot], w);
+                    }
+                }
+            });
+        }
+        
+        // Reduce in window order, so the sum does not depend on threads
+        result.embedding.assign(dim, 0.0f);
+        for (size_t w = 0; w < n_windows; ++w) {
+            for (size_t i = 0; i < dim; ++i) result.embedding[i] += owned[w * dim + i];
+        }
+        for (size_t i = 0; i < dim; ++i) result.embedding[i] /= static_cast<float>(n);
+        if (span_of) {
+            for (size_t w = 0; w < n_windows; ++w) {
+                const uint32_t first = span_of[owned_begin(w)];
+                const uint32_t last = span_of[(w + 1 == n_windows ? n : owned_begin(w + 1)) - 1];
+                for (size_t i = 0; i < dim; ++i) span_sums[first * dim + i] += edges[2 * w * dim + i];
+                if (last == first) continue;
+                for (size_t i = 0; i < dim; ++i) span_sums[last * dim + i] += edges[(2 * w + 1) * dim + i];
+            }
+        }
+    }
+    
+    /**
+     * Keep encode() results in a persistent cache file of `bytes` bytes
+     * (see EmbeddingCache), replacing any open one. Entries are keyed by
+     * two independent hashes of the token ids and a fingerprint of the
+     * model (shape, norm and rope settings, every weight byte), so only the
+     * same tokens on the same model hit them. Throws if another engine
+     * holds the file.
+     */
+    void open_cache(const std::string& path, size_t bytes) {
+        cache_.reset();
+        cache_.reset(new EmbeddingCache(path, bytes));
+        model_identity_ = model_->identity();
+    }
+    
+    EmbeddingCache::Stats cache_stats() const {
+        return cache_ ? cache_->stats() : EmbeddingCache::Stats();
+    }
+    
+    /**
+     * Run tokens through the model, writing [n_tokens x embedding_dim]
+     * final hidden states to out
+     */
+    void encode_tokens(const std::vector<int>& tokens, float* out) {
+        scratch_.reset();
+        run_layers(tokens, out, scratch_);
+    }
+    
+    /**
+     * Generate text from prompt (greedy unless `sampling` says otherwise)
+     */
+    std::string generate(const std::string& prompt, size_t max_length = 100,
+                         const SamplingParams& sampling = SamplingParams()) {
+        LLAMALEX_LOG(DEBUG, "Generating up to %zu tokens from a %zu-byte prompt", max_length, prompt.size());
+        return generate_stream(prompt, max_length, sampling, TokenCallback());
+    }
+    
+    /**
+     * generate(), handing each piece of generated text to on_piece as soon
+     * as its token is sampled. The pieces concatenate to the returned text
+     * minus the (detokenized) prompt. on_piece returning false cancels:
+     * generation stops and the text so far is returned.
+     */
+    std::string generate_stream(const std::string& prompt, size_t max_length,
+                                const SamplingParams& sampling, const TokenCallback& on_piece) {
+        // Tokenize prompt, keeping its tail if it overflows the context
+        auto tokens = tokenizer_->tokenize(prompt, false);
+        if (tokens.size() > config_.max_seq_length) {
+            tokens.erase(tokens.begin(), tokens.end() - config_.max_seq_length);
+        }
+        
+        // Prefill (only the part not already in the KV cache), then decode
+        // one token per step against the cache
+        tokens.reserve(tokens.size() + max_length);
+        TextStream stream(*tokenizer_, tokens);
+        const std::vector<float>* logits = max_length > 0 ? &prefill(tokens) : nullptr;
+        std::vector<int> step(1);
+        Sampler sampler(sampling);
+        bool cancelled = false;
+        for (size_t i = 0; i < max_length; ++i) {
+            const int next_token = sampler.sample(logits->data(), logits->size(), tokens);
+            tokens.push_back(next_token);
+            const std::string& piece = stream.push(next_token);
+            if (on_piece && !piece.empty() && !on_piece(piece)) {
+                cancelled = true;
+                break;
+            }
+            
+            // Stop if we generate EOS or run out of context
+            if (next_token == tokenizer_->eos_id()) break;
+            if (i + 1 == max_length || kv_cache_.size() >= kv_cache_.capacity()) break;
+            step[0] = next_token;
+            logits = &evaluate(step);
+        }
+        
+        const std::string& rest = stream.flush();
+        if (on_piece && !cancelled && !rest.empty()) on_piece(rest);
+        return stream.text();
+    }
+    
+    /**
+     * Generate into an engine-owned string; valid until the next
+     * generate_view call on this engine
+     */
+    const std::string& generate_view(const std::string& prompt, size_t max_length,
+                                     const SamplingParams& sampling = SamplingParams()) {
+        generated_ = generate(prompt, max_length, sampling);
+        return generated_;
+    }
+    
+    // Result of the last generate_view call (empty before the first)
+    const std::string& last_generated() const { return generated_; }
+    
+    /**
+     * Bring the KV cache to hold exactly `tokens` and return next-token logits.
+     *
+     * The longest prefix shared with the cached sequence is reused (unless
+     * reuse_kv_cache is off), or a longer one kept by the prefix cache (see
+     * set_prefix_cache); only the remaining suffix is evaluated, and the
+     * prompt's pages are then offered to the prefix cache.
+     */
+    const std::vector<float>& prefill(const std::vector<int>& tokens) {
+        size_t reuse = config_.reuse_kv_cache ? kv_cache_.common_prefix(tokens) : 0;
+        if (prefix_cache_) {
+            size_t cached = 0;
+            const PagedKVCache* entry = prefix_cache_->find(tokens, &cached);
+            if (entry && cached > reuse) {
+                kv_cache_.share_prefix(*entry, cached);
+                reuse = cached;
+            }
+        }
+        // Always evaluate at least one token to produce logits
+        if (reuse == tokens.size() && reuse > 0) --reuse;
+        kv_cache_.truncate(reuse);
+        const std::vector<float>& logits = evaluate(std::vector<int>(tokens.begin() + reuse, tokens.end()));
+        if (prefix_cache_) prefix_cache_->insert(kv_cache_);
+        return logits;
+    }
+    
+    /**
+     * Append tokens to the KV cache and return logits for the last one.
+     * The logits live in an engine-owned buffer that the next evaluate /
+     * prefill / evaluate_batch call overwrites.
+     */
+    const std::vector<float>& evaluate(const std::vector<int>& tokens) {
+        PagedKVCache* cache = &kv_cache_;
+        return evaluate_sequences(&tokens, &cache, 1);
+    }
+    
+    /**
+     * One forward pass over several independent sequences, each continuing
+     * its own KV cache: tokens[i] is appended to caches[i]. All tokens go
+     * through the layers as one batch. Returns next-token logits for each
+     * sequence's last token, [tokens.size() x vocab_size], in the same
+     * engine-owned buffer as evaluate().
+     */
+    const std::vector<float>& evaluate_batch(const std::vector<std::vector<int>>& tokens,
+                                             const std::vector<PagedKVCache*>& caches) {
+        return evaluate_sequences(tokens.data(), caches.data(), tokens.size());
+    }
+    
+    /**
+     * Append tokens to `cache` and return logits for every one of them,
+     * [tokens.size() x vocab_size] (row i predicts the token after
+     * tokens[i]), in the same engine-owned buffer as evaluate(). Used to
+     * score several proposed tokens in one forward pass.
+     */
+    const std::vector<float>& evaluate_positions(const std::vector<int>& tokens, PagedKVCache& cache) {
+        PagedKVCache* caches = &cache;
+        return evaluate_sequences(&tokens, &caches, 1, true);
+    }
+    
+    // An empty KV cache on this engine's page pool (for evaluate_batch);
+    // the engine must outlive it
+    std::unique_ptr<PagedKVCache> new_cache() {
+        return std::unique_ptr<PagedKVCache>(new PagedKVCache(kv_pool_, config_.max_seq_length));
+    }
+    
+    const KVPagePool& kv_pool() const { return kv_pool_; }
+    
+    /**
+     * Keep the KV pages of prefilled prompts, up to `bytes`, so later
+     * prompts with the same opening (a fixed instruction block, a quoted
+     * statute) only prefill their suffix; see PrefixCache. Its pages come
+     * from the engine's page pool and count against kv_max_pages, and when
+     * the pool runs out entries are evicted before a step fails. bytes 0
+     * turns the cache off.
+     */
+    void set_prefix_cache(size_t bytes) {
+        prefix_cache_.reset();
+        if (bytes > 0) prefix_cache_.reset(new PrefixCache(kv_pool_, bytes, config_.max_seq_length));
+    }
+    
+    PrefixCache* prefix_cache() { return prefix_cache_.get(); }
+    
+    PrefixCache::Stats prefix_cache_stats() const {
+        return prefix_cache_ ? prefix_cache_->stats() : PrefixCache::Stats();
+    }
+    
+    // cache.reserve(n) for a cache on this engine's pool, evicting prefix
+    // cache entries while the pool is out of pages
+    void reserve_kv(PagedKVCache& cache, size_t n) {
+        for (;;) {
+            try {
+                cache.reserve(n);
+                return;
+            } catch (const std::length_error&) {
+                if (!kv_pool_.full() || !prefix_cache_ || !prefix_cache_->evict()) throw;
+            }
+        }
+    }
+    
+    /**
+     * Heap blocks the engine has requested for activations and KV pages
+     * since construction. Steady once the scratch arena has seen the
+     * largest step shape and the page pool covers the cached positions;
+     * decode then runs without allocating.
+     */
+    size_t heap_allocations() const {
+        return scratch_.allocations() + kv_pool_.allocations();
+    }
+    
+    const LlamaLexConfig& config() const { return config_; }
+    const LegalTokenizer& tokenizer() const { return *tokenizer_; }
+    
+    // The shared model, e.g. to open more sessions over it
+    const std::shared_ptr<const LlamaLexModel>& model() const { return model_; }
+    
+    /**
+     * Forget all cached positions
+     */
+    void reset_cache() {
+        kv_cache_.clear();
+    }
+    
+    /**
+     * Replace the tokenizer vocabulary (see LegalTokenizer::load) for this
+     * session; the model and its other sessions keep theirs. Token ids
+     * must fit the embedding table; cached positions are dropped since
+     * their ids no longer mean the same thing.
+     */
+    void load_vocab(const std::string& vocab_path, const std::string& merges_path = "") {
+        std::shared_ptr<LegalTokenizer> tokenizer = std::make_shared<LegalTokenizer>(
+            config_.vocab_size, config_.enable_case_law_mode, config_.enable_statute_mode);
+        tokenizer->load(vocab_path, merges_path);
+        set_tokenizer(tokenizer);
+    }
+    
+    size_t cached_tokens() const {
+        return kv_cache_.size();
+    }
+    
+    // Bytes of model weights (mapped or owned); "blk." selects the layers
+    size_t weight_bytes(const std::string& prefix = "") const {
+        return model_->weights().total_bytes(prefix);
+    }
+    
+    // Bytes this session holds on top of the shared weights: its KV pages
+    // (in use or free) and scratch arena
+    size_t session_bytes() const {
+        return kv_pool_.allocated_bytes() + scratch_.capacity();
+    }
+    
+    /**
+     * Write weights and model shape to a GGUF file (llama.cpp naming, each
+     * tensor in its current storage type)
+     */
+    void save(const std::string& path) const {
+        GGUFWriter writer;
+        writer.add_string("general.architecture", "llama");
+        writer.add_uint32("llama.context_length", static_cast<uint32_t>(config_.max_seq_length));
+        writer.add_uint32("llama.embedding_length", static_cast<uint32_t>(config_.embedding_dim));
+        writer.add_uint32("llama.block_count", static_cast<uint32_t>(config_.num_layers));
+        writer.add_uint32("llama.feed_forward_length", static_cast<uint32_t>(config_.ff_dim));
+        writer.add_uint32("llama.attention.head_count", static_cast<uint32_t>(config_.num_heads));
+        writer.add_float32("llama.attention.layer_norm_rms_epsilon", config_.rms_norm_eps);
+        writer.add_float32("llama.rope.freq_base", config_.rope_freq_base);
+        if (tokenizer_->has_vocab()) {
+            const LegalTokenizer::Vocab& vocab = tokenizer_->vocab();
+            writer.add_string("tokenizer.ggml.model", vocab.merges.empty() ? "llama" : "gpt2");
+            writer.add_string_array("tokenizer.ggml.tokens", vocab.pieces);
+            if (!vocab.scores.empty()) writer.add_float32_array("tokenizer.ggml.scores", vocab.scores);
+            if (!vocab.types.empty()) writer.add_int32_array("tokenizer.ggml.token_type", vocab.types);
+            if (!vocab.merges.empty()) writer.add_string_array("tokenizer.ggml.merges", vocab.merges);
+            writer.add_uint32("tokenizer.ggml.bos_token_id", static_cast<uint32_t>(tokenizer_->bos_id()));
+            writer.add_uint32("tokenizer.ggml.eos_token_id", static_cast<uint32_t>(tokenizer_->eos_id()));
+            writer.add_bool("tokenizer.ggml.add_space_prefix", vocab.add_space_prefix);
+        }
+        for (const auto& entry : model_->weights().tensors()) {
+            writer.add_tensor(entry.first, entry.second);
+        }
+        writer.write(path);
+    }
+    
+    /**
+     * Analyze a legal case in stages, sharing one tokenization and one
+     * encoding pass:
+     *
+     *   1. tokenize (with byte offsets), split sentences and extract
+     *      citations, case names, provisions and Acts, in parallel;
+     *   2. encode the case as encode_document does, summing each
+     *      sentence's hidden states in the same pass;
+     *   3. in parallel: look up the nearest precedents in
+     *      params.precedents, score the case against kCaseIssues, and pick
+     *      the sentences closest to the whole case as its summary.
+     *
+     * Parallel stages run on the engine's thread pool. Results go to
+     * `result`, whose buffers are reused from call to call.
+     */
+    void analyze_case(const std::string& case_text, CaseAnalysis& result,
+                      const CaseAnalysisParams& params = CaseAnalysisParams()) {
+        const size_t dim = config_.embedding_dim;
+        if (params.precedents && params.precedents->dim() != dim) {
+            throw std::invalid_argument("precedent index dimension does not match the model");
+        }
+        if (params.n_issues > 0 && issue_embeddings_.empty()) {
+            // Once per engine: the issue descriptions' normalized embeddings
+            for (size_t i = 0; i < kNumCaseIssues; ++i) {
+                const DocumentEmbedding issue = encode_document(kCaseIssues[i].description);
+                issue_embeddings_.insert(issue_embeddings_.end(), issue.embedding.begin(), issue.embedding.end());
+                l2_normalize(&issue_embeddings_[i * dim], dim);
+            }
+        }
+        CaseScratch& scratch = case_scratch_;
+        
+        // Stage 1: text passes
+        pool_->parallel_for(3, [&](size_t b, size_t e) {
+            for (size_t stage = b; stage < e; ++stage) {
+                if (stage == 0) tokenizer_->tokenize(case_text, scratch.tokens, true, &scratch.offsets);
+                if (stage == 1) split_sentences(case_text, scratch.sentences);
+                if (stage == 2) extract_entities(case_text, result.entities);
+            }
+        });
+        if (scratch.sentences.empty()) scratch.sentences.emplace_back(0, case_text.size());
+        
+        // Each token belongs to the sentence its text starts in (or the
+        // last one before it)
+        const size_t n_tokens = scratch.tokens.size();
+        const size_t n_sentences = scratch.sentences.size();
+        scratch.sentence_of.resize(n_tokens);
+        scratch.sentence_tokens.assign(n_sentences, 0);
+        for (size_t t = 0, s = 0; t < n_tokens; ++t) {
+            while (s + 1 < n_sentences && scratch.offsets[t] >= scratch.sentences[s + 1].first) ++s;
+            scratch.sentence_of[t] = static_cast<uint32_t>(s);
+            ++scratch.sentence_tokens[s];
+        }
+        
+        // Stage 2: one encoding pass
+        scratch.sentence_sums.assign(n_sentences * dim, 0.0f);
+        encode_document_tokens(scratch.tokens, result.document, scratch.sentence_of.data(),
+                               scratch.sentence_sums.data());
+        scratch.query.assign(result.document.embedding.begin(), result.document.embedding.end());
+        l2_normalize(scratch.query.data(), dim);
+        const float* query = scratch.query.data();
+        
+        // Stage 3: independent lookups on the case embedding
+        pool_->parallel_for(3, [&](size_t b, size_t e) {
+            for (size_t stage = b; stage < e; ++stage) {
+                if (stage == 0) find_precedents(query, params, result.precedents);
+                if (stage == 1) score_issues(query, params.n_issues, result.issues);
+                if (stage == 2) summarize(query, params.n_summary, result.summary);
+            }
+        });
+    }
+    
+    CaseAnalysis analyze_case(const std::string& case_text,
+                              const CaseAnalysisParams& params = CaseAnalysisParams()) {
+        CaseAnalysis result;
+        analyze_case(case_text, result, params);
+        return result;
+    }
+
+private:
+    std::shared_ptr<const LlamaLexModel> model_;  // weights, shared with other sessions
+    LlamaLexConfig config_;     // model shape plus this session's settings
+    ThreadPool* pool_;          // the model's
+    std::shared_ptr<const LegalTokenizer> tokenizer_;  // the model's, unless load_vocab() replaced it
+    KVPagePool kv_pool_;        // pages of kv_cache_ and every new_cache()
+    PagedKVCache kv_cache_;
+    std::unique_ptr<PrefixCache> prefix_cache_;  // see set_prefix_cache()
+    ScratchArena scratch_;      // activations of the current step
+    std::vector<float> logits_; // result of the last evaluate*()
+    
+    // Per-thread activations of encode_document windows
+    struct WindowWorker {
+        explicit WindowWorker(size_t bytes) : scratch(bytes) {}
+        ScratchArena scratch;
+        std::vector<int> tokens;
+    };
+    std::vector<std::unique_ptr<WindowWorker>> window_workers_;
+    std::vector<float> document_sums_;  // encode_document_tokens() reductions
+    
+    std::unique_ptr<EmbeddingCache> cache_;  // see open_cache()
+    uint64_t model_identity_ = 0;
+    
+    // analyze_case() buffers, kept between calls
+    struct CaseScratch {
+        std::vector<int> tokens;
+        std::vector<uint32_t> offsets;                      // byte of each token's word
+        std::vector<std::pair<size_t, size_t>> sentences;  // byte ranges
+        std::vector<uint32_t> sentence_of;                  // per token
+        std::vector<size_t> sentence_tokens;
+        std::vector<float> sentence_sums;                   // [n_sentences x embedding_dim]
+        std::vector<float> query;                           // normalized case embedding
+    };
+    CaseScratch case_scratch_;
+    std::vector<float> issue_embeddings_;  // [kNumCaseIssues x embedding_dim], normalized
+    
+    // Engine-owned results behind the *_view calls
+    std::vector<float> encode_output_;
+    std::string generated_;
+    
+    // analyze_case() stage 3: nearest precedents to the normalized case embedding
+    void find_precedents(const float* query, const CaseAnalysisParams& params,
+                         std::vector<EmbeddingIndex::Hit>& hits) const {
+        hits.clear();
+        if (!params.precedents || params.precedents->size() == 0 || params.n_precedents == 0) return;
+        hits.resize(params.n_precedents);
+        params.precedents->search(query, 1, params.n_precedents, hits.data());
+        while (!hits.empty() && hits.back().id < 0) hits.pop_back();
+    }
+    
+    // analyze_case() stage 3: the n best kCaseIssues by cosine similarity
+    void score_issues(const float* query, size_t n, std::vector<CaseAnalysis::Issue>& issues) const {
+        issues.clear();
+        if (n == 0) return;
+        const size_t dim = config_.embedding_dim;
+        for (size_t i = 0; i < kNumCaseIssues; ++i) {
+            CaseAnalysis::Issue issue = {i, dot(query, &issue_embeddings_[i * dim], dim)};
+            issues.push_back(issue);
+        }
+        n = std::min(n, issues.size());
+        std::partial_sort(issues.begin(), issues.begin() + n, issues.end(),
+                          [](const CaseAnalysis::Issue& a, const CaseAnalysis::Issue& b) { return a.score > b.score; });
+        issues.resize(n);
+    }
+    
+    // analyze_case() stage 3: extractive summary of the n sentences whose
+    // mean hidden state is closest to the whole case, in text order
+    void summarize(const float* query, size_t n, std::vector<CaseAnalysis::Sentence>& summary) {
+        summary.clear();
+        if (n == 0) return;
+        const size_t dim = config_.embedding_dim;
+        CaseScratch& scratch = case_scratch_;
+        for (size_t s = 0; s < scratch.sentences.size(); ++s) {
+            if (scratch.sentence_tokens[s] == 0) continue;
+            float* sum = &scratch.sentence_sums[s * dim];
+            l2_normalize(sum, dim);  // the mean's direction
+            const auto& range = scratch.sentences[s];
+            CaseAnalysis::Sentence sentence = {range.first, range.second - range.first, dot(query, sum, dim)};
+            summary.push_back(sentence);
+        }
+        n = std::min(n, summary.size());
+        std::partial_sort(summary.begin(), summary.begin() + n, summary.end(),
+                          [](const CaseAnalysis::Sentence& a, const CaseAnalysis::Sentence& b) {
+                              return a.score > b.score;
+                          });
+        summary.resize(n);
+        std::sort(summary.begin(), summary.end(),
+                  [](const CaseAnalysis::Sentence& a, const CaseAnalysis::Sentence& b) { return a.begin < b.begin; });
+    }
+    
+    void set_tokenizer(std::shared_ptr<const LegalTokenizer> tokenizer) {
+        model_->check_vocab(*tokenizer);
+        tokenizer_ = std::move(tokenizer);
+        reset_cache();
+        if (prefix_cache_) prefix_cache_->clear();
+        issue_embeddings_.clear();
+    }
+    
+    uint64_t cache_key(const std::vector<int>& tokens) const {
+        return fnv1a(tokens.data(), tokens.size() * sizeof(int), model_identity_);
+    }
+    
+    // Second key of tokens, independent of cache_key(), that a hit must match
+    uint64_t cache_check(const std::vector<int>& tokens) const {
+        return hash_words(tokens.data(), tokens.size() * sizeof(int), ~model_identity_);
+    }
+    
+    // Cached final hidden states of tokens, or nullptr
+    const float* cache_lookup(const std::vector<int>& tokens) {
+        return cache_ ? cache_->find(cache_key(tokens), cache_check(tokens),
+                                     tokens.size() * config_.embedding_dim)
+                      : nullptr;
+    }
+    
+    // encode_tokens() through the embedding cache, when one is open
+    void encode_tokens_cached(const std::vector<int>& tokens, float* out) {
+        const size_t n = tokens.size() * config_.embedding_dim;
+        if (const float* hit = cache_lookup(tokens)) {
+            std::memcpy(out, hit, n * sizeof(float));
+            return;
+        }
+        encode_tokens(tokens, out);
+        if (cache_) cache_->insert(cache_key(tokens), cache_check(tokens), out, n);
+    }
+    
+    void cleanup() {
+        // Free allocated memory
+    }
+    
+    void tokenize_batch(const std::vector<std::string>& texts, std::vector<std::vector<int>>& docs,
+                        std::vector<size_t>& offsets) {
+        docs.reserve(texts.size());
+        offsets.reserve(texts.size() + 1);
+        for (const auto& text : texts) {
+            docs.push_back(tokenizer_->tokenize(text));
+            offsets.push_back(offsets.back() + docs.back().size());
+        }
+    }
+    
+    // Runs packed documents through the model in batches of at most
+    // max_batch_tokens tokens (a longer document forms its own batch).
+    // Hidden states go to out, or with pooling, stay in scratch_ and only
+    // each document's pooled embedding is written to pooled.
+    void encode_batch_tokens(const std::vector<std::vector<int>>& docs,
+                             const std::vector<size_t>& offsets, float* out,
+                             const PoolingParams* pooling = nullptr, uint8_t* pooled = nullptr) {
+        const size_t dim = config_.embedding_dim;
+        size_t first = 0;
+        while (first < docs.size()) {
+            size_t last = first + 1;
+            while (last < docs.size() &&
+                   offsets[last + 1] - offsets[first] <= config_.max_batch_tokens) {
+                ++last;
+            }
+            
+            // Batch-local offsets and packed tokens
+            std::vector<size_t> batch_offsets(offsets.begin() + first, offsets.begin() + last + 1);
+            for (size_t& o : batch_offsets) o -= offsets[first];
+            std::vector<int> tokens;
+            tokens.reserve(batch_offsets.back());
+            for (size_t d = first; d < last; ++d) {
+                tokens.insert(tokens.end(), docs[d].begin(), docs[d].end());
+            }
+            
+            scratch_.reset();
+            float* hidden = pooling ? scratch_.floats(tokens.size() * dim) : out + offsets[first] * dim;
+            embed_tokens(tokens, hidden);
+            float* k = scratch_.floats(tokens.size() * dim);
+            float* v = scratch_.floats(tokens.size() * dim);
+            for (const auto& span : model_->backends()) {
+                span->forward_packed(hidden, batch_offsets, k, v, scratch_);
+            }
+            LLAMALEX_PROFILE_SCOPE(ProfileOp::NORM);
+            rms_norm(hidden, hidden, tokens.size(), dim, model_->output_norm().f32(), config_.rms_norm_eps);
+            if (pooling) {
+                const size_t bytes = pooled_bytes(pooling->type);
+                float* vec = scratch_.floats(dim);
+                for (size_t d = first; d < last; ++d) {
+                    pool_hidden(hidden + batch_offsets[d - first] * dim, docs[d].size(), dim, *pooling, vec);
+                    quantize_row(pooling->type, vec, pooled + d * bytes, dim);
+                }
+            }
+            first = last;
+        }
+    }
+    
+    // evaluate_batch() over n_seqs sequences, activations in scratch_; with
+    // all_positions, logits for every token rather than each sequence's last
+    const std::vector<float>& evaluate_sequences(const std::vector<int>* tokens,
+                                                 PagedKVCache* const* caches, size_t n_seqs,
+                                                 bool all_positions = false) {
+        const size_t dim = config_.embedding_dim;
+        scratch_.reset();
+        size_t* rows = scratch_.alloc<size_t>(n_seqs + 1);
+        rows[0] = 0;
+        for (size_t i = 0; i < n_seqs; ++i) {
+            if (tokens[i].empty()) throw std::invalid_argument("empty sequence in batch");
+            reserve_kv(*caches[i], tokens[i].size());
+            rows[i + 1] = rows[i] + tokens[i].size();
+        }
+        
+        float* hidden = scratch_.floats(rows[n_seqs] * dim);
+        for (size_t i = 0; i < n_seqs; ++i) embed_tokens(tokens[i], hidden + rows[i] * dim);
+        SequenceKV* seqs = scratch_.alloc<SequenceKV>(config_.num_layers * n_seqs);
+        for (size_t l = 0; l < config_.num_layers; ++l) {
+            for (size_t i = 0; i < n_seqs; ++i) {
+                SequenceKV seq = {rows[i], tokens[i].size(), caches[i]->size(),
+                                  caches[i]->keys(l), caches[i]->values(l)};
+                seqs[l * n_seqs + i] = seq;
+            }
+        }
+        for (const auto& span : model_->backends()) {
+            span->forward_sequences(hidden, rows[n_seqs], seqs + span->first() * n_seqs, n_seqs, scratch_);
+        }
+        for (size_t i = 0; i < n_seqs; ++i) caches[i]->append(tokens[i]);
+        
+        // Final norm and output projection of each sequence's last position
+        float* last = hidden;
+        size_t n_out = rows[n_seqs];
+        if (!all_positions) {
+            last = scratch_.floats(n_seqs * dim);
+            for (size_t i = 0; i < n_seqs; ++i) {
+                std::copy(hidden + (rows[i + 1] - 1) * dim, hidden + rows[i + 1] * dim, last + i * dim);
+            }
+            n_out = n_seqs;
+        }
+        LLAMALEX_PROFILE_SCOPE(ProfileOp::LM_HEAD);
+        rms_norm(last, last, n_out, dim, model_->output_norm().f32(), config_.rms_norm_eps);
+        logits_.resize(n_out * config_.vocab_size);
+        matmul(model_->output(), last, logits_.data(), n_out, pool_);
+        return logits_;
+    }
+    
+    // Session settings from `config`, everything the weights and vocabulary
+    // depend on from the model's config
+    static LlamaLexConfig session_config(const LlamaLexConfig& model, const LlamaLexConfig& config) {
+        LlamaLexConfig session = model;
+        session.max_seq_length = std::min(config.max_seq_length, model.max_seq_length);
+        session.reuse_kv_cache = config.reuse_kv_cache;
+        session.max_batch_tokens = config.max_batch_tokens;
+        session.chunk_tokens = config.chunk_tokens;
+        session.chunk_overlap = config.chunk_overlap;
+        session.kv_page_size = config.kv_page_size;
+        session.kv_max_pages = config.kv_max_pages;
+        session.prefix_cache_bytes = config.prefix_cache_bytes;
+        session.cache_path = config.cache_path;
+        session.cache_bytes = config.cache_bytes;
+        return session;
+    }
+    
+    // Scratch for one step of n_tokens tokens: the residual stream, its
+    // normed copy, and the larger of the attention (Q, K, V, context,
+    // output) and feed-forward (gate, up, output) temporaries
+    static size_t scratch_bytes(const LlamaLexConfig& config, size_t n_tokens) {
+        const size_t d = config.embedding_dim;
+        const size_t per_token = 3 * d + std::max(5 * d, 2 * config.ff_dim + d);
+        return n_tokens * per_token * sizeof(float) + (64 << 10);
+    }
+    
+    // Final hidden states of tokens run from position 0 with nothing cached,
+    // [n_tokens x embedding_dim] into out; temporaries come from arena
+    void run_layers(const std::vector<int>& tokens, float* out, ScratchArena& arena) {
+        embed_tokens(tokens, out);
+        
+        // K/V scratch is shared across layers since nothing is kept for
+        // later calls
+        const size_t n = tokens.size() * config_.embedding_dim;
+        float* k = arena.floats(n);
+        float* v = arena.floats(n);
+        for (const auto& span : model_->backends()) {
+            span->forward(out, tokens.size(), k, v, arena);
+        }
+        LLAMALEX_PROFILE_SCOPE(ProfileOp::NORM);
+        rms_norm(out, out, tokens.size(), config_.embedding_dim,
+                 model_->output_norm().f32(), config_.rms_norm_eps);
+    }
+    
+    // Gather embedding-table rows for tokens into out [n_tokens x embedding_dim]
+    void embed_tokens(const std::vector<int>& tokens, float* out) const {
+        LLAMALEX_PROFILE_SCOPE(ProfileOp::EMBED);
+        const size_t dim = config_.embedding_dim;
+        LLAMALEX_PROFILE_COUNT(0, tokens.size() * (model_->token_embd().row_bytes() + dim * sizeof(float)));
+        for (size_t i = 0; i < tokens.size(); ++i) {
+            const size_t id = static_cast<size_t>(tokens[i]);
+            if (id >= config_.vocab_size) throw std::out_of_range("token id out of range");
+            dequantize_row(model_->token_embd().type, model_->token_embd().row(id), out + i * dim, dim);
+        }
+    }
+};
+
+/**
+ * Scheduler - Continuous batching over one LlamaLex engine
+ *
+ * Requests from any thread are queued and served by a single loop thread.
+ * Each iteration admits waiting requests (up to max_active), runs all
+ * pending encodes as one packed batch, then advances every active
+ * generation by one step in a single evaluate_batch call: new requests
+ * contribute their prompt (prefill, chunked to max_batch_tokens), running
+ * ones their last token. Requests join and leave between iterations, each
+ * holding a paged KV cache while it runs; a new request starts from the
+ * longest prompt prefix another request has cached, sharing its pages.
+ *
+ * Every request samples with its own Sampler, so results match
+ * LlamaLex::generate with the same SamplingParams. The engine
+ * must not be used directly while a Scheduler is attached to it.
+ *
+ * Results come back as futures, through completion callbacks, or (C++20)
+ * by co_await on async_generate() / async_encode(). Submitting never
+ * waits on the model, so one service thread can keep hundreds of
+ * requests in flight while the loop thread and the engine's thread pool
+ * do the work.
+ */
+class Scheduler {
+public:
+    Scheduler(LlamaLex& model, size_t max_active = 64)
+        : model_(model), max_active_(std::max<size_t>(1, max_active)), stop_(false),
+          generated_tokens_(0), thread_(&Scheduler::run, this) {}
+    
+    // Finishes all submitted requests before returning
+    ~Scheduler() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        cv_.notify_one();
+        thread_.join();
+    }
+    
+    Scheduler(const Scheduler&) = delete;
+    Scheduler& operator=(const Scheduler&) = delete;
+    
+    /**
+     * Queue a generation. With on_piece, its text is also streamed as in
+     * LlamaLex::generate_stream; the callback runs on the scheduler thread
+     * between steps (keep it short), and returning false finishes the
+     * request early with the text so far.
+     */
+    std::future<std::string> submit_generate(const std::string& prompt, size_t max_length = 100,
+                                             const SamplingParams& sampling = SamplingParams(),
+                                             const TokenCallback& on_piece = TokenCallback()) {
+        std::unique_ptr<GenerateRequest> request(new GenerateRequest(sampling));
+        auto result = request->result.promise.get_future();
+        submit(std::move(request), prompt, max_length, on_piece);
+        return result;
+    }
+    
+    // Completion callbacks: the result, or a default value and the error
+    typedef std::function<void(std::string&& text, std::exception_ptr error)> GenerateDone;
+    typedef std::function<void(std::vector<float>&& embeddings, std::exception_ptr error)> EncodeDone;
+    
+    /**
+     * Queue a generation and pass its text (or error) to done instead of
+     * a future. done runs on the scheduler thread, or on the calling
+     * thread when the request finishes at once (empty prompt, max_length
+     * 0); keep it short, as with on_piece. An exception it throws is
+     * logged and dropped.
+     */
+    void submit_generate(const std::string& prompt, size_t max_length, const SamplingParams& sampling,
+                         const TokenCallback& on_piece, const GenerateDone& done) {
+        std::unique_ptr<GenerateRequest> request(new GenerateRequest(sampling));
+        request->result.done = done;
+        submit(std::move(request), prompt, max_length, on_piece);
+    }
+    
+    // Final hidden states [n_tokens x embedding_dim], as LlamaLex::encode
+    std::future<std::vector<float>> submit_encode(const std::string& text) {
+        std::unique_ptr<EncodeRequest> request(new EncodeRequest());
+        auto result = request->result.promise.get_future();
+        submit(std::move(request), text);
+        return result;
+    }
+    
+    // submit_encode with a completion callback (run as for submit_generate)
+    void submit_encode(const std::string& text, const EncodeDone& done) {
+        std::unique_ptr<EncodeRequest> request(new EncodeRequest());
+        request->result.done = done;
+        submit(std::move(request), text);
+    }
+
+#if defined(LLAMALEX_COROUTINES)
+    /**
+     * co_await result of async_generate() / async_encode(). The request is
+     * queued when awaited; the coroutine resumes on the scheduler thread
+     * when it finishes (hop to another executor for long continuations),
+     * or without suspending if it finished at once. A failed request
+     * rethrows its error from co_await.
+     */
+    template <typename T>
+    class Awaitable {
+    public:
+        bool await_ready() const noexcept { return false; }
+        
+        bool await_suspend(std::coroutine_handle<> handle) {
+            handle_ = handle;
+            submit_([this](T&& value, std::exception_ptr error) {
+                value_ = std::move(value);
+                error_ = error;
+                const std::coroutine_handle<> handle = handle_;
+                // Whichever of this and await_suspend finishes second resumes
+                if (finished_.exchange(true, std::memory_order_acq_rel)) handle.resume();
+            });
+            return !finished_.exchange(true, std::memory_order_acq_rel);
+        }
+        
+        T await_resume() {
+            if (error_) std::rethrow_exception(error_);
+            return std::move(value_);
+        }
+    
+    private:
+        friend class Scheduler;
+        typedef std::function<void(std::function<void(T&&, std::exception_ptr)>)> Submit;
+        
+        explicit Awaitable(Submit submit) : submit_(std::move(submit)) {}
+        
+        Submit submit_;
+        std::coroutine_handle<> handle_;
+        std::atomic<bool> finished_{false};
+        T value_;
+        std::exception_ptr error_;
+    };
+    
+    // co_await scheduler.async_generate(prompt) yields the generated text
+    Awaitable<std::string> async_generate(const std::string& prompt, size_t max_length = 100,
+                                          const SamplingParams& sampling = SamplingParams(),
+                                          const TokenCallback& on_piece = TokenCallback()) {
+        return Awaitable<std::string>([this, prompt, max_length, sampling, on_piece](GenerateDone done) {
+            submit_generate(prompt, max_length, sampling, on_piece, done);
+        });
+    }
+    
+    // co_await scheduler.async_encode(text) yields the hidden states
+    Awaitable<std::vector<float>> async_encode(const std::string& text) {
+        return Awaitable<std::vector<float>>([this, text](EncodeDone done) { submit_encode(text, done); });
+    }
+#endif
+    
+    struct Stats {
+        size_t generated_tokens;
+        double p50_token_ms;  // time between consecutive tokens of a request
+        double p99_token_ms;  // (the first token counts from submission)
+    };
+    
+    Stats stats() const {
+        std::lock_guard<std::mutex> lock(stats_mutex_);
+        Stats s = {generated_tokens_, percentile(0.50), percentile(0.99)};
+        return s;
+    }
+    
+    void reset_stats() {
+        std::lock_guard<std::mutex> lock(stats_mutex_);
+        generated_tokens_ = 0;
+        token_ms_.clear();
+    }
+
+private:
+    // A request's outcome: fulfils the promise, or calls done when set
+    template <typename T>
+    struct Result {
+        std::promise<T> promise;
+        std::function<void(T&&, std::exception_ptr)> done;
+        
+        void set_value(T value) {
+            if (!done) {
+                promise.set_value(std::move(value));
+                return;
+            }
+            call(std::move(value), nullptr);
+        }
+        
+        void set_exception(std::exception_ptr error) {
+            if (!done) {
+                promise.set_exception(error);
+                return;
+            }
+            call(T(), error);
+        }
+        
+        void call(T&& value, std::exception_ptr error) {
+            try {
+                done(std::move(value), error);
+            } catch (const std::exception& e) {
+                LLAMALEX_LOG(ERROR, "completion callback threw: %s", e.what());
+            } catch (...) {
+                LLAMALEX_LOG(ERROR, "completion callback threw");
+            }
+        }
+    };
+    
+    struct GenerateRequest {
+        explicit GenerateRequest(const SamplingParams& sampling) : sampler(sampling) {}
+        
+        std::vector<int> tokens;     // prompt, then generated tokens
+        size_t max_length;
+        size_t n_generated = 0;
+        size_t n_evaluated = 0;      // tokens already in the KV cache
+        bool done = false;
+        Sampler sampler;
+        TokenCallback on_piece;
+        std::unique_ptr<TextStream> stream;  // with on_piece
+        bool cancelled = false;
+        std::exception_ptr error;            // thrown by on_piece
+        std::unique_ptr<PagedKVCache> cache;
+        std::chrono::steady_clock::time_point last_token_at;
+        Result<std::string> result;
+    };
+    
+    struct EncodeRequest {
+        std::string text;
+        Result<std::vector<float>> result;
+    };
+    
+    LlamaLex& model_;
+    const size_t max_active_;
+    
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stop_;
+    std::vector<std::unique_ptr<GenerateRequest>> waiting_;
+    std::vector<std::unique_ptr<EncodeRequest>> encodes_;
+    
+    // Loop thread only (per-step buffers are kept to avoid reallocating)
+    std::vector<std::unique_ptr<GenerateRequest>> active_;
+    std::vector<std::vector<int>> batch_;
+    std::vector<PagedKVCache*> caches_;
+    std::vector<GenerateRequest*> stepped_;
+    std::vector<double> step_token_ms_;
+    
+    mutable std::mutex stats_mutex_;
+    size_t generated_tokens_;
+    std::vector<double> token_ms_;
+    
+    std::thread thread_;
+    
+    double percentile(double p) const {
+        if (token_ms_.empty()) return 0.0;
+        std::vector<double> sorted(token_ms_);
+        const size_t i = std::min(sorted.size() - 1, static_cast<size_t>(p * sorted.size()));
+        std::nth_element(sorted.begin(), sorted.begin() + i, sorted.end());
+        return sorted[i];
+    }
+    
+    void submit(std::unique_ptr<GenerateRequest> request, const std::string& prompt, size_t max_length,
+                const TokenCallback& on_piece) {
+        request->tokens = model_.tokenizer().tokenize(prompt, false);
+        const size_t context = model_.config().max_seq_length;
+        if (request->tokens.size() > context) {
+            request->tokens.erase(request->tokens.begin(), request->tokens.end() - context);
+        }
+        request->max_length = max_length;
+        if (on_piece) {
+            request->on_piece = on_piece;
+            request->stream.reset(new TextStream(model_.tokenizer(), request->tokens));
+        }
+        request->last_token_at = std::chrono::steady_clock::now();
+        if (request->tokens.empty()) {
+            request->result.set_exception(
+                std::make_exception_ptr(std::invalid_argument("empty prompt")));
+            return;
+        }
+        if (max_length == 0) {
+            request->result.set_value(model_.tokenizer().detokenize(request->tokens));
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            waiting_.push_back(std::move(request));
+        }
+        cv_.notify_one();
+    }
+    
+    void submit(std::unique_ptr<EncodeRequest> request, const std::string& text) {
+        request->text = text;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            encodes_.push_back(std::move(request));
+        }
+        cv_.notify_one();
+    }
+    
+    void run() {
+        for (;;) {
+            std::vector<std::unique_ptr<EncodeRequest>> encodes;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cv_.wait(lock, [this] {
+                    return stop_ || !waiting_.empty() || !encodes_.empty() || !active_.empty();
+                });
+                if (stop_ && waiting_.empty() && encodes_.empty() && active_.empty()) return;
+                encodes.swap(encodes_);
+                while (active_.size() < max_active_ && !waiting_.empty()) {
+                    active_.push_back(std::move(waiting_.front()));
+                    waiting_.erase(waiting_.begin());
+                }
+            }
+            if (!encodes.empty()) run_encodes(encodes);
+            if (!active_.empty()) step();
+        }
+    }
+    
+    void run_encodes(std::vector<std::unique_ptr<EncodeRequest>>& encodes) {
+        std::vector<std::string> texts;
+        for (auto& request : encodes) texts.push_back(request->text);
+        try {
+            std::vector<float> out;
+            std::vector<size_t> offsets;
+            model_.encode_batch(texts, out, offsets);
+            const size_t dim = model_.config().embedding_dim;
+            for (size_t d = 0; d < encodes.size(); ++d) {
+                encodes[d]->result.set_value(std::vector<float>(
+                    out.begin() + offsets[d] * dim, out.begin() + offsets[d + 1] * dim));
+            }
+        } catch (...) {
+            for (auto& request : encodes) request->result.set_exception(std::current_exception());
+        }
+    }
+    
+    // One batched forward pass over all active generations
+    void step() {
+        std::vector<std::vector<int>>& batch = batch_;
+        std::vector<PagedKVCache*>& caches = caches_;
+        std::vector<GenerateRequest*>& stepped = stepped_;
+        size_t n_batch = 0;
+        caches.clear();
+        stepped.clear();
+        size_t budget = model_.config().max_batch_tokens;
+        size_t keep = 0;
+        for (size_t i = 0; i < active_.size(); ++i) {
+            GenerateRequest& request = *active_[i];
+            if (!request.cache && !admit(request)) {
+                active_[keep++] = std::move(active_[i]);
+                continue;
+            }
+            // Pending prompt tokens (one token once prefilled); long prompts
+            // are split across iterations, but every request gets a token
+            const size_t pending = request.tokens.size() - request.n_evaluated;
+            const size_t n = std::max<size_t>(1, std::min(pending, budget));
+            try {
+                model_.reserve_kv(*request.cache, n);
+            } catch (...) {
+                // Out of KV pages (kv_max_pages): fail this request only
+                request.result.set_exception(std::current_exception());
+                continue;
+            }
+            budget -= std::min(budget, n);
+            auto first = request.tokens.begin() + request.n_evaluated;
+            if (batch.size() <= n_batch) batch.resize(n_batch + 1);
+            batch[n_batch++].assign(first, first + n);
+            caches.push_back(request.cache.get());
+            stepped.push_back(&request);
+            active_[keep++] = std::move(active_[i]);
+        }
+        active_.resize(keep);
+        if (n_batch == 0) return;
+        batch.resize(n_batch);
+        
+        const float* logits;
+        try {
+            logits = model_.evaluate_batch(batch, caches).data();
+        } catch (...) {
+            for (auto& request : active_) request->result.set_exception(std::current_exception());
+            active_.clear();
+            return;
+        }
+        
+        const auto now = std::chrono::steady_clock::now();
+        const size_t vocab = model_.config().vocab_size;
+        const int eos = model_.tokenizer().eos_id();
+        std::vector<double>& token_ms = step_token_ms_;
+        token_ms.clear();
+        for (size_t i = 0; i < stepped.size(); ++i) {
+            GenerateRequest& request = *stepped[i];
+            request.n_evaluated += batch[i].size();
+            if (request.n_evaluated < request.tokens.size()) continue;
+            if (request.n_generated == 0 && model_.prefix_cache()) model_.prefix_cache()->insert(*request.cache);
+            const int next = request.sampler.sample(logits + i * vocab, vocab, request.tokens);
+            request.tokens.push_back(next);
+            ++request.n_generated;
+            token_ms.push_back(std::chrono::duration<double, std::milli>(
+                now - request.last_token_at).count());
+            request.last_token_at = now;
+            request.done = next == eos || request.n_generated >= request.max_length ||
+                           request.cache->size() >= request.cache->capacity();
+            if (request.stream && !deliver(request, request.stream->push(next))) request.done = true;
+        }
+        
+        std::vector<std::unique_ptr<GenerateRequest>> finished;
+        keep = 0;
+        for (size_t i = 0; i < active_.size(); ++i) {
+            if (active_[i]->done) {
+                active_[i]->cache.reset();  // pages back to the pool
+                finished.push_back(std::move(active_[i]));
+            } else {
+                active_[keep++] = std::move(active_[i]);
+            }
+        }
+        active_.resize(keep);
+        
+        // Stats first, so they already cover a request when its future is ready
+        {
+            std::lock_guard<std::mutex> lock(stats_mutex_);
+            generated_tokens_ += token_ms.size();
+            token_ms_.insert(token_ms_.end(), token_ms.begin(), token_ms.end());
+        }
+        for (auto& request : finished) {
+            if (request->stream && !request->cancelled) deliver(*request, request->stream->flush());
+            if (request->error) {
+                request->result.set_exception(request->error);
+            } else {
+                request->result.set_value(model_.tokenizer().detokenize(request->tokens));
+            }
+        }
     }
     
-    ~LlamaLex() {
-        cleanup();
+    // Pass a piece to the request's callback; false once it cancels or throws
+    bool deliver(GenerateRequest& request, const std::string& piece) {
+        if (piece.empty()) return true;
+        try {
+            if (request.on_piece(piece)) return true;
+        } catch (...) {
+            request.error = std::current_exception();
+        }
+        request.cancelled = true;
+        return false;
     }
     
     /**
-     * Encode text into embeddings
+     * Give a newly admitted request its KV cache, sharing (copy-on-write)
+     * the longest prefix of its prompt already cached by another request
+     * or by the model's prefix cache.
+     * Returns false to hold the request back for an iteration when an
+     * earlier request is about to cache a longer shared prefix (e.g. a
+     * burst of prompts with the same preamble).
      */
-    std::vector<float> encode(const std::string& text) {
-        // Tokenize input
-        auto tokens = tokenizer_.tokenize(text);
-        
-        // Get embeddings
-        std::vector<float> embeddings;
-        for (int token_id : tokens) {
-            // Get token embedding (simplified)
-            auto token_emb = get_token_embedding(token_id);
-            embeddings.insert(embeddings.end(), token_emb.begin(), token_emb.end());
+    bool admit(GenerateRequest& request) {
+        const PagedKVCache* source = nullptr;
+        size_t cached = 0, upcoming = 0;
+        for (auto& other : active_) {
+            if (!other || !other->cache) continue;
+            const size_t n = other->cache->common_prefix(request.tokens);
+            if (n > cached) {
+                source = other->cache.get();
+                cached = n;
+            }
+            size_t shared = 0;
+            const size_t limit = std::min(request.tokens.size(), other->tokens.size());
+            while (shared < limit && request.tokens[shared] == other->tokens[shared]) ++shared;
+            upcoming = std::max(upcoming, shared);
+        }
+        if (PrefixCache* prefix_cache = model_.prefix_cache()) {
+            size_t n = 0;
+            const PagedKVCache* entry = prefix_cache->find(request.tokens, &n);
+            if (entry && n > cached) {
+                source = entry;
+                cached = n;
+            }
         }
+        if (upcoming >= cached + model_.kv_pool().page_size()) return false;
         
-        return embeddings;
+        request.cache = model_.new_cache();
+        // Keep at least one prompt token to evaluate, for its logits
+        cached = std::min(cached, request.tokens.size() - 1);
+        if (source && cached > 0) {
+            request.cache->share_prefix(*source, cached);
+            request.n_evaluated = cached;
+        }
+        return true;
+    }
+};
+
+/**
+ * SpeculativeDecoder - Generation with a small draft model
+ *
+ * Each round the draft proposes up to n_draft tokens one at a time, then
+ * the target scores the last accepted token and all proposals in a single
+ * evaluate_positions pass. Proposal x with draft probability q(x) is kept
+ * with probability min(1, p(x) / q(x)) under the target's p; the first
+ * rejection is replaced by a draw from max(0, p - q), and when every
+ * proposal is kept the target's last row yields one more token. The
+ * output thus follows the target's distribution for any draft (greedy
+ * output equals target.generate), while a draft that agrees often turns
+ * several decode steps into one target pass. The number of proposals per
+ * round adapts between 1 and n_draft to how many the target keeps, so a
+ * poorly matched draft costs little verification work.
+ *
+ * Both engines must share the tokenizer vocabulary. The decoder keeps its
+ * own KV caches on each engine's page pool, reusing the common prefix
+ * between calls; neither engine may be used elsewhere during generate.
+ */
+class SpeculativeDecoder {
+public:
+    SpeculativeDecoder(LlamaLex& target, LlamaLex& draft, size_t n_draft = 4)
+        : target_(target), draft_(draft), n_draft_(std::max<size_t>(1, n_draft)), draft_length_(n_draft_),
+          target_cache_(target.new_cache()), draft_cache_(draft.new_cache()) {
+        if (draft.config().vocab_size != target.config().vocab_size) {
+            throw std::invalid_argument("draft and target vocabularies differ");
+        }
+        batch_.resize(1);
+        caches_.resize(1);
+        reset_stats();
     }
     
+    SpeculativeDecoder(const SpeculativeDecoder&) = delete;
+    SpeculativeDecoder& operator=(const SpeculativeDecoder&) = delete;
+    
     /**
-     * Generate text from prompt
+     * Generate from prompt as target.generate would; sampled runs are
+     * reproducible per seed but draw a different random stream
      */
-    std::string generate(const std::string& prompt, size_t max_length = 100) {
-        std::cout << "Generating text from prompt..." << std::endl;
+    std::string generate(const std::string& prompt, size_t max_length = 100,
+                         const SamplingParams& sampling = SamplingParams()) {
+        const LegalTokenizer& tokenizer = target_.tokenizer();
+        const size_t context = target_cache_->capacity();
+        std::vector<int> tokens = tokenizer.tokenize(prompt, false);
+        if (tokens.size() > context) tokens.erase(tokens.begin(), tokens.end() - context);
+        if (tokens.empty() || max_length == 0) return tokenizer.detokenize(tokens);
         
-        // Tokenize prompt
-        auto tokens = tokenizer_.tokenize(prompt);
+        // Both caches hold every token but the last, which opens the next
+        // target pass (the draft may fall further behind and catch up)
+        tokens.reserve(tokens.size() + max_length + n_draft_);
+        sync(target_, *target_cache_, tokens);
+        sync(draft_, *draft_cache_, tokens);
         
-        // Generate tokens (simplified - random for now)
-        for (size_t i = 0; i < max_length; ++i) {
-            // In production, run forward pass and sample next token
-            int next_token = rand() % config_.vocab_size;
-            tokens.push_back(next_token);
+        Sampler target_sampler(sampling);
+        SamplingParams draft_sampling = sampling;
+        draft_sampling.seed = sampling.seed ^ 0x5851F42D4C957F2Dull;
+        Sampler draft_sampler(draft_sampling);
+        const size_t vocab = target_.config().vocab_size;
+        const int eos = tokenizer.eos_id();
+        
+        size_t generated = 0;
+        bool done = false;
+        while (!done) {
+            // Room for the proposals plus the target's own token, in both caches
+            const size_t base = tokens.size();
+            size_t k = std::min(draft_length_, std::min(max_length - generated - 1, context - base));
+            const size_t draft_room = draft_cache_->capacity() + 1;
+            k = std::min(k, draft_room > base ? draft_room - base : 0);
+            
+            draft_probs_.resize(k * vocab);
+            for (size_t i = 0; i < k; ++i) {
+                batch_[0].assign(tokens.begin() + draft_cache_->size(), tokens.end());
+                caches_[0] = draft_cache_.get();
+                const std::vector<float>& logits = draft_.evaluate_batch(batch_, caches_);
+                const std::vector<float>& q = draft_sampler.probabilities(logits.data(), vocab, tokens);
+                std::copy(q.begin(), q.end(), draft_probs_.begin() + i * vocab);
+                tokens.push_back(draft_sampler.draw(q.data(), vocab));
+            }
+            
+            verify_.assign(tokens.begin() + (base - 1), tokens.end());
+            const float* logits = target_.evaluate_positions(verify_, *target_cache_).data();
+            tokens.resize(base);
+            
+            // Accept proposals left to right; the first rejection is resampled
+            size_t accepted = 0;
+            int next = -1;
+            bool ended = false;
+            while (accepted < k) {
+                const std::vector<float>& p = target_sampler.probabilities(logits + accepted * vocab, vocab, tokens);
+                const float* q = &draft_probs_[accepted * vocab];
+                const int x = verify_[accepted + 1];
+                if (!(target_sampler.uniform() * q[x] < p[x])) {
+                    next = draw_residual(target_sampler, p.data(), q, vocab);
+                    break;
+                }
+                tokens.push_back(x);
+                ++accepted;
+                if (x == eos) {
+                    ended = true;
+                    break;
+                }
+            }
+            if (next < 0 && !ended) {
+                // Every proposal kept: the target's last row gives one more
+                const std::vector<float>& p = target_sampler.probabilities(logits + k * vocab, vocab, tokens);
+                next = target_sampler.draw(p.data(), vocab);
+            }
+            if (next >= 0) tokens.push_back(next);
+            
+            // Draft further after a fully kept round, less after an early miss
+            if (k > 0 && accepted == k) draft_length_ = std::min(n_draft_, draft_length_ + 1);
+            if (accepted < k / 2) draft_length_ = std::max<size_t>(1, draft_length_ - 1);
+            drafted_ += k;
+            accepted_ += accepted;
+            ++target_passes_;
+            generated += tokens.size() - base;
+            generated_tokens_ += tokens.size() - base;
             
-            // Stop if we generate EOS
-            if (next_token == 2) break;
+            target_cache_->truncate(tokens.size() - 1);
+            draft_cache_->truncate(std::min(draft_cache_->size(), tokens.size() - 1));
+            done = ended || next == eos || generated >= max_length || target_cache_->size() >= context;
         }
-        
-        // Detokenize
-        return tokenizer_.detokenize(tokens);
+        return tokenizer.detokenize(tokens);
     }
     
-    /**
-     * Analyze legal case
-     */
-    void analyze_case(const std::string& case_text) {
-        std::cout << "Analyzing legal case..." << std::endl;
-        
-        // Encode case
-        auto embeddings = encode(case_text);
+    struct Stats {
+        size_t drafted;           // tokens proposed by the draft
+        size_t accepted;          // proposals the target kept
+        size_t target_passes;     // target forward passes (one per round)
+        size_t generated_tokens;
         
-        std::cout << "Case encoded with " << embeddings.size() / config_.embedding_dim 
-                  << " tokens" << std::endl;
-        
-        // In production, perform legal-specific analysis
-        // - Extract entities
-        // - Identify legal issues
-        // - Find precedents
-        // - Generate summary
+        double acceptance_rate() const { return drafted ? static_cast<double>(accepted) / drafted : 0.0; }
+        double tokens_per_pass() const {
+            return target_passes ? static_cast<double>(generated_tokens) / target_passes : 0.0;
+        }
+    };
+    
+    Stats stats() const {
+        Stats s = {drafted_, accepted_, target_passes_, generated_tokens_};
+        return s;
+    }
+    
+    void reset_stats() {
+        drafted_ = accepted_ = target_passes_ = generated_tokens_ = 0;
     }
 
 private:
-    LlamaLexConfig config_;
-    LegalTokenizer tokenizer_;
+    LlamaLex& target_;
+    LlamaLex& draft_;
+    const size_t n_draft_;
+    size_t draft_length_;  // proposals per round, adapted up to n_draft_
+    std::unique_ptr<PagedKVCache> target_cache_;
+    std::unique_ptr<PagedKVCache> draft_cache_;
     
-    void init_model() {
-        // Initialize model weights and embeddings
-        // In production:
-        // - Allocate GGML context
-        // - Create embedding tensors
-        // - Initialize transformer layers
-        // - Load pretrained weights if available
-    }
+    // Per-round buffers, kept to avoid reallocating
+    std::vector<std::vector<int>> batch_;
+    std::vector<PagedKVCache*> caches_;
+    std::vector<float> draft_probs_;  // [k x vocab] draft distributions
+    std::vector<int> verify_;
+    std::vector<float> residual_;
     
-    void cleanup() {
-        // Free allocated memory
+    size_t drafted_;
+    size_t accepted_;
+    size_t target_passes_;
+    size_t generated_tokens_;
+    
+    // Bring cache to hold all of tokens but the last, reusing the common prefix
+    void sync(LlamaLex& model, PagedKVCache& cache, const std::vector<int>& tokens) {
+        const size_t reuse = model.config().reuse_kv_cache ? cache.common_prefix(tokens) : 0;
+        cache.truncate(std::min(reuse, tokens.size() - 1));
+        if (cache.size() + 1 == tokens.size()) return;
+        batch_[0].assign(tokens.begin() + cache.size(), tokens.end() - 1);
+        caches_[0] = &cache;
+        model.evaluate_batch(batch_, caches_);
     }
     
-    std::vector<float> get_token_embedding(int token_id) {
-        // Return embedding for token (simplified)
-        std::vector<float> emb(config_.embedding_dim);
-        for (size_t i = 0; i < config_.embedding_dim; ++i) {
-            emb[i] = 0.01f * (rand() / (float)RAND_MAX);
+    // Draw from max(0, p - q) normalized (p itself if that is empty)
+    int draw_residual(Sampler& sampler, const float* p, const float* q, size_t n) {
+        residual_.resize(n);
+        double mass = 0.0;
+        for (size_t i = 0; i < n; ++i) {
+            residual_[i] = std::max(0.0f, p[i] - q[i]);
+            mass += residual_[i];
         }
-        return emb;
+        if (mass <= 0.0) return sampler.draw(p, n);
+        const float inv = static_cast<float>(1.0 / mass);
+        for (size_t i = 0; i < n; ++i) residual_[i] *= inv;
+        return sampler.draw(residual_.data(), n);
     }
 };
 
+namespace {
+
+// Message of an exception_ptr, for C completion callbacks
+std::string error_message(std::exception_ptr error) {
+    try {
+        std::rethrow_exception(error);
+    } catch (const std::exception& e) {
+        return e.what();
+    } catch (...) {
+        return "unknown error";
+    }
+}
+
+// Config of the C ABI's random-init shapes: heads of about 64 dims,
+// reduced until they split embedding_dim into even widths (validated by
+// the model, so an unsplittable dim still fails there)
+LlamaLexConfig shape_config(size_t vocab_size, size_t embedding_dim, size_t num_layers) {
+    LlamaLexConfig config;
+    config.vocab_size = vocab_size;
+    config.embedding_dim = embedding_dim;
+    config.num_layers = num_layers;
+    config.num_heads = std::max<size_t>(1, embedding_dim / 64);
+    while (config.num_heads > 1 &&
+           (embedding_dim % config.num_heads != 0 || (embedding_dim / config.num_heads) % 2 != 0)) {
+        --config.num_heads;
+    }
+    config.ff_dim = 4 * embedding_dim;
+    return config;
+}
+
+// Copy text into out with snprintf semantics: at most capacity - 1
+// bytes plus a terminator; returns the full length
+size_t copy_text(const std::string& text, char* out, size_t capacity) {
+    if (out && capacity > 0) {
+        const size_t n = std::min(text.size(), capacity - 1);
+        std::memcpy(out, text.data(), n);
+        out[n] = '\0';
+    }
+    return text.size();
+}
+
+} // namespace
+
 /**
  * C interface for Python bindings
  */
 extern "C" {
-    // Create LlamaLex instance
+    // Create LlamaLex instance; returns nullptr if the shape is invalid
     void* llamalex_create(size_t vocab_size, size_t embedding_dim, size_t num_layers) {
+        try {
+            return new LlamaLex(shape_config(vocab_size, embedding_dim, num_layers));
+        } catch (const std::exception& e) {
+            LLAMALEX_LOG(ERROR, "%s", e.what());
+            return nullptr;
+        }
+    }
+    
+    // Load a pretrained model from a GGUF file (memory-mapped).
+    // max_seq_length == 0 uses the model's context length. Returns nullptr on failure.
+    void* llamalex_create_from_file(const char* path, size_t max_seq_length) {
         LlamaLexConfig config;
-        config.vocab_size = vocab_size;
-        config.embedding_dim = embedding_dim;
-        config.num_layers = num_layers;
-        
-        return new LlamaLex(config);
+        config.max_seq_length = max_seq_length > 0 ? max_seq_length : SIZE_MAX;
+        try {
+            return new LlamaLex(std::string(path), config);
+        } catch (const std::exception& e) {
+            LLAMALEX_LOG(ERROR, "%s", e.what());
+            return nullptr;
+        }
+    }
+    
+    // As llamalex_create / llamalex_create_from_file, with the last
+    // gpu_layers layers offloaded to backend (0 cpu, 1 cuda, 2 vulkan,
+    // 3 metal). When that backend is not built in or cannot start, every
+    // layer runs on the CPU; see llamalex_backend.
+    void* llamalex_create_offloaded(size_t vocab_size, size_t embedding_dim, size_t num_layers,
+                                    uint32_t backend, size_t gpu_layers) {
+        try {
+            LlamaLexConfig config = shape_config(vocab_size, embedding_dim, num_layers);
+            config.backend = static_cast<BackendType>(backend);
+            config.gpu_layers = gpu_layers;
+            return new LlamaLex(config);
+        } catch (const std::exception& e) {
+            LLAMALEX_LOG(ERROR, "%s", e.what());
+            return nullptr;
+        }
+    }
+    
+    void* llamalex_create_from_file_offloaded(const char* path, size_t max_seq_length,
+                                              uint32_t backend, size_t gpu_layers) {
+        LlamaLexConfig config;
+        config.max_seq_length = max_seq_length > 0 ? max_seq_length : SIZE_MAX;
+        config.backend = static_cast<BackendType>(backend);
+        config.gpu_layers = gpu_layers;
+        try {
+            return new LlamaLex(std::string(path), config);
+        } catch (const std::exception& e) {
+            LLAMALEX_LOG(ERROR, "%s", e.what());
+            return nullptr;
+        }
+    }
+    
+    // Backend the offloaded layers actually run on (0 cpu when nothing was
+    // offloaded) and how many layers that is
+    uint32_t llamalex_backend(void* handle, size_t* offloaded_layers) {
+        const LlamaLexModel& model = *static_cast<LlamaLex*>(handle)->model();
+        if (offloaded_layers) *offloaded_layers = model.offloaded_layers();
+        return static_cast<uint32_t>(model.backend());
+    }
+    
+    // Shared models: a model handle holds one reference to the weights and
+    // vocabulary; every session made from it holds another, so the model
+    // handle may be released while sessions are still in use.
+    
+    // Random-init model of the given shape (as llamalex_create), no
+    // session; returns nullptr if the shape is invalid
+    void* llamalex_model_create(size_t vocab_size, size_t embedding_dim, size_t num_layers) {
+        try {
+            return new std::shared_ptr<const LlamaLexModel>(
+                LlamaLexModel::create(shape_config(vocab_size, embedding_dim, num_layers)));
+        } catch (const std::exception& e) {
+            LLAMALEX_LOG(ERROR, "%s", e.what());
+            return nullptr;
+        }
+    }
+    
+    // Memory-mapped GGUF model (as llamalex_create_from_file), no session;
+    // returns nullptr on failure
+    void* llamalex_model_load(const char* path, size_t max_seq_length) {
+        LlamaLexConfig config;
+        config.max_seq_length = max_seq_length > 0 ? max_seq_length : SIZE_MAX;
+        try {
+            return new std::shared_ptr<const LlamaLexModel>(LlamaLexModel::load(path, config));
+        } catch (const std::exception& e) {
+            LLAMALEX_LOG(ERROR, "%s", e.what());
+            return nullptr;
+        }
+    }
+    
+    // New reference to the model behind an engine handle (release it too)
+    void* llamalex_model_of(void* handle) {
+        return new std::shared_ptr<const LlamaLexModel>(static_cast<LlamaLex*>(handle)->model());
+    }
+    
+    void llamalex_model_release(void* model) {
+        delete static_cast<std::shared_ptr<const LlamaLexModel>*>(model);
+    }
+    
+    // New engine handle over a shared model: its own KV cache and scratch,
+    // no copy of the weights. Use it like any llamalex_create handle and
+    // free it with llamalex_destroy. Returns nullptr on failure.
+    void* llamalex_session_create(void* model) {
+        try {
+            return new LlamaLex(*static_cast<std::shared_ptr<const LlamaLexModel>*>(model));
+        } catch (const std::exception& e) {
+            LLAMALEX_LOG(ERROR, "%s", e.what());
+            return nullptr;
+        }
+    }
+    
+    // Write model weights to a GGUF file; returns 0 on success
+    int llamalex_save(void* handle, const char* path) {
+        try {
+            static_cast<LlamaLex*>(handle)->save(path);
+            return 0;
+        } catch (const std::exception& e) {
+            LLAMALEX_LOG(ERROR, "%s", e.what());
+            return -1;
+        }
+    }
+    
+    // Load a tokenizer vocabulary for this handle only (merges_path may be
+    // null); returns 0 on success
+    int llamalex_load_vocab(void* handle, const char* vocab_path, const char* merges_path) {
+        try {
+            static_cast<LlamaLex*>(handle)->load_vocab(vocab_path, merges_path ? merges_path : "");
+            return 0;
+        } catch (const std::exception& e) {
+            LLAMALEX_LOG(ERROR, "%s", e.what());
+            return -1;
+        }
     }
     
     // Destroy instance
@@ -260,30 +7449,776 @@ extern "C" {
         delete static_cast<LlamaLex*>(handle);
     }
     
-    // Encode text
+    // Encode text (copy in a new buffer; release with llamalex_free_floats);
+    // nullptr on failure
     float* llamalex_encode(void* handle, const char* text, size_t* out_size) {
-        auto* model = static_cast<LlamaLex*>(handle);
-        auto embeddings = model->encode(text);
-        
-        *out_size = embeddings.size();
-        
-        // Allocate output buffer
-        float* output = new float[embeddings.size()];
-        std::memcpy(output, embeddings.data(), embeddings.size() * sizeof(float));
-        
-        return output;
+        *out_size = 0;
+        try {
+            auto* model = static_cast<LlamaLex*>(handle);
+            auto embeddings = model->encode(text);
+            
+            // Allocate output buffer
+            float* output = new float[embeddings.size()];
+            std::memcpy(output, embeddings.data(), embeddings.size() * sizeof(float));
+            *out_size = embeddings.size();
+            return output;
+        } catch (const std::exception& e) {
+            LLAMALEX_LOG(ERROR, "%s", e.what());
+            return nullptr;
+        }
+    }
+    
+    // Free a buffer returned by llamalex_encode
+    void llamalex_free_floats(float* data) {
+        delete[] data;
+    }
+    
+    // Number of floats llamalex_encode* will produce for text (size query;
+    // 0 on failure)
+    size_t llamalex_encode_size(void* handle, const char* text) {
+        try {
+            return static_cast<LlamaLex*>(handle)->encode_size(text);
+        } catch (const std::exception& e) {
+            LLAMALEX_LOG(ERROR, "%s", e.what());
+            return 0;
+        }
+    }
+    
+    // Encode text into a caller-allocated buffer of `capacity` floats.
+    // Returns the floats needed (tokens x embedding_dim); writes only if they
+    // fit. Returns 0 on failure.
+    size_t llamalex_encode_into(void* handle, const char* text, float* out, size_t capacity) {
+        try {
+            return static_cast<LlamaLex*>(handle)->encode(text, out, capacity);
+        } catch (const std::exception& e) {
+            LLAMALEX_LOG(ERROR, "%s", e.what());
+            return 0;
+        }
+    }
+    
+    // Encode n_texts documents in packed batches. offsets (n_texts + 1
+    // entries) receives per-document token offsets and is always filled;
+    // out [offsets[n_texts] x embedding_dim] is written only if capacity
+    // floats suffice. Returns the floats needed, or 0 on failure.
+    size_t llamalex_encode_batch(void* handle, const char* const* texts, size_t n_texts,
+                                 float* out, size_t capacity, size_t* offsets) {
+        try {
+            const std::vector<std::string> docs(texts, texts + n_texts);
+            return static_cast<LlamaLex*>(handle)->encode_batch(docs, out, capacity, offsets);
+        } catch (const std::exception& e) {
+            LLAMALEX_LOG(ERROR, "%s", e.what());
+            return 0;
+        }
+    }
+    
+    // Encode text without copying: returns a view of an engine-owned buffer
+    // (e.g. for numpy.ctypeslib.as_array), valid until the next
+    // llamalex_encode_view call on this handle; nullptr on failure
+    const float* llamalex_encode_view(void* handle, const char* text, size_t* out_size) {
+        *out_size = 0;
+        try {
+            return static_cast<LlamaLex*>(handle)->encode_view(text, out_size);
+        } catch (const std::exception& e) {
+            LLAMALEX_LOG(ERROR, "%s", e.what());
+            *out_size = 0;
+            return nullptr;
+        }
+    }
+    
+    // Bytes of one pooled embedding stored as type (GGML ids: 0 f32,
+    // 1 f16, 8 q8_0), or 0 if this model cannot store that type
+    size_t llamalex_pooled_size(void* handle, uint32_t type) {
+        try {
+            return static_cast<LlamaLex*>(handle)->pooled_bytes(static_cast<TensorType>(type));
+        } catch (const std::exception& e) {
+            LLAMALEX_LOG(ERROR, "%s", e.what());
+            return 0;
+        }
+    }
+    
+    // Encode text into one pooled embedding (mode: 0 mean, 1 first token,
+    // 2 last token, 3 max), L2-normalized if normalize != 0 and stored as
+    // type into out (llamalex_pooled_size bytes). Returns 0 on success.
+    int llamalex_encode_pooled(void* handle, const char* text, uint32_t mode, int normalize,
+                               uint32_t type, void* out) {
+        PoolingParams params;
+        params.mode = static_cast<PoolingMode>(mode);
+        params.normalize = normalize != 0;
+        params.type = static_cast<TensorType>(type);
+        try {
+            static_cast<LlamaLex*>(handle)->encode_pooled(text, params, out);
+            return 0;
+        } catch (const std::exception& e) {
+            LLAMALEX_LOG(ERROR, "%s", e.what());
+            return -1;
+        }
+    }
+    
+    // llamalex_encode_pooled for n_texts documents in packed batches;
+    // document d is written at out + d * llamalex_pooled_size(type).
+    // Returns 0 on success.
+    int llamalex_encode_batch_pooled(void* handle, const char* const* texts, size_t n_texts,
+                                     uint32_t mode, int normalize, uint32_t type, void* out) {
+        PoolingParams params;
+        params.mode = static_cast<PoolingMode>(mode);
+        params.normalize = normalize != 0;
+        params.type = static_cast<TensorType>(type);
+        try {
+            const std::vector<std::string> docs(texts, texts + n_texts);
+            static_cast<LlamaLex*>(handle)->encode_batch_pooled(docs, params, out);
+            return 0;
+        } catch (const std::exception& e) {
+            LLAMALEX_LOG(ERROR, "%s", e.what());
+            return -1;
+        }
+    }
+    
+    // Keep encode results in a persistent embedding cache file of bytes
+    // bytes (created if missing); returns 0 on success
+    int llamalex_open_cache(void* handle, const char* path, size_t bytes) {
+        try {
+            static_cast<LlamaLex*>(handle)->open_cache(path, bytes);
+            return 0;
+        } catch (const std::exception& e) {
+            LLAMALEX_LOG(ERROR, "%s", e.what());
+            return -1;
+        }
+    }
+    
+    // Embedding cache counters of this process (any pointer may be null);
+    // entries is the number of records in the file
+    void llamalex_cache_stats(void* handle, size_t* hits, size_t* misses, size_t* evictions,
+                              size_t* entries) {
+        const EmbeddingCache::Stats stats = static_cast<LlamaLex*>(handle)->cache_stats();
+        if (hits) *hits = stats.hits;
+        if (misses) *misses = stats.misses;
+        if (evictions) *evictions = stats.evictions;
+        if (entries) *entries = stats.entries;
+    }
+    
+    // Keep the KV pages of prefilled prompts (up to bytes; 0 turns it off)
+    // so prompts with a cached opening only prefill their suffix; returns
+    // 0 on success
+    int llamalex_set_prefix_cache(void* handle, size_t bytes) {
+        try {
+            static_cast<LlamaLex*>(handle)->set_prefix_cache(bytes);
+            return 0;
+        } catch (const std::exception& e) {
+            LLAMALEX_LOG(ERROR, "%s", e.what());
+            return -1;
+        }
+    }
+    
+    // Prefix cache counters (any pointer may be null); bytes is the page
+    // memory its entries hold
+    void llamalex_prefix_cache_stats(void* handle, size_t* hits, size_t* misses, size_t* evictions,
+                                     size_t* entries, size_t* bytes) {
+        const PrefixCache::Stats stats = static_cast<LlamaLex*>(handle)->prefix_cache_stats();
+        if (hits) *hits = stats.hits;
+        if (misses) *misses = stats.misses;
+        if (evictions) *evictions = stats.evictions;
+        if (entries) *entries = stats.entries;
+        if (bytes) *bytes = stats.bytes;
+    }
+    
+    // Encode a document of any length in overlapping windows (see
+    // LlamaLex::encode_document): the pooled [embedding_dim] vector goes to
+    // embedding, and the per-window means [n_chunks x embedding_dim] to
+    // chunks if capacity floats suffice (either may be null). Returns
+    // n_chunks, or 0 on failure.
+    size_t llamalex_encode_document(void* handle, const char* text, float* embedding,
+                                    float* chunks, size_t capacity) {
+        try {
+            const DocumentEmbedding document = static_cast<LlamaLex*>(handle)->encode_document(text);
+            if (embedding) std::copy(document.embedding.begin(), document.embedding.end(), embedding);
+            if (chunks && document.chunks.size() <= capacity) {
+                std::copy(document.chunks.begin(), document.chunks.end(), chunks);
+            }
+            return document.n_chunks();
+        } catch (const std::exception& e) {
+            LLAMALEX_LOG(ERROR, "%s", e.what());
+            return 0;
+        }
+    }
+    
+    // analyze_case results, in caller-owned arrays (see llamalex_analyze_case)
+    typedef struct {
+        uint32_t kind;    // 0 citation, 1 case name, 2 provision, 3 Act
+        uint32_t begin;   // byte range of the analyzed text
+        uint32_t length;
+    } llamalex_case_entity;
+    
+    typedef struct {
+        uint32_t issue;   // see llamalex_case_issue_name
+        float score;
+    } llamalex_case_issue;
+    
+    typedef struct {
+        uint32_t begin;
+        uint32_t length;
+        float score;
+    } llamalex_case_sentence;
+    
+    typedef struct {
+        // Filled in by llamalex_analyze_case
+        size_t n_tokens;
+        size_t n_chunks;
+        size_t n_entities;    // found (only entities_capacity are copied)
+        size_t n_issues;
+        size_t n_precedents;
+        size_t n_summary;
+        // Caller-owned outputs (any may be null with capacity 0); issue,
+        // precedent and summary capacities are also how many to compute
+        float* embedding;     // [embedding_dim]
+        size_t embedding_capacity;
+        llamalex_case_entity* entities;
+        size_t entities_capacity;
+        llamalex_case_issue* issues;
+        size_t issues_capacity;
+        int64_t* precedent_ids;
+        float* precedent_scores;
+        size_t precedents_capacity;
+        llamalex_case_sentence* summary;
+        size_t summary_capacity;
+    } llamalex_case_analysis;
+    
+    // Name of issue id (as in llamalex_case_issue), or null
+    const char* llamalex_case_issue_name(uint32_t issue) {
+        return issue < kNumCaseIssues ? kCaseIssues[issue].name : nullptr;
+    }
+    
+    // Analyze a case (see LlamaLex::analyze_case), with precedents from an
+    // index created by llamalex_index_create (may be null). Returns 0 on
+    // success, -1 on failure.
+    int llamalex_analyze_case(void* handle, const char* text, void* precedents, llamalex_case_analysis* out) {
+        try {
+            LlamaLex* model = static_cast<LlamaLex*>(handle);
+            const size_t dim = model->config().embedding_dim;
+            if (out->embedding && out->embedding_capacity < dim) {
+                throw std::invalid_argument("embedding_capacity " + std::to_string(out->embedding_capacity) +
+                                            " is below embedding_dim " + std::to_string(dim));
+            }
+            CaseAnalysisParams params;
+            params.precedents = static_cast<const EmbeddingIndex*>(precedents);
+            params.n_precedents = out->precedent_ids ? out->precedents_capacity : 0;
+            params.n_issues = out->issues ? out->issues_capacity : 0;
+            params.n_summary = out->summary ? out->summary_capacity : 0;
+            thread_local CaseAnalysis analysis;
+            model->analyze_case(text, analysis, params);
+            
+            out->n_tokens = analysis.document.n_tokens;
+            out->n_chunks = analysis.document.n_chunks();
+            if (out->embedding) {
+                std::copy(analysis.document.embedding.begin(), analysis.document.embedding.end(), out->embedding);
+            }
+            out->n_entities = analysis.entities.size();
+            for (size_t i = 0; out->entities && i < std::min(out->entities_capacity, analysis.entities.size()); ++i) {
+                const CaseAnalysis::Entity& e = analysis.entities[i];
+                llamalex_case_entity entity = {static_cast<uint32_t>(e.kind), static_cast<uint32_t>(e.begin),
+                                               static_cast<uint32_t>(e.length)};
+                out->entities[i] = entity;
+            }
+            out->n_issues = analysis.issues.size();
+            for (size_t i = 0; i < analysis.issues.size(); ++i) {
+                llamalex_case_issue issue = {static_cast<uint32_t>(analysis.issues[i].issue),
+                                             analysis.issues[i].score};
+                out->issues[i] = issue;
+            }
+            out->n_precedents = analysis.precedents.size();
+            for (size_t i = 0; i < analysis.precedents.size(); ++i) {
+                out->precedent_ids[i] = analysis.precedents[i].id;
+                if (out->precedent_scores) out->precedent_scores[i] = analysis.precedents[i].score;
+            }
+            out->n_summary = analysis.summary.size();
+            for (size_t i = 0; i < analysis.summary.size(); ++i) {
+                const CaseAnalysis::Sentence& s = analysis.summary[i];
+                llamalex_case_sentence sentence = {static_cast<uint32_t>(s.begin), static_cast<uint32_t>(s.length),
+                                                   s.score};
+                out->summary[i] = sentence;
+            }
+            return 0;
+        } catch (const std::exception& e) {
+            LLAMALEX_LOG(ERROR, "%s", e.what());
+            return -1;
+        }
+    }
+    
+    // Create an index of dim-dimensional vectors stored as type (0 f32,
+    // 1 f16, 8 q8_0), searched on n_threads threads (0: one per core).
+    // Returns nullptr on failure.
+    void* llamalex_index_create(size_t dim, uint32_t type, size_t n_threads) {
+        try {
+            return new EmbeddingIndex(dim, static_cast<TensorType>(type), n_threads);
+        } catch (const std::exception& e) {
+            LLAMALEX_LOG(ERROR, "%s", e.what());
+            return nullptr;
+        }
+    }
+    
+    // Append n vectors [n x dim] (ids continue from llamalex_index_size);
+    // returns 0 on success
+    int llamalex_index_add(void* index, const float* vectors, size_t n) {
+        try {
+            static_cast<EmbeddingIndex*>(index)->add(vectors, n);
+            return 0;
+        } catch (const std::exception& e) {
+            LLAMALEX_LOG(ERROR, "%s", e.what());
+            return -1;
+        }
+    }
+    
+    // Append n vectors already stored as the index type, e.g. the output of
+    // llamalex_encode_batch_pooled; returns 0 on success
+    int llamalex_index_add_encoded(void* index, const void* rows, size_t n) {
+        try {
+            static_cast<EmbeddingIndex*>(index)->add_encoded(rows, n);
+            return 0;
+        } catch (const std::exception& e) {
+            LLAMALEX_LOG(ERROR, "%s", e.what());
+            return -1;
+        }
+    }
+    
+    // Cluster into n_lists inverted lists for approximate search (see
+    // EmbeddingIndex::build_ivf); returns 0 on success
+    int llamalex_index_build_ivf(void* index, size_t n_lists, size_t n_iterations) {
+        try {
+            static_cast<EmbeddingIndex*>(index)->build_ivf(n_lists, n_iterations);
+            return 0;
+        } catch (const std::exception& e) {
+            LLAMALEX_LOG(ERROR, "%s", e.what());
+            return -1;
+        }
+    }
+    
+    // Inverted lists scanned per query after llamalex_index_build_ivf
+    void llamalex_index_set_probes(void* index, size_t n_probe) {
+        static_cast<EmbeddingIndex*>(index)->set_probes(n_probe);
+    }
+    
+    size_t llamalex_index_size(void* index) {
+        return static_cast<EmbeddingIndex*>(index)->size();
+    }
+    
+    // k best inner-product matches of each of n_queries queries
+    // [n_queries x dim], best first: ids and scores are [n_queries x k],
+    // id -1 where fewer were found. Returns 0 on success.
+    int llamalex_index_search(void* index, const float* queries, size_t n_queries, size_t k,
+                              int64_t* ids, float* scores) {
+        try {
+            std::vector<EmbeddingIndex::Hit> hits(n_queries * k);
+            static_cast<EmbeddingIndex*>(index)->search(queries, n_queries, k, hits.data());
+            for (size_t i = 0; i < hits.size(); ++i) {
+                ids[i] = hits[i].id;
+                scores[i] = hits[i].score;
+            }
+            return 0;
+        } catch (const std::exception& e) {
+            LLAMALEX_LOG(ERROR, "%s", e.what());
+            return -1;
+        }
+    }
+    
+    void llamalex_index_destroy(void* index) {
+        delete static_cast<EmbeddingIndex*>(index);
     }
     
     // Generate text
     char* llamalex_generate(void* handle, const char* prompt, size_t max_length) {
-        auto* model = static_cast<LlamaLex*>(handle);
-        auto generated = model->generate(prompt, max_length);
-        
-        // Allocate output buffer
-        char* output = new char[generated.size() + 1];
-        std::strcpy(output, generated.c_str());
-        
-        return output;
+        try {
+            auto* model = static_cast<LlamaLex*>(handle);
+            auto generated = model->generate(prompt, max_length);
+            
+            // Allocate output buffer
+            char* output = new char[generated.size() + 1];
+            std::strcpy(output, generated.c_str());
+            
+            return output;
+        } catch (const std::exception& e) {
+            LLAMALEX_LOG(ERROR, "%s", e.what());
+            return nullptr;
+        }
+    }
+    
+    // Generate text into a caller-allocated buffer (snprintf semantics):
+    // writes at most capacity - 1 bytes plus a terminator and returns
+    // the full length of the generated text (0 on failure). When that is
+    // capacity or more, fetch the whole text with llamalex_last_generated
+    // rather than generating again, which could sample different text.
+    size_t llamalex_generate_into(void* handle, const char* prompt, size_t max_length,
+                                  char* out, size_t capacity) {
+        try {
+            return copy_text(static_cast<LlamaLex*>(handle)->generate_view(prompt, max_length), out, capacity);
+        } catch (const std::exception& e) {
+            LLAMALEX_LOG(ERROR, "%s", e.what());
+            copy_text(std::string(), out, capacity);
+            return 0;
+        }
+    }
+    
+    // Text of the last llamalex_generate_into / llamalex_generate_view call
+    // on this handle, copied as llamalex_generate_into does
+    size_t llamalex_last_generated(void* handle, char* out, size_t capacity) {
+        return copy_text(static_cast<LlamaLex*>(handle)->last_generated(), out, capacity);
+    }
+    
+    // Generate text without copying: returns an engine-owned NUL-terminated
+    // string, valid until the next generate call on this handle; nullptr on
+    // failure
+    const char* llamalex_generate_view(void* handle, const char* prompt, size_t max_length,
+                                       size_t* out_len) {
+        try {
+            const std::string& generated = static_cast<LlamaLex*>(handle)->generate_view(prompt, max_length);
+            if (out_len) *out_len = generated.size();
+            return generated.c_str();
+        } catch (const std::exception& e) {
+            LLAMALEX_LOG(ERROR, "%s", e.what());
+            if (out_len) *out_len = 0;
+            return nullptr;
+        }
+    }
+    
+    // Generate with sampling (release with llamalex_free_string): temperature
+    // 0 is greedy; top_k 0, top_p 1 and repetition_penalty 1 turn those off;
+    // the same seed reproduces the same text. Returns nullptr on failure.
+    char* llamalex_generate_sampled(void* handle, const char* prompt, size_t max_length,
+                                    float temperature, size_t top_k, float top_p,
+                                    float repetition_penalty, uint64_t seed) {
+        SamplingParams sampling;
+        sampling.temperature = temperature;
+        sampling.top_k = top_k;
+        sampling.top_p = top_p;
+        sampling.repetition_penalty = repetition_penalty;
+        sampling.seed = seed;
+        try {
+            auto generated = static_cast<LlamaLex*>(handle)->generate(prompt, max_length, sampling);
+            char* output = new char[generated.size() + 1];
+            std::strcpy(output, generated.c_str());
+            return output;
+        } catch (const std::exception& e) {
+            LLAMALEX_LOG(ERROR, "%s", e.what());
+            return nullptr;
+        }
+    }
+    
+    // Streaming callback: receives each piece of generated text (`length`
+    // bytes, NUL-terminated) as soon as its token is sampled; return 0 to
+    // stop generating
+    typedef int (*llamalex_piece_callback)(const char* piece, size_t length, void* user_data);
+    
+    // llamalex_generate_sampled, streaming the generated text to callback
+    // instead of returning it; returns 0 on success (also when cancelled)
+    int llamalex_generate_stream(void* handle, const char* prompt, size_t max_length,
+                                 float temperature, size_t top_k, float top_p,
+                                 float repetition_penalty, uint64_t seed,
+                                 llamalex_piece_callback callback, void* user_data) {
+        SamplingParams sampling;
+        sampling.temperature = temperature;
+        sampling.top_k = top_k;
+        sampling.top_p = top_p;
+        sampling.repetition_penalty = repetition_penalty;
+        sampling.seed = seed;
+        try {
+            static_cast<LlamaLex*>(handle)->generate_stream(prompt, max_length, sampling,
+                [&](const std::string& piece) {
+                    return callback(piece.c_str(), piece.size(), user_data) != 0;
+                });
+            return 0;
+        } catch (const std::exception& e) {
+            LLAMALEX_LOG(ERROR, "%s", e.what());
+            return -1;
+        }
+    }
+    
+    // Drop the cached prompt/generation state
+    void llamalex_reset_cache(void* handle) {
+        static_cast<LlamaLex*>(handle)->reset_cache();
+    }
+    
+    // Number of positions currently held in the KV cache
+    size_t llamalex_cached_tokens(void* handle) {
+        return static_cast<LlamaLex*>(handle)->cached_tokens();
+    }
+    
+    // Attach a continuous-batching scheduler serving up to max_active
+    // concurrent generations; the engine handle must not be used directly
+    // until llamalex_scheduler_destroy. Returns nullptr on failure.
+    void* llamalex_scheduler_create(void* handle, size_t max_active) {
+        try {
+            return new Scheduler(*static_cast<LlamaLex*>(handle), max_active);
+        } catch (const std::exception& e) {
+            LLAMALEX_LOG(ERROR, "%s", e.what());
+            return nullptr;
+        }
+    }
+    
+    // llamalex_generate_sampled through the scheduler (safe to call from many
+    // threads; blocks until this request finishes). Release with
+    // llamalex_free_string; returns nullptr on failure.
+    char* llamalex_scheduler_generate_sampled(void* scheduler, const char* prompt, size_t max_length,
+                                              float temperature, size_t top_k, float top_p,
+                                              float repetition_penalty, uint64_t seed) {
+        SamplingParams sampling;
+        sampling.temperature = temperature;
+        sampling.top_k = top_k;
+        sampling.top_p = top_p;
+        sampling.repetition_penalty = repetition_penalty;
+        sampling.seed = seed;
+        try {
+            auto generated = static_cast<Scheduler*>(scheduler)->submit_generate(prompt, max_length, sampling).get();
+            char* output = new char[generated.size() + 1];
+            std::strcpy(output, generated.c_str());
+            return output;
+        } catch (const std::exception& e) {
+            LLAMALEX_LOG(ERROR, "%s", e.what());
+            return nullptr;
+        }
+    }
+    
+    // llamalex_generate_stream through the scheduler; the callback runs on
+    // the scheduler thread. Blocks until this request finishes.
+    int llamalex_scheduler_generate_stream(void* scheduler, const char* prompt, size_t max_length,
+                                           float temperature, size_t top_k, float top_p,
+                                           float repetition_penalty, uint64_t seed,
+                                           llamalex_piece_callback callback, void* user_data) {
+        SamplingParams sampling;
+        sampling.temperature = temperature;
+        sampling.top_k = top_k;
+        sampling.top_p = top_p;
+        sampling.repetition_penalty = repetition_penalty;
+        sampling.seed = seed;
+        try {
+            static_cast<Scheduler*>(scheduler)->submit_generate(prompt, max_length, sampling,
+                [&](const std::string& piece) {
+                    return callback(piece.c_str(), piece.size(), user_data) != 0;
+                }).get();
+            return 0;
+        } catch (const std::exception& e) {
+            LLAMALEX_LOG(ERROR, "%s", e.what());
+            return -1;
+        }
+    }
+    
+    // Greedy llamalex_scheduler_generate_sampled
+    char* llamalex_scheduler_generate(void* scheduler, const char* prompt, size_t max_length) {
+        return llamalex_scheduler_generate_sampled(scheduler, prompt, max_length, 0.0f, 0, 1.0f, 1.0f, 0);
+    }
+    
+    // Encode through the scheduler, batched with other concurrent encodes.
+    // Release with llamalex_free_floats; returns nullptr (and *out_size 0)
+    // on failure.
+    float* llamalex_scheduler_encode(void* scheduler, const char* text, size_t* out_size) {
+        *out_size = 0;
+        try {
+            auto embeddings = static_cast<Scheduler*>(scheduler)->submit_encode(text).get();
+            *out_size = embeddings.size();
+            float* output = new float[embeddings.size()];
+            std::memcpy(output, embeddings.data(), embeddings.size() * sizeof(float));
+            return output;
+        } catch (const std::exception& e) {
+            LLAMALEX_LOG(ERROR, "%s", e.what());
+            return nullptr;
+        }
+    }
+    
+    // Completion callbacks for the *_async calls: exactly one call per
+    // accepted request, on the scheduler thread. On failure the result is
+    // null and error holds the message; both are only valid during the call.
+    typedef void (*llamalex_generate_callback)(const char* text, const char* error, void* user_data);
+    typedef void (*llamalex_encode_callback)(const float* embeddings, size_t size, const char* error,
+                                             void* user_data);
+    
+    // llamalex_scheduler_generate_sampled without blocking: returns 0 once
+    // the request is queued and passes the text to done when it finishes
+    // (-1 and no callback if it cannot be queued). on_piece may be null.
+    int llamalex_scheduler_generate_async(void* scheduler, const char* prompt, size_t max_length,
+                                          float temperature, size_t top_k, float top_p,
+                                          float repetition_penalty, uint64_t seed,
+                                          llamalex_piece_callback on_piece,
+                                          llamalex_generate_callback done, void* user_data) {
+        SamplingParams sampling;
+        sampling.temperature = temperature;
+        sampling.top_k = top_k;
+        sampling.top_p = top_p;
+        sampling.repetition_penalty = repetition_penalty;
+        sampling.seed = seed;
+        TokenCallback pieces;
+        if (on_piece) {
+            pieces = [on_piece, user_data](const std::string& piece) {
+                return on_piece(piece.c_str(), piece.size(), user_data) != 0;
+            };
+        }
+        try {
+            static_cast<Scheduler*>(scheduler)->submit_generate(prompt, max_length, sampling, pieces,
+                [done, user_data](std::string&& text, std::exception_ptr error) {
+                    if (error) {
+                        done(nullptr, error_message(error).c_str(), user_data);
+                    } else {
+                        done(text.c_str(), nullptr, user_data);
+                    }
+                });
+            return 0;
+        } catch (const std::exception& e) {
+            LLAMALEX_LOG(ERROR, "%s", e.what());
+            return -1;
+        }
+    }
+    
+    // llamalex_scheduler_encode without blocking: done receives the hidden
+    // states (size floats). Returns 0 once queued.
+    int llamalex_scheduler_encode_async(void* scheduler, const char* text, llamalex_encode_callback done,
+                                        void* user_data) {
+        try {
+            static_cast<Scheduler*>(scheduler)->submit_encode(text,
+                [done, user_data](std::vector<float>&& embeddings, std::exception_ptr error) {
+                    if (error) {
+                        done(nullptr, 0, error_message(error).c_str(), user_data);
+                    } else {
+                        done(embeddings.data(), embeddings.size(), nullptr, user_data);
+                    }
+                });
+            return 0;
+        } catch (const std::exception& e) {
+            LLAMALEX_LOG(ERROR, "%s", e.what());
+            return -1;
+        }
+    }
+    
+    // Finish outstanding requests and detach the scheduler
+    void llamalex_scheduler_destroy(void* scheduler) {
+        delete static_cast<Scheduler*>(scheduler);
+    }
+    
+    // Pair a target engine with a smaller draft engine for speculative
+    // decoding (n_draft proposals per target pass). Neither handle may be
+    // used elsewhere until llamalex_speculative_destroy; returns nullptr if
+    // their vocabularies differ.
+    void* llamalex_speculative_create(void* target, void* draft, size_t n_draft) {
+        try {
+            return new SpeculativeDecoder(*static_cast<LlamaLex*>(target), *static_cast<LlamaLex*>(draft),
+                                          n_draft);
+        } catch (const std::exception& e) {
+            LLAMALEX_LOG(ERROR, "%s", e.what());
+            return nullptr;
+        }
+    }
+    
+    // llamalex_generate_sampled with speculative decoding (release with
+    // llamalex_free_string); returns nullptr on failure
+    char* llamalex_speculative_generate(void* decoder, const char* prompt, size_t max_length,
+                                        float temperature, size_t top_k, float top_p,
+                                        float repetition_penalty, uint64_t seed) {
+        SamplingParams sampling;
+        sampling.temperature = temperature;
+        sampling.top_k = top_k;
+        sampling.top_p = top_p;
+        sampling.repetition_penalty = repetition_penalty;
+        sampling.seed = seed;
+        try {
+            auto generated = static_cast<SpeculativeDecoder*>(decoder)->generate(prompt, max_length, sampling);
+            char* output = new char[generated.size() + 1];
+            std::strcpy(output, generated.c_str());
+            return output;
+        } catch (const std::exception& e) {
+            LLAMALEX_LOG(ERROR, "%s", e.what());
+            return nullptr;
+        }
+    }
+    
+    // Fraction of draft proposals the target has accepted
+    double llamalex_speculative_acceptance_rate(void* decoder) {
+        return static_cast<SpeculativeDecoder*>(decoder)->stats().acceptance_rate();
+    }
+    
+    void llamalex_speculative_destroy(void* decoder) {
+        delete static_cast<SpeculativeDecoder*>(decoder);
+    }
+    
+    // One op's profile totals, as returned by llamalex_profile_stats
+    typedef struct {
+        const char* op;        // "attention", "feed_forward", ... (static storage)
+        int32_t layer;         // -1 for ops outside the transformer layers
+        uint64_t calls;
+        uint64_t nanoseconds;  // wall time summed over calls and threads
+        uint64_t flops;
+        uint64_t bytes;        // estimated memory traffic
+    } llamalex_op_stats;
+    
+    // Copy up to capacity per-op totals into out (may be null) and return
+    // how many there are; always 0 unless built with -DLLAMALEX_PROFILE.
+    size_t llamalex_profile_stats(llamalex_op_stats* out, size_t capacity) {
+#if defined(LLAMALEX_PROFILE)
+        const std::vector<Profiler::Entry> entries = Profiler::instance().stats();
+        for (size_t i = 0; out && i < std::min(capacity, entries.size()); ++i) {
+            const Profiler::Entry& e = entries[i];
+            out[i].op = profile_op_name(e.op);
+            out[i].layer = e.layer;
+            out[i].calls = e.calls;
+            out[i].nanoseconds = e.ns;
+            out[i].flops = e.flops;
+            out[i].bytes = e.bytes;
+        }
+        return entries.size();
+#else
+        (void)out;
+        (void)capacity;
+        return 0;
+#endif
+    }
+    
+    // Zero the profile totals and drop any trace events
+    void llamalex_profile_reset() {
+#if defined(LLAMALEX_PROFILE)
+        Profiler::instance().reset();
+#endif
+    }
+    
+    // Record up to max_events op spans for llamalex_profile_write_trace
+    // (0 stops recording). Returns -1 if profiling is compiled out.
+    int llamalex_profile_start_trace(size_t max_events) {
+#if defined(LLAMALEX_PROFILE)
+        Profiler::instance().start_trace(max_events);
+        return 0;
+#else
+        (void)max_events;
+        return -1;
+#endif
+    }
+    
+    // Write the recorded spans as Chrome trace JSON (chrome://tracing,
+    // ui.perfetto.dev). Returns 0 on success, -1 on failure.
+    int llamalex_profile_write_trace(const char* path) {
+#if defined(LLAMALEX_PROFILE)
+        try {
+            Profiler::instance().write_trace(path);
+            return 0;
+        } catch (const std::exception& e) {
+            LLAMALEX_LOG(ERROR, "%s", e.what());
+            return -1;
+        }
+#else
+        (void)path;
+        return -1;
+#endif
+    }
+    
+    // Receives each enabled log message on the logger thread; level is a
+    // Python logging level (10 DEBUG, 20 INFO, 30 WARNING, 40 ERROR)
+    typedef void (*llamalex_log_callback)(int level, const char* message, void* user_data);
+    
+    // Drop messages below level (Python logging values; default 30, WARNING)
+    void llamalex_set_log_level(int level) {
+        Logger::instance().set_level(static_cast<LogLevel>(level));
+    }
+    
+    // Send log messages to callback instead of stderr (null restores stderr)
+    void llamalex_set_log_callback(llamalex_log_callback callback, void* user_data) {
+        Logger::instance().set_sink(callback, user_data);
+    }
+    
+    // Block until every queued log message has been delivered
+    void llamalex_log_flush() {
+        Logger::instance().flush();
     }
     
     // Free string buffer
@@ -294,11 +8229,13 @@ extern "C" {
 
 } // namespace llamalex
 
+#ifndef LLAMALEX_NO_MAIN
 /**
  * Example usage
  */
 int main() {
     using namespace llamalex;
+    Logger::instance().set_level(LogLevel::INFO);
     
     std::cout << "LlamaLex Legal Inference Engine" << std::endl;
     std::cout << "================================" << std::endl;
@@ -308,6 +8245,8 @@ int main() {
     config.vocab_size = 5000;
     config.embedding_dim = 256;
     config.num_layers = 4;
+    config.num_heads = 4;
+    config.ff_dim = 1024;
     config.use_legal_vocab = true;
     
     LlamaLex model(config);
@@ -327,9 +8266,23 @@ int main() {
     // Example 3: Analyze case
     std::string case_text = "In the matter of Smith v. Jones, the court considered whether "
                            "the defendant breached the contract by failing to deliver goods.";
-    model.analyze_case(case_text);
+    std::cout << "Analyzing legal case..." << std::endl;
+    const CaseAnalysis analysis = model.analyze_case(case_text);
+    std::cout << "Case encoded with " << analysis.document.n_tokens << " tokens in "
+              << analysis.document.n_chunks() << " chunks" << std::endl;
+    for (const auto& entity : analysis.entities) {
+        std::cout << "Entity (" << case_entity_kind_name(entity.kind) << "): "
+                  << case_text.substr(entity.begin, entity.length) << std::endl;
+    }
+    for (const auto& issue : analysis.issues) {
+        std::cout << "Issue " << kCaseIssues[issue.issue].name << " similarity " << issue.score << std::endl;
+    }
+    for (const auto& sentence : analysis.summary) {
+        std::cout << "Summary: " << case_text.substr(sentence.begin, sentence.length) << std::endl;
+    }
     
     std::cout << "\nLlamaLex example completed successfully!" << std::endl;
     
     return 0;
 }
+#endif // LLAMALEX_NO_MAIN
@@ -0,0 +1,82 @@
+/**
+ * llamalex_alloc_counter.h - Counts every heap allocation in the process
+ *
+ * Replaces the whole global operator new / delete family (plain, array,
+ * nothrow and, from C++17, aligned) so tools built on the engine can
+ * check how many heap allocations a piece of work makes. Include it in
+ * exactly one translation unit of a program (the bench and the tests);
+ * the engine's own aligned blocks are counted separately by
+ * LlamaLex::heap_allocations().
+ */
+
+#ifndef LLAMALEX_ALLOC_COUNTER_H
+#define LLAMALEX_ALLOC_COUNTER_H
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+static std::atomic<size_t> g_allocations(0);
+
+namespace llamalex_alloc {
+
+// Out of line, so the compiler never pairs an inlined free() with the
+// operator new that produced the pointer (-Wmismatched-new-delete)
+__attribute__((noinline)) inline void* allocate(size_t size, size_t alignment = 0) {
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (size == 0) size = 1;
+    void* ptr = nullptr;
+    if (alignment > sizeof(void*)) {
+        if (posix_memalign(&ptr, alignment, size) != 0) ptr = nullptr;
+    } else {
+        ptr = std::malloc(size);
+    }
+    return ptr;
+}
+
+__attribute__((noinline)) inline void release(void* ptr) { std::free(ptr); }
+
+} // namespace llamalex_alloc
+
+void* operator new(size_t size) {
+    if (void* ptr = llamalex_alloc::allocate(size)) return ptr;
+    throw std::bad_alloc();
+}
+void* operator new[](size_t size) {
+    if (void* ptr = llamalex_alloc::allocate(size)) return ptr;
+    throw std::bad_alloc();
+}
+void* operator new(size_t size, const std::nothrow_t&) noexcept { return llamalex_alloc::allocate(size); }
+void* operator new[](size_t size, const std::nothrow_t&) noexcept { return llamalex_alloc::allocate(size); }
+
+void operator delete(void* ptr) noexcept { llamalex_alloc::release(ptr); }
+void operator delete[](void* ptr) noexcept { llamalex_alloc::release(ptr); }
+void operator delete(void* ptr, size_t) noexcept { llamalex_alloc::release(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { llamalex_alloc::release(ptr); }
+void operator delete(void* ptr, const std::nothrow_t&) noexcept { llamalex_alloc::release(ptr); }
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept { llamalex_alloc::release(ptr); }
+
+#if defined(__cpp_aligned_new)
+void* operator new(size_t size, std::align_val_t align) {
+    if (void* ptr = llamalex_alloc::allocate(size, static_cast<size_t>(align))) return ptr;
+    throw std::bad_alloc();
+}
+void* operator new[](size_t size, std::align_val_t align) {
+    if (void* ptr = llamalex_alloc::allocate(size, static_cast<size_t>(align))) return ptr;
+    throw std::bad_alloc();
+}
+void* operator new(size_t size, std::align_val_t align, const std::nothrow_t&) noexcept {
+    return llamalex_alloc::allocate(size, static_cast<size_t>(align));
+}
+void* operator new[](size_t size, std::align_val_t align, const std::nothrow_t&) noexcept {
+    return llamalex_alloc::allocate(size, static_cast<size_t>(align));
+}
+void operator delete(void* ptr, std::align_val_t) noexcept { llamalex_alloc::release(ptr); }
+void operator delete[](void* ptr, std::align_val_t) noexcept { llamalex_alloc::release(ptr); }
+void operator delete(void* ptr, size_t, std::align_val_t) noexcept { llamalex_alloc::release(ptr); }
+void operator delete[](void* ptr, size_t, std::align_val_t) noexcept { llamalex_alloc::release(ptr); }
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { llamalex_alloc::release(ptr); }
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { llamalex_alloc::release(ptr); }
+#endif
+
+#endif // LLAMALEX_ALLOC_COUNTER_H
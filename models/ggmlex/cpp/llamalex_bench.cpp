@@ -0,0 +1,1234 @@
+/**
+ * llamalex_bench.cpp - Throughput benchmarks for the LlamaLex engine
+ *
+ * Builds the engine as part of this translation unit (without the demo
+ * main) and times its hot paths on synthetic inputs. The sweep bench
+ * also records its numbers as results that can be written as JSON or CSV
+ * for comparing builds.
+ *
+ * Building:
+ *   g++ -std=c++11 -O3 -march=native -pthread cpp/llamalex_bench.cpp -o llamalex_bench
+ *
+ * Usage:
+ *   llamalex_bench [--only NAME[,NAME...]] [--quick] [--json PATH] [--csv PATH] [--trace PATH]
+ *
+ * --only runs the named benches (see main), --quick shortens the sweep.
+ * Built with -DLLAMALEX_PROFILE, the profile bench breaks time down per
+ * op, and --trace writes its spans as a Chrome trace.
+ */
+
+#define LLAMALEX_NO_MAIN
+#include "llamalex.cpp"
+
+#include <chrono>
+#include <cstdio>
+#include <future>
+#include <random>
+#include <set>
+#include <sys/resource.h>
+
+// Every operator new in the process is counted (g_allocations), so
+// benchmarks can report heap allocations per token
+#include "llamalex_alloc_counter.h"
+
+namespace {
+
+using namespace llamalex;
+
+// Results are written here so the optimizer cannot drop the timed work
+volatile float g_sink;
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Peak resident set size of the process so far
+double peak_rss_mb() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss / 1024.0;  // kilobytes on Linux
+}
+
+// One measured number, as written to the JSON/CSV output
+struct Result {
+    std::string bench;
+    std::string config;
+    size_t threads;
+    size_t seq_len;
+    std::string metric;
+    double value;
+};
+
+std::vector<Result> g_results;
+
+void record(const char* bench, const std::string& config, size_t threads, size_t seq_len,
+            const char* metric, double value) {
+    Result r = {bench, config, threads, seq_len, metric, value};
+    g_results.push_back(r);
+}
+
+bool write_json(const std::string& path) {
+    FILE* f = std::fopen(path.c_str(), "w");
+    if (!f) return false;
+    std::fprintf(f, "{\n  \"hardware_threads\": %u,\n  \"peak_rss_mb\": %.1f,\n  \"results\": [",
+                 std::thread::hardware_concurrency(), peak_rss_mb());
+    for (size_t i = 0; i < g_results.size(); ++i) {
+        const Result& r = g_results[i];
+        std::fprintf(f, "%s\n    {\"bench\": \"%s\", \"config\": \"%s\", \"threads\": %zu, "
+                        "\"seq_len\": %zu, \"metric\": \"%s\", \"value\": %.6g}",
+                     i ? "," : "", r.bench.c_str(), r.config.c_str(), r.threads, r.seq_len,
+                     r.metric.c_str(), r.value);
+    }
+    std::fprintf(f, "\n  ]\n}\n");
+    return std::fclose(f) == 0;
+}
+
+bool write_csv(const std::string& path) {
+    FILE* f = std::fopen(path.c_str(), "w");
+    if (!f) return false;
+    std::fprintf(f, "bench,config,threads,seq_len,metric,value\n");
+    for (const Result& r : g_results) {
+        std::fprintf(f, "%s,%s,%zu,%zu,%s,%.6g\n", r.bench.c_str(), r.config.c_str(), r.threads,
+                     r.seq_len, r.metric.c_str(), r.value);
+    }
+    return std::fclose(f) == 0;
+}
+
+/**
+ * Single attention layer forward over a full sequence (prefill shape)
+ */
+void bench_attention(size_t embedding_dim, size_t num_heads, size_t seq_len) {
+    WeightStore weights;
+    MultiHeadAttention attn(embedding_dim, num_heads, weights, "blk.0.");
+    std::vector<float> input(seq_len * embedding_dim);
+    fill_random(input, 1.0f, seq_len);
+
+    const auto start = std::chrono::steady_clock::now();
+    auto output = attn.forward(input);
+    const double elapsed = seconds_since(start);
+    g_sink = output[0];
+
+    // Q, K, V, context and output buffers; a naive kernel would add the
+    // num_heads x seq x seq score matrix on top
+    const double working_mb = 5.0 * seq_len * embedding_dim * sizeof(float) / 1e6;
+    const double naive_mb = working_mb + 1.0 * num_heads * seq_len * seq_len * sizeof(float) / 1e6;
+
+    std::printf("attention d=%zu h=%zu seq=%-5zu %10.1f tok/s %8.3f s  mem %7.1f MB (naive %8.1f MB)\n",
+                embedding_dim, num_heads, seq_len, seq_len / elapsed, elapsed,
+                working_mb, naive_mb);
+}
+
+/**
+ * Regression sweep over thread counts and sequence lengths: encode,
+ * prefill and decode throughput, time to first token (prefill plus the
+ * first greedy pick), allocations per decoded token and peak RSS, each
+ * recorded as a result
+ */
+void bench_sweep(const char* name, LlamaLexConfig config, const std::vector<size_t>& thread_counts,
+                 const std::vector<size_t>& seq_lengths, size_t n_decode) {
+    for (size_t n_threads : thread_counts) {
+        config.n_threads = n_threads;
+        LlamaLex model(config);
+        for (size_t seq_len : seq_lengths) {
+            std::vector<int> prompt(seq_len);
+            for (size_t i = 0; i < seq_len; ++i) prompt[i] = 3 + i % (config.vocab_size - 3);
+            
+            std::vector<float> hidden(seq_len * config.embedding_dim);
+            double encode_s = 1e30;
+            for (int run = 0; run < 2; ++run) {
+                const auto start = std::chrono::steady_clock::now();
+                model.encode_tokens(prompt, hidden.data());
+                encode_s = std::min(encode_s, seconds_since(start));
+            }
+            g_sink = hidden[0];
+            
+            model.reset_cache();
+            auto start = std::chrono::steady_clock::now();
+            const std::vector<float>* logits = &model.prefill(prompt);
+            const double prefill_s = seconds_since(start);
+            std::vector<int> step(1, static_cast<int>(argmax(*logits)));
+            const double ttft_s = seconds_since(start);
+            
+            const size_t allocs_before = g_allocations.load() + model.heap_allocations();
+            start = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < n_decode; ++i) {
+                logits = &model.evaluate(step);
+                step[0] = static_cast<int>(argmax(*logits));
+            }
+            const double decode_s = seconds_since(start);
+            const double allocs = static_cast<double>(g_allocations.load() + model.heap_allocations() -
+                                                      allocs_before) / n_decode;
+            const size_t threads = ThreadPool::resolve(n_threads);
+            
+            record("sweep", name, threads, seq_len, "encode_tok_per_s", seq_len / encode_s);
+            record("sweep", name, threads, seq_len, "prefill_tok_per_s", seq_len / prefill_s);
+            record("sweep", name, threads, seq_len, "decode_tok_per_s", n_decode / decode_s);
+            record("sweep", name, threads, seq_len, "ttft_ms", ttft_s * 1e3);
+            record("sweep", name, threads, seq_len, "allocs_per_token", allocs);
+            record("sweep", name, threads, seq_len, "peak_rss_mb", peak_rss_mb());
+            std::printf("sweep  %-8s threads=%-3zu seq=%-5zu encode %8.1f tok/s  prefill %8.1f tok/s  "
+                        "decode %7.1f tok/s  ttft %8.1f ms  allocs/token %.2f  peak rss %6.1f MB\n",
+                        name, threads, seq_len, seq_len / encode_s, seq_len / prefill_s,
+                        n_decode / decode_s, ttft_s * 1e3, allocs, peak_rss_mb());
+        }
+    }
+}
+
+/**
+ * Prompt prefill followed by cached single-token decode steps, against
+ * re-running the whole prefix per token (no KV cache)
+ */
+void bench_decode(const char* name, const LlamaLexConfig& config,
+                  size_t prompt_len, size_t n_decode) {
+    LlamaLex model(config);
+    std::vector<int> prompt(prompt_len);
+    for (size_t i = 0; i < prompt_len; ++i) prompt[i] = 3 + i % (config.vocab_size - 3);
+
+    auto start = std::chrono::steady_clock::now();
+    auto logits = model.prefill(prompt);
+    const double prefill_s = seconds_since(start);
+
+    // Heap allocations: operator new calls plus the engine's own aligned
+    // blocks (scratch arena growth, new KV pages)
+    std::vector<int> step(1);
+    const size_t allocs_before = g_allocations.load() + model.heap_allocations();
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < n_decode; ++i) {
+        step[0] = static_cast<int>(argmax(logits));
+        logits = model.evaluate(step);
+    }
+    const double decode_s = seconds_since(start);
+    const size_t decode_allocs = g_allocations.load() + model.heap_allocations() - allocs_before;
+
+    // A handful of uncached steps is enough to show the per-token cost
+    const size_t n_uncached = std::min<size_t>(n_decode, 4);
+    std::vector<int> tokens = prompt;
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < n_uncached; ++i) {
+        model.reset_cache();
+        logits = model.prefill(tokens);
+        tokens.push_back(static_cast<int>(argmax(logits)));
+    }
+    const double uncached_s = seconds_since(start);
+    g_sink = logits[0];
+
+    std::printf("decode %-8s prompt=%-5zu prefill %8.1f tok/s  decode %7.1f tok/s  (no cache %6.2f tok/s)  "
+                "allocs/token %.2f\n",
+                name, prompt_len, prompt_len / prefill_s, n_decode / decode_s,
+                n_uncached / uncached_s, static_cast<double>(decode_allocs) / n_decode);
+}
+
+/**
+ * Layer weight footprint and decode speed per storage type
+ */
+void bench_quantized(const char* name, LlamaLexConfig config, size_t n_decode) {
+    const TensorType types[] = {TensorType::F32, TensorType::Q8_0, TensorType::Q4_K};
+    std::vector<int> prompt(16);
+    for (size_t i = 0; i < prompt.size(); ++i) prompt[i] = 3 + static_cast<int>(i);
+
+    double f32_mb = 0.0, f32_tps = 0.0;
+    for (TensorType type : types) {
+        config.weight_type = type;
+        LlamaLex model(config);
+        auto logits = model.prefill(prompt);
+
+        const auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < n_decode; ++i) {
+            logits = model.evaluate(std::vector<int>(1, static_cast<int>(argmax(logits))));
+        }
+        const double tps = n_decode / seconds_since(start);
+        g_sink = logits[0];
+
+        const double layer_mb = model.weight_bytes("blk.") / 1e6;
+        if (type == TensorType::F32) {
+            f32_mb = layer_mb;
+            f32_tps = tps;
+        }
+        std::printf("quant  %-8s %-5s layers %7.1f MB (%.2fx smaller)  total %7.1f MB  decode %7.1f tok/s (%.2fx)\n",
+                    name, type_name(type), layer_mb, f32_mb / layer_mb,
+                    model.weight_bytes() / 1e6, tps, tps / f32_tps);
+    }
+}
+
+// Synthetic clause of n_words words
+std::string make_clause(size_t n_words, size_t seed) {
+    static const char* words[] = {"the", "court", "held", "that", "contract", "was", "valid",
+                                  "plaintiff", "defendant", "section", "act", "breach", "of",
+                                  "duty", "damages", "in", "terms", "agreement", "party", "shall"};
+    std::string text;
+    for (size_t i = 0; i < n_words; ++i) {
+        if (i) text += ' ';
+        text += words[(seed * 7 + i * 13) % (sizeof(words) / sizeof(words[0]))];
+    }
+    return text;
+}
+
+/**
+ * Many short documents: one encode() call per document vs encode_batch()
+ */
+void bench_encode_batch(const char* name, const LlamaLexConfig& config,
+                        size_t n_docs, size_t words_per_doc) {
+    LlamaLex model(config);
+    std::vector<std::string> docs;
+    for (size_t d = 0; d < n_docs; ++d) docs.push_back(make_clause(words_per_doc, d));
+    const size_t n_tokens = n_docs * (words_per_doc + 2);
+
+    // Best of three runs each: these are short and sensitive to noise
+    double single_s = 1e30, batch_s = 1e30;
+    std::vector<float> out;
+    std::vector<size_t> offsets;
+    for (int run = 0; run < 3; ++run) {
+        auto start = std::chrono::steady_clock::now();
+        for (const auto& doc : docs) g_sink = model.encode(doc)[0];
+        single_s = std::min(single_s, seconds_since(start));
+
+        start = std::chrono::steady_clock::now();
+        model.encode_batch(docs, out, offsets);
+        batch_s = std::min(batch_s, seconds_since(start));
+        g_sink = out[0];
+    }
+
+    std::printf("encode %-8s %zu docs x %zu tok  single %8.1f tok/s  batch %8.1f tok/s (%.2fx)\n",
+                name, n_docs, words_per_doc + 2, n_tokens / single_s, n_tokens / batch_s,
+                single_s / batch_s);
+}
+
+/**
+ * Pooled embeddings per storage type: output bytes per document against
+ * the per-token hidden states, and throughput against encode_batch()
+ */
+void bench_pooled(const char* name, const LlamaLexConfig& config, size_t n_docs, size_t words_per_doc) {
+    LlamaLex model(config);
+    std::vector<std::string> docs;
+    for (size_t d = 0; d < n_docs; ++d) docs.push_back(make_clause(words_per_doc, d));
+    const size_t raw_bytes = (words_per_doc + 2) * config.embedding_dim * sizeof(float);
+
+    std::vector<float> out;
+    std::vector<size_t> offsets;
+    double batch_s = 1e30;
+    for (int run = 0; run < 3; ++run) {
+        const auto start = std::chrono::steady_clock::now();
+        model.encode_batch(docs, out, offsets);
+        batch_s = std::min(batch_s, seconds_since(start));
+    }
+
+    const TensorType types[] = {TensorType::F32, TensorType::F16, TensorType::Q8_0};
+    for (TensorType type : types) {
+        PoolingParams params;
+        params.normalize = true;
+        params.type = type;
+        std::vector<uint8_t> pooled(n_docs * model.pooled_bytes(type));
+        double pooled_s = 1e30;
+        for (int run = 0; run < 3; ++run) {
+            const auto start = std::chrono::steady_clock::now();
+            model.encode_batch_pooled(docs, params, pooled.data());
+            pooled_s = std::min(pooled_s, seconds_since(start));
+        }
+        g_sink = pooled[0];
+        std::printf("pooled %-8s %-4s %5zu B/doc (raw %6zu B, %5.0fx smaller)  %8.1f docs/s (batch %8.1f)\n",
+                    name, type_name(type), model.pooled_bytes(type), raw_bytes,
+                    static_cast<double>(raw_bytes) / model.pooled_bytes(type), n_docs / pooled_s,
+                    n_docs / batch_s);
+    }
+}
+
+/**
+ * Re-encoding a corpus with the persistent embedding cache: a cold run
+ * fills the file, then a new engine on the same file (as in the next
+ * analysis run) serves encode() copies and encode_view() zero-copy views
+ */
+void bench_embedding_cache(const char* name, LlamaLexConfig config, size_t n_docs, size_t words_per_doc) {
+    const std::string path = "/tmp/llamalex_bench_cache.bin";
+    std::remove(path.c_str());
+    config.cache_path = path;
+    std::vector<std::string> docs;
+    for (size_t d = 0; d < n_docs; ++d) docs.push_back(make_clause(words_per_doc, d));
+
+    double cold_s, warm_s, view_s;
+    {
+        LlamaLex model(config);
+        const auto start = std::chrono::steady_clock::now();
+        for (const auto& doc : docs) g_sink = model.encode(doc)[0];
+        cold_s = seconds_since(start);
+    }
+    LlamaLex model(config);
+    auto start = std::chrono::steady_clock::now();
+    for (const auto& doc : docs) g_sink = model.encode(doc)[0];
+    warm_s = seconds_since(start);
+    start = std::chrono::steady_clock::now();
+    size_t n;
+    for (const auto& doc : docs) g_sink = model.encode_view(doc, &n)[0];
+    view_s = seconds_since(start);
+    const EmbeddingCache::Stats stats = model.cache_stats();
+    std::printf("cache  %-8s %zu docs x %zu words  cold %8.1f docs/s  warm %9.1f docs/s (%.0fx)  "
+                "view %9.1f docs/s  hit rate %.2f\n",
+                name, n_docs, words_per_doc, n_docs / cold_s, n_docs / warm_s, cold_s / warm_s,
+                n_docs / view_s, stats.hit_rate());
+    std::remove(path.c_str());
+}
+
+/**
+ * Prefill with a prefix cache: requests cycle through four fixed
+ * instruction preambles, each followed by its own short question, so the
+ * engine's own KV cache never holds the next request's preamble
+ */
+void bench_prefix_cache(const char* name, LlamaLexConfig config, size_t preamble_words, size_t n_requests) {
+    std::vector<std::vector<int>> prompts;
+    LlamaLex model(config);
+    for (size_t i = 0; i < n_requests; ++i) {
+        prompts.push_back(model.tokenizer().tokenize(make_clause(preamble_words, i % 4) + " " +
+                                                     make_clause(20, 100 + i), false));
+    }
+
+    double base_ms = 0.0;
+    const size_t budgets[] = {0, 256u << 20};
+    for (size_t budget : budgets) {
+        model.set_prefix_cache(budget);
+        model.prefill(prompts[0]);  // warm up
+        model.reset_cache();
+        size_t evaluated = 0;
+        const auto start = std::chrono::steady_clock::now();
+        for (const auto& prompt : prompts) {
+            model.prefill(prompt);
+            evaluated += prompt.size();
+        }
+        const double ms = seconds_since(start) * 1e3 / n_requests;
+        if (budget == 0) base_ms = ms;
+        const PrefixCache::Stats stats = model.prefix_cache_stats();
+        std::printf("prefix %-8s %4zu-token prompts  cache %3zu MB  %8.2f ms/request (%5.2fx)  "
+                    "hit rate %.2f  %zu entries  %.1f MB held\n",
+                    name, evaluated / n_requests, budget >> 20, ms, base_ms / ms, stats.hit_rate(),
+                    stats.entries, stats.bytes / 1e6);
+        record("prefix_cache", name, ThreadPool::resolve(config.n_threads), evaluated / n_requests,
+               budget ? "cached_ms_per_request" : "uncached_ms_per_request", ms);
+    }
+}
+
+// n unit vectors scattered around 64 random centres (topic clusters)
+std::vector<float> make_clustered_vectors(size_t n, size_t dim, uint32_t seed) {
+    std::mt19937 rng(seed);
+    std::normal_distribution<float> normal;
+    std::mt19937 centre_rng(7);
+    std::vector<float> centres(64 * dim);
+    for (float& v : centres) v = normal(centre_rng);
+    std::vector<float> vectors(n * dim);
+    for (size_t i = 0; i < n; ++i) {
+        const float* c = &centres[rng() % 64 * dim];
+        for (size_t j = 0; j < dim; ++j) vectors[i * dim + j] = c[j] + 0.7f * normal(rng);
+        l2_normalize(&vectors[i * dim], dim);
+    }
+    return vectors;
+}
+
+/**
+ * Top-k search: exact scans per storage type (one query at a time and as
+ * a batch), then IVF at a few probe counts with recall against exact f32
+ */
+void bench_index(size_t n_vectors, size_t dim, size_t n_queries, size_t k) {
+    const std::vector<float> vectors = make_clustered_vectors(n_vectors, dim, 1);
+    const std::vector<float> queries = make_clustered_vectors(n_queries, dim, 2);
+    std::vector<EmbeddingIndex::Hit> truth(n_queries * k), hits(n_queries * k);
+
+    const TensorType types[] = {TensorType::F32, TensorType::F16, TensorType::Q8_0};
+    for (TensorType type : types) {
+        EmbeddingIndex index(dim, type);
+        index.add(vectors.data(), n_vectors);
+        auto start = std::chrono::steady_clock::now();
+        for (size_t q = 0; q < n_queries; ++q) index.search(&queries[q * dim], 1, k, &hits[q * k]);
+        const double single_s = seconds_since(start);
+        if (type == TensorType::F32) truth = hits;
+        start = std::chrono::steady_clock::now();
+        index.search(queries.data(), n_queries, k, hits.data());
+        const double batch_s = seconds_since(start);
+        std::printf("index  %zu x %zu %-4s %6.1f MB  single %8.1f q/s  batch %8.1f q/s\n",
+                    n_vectors, dim, type_name(type), n_vectors * index.row_bytes() / 1e6,
+                    n_queries / single_s, n_queries / batch_s);
+    }
+
+    EmbeddingIndex index(dim);
+    index.add(vectors.data(), n_vectors);
+    const size_t n_lists = 256;
+    auto start = std::chrono::steady_clock::now();
+    index.build_ivf(n_lists);
+    std::printf("index  ivf %zu lists built in %.2f s\n", n_lists, seconds_since(start));
+    const size_t probes[] = {1, 4, 16};
+    for (size_t n_probe : probes) {
+        index.set_probes(n_probe);
+        start = std::chrono::steady_clock::now();
+        for (size_t q = 0; q < n_queries; ++q) index.search(&queries[q * dim], 1, k, &hits[q * k]);
+        const double elapsed = seconds_since(start);
+        size_t found = 0;
+        for (size_t q = 0; q < n_queries; ++q) {
+            std::set<int64_t> exact;
+            for (size_t i = 0; i < k; ++i) exact.insert(truth[q * k + i].id);
+            for (size_t i = 0; i < k; ++i) found += exact.count(hits[q * k + i].id);
+        }
+        std::printf("index  ivf probe %-3zu %8.1f q/s  recall@%zu %.3f\n",
+                    n_probe, n_queries / elapsed, k, static_cast<double>(found) / (n_queries * k));
+    }
+}
+
+// Synthetic statute text: numbered sections of legal boilerplate
+std::string make_statute_corpus(size_t bytes) {
+    static const char* clauses[] = {
+        "The Minister may, by notice in the Gazette, make regulations regarding any matter",
+        "that is required or permitted to be prescribed in terms of this Act.",
+        "Subject to subsection (2), a person who contravenes section 12 is guilty of an offence",
+        "and liable on conviction to a fine or to imprisonment for a period not exceeding two years.",
+        "Any agreement which purports to exclude the provisions of this Chapter is void.",
+        "The court may, on application by any interested party, grant an order declaring",
+        "that the contract was concluded in breach of the duty of good faith."};
+    const size_t n_clauses = sizeof(clauses) / sizeof(clauses[0]);
+    std::string corpus;
+    corpus.reserve(bytes + 256);
+    for (size_t section = 1; corpus.size() < bytes; ++section) {
+        corpus += "Section " + std::to_string(section) + ".\n";
+        for (size_t c = 0; c < 3; ++c) {
+            corpus += "(" + std::to_string(c + 1) + ") ";
+            corpus += clauses[(section + c) % n_clauses];
+            corpus += ' ';
+            corpus += clauses[(section * 3 + c) % n_clauses];
+            corpus += '\n';
+        }
+    }
+    return corpus;
+}
+
+/**
+ * Vocabulary over the corpus words: every word prefix as a piece (so
+ * whole words are single tokens) plus byte fallback; with bpe, the merges
+ * that build each word left to right
+ */
+LegalTokenizer::Vocab make_statute_vocab(const std::string& corpus, bool bpe) {
+    const std::string space = "\xE2\x96\x81";
+    LegalTokenizer::Vocab vocab;
+    vocab.pieces.push_back("<unk>");
+    vocab.pieces.push_back("<s>");
+    vocab.pieces.push_back("</s>");
+    char byte_piece[8];
+    for (int b = 0; b < 256; ++b) {
+        std::snprintf(byte_piece, sizeof(byte_piece), "<0x%02X>", b);
+        vocab.pieces.push_back(byte_piece);
+    }
+    for (char c = 33; c < 127; ++c) vocab.pieces.push_back(std::string(1, c));
+    vocab.pieces.push_back(space);
+
+    std::set<std::string> seen(vocab.pieces.begin(), vocab.pieces.end());
+    size_t pos = 0;
+    while (pos < corpus.size()) {
+        const size_t end = std::min(corpus.find_first_of(" \n", pos), corpus.size());
+        const std::string word = corpus.substr(pos, end - pos);
+        std::string piece = space;
+        for (char c : word) {
+            const std::string left = piece;
+            piece += c;
+            if (seen.insert(piece).second) {
+                vocab.pieces.push_back(piece);
+                if (bpe) vocab.merges.push_back(left + " " + std::string(1, c));
+            }
+        }
+        pos = end + 1;
+    }
+    return vocab;
+}
+
+/**
+ * Tokenizer throughput over a statute corpus; checks that detokenize
+ * reproduces the input
+ */
+void bench_tokenizer(size_t corpus_mb) {
+    const std::string corpus = make_statute_corpus(corpus_mb << 20);
+    const char* names[] = {"hash", "unigram", "bpe"};
+    for (int mode = 0; mode < 3; ++mode) {
+        LegalTokenizer tokenizer;
+        if (mode > 0) tokenizer.set_vocab(make_statute_vocab(corpus, mode == 2));
+        
+        const auto start = std::chrono::steady_clock::now();
+        const std::vector<int> tokens = tokenizer.tokenize(corpus);
+        const double elapsed = seconds_since(start);
+        const bool exact = mode > 0 && tokenizer.detokenize(tokens) == corpus;
+        
+        record("tokenizer", names[mode], 1, 0, "mb_per_s", corpus.size() / elapsed / 1e6);
+        std::printf("tokenize %-8s %zu MB  %8.1f MB/s  %zu tokens (%.1f bytes/token)  %s\n",
+                    names[mode], corpus_mb, corpus.size() / elapsed / 1e6, tokens.size(),
+                    static_cast<double>(corpus.size()) / tokens.size(),
+                    mode == 0 ? "not reversible" : exact ? "round trip exact" : "ROUND TRIP MISMATCH");
+    }
+}
+
+// Citation-heavy judgment text of roughly n_words words
+std::string make_judgment(size_t n_words) {
+    static const char* sentences[] = {
+        "In Smith v. Jones 2019 (3) SA 123 (CC) the court applied s 34(1)(b) of Act 108 of 1996.",
+        "See also S v Makwanyane 1995 (3) SA 391 (CC) and [2019] ZACC 12 at para 41.",
+        "The respondent relied on section 12A(3) read with subsection (2)(a) of the Act.",
+        "That approach was followed in Brisley v Drotsky 2002 (4) SA 1 (SCA) under ss 25-27."};
+    std::string text;
+    for (size_t i = 0, words = 0; words < n_words; ++i) {
+        const std::string sentence = sentences[i % 4];
+        words += std::count(sentence.begin(), sentence.end(), ' ') + 1;
+        if (!text.empty()) text += ' ';
+        text += sentence;
+    }
+    return text;
+}
+
+/**
+ * Case-law/statute pre-tokenization: sequence length and encode time for
+ * the same judgment with the citation patterns off and on
+ */
+void bench_legal_modes(const char* name, LlamaLexConfig config, size_t n_words) {
+    const std::string text = make_judgment(n_words);
+    const LegalTokenizer plain(config.vocab_size);
+    const LegalTokenizer legal(config.vocab_size, true, true);
+
+    const std::string corpus = make_judgment(1 << 20);
+    auto start = std::chrono::steady_clock::now();
+    g_sink = static_cast<float>(plain.tokenize(corpus).size());
+    const double plain_mbs = corpus.size() / seconds_since(start) / 1e6;
+    start = std::chrono::steady_clock::now();
+    g_sink = static_cast<float>(legal.tokenize(corpus).size());
+    const double legal_mbs = corpus.size() / seconds_since(start) / 1e6;
+
+    double encode_s[2];
+    size_t n_tokens[2];
+    for (int mode = 0; mode < 2; ++mode) {
+        config.enable_case_law_mode = config.enable_statute_mode = mode == 1;
+        LlamaLex model(config);
+        n_tokens[mode] = (mode ? legal : plain).tokenize(text).size();
+        start = std::chrono::steady_clock::now();
+        g_sink = model.encode(text)[0];
+        encode_s[mode] = seconds_since(start);
+    }
+
+    std::printf("legal  %-8s tokens %zu -> %zu (%.0f%% fewer)  encode %.3f -> %.3f s (%.2fx)  "
+                "tokenize %.1f -> %.1f MB/s\n",
+                name, n_tokens[0], n_tokens[1], 100.0 * (n_tokens[0] - n_tokens[1]) / n_tokens[0],
+                encode_s[0], encode_s[1], encode_s[0] / encode_s[1], plain_mbs, legal_mbs);
+}
+
+/**
+ * Long-document encoding in overlapping windows (encode_document); a page
+ * is taken as 500 words
+ */
+void bench_long_document(const char* name, const LlamaLexConfig& config, size_t n_words) {
+    const std::string text = make_judgment(n_words);
+    LlamaLex model(config);
+    model.encode_document(make_judgment(200));  // warm up
+
+    const auto start = std::chrono::steady_clock::now();
+    const DocumentEmbedding document = model.encode_document(text);
+    const double elapsed = seconds_since(start);
+    g_sink = document.embedding[0];
+
+    std::printf("document %-8s %6zu words  %6zu tokens  %4zu windows of %zu  %8.1f pages/s  %8.1f tok/s\n",
+                name, n_words, document.n_tokens, document.n_chunks(), config.chunk_tokens,
+                n_words / 500.0 / elapsed, document.n_tokens / elapsed);
+}
+
+/**
+ * analyze_case on an n_words judgment: the staged pipeline against a bare
+ * encode_document of the same text (the pipeline's overhead) and against
+ * re-encoding each sentence for the summary (what sharing the pass saves),
+ * plus heap allocations per call (precedents from a 2000-case index) once
+ * its buffers have grown
+ */
+void bench_analyze_case(const char* name, const LlamaLexConfig& config, size_t n_words, size_t n_runs) {
+    const std::string text = make_judgment(n_words);
+    LlamaLex model(config);
+    EmbeddingIndex precedents(config.embedding_dim);
+    precedents.add(make_clustered_vectors(2000, config.embedding_dim, 3).data(), 2000);
+    CaseAnalysisParams params;
+    params.precedents = &precedents;
+    CaseAnalysis analysis;
+    model.analyze_case(text, analysis, params);  // warm up, issue embeddings
+
+    const size_t allocations = g_allocations.load() + model.heap_allocations();
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < n_runs; ++i) model.analyze_case(text, analysis, params);
+    const double pipeline_ms = seconds_since(start) * 1e3 / n_runs;
+    const double allocs = static_cast<double>(g_allocations.load() + model.heap_allocations() - allocations) /
+                          n_runs;
+
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < n_runs; ++i) g_sink = model.encode_document(text).embedding[0];
+    const double encode_ms = seconds_since(start) * 1e3 / n_runs;
+
+    // Summary the naive way: every sentence encoded on its own
+    std::vector<std::pair<size_t, size_t>> sentences;
+    split_sentences(text, sentences);
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < n_runs; ++i) {
+        g_sink = model.encode_document(text).embedding[0];
+        for (const auto& sentence : sentences) {
+            g_sink = model.encode_document(text.substr(sentence.first, sentence.second - sentence.first)).embedding[0];
+        }
+    }
+    const double naive_ms = seconds_since(start) * 1e3 / n_runs;
+
+    std::printf("analyze %-8s %6zu words  %4zu sentences  %3zu entities  pipeline %8.2f ms  "
+                "encode only %8.2f ms  re-encoding %8.2f ms (%.1fx)  allocs/call %.0f\n",
+                name, n_words, sentences.size(), analysis.entities.size(), pipeline_ms, encode_ms, naive_ms,
+                naive_ms / pipeline_ms, allocs);
+    record("analyze_case", name, ThreadPool::resolve(config.n_threads), analysis.document.n_tokens,
+           "ms_per_case", pipeline_ms);
+}
+
+/**
+ * Prefill and decode throughput as the thread pool grows
+ */
+void bench_threads(const char* name, LlamaLexConfig config, size_t prompt_len, size_t n_decode) {
+    const size_t thread_counts[] = {1, 4, 16, 32};
+    std::vector<int> prompt(prompt_len);
+    for (size_t i = 0; i < prompt_len; ++i) prompt[i] = 3 + i % (config.vocab_size - 3);
+
+    double base_prefill = 0.0, base_decode = 0.0;
+    for (size_t n_threads : thread_counts) {
+        config.n_threads = n_threads;
+        LlamaLex model(config);
+        auto start = std::chrono::steady_clock::now();
+        auto logits = model.prefill(prompt);
+        const double prefill_tps = prompt_len / seconds_since(start);
+        
+        start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < n_decode; ++i) {
+            logits = model.evaluate(std::vector<int>(1, static_cast<int>(argmax(logits))));
+        }
+        const double decode_tps = n_decode / seconds_since(start);
+        g_sink = logits[0];
+        
+        if (n_threads == 1) {
+            base_prefill = prefill_tps;
+            base_decode = decode_tps;
+        }
+        std::printf("threads %-8s n=%-3zu prefill %8.1f tok/s (%5.2fx)  decode %7.1f tok/s (%5.2fx)\n",
+                    name, n_threads, prefill_tps, prefill_tps / base_prefill,
+                    decode_tps, decode_tps / base_decode);
+    }
+}
+
+/**
+ * Prefill and decode throughput as the pool grows from one NUMA node to
+ * all of them (one thread per CPU of the nodes in use), with weights left
+ * to first touch, interleaved, or replicated per node. On a single-node
+ * host only the first row per mode is meaningful.
+ */
+void bench_numa(const char* name, LlamaLexConfig config, size_t prompt_len, size_t n_decode) {
+    const NumaTopology& topology = NumaTopology::system();
+    const NumaMode modes[] = {NumaMode::OFF, NumaMode::INTERLEAVE, NumaMode::REPLICATE};
+    const char* mode_names[] = {"off", "interleave", "replicate"};
+    std::vector<int> prompt(prompt_len);
+    for (size_t i = 0; i < prompt_len; ++i) prompt[i] = 3 + i % (config.vocab_size - 3);
+    
+    std::printf("numa     %-8s %zu node(s), %zu CPUs\n", name, topology.nodes(), topology.cpu_count());
+    for (size_t m = 0; m < 3; ++m) {
+        double base_prefill = 0.0, base_decode = 0.0;
+        for (size_t n_nodes = 1; n_nodes <= topology.nodes(); ++n_nodes) {
+            config.numa_mode = modes[m];
+            config.numa_nodes = n_nodes;
+            config.n_threads = topology.cpu_count(n_nodes);
+            LlamaLex model(config);
+            auto start = std::chrono::steady_clock::now();
+            auto logits = model.prefill(prompt);
+            const double prefill_tps = prompt_len / seconds_since(start);
+            
+            start = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < n_decode; ++i) {
+                logits = model.evaluate(std::vector<int>(1, static_cast<int>(argmax(logits))));
+            }
+            const double decode_tps = n_decode / seconds_since(start);
+            g_sink = logits[0];
+            
+            if (n_nodes == 1) {
+                base_prefill = prefill_tps;
+                base_decode = decode_tps;
+            }
+            const std::string label = std::string(name) + " " + mode_names[m];
+            const double replica_mb = model.model()->weights().replica_bytes() / 1048576.0;
+            std::printf("numa     %-8s %-10s nodes=%zu threads=%-3zu prefill %8.1f tok/s (%5.2fx)  "
+                        "decode %7.1f tok/s (%5.2fx)  replicas %7.1f MB\n",
+                        name, mode_names[m], n_nodes, config.n_threads, prefill_tps,
+                        prefill_tps / base_prefill, decode_tps, decode_tps / base_decode, replica_mb);
+            record("numa", label, config.n_threads, prompt_len, "prefill_tok_per_s", prefill_tps);
+            record("numa", label, config.n_threads, prompt_len, "decode_tok_per_s", decode_tps);
+            record("numa", label, config.n_threads, prompt_len, "replica_mb", replica_mb);
+        }
+    }
+}
+
+/**
+ * Shape-specialized kernels (ShapeKernels) against the generic fallback
+ * on the same model: prefill, decode and attention-heavy long prefill
+ */
+void bench_kernels(const char* name, LlamaLexConfig config, size_t prompt_len, size_t n_decode) {
+    std::vector<int> prompt(prompt_len);
+    for (size_t i = 0; i < prompt_len; ++i) prompt[i] = 3 + i % (config.vocab_size - 3);
+
+    double generic_prefill = 0.0, generic_decode = 0.0;
+    const bool variants[] = {false, true};
+    for (bool specialized : variants) {
+        config.specialized_kernels = specialized;
+        LlamaLex model(config);
+        model.prefill(prompt);  // warm up
+        model.reset_cache();
+
+        auto start = std::chrono::steady_clock::now();
+        auto logits = model.prefill(prompt);
+        const double prefill_tps = prompt_len / seconds_since(start);
+        start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < n_decode; ++i) {
+            logits = model.evaluate(std::vector<int>(1, static_cast<int>(argmax(logits))));
+        }
+        const double decode_tps = n_decode / seconds_since(start);
+        g_sink = logits[0];
+
+        if (!specialized) {
+            generic_prefill = prefill_tps;
+            generic_decode = decode_tps;
+        }
+        const char* kernels = ShapeKernels::select(config).name;
+        std::printf("kernels %-8s %-16s prompt=%-5zu prefill %8.1f tok/s (%5.2fx)  decode %7.1f tok/s (%5.2fx)\n",
+                    name, kernels, prompt_len, prefill_tps, prefill_tps / generic_prefill,
+                    decode_tps, decode_tps / generic_decode);
+        record("kernels", std::string(name) + " " + kernels, ThreadPool::resolve(config.n_threads), prompt_len,
+               "prefill_tok_per_s", prefill_tps);
+        record("kernels", std::string(name) + " " + kernels, ThreadPool::resolve(config.n_threads), prompt_len,
+               "decode_tok_per_s", decode_tps);
+    }
+}
+
+#if defined(LLAMALEX_PROFILE)
+/**
+ * Where prefill and decode time goes, per op summed over layers, from the
+ * profiler counters (build with -DLLAMALEX_PROFILE). With trace_path set,
+ * the spans are also written as a Chrome trace.
+ */
+void bench_profile(const char* name, const LlamaLexConfig& config, size_t prompt_len, size_t n_decode,
+                   const std::string& trace_path) {
+    LlamaLex model(config);
+    std::vector<int> prompt(prompt_len);
+    for (size_t i = 0; i < prompt_len; ++i) prompt[i] = 3 + i % (config.vocab_size - 3);
+    model.prefill(prompt);  // warm up
+    model.reset_cache();
+
+    llamalex_profile_reset();
+    if (!trace_path.empty()) llamalex_profile_start_trace(1 << 20);
+    Sampler sampler;
+    auto logits = model.prefill(prompt);
+    for (size_t i = 0; i < n_decode; ++i) {
+        const int token = sampler.sample(logits.data(), config.vocab_size, prompt);
+        logits = model.evaluate(std::vector<int>(1, token));
+    }
+    g_sink = logits[0];
+
+    std::vector<llamalex_op_stats> stats(llamalex_profile_stats(nullptr, 0));
+    llamalex_profile_stats(stats.data(), stats.size());
+    std::map<std::string, llamalex_op_stats> by_op;
+    uint64_t total_ns = 0;
+    for (const llamalex_op_stats& s : stats) {
+        llamalex_op_stats& op = by_op.emplace(s.op, llamalex_op_stats()).first->second;
+        op.op = s.op;
+        op.calls += s.calls;
+        op.nanoseconds += s.nanoseconds;
+        op.flops += s.flops;
+        op.bytes += s.bytes;
+        total_ns += s.nanoseconds;
+    }
+    for (const auto& entry : by_op) {
+        const llamalex_op_stats& op = entry.second;
+        const double seconds = op.nanoseconds * 1e-9;
+        std::printf("profile %-8s %-12s %7llu calls %9.2f ms (%5.1f%%)  %7.2f GFLOP/s  %7.2f GB/s\n",
+                    name, op.op, static_cast<unsigned long long>(op.calls), seconds * 1e3,
+                    100.0 * op.nanoseconds / std::max<uint64_t>(total_ns, 1),
+                    seconds > 0 ? op.flops / seconds * 1e-9 : 0.0, seconds > 0 ? op.bytes / seconds * 1e-9 : 0.0);
+        record("profile", name, config.n_threads, prompt_len, (std::string(op.op) + "_ms").c_str(), seconds * 1e3);
+    }
+    if (!trace_path.empty()) {
+        llamalex_profile_start_trace(0);
+        if (llamalex_profile_write_trace(trace_path.c_str()) == 0) {
+            std::printf("profile %-8s trace written to %s\n", name, trace_path.c_str());
+        }
+    }
+}
+#endif
+
+/**
+ * Continuous batching: `concurrency` generate requests in flight at once,
+ * each decoding n_decode tokens, served by one Scheduler
+ */
+void bench_scheduler(const char* name, const LlamaLexConfig& config, size_t n_decode) {
+    const size_t concurrency[] = {1, 2, 4, 8, 16, 32, 64};
+    LlamaLex model(config);
+    double base = 0.0;
+    for (size_t n : concurrency) {
+        Scheduler scheduler(model, n);
+        std::vector<std::future<std::string>> results;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < n; ++i) {
+            results.push_back(scheduler.submit_generate(
+                "The court considered whether clause " + std::to_string(i) + " was enforceable", n_decode));
+        }
+        for (auto& result : results) result.get();
+        const double elapsed = seconds_since(start);
+        
+        const Scheduler::Stats stats = scheduler.stats();
+        const double tps = stats.generated_tokens / elapsed;
+        if (n == 1) base = tps;
+        // Paged KV memory high-water mark vs. one max_seq_length slot per request
+        const double kv_mb = model.kv_pool().allocated_bytes() / 1048576.0;
+        const double slot_mb = n * 2.0 * config.num_layers * config.max_seq_length *
+                               config.embedding_dim * sizeof(float) / 1048576.0;
+        std::printf("schedule %-8s n=%-3zu %8.1f tok/s (%5.2fx)  per-token p50 %7.2f ms  p99 %7.2f ms  "
+                    "KV %6.1f MB (contiguous %7.1f MB)\n",
+                    name, n, tps, tps / base, stats.p50_token_ms, stats.p99_token_ms, kv_mb, slot_mb);
+    }
+}
+
+/**
+ * Sessions over one shared LlamaLexModel against independent engines:
+ * time to create one and the memory it holds once it has run a short
+ * generation, counted from its weights, KV pages and scratch (an RSS
+ * delta reads near zero when an earlier bench left freed memory behind)
+ */
+void bench_sessions(const char* name, const LlamaLexConfig& config, size_t n_sessions, size_t n_engines) {
+    const std::string prompt = "The court considered whether the restraint of trade clause was enforceable";
+    const size_t threads = ThreadPool::resolve(config.n_threads);
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::unique_ptr<LlamaLex>> engines;
+    for (size_t i = 0; i < n_engines; ++i) engines.emplace_back(new LlamaLex(config));
+    const double engine_ms = seconds_since(start) * 1e3 / n_engines;
+    size_t engine_bytes = 0;
+    for (auto& engine : engines) {
+        g_sink = engine->generate(prompt, 4).size();
+        engine_bytes += engine->weight_bytes() + engine->session_bytes();
+    }
+    const double engine_mb = engine_bytes / 1048576.0 / n_engines;
+
+    std::shared_ptr<const LlamaLexModel> model = engines.front()->model();
+    engines.clear();
+    start = std::chrono::steady_clock::now();
+    std::vector<std::unique_ptr<LlamaLex>> sessions;
+    for (size_t i = 0; i < n_sessions; ++i) sessions.emplace_back(new LlamaLex(model));
+    const double session_us = seconds_since(start) * 1e6 / n_sessions;
+    size_t session_bytes = 0;
+    for (auto& session : sessions) {
+        g_sink = session->generate(prompt, 4).size();
+        session_bytes += session->session_bytes();
+    }
+    const double session_mb = session_bytes / 1048576.0 / n_sessions;
+
+    std::printf("sessions %-8s engine %8.1f ms %7.1f MB each   session %6.1f us %5.2f MB each  "
+                "(weights %.1f MB shared by %zu)\n",
+                name, engine_ms, engine_mb, session_us, session_mb,
+                sessions.front()->weight_bytes() / 1048576.0, n_sessions);
+    record("sessions", name, threads, 0, "engine_create_ms", engine_ms);
+    record("sessions", name, threads, 0, "engine_mb", engine_mb);
+    record("sessions", name, threads, 0, "session_create_us", session_us);
+    record("sessions", name, threads, 0, "session_mb", session_mb);
+}
+
+/**
+ * One service thread driving a Scheduler: blocking on each request in
+ * turn, against keeping `in_flight` requests outstanding with completion
+ * callbacks (the C ABI's *_async path). Each request generates n_decode
+ * tokens and encodes a short text.
+ */
+void bench_async(const char* name, const LlamaLexConfig& config, size_t n_requests, size_t n_decode) {
+    LlamaLex model(config);
+    const size_t threads = ThreadPool::resolve(config.n_threads);
+    const size_t in_flight[] = {1, 16, 64, 256};
+    double base = 0.0;
+    for (size_t limit : in_flight) {
+        Scheduler scheduler(model, std::min<size_t>(limit, 64));
+        std::mutex mutex;
+        std::condition_variable finished;
+        size_t outstanding = 0, completed = 0;
+        auto on_done = [&]() {
+            std::lock_guard<std::mutex> lock(mutex);
+            --outstanding;
+            ++completed;
+            finished.notify_one();
+        };
+        double submit_s = 0.0;
+        const auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < n_requests; ++i) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                finished.wait(lock, [&] { return outstanding + 2 <= 2 * limit; });
+                outstanding += 2;
+            }
+            const auto submit_start = std::chrono::steady_clock::now();
+            scheduler.submit_generate("The court considered whether clause " + std::to_string(i) +
+                                      " was enforceable", n_decode, SamplingParams(), TokenCallback(),
+                                      [&](std::string&& text, std::exception_ptr) {
+                                          g_sink = text.size();
+                                          on_done();
+                                      });
+            scheduler.submit_encode("Clause " + std::to_string(i) + " is void for vagueness",
+                                    [&](std::vector<float>&& hidden, std::exception_ptr) {
+                                        g_sink = hidden.size();
+                                        on_done();
+                                    });
+            submit_s += seconds_since(submit_start);
+        }
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            finished.wait(lock, [&] { return completed == 2 * n_requests; });
+        }
+        const double rps = n_requests / seconds_since(start);
+        if (limit == 1) base = rps;
+        std::printf("async    %-8s %3zu in flight  %8.1f requests/s (%5.2fx)  submit %6.1f us\n",
+                    name, limit, rps, rps / base, submit_s * 1e6 / (2 * n_requests));
+        record("async", std::string(name) + "/" + std::to_string(limit) + "-in-flight", threads, n_decode,
+               "requests_per_s", rps);
+    }
+}
+
+/**
+ * Time to the first piece of text with generate_stream, against waiting
+ * for generate to return the whole completion
+ */
+void bench_streaming(const char* name, const LlamaLexConfig& config, size_t n_decode) {
+    const std::string prompt = "The court considered whether the restraint of trade clause was enforceable";
+    LlamaLex model(config);
+    model.generate(prompt, 4);  // warm up
+    model.reset_cache();
+    auto start = std::chrono::steady_clock::now();
+    double first_ms = 0.0;
+    size_t pieces = 0;
+    model.generate_stream(prompt, n_decode, SamplingParams(), [&](const std::string&) {
+        if (pieces++ == 0) first_ms = seconds_since(start) * 1e3;
+        return true;
+    });
+    const double total_ms = seconds_since(start) * 1e3;
+    std::printf("stream   %-8s first piece %8.1f ms  whole completion %8.1f ms (%zu pieces)\n",
+                name, first_ms, total_ms, pieces);
+}
+
+/**
+ * Speculative decoding against plain decode on the target, for drafts of
+ * decreasing agreement with it: quantized copies of the target (standing
+ * in for a distilled draft) and the 4-layer demo shape. With synthetic
+ * weights the demo shape shares nothing with the target, so it shows the
+ * cost of a draft that is always rejected. llamalex_test checks that the
+ * output matches plain decode.
+ */
+void bench_speculative(const LlamaLexConfig& target_config, size_t n_draft, size_t n_decode) {
+    const std::string prompt = "The court considered whether the restraint of trade clause was enforceable";
+    LlamaLex target(target_config);
+    target.generate(prompt, 4);  // warm up
+    target.reset_cache();
+    auto start = std::chrono::steady_clock::now();
+    target.generate(prompt, n_decode);
+    const double base = seconds_since(start);
+    std::printf("speculate target %zuL/%zud  plain decode %8.1f tok/s\n", target_config.num_layers,
+                target_config.embedding_dim, n_decode / base);
+
+    LlamaLexConfig demo = target_config;
+    demo.embedding_dim = 256;
+    demo.num_layers = 4;
+    demo.num_heads = 4;
+    demo.ff_dim = 1024;
+    LlamaLexConfig q8 = target_config;
+    q8.weight_type = TensorType::Q8_0;
+    LlamaLexConfig q4 = target_config;
+    q4.weight_type = TensorType::Q4_K;
+    const std::pair<const char*, LlamaLexConfig> drafts[] = {
+        {"Q8_0 copy", q8}, {"Q4_K copy", q4}, {"4L/256d", demo}};
+    for (const auto& entry : drafts) {
+        LlamaLex draft(entry.second);
+        SpeculativeDecoder decoder(target, draft, n_draft);
+        decoder.generate(prompt, 4);  // warm up
+        decoder.reset_stats();
+        
+        start = std::chrono::steady_clock::now();
+        decoder.generate(prompt, n_decode);
+        const double elapsed = seconds_since(start);
+        const SpeculativeDecoder::Stats stats = decoder.stats();
+        std::printf("speculate draft %-10s k=%zu  %8.1f tok/s (%5.2fx)  accept %5.1f%%  "
+                    "%4.2f tokens/target pass\n",
+                    entry.first, n_draft, stats.generated_tokens / elapsed, base / elapsed,
+                    100.0 * stats.acceptance_rate(), stats.tokens_per_pass());
+    }
+}
+
+/**
+ * Per-token sampling cost over a vocab_size vocabulary, against drawing
+ * top-k from a fully sorted copy of the logits
+ */
+void bench_sampler(size_t vocab_size, size_t n_tokens) {
+    std::vector<float> logits(vocab_size);
+    fill_random(logits, 8.0f, vocab_size);
+    const std::vector<int> history(64, 7);
+
+    struct Mode { const char* name; float temperature; size_t top_k; float top_p; float penalty; };
+    const Mode modes[] = {{"greedy", 0.0f, 0, 1.0f, 1.0f},
+                          {"temperature", 0.8f, 0, 1.0f, 1.0f},
+                          {"top-k 40", 0.8f, 40, 1.0f, 1.0f},
+                          {"top-p 0.9", 0.8f, 0, 0.9f, 1.0f},
+                          {"k40+p0.9+rep", 0.8f, 40, 0.9f, 1.1f}};
+    for (const Mode& mode : modes) {
+        SamplingParams params;
+        params.temperature = mode.temperature;
+        params.top_k = mode.top_k;
+        params.top_p = mode.top_p;
+        params.repetition_penalty = mode.penalty;
+        params.seed = 1;
+        Sampler sampler(params);
+        g_sink = sampler.sample(logits.data(), vocab_size, history);  // warm the buffers
+
+        const size_t allocations = g_allocations.load();
+        const auto start = std::chrono::steady_clock::now();
+        int sum = 0;
+        for (size_t i = 0; i < n_tokens; ++i) sum += sampler.sample(logits.data(), vocab_size, history);
+        const double elapsed = seconds_since(start);
+        g_sink = static_cast<float>(sum);
+        std::printf("sample   %-13s vocab=%zu %8.1f us/token  allocs/token %.2f\n", mode.name, vocab_size,
+                    elapsed * 1e6 / n_tokens,
+                    static_cast<double>(g_allocations.load() - allocations) / n_tokens);
+    }
+
+    std::vector<std::pair<float, int>> sorted(vocab_size);
+    const auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < n_tokens; ++i) {
+        for (size_t t = 0; t < vocab_size; ++t) sorted[t] = std::make_pair(logits[t], static_cast<int>(t));
+        std::sort(sorted.begin(), sorted.end(), std::greater<std::pair<float, int>>());
+        g_sink = sorted[i % 40].first;
+    }
+    std::printf("sample   %-13s vocab=%zu %8.1f us/token\n", "full sort", vocab_size,
+                seconds_since(start) * 1e6 / n_tokens);
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    std::string only, json_path, csv_path, trace_path;
+    bool quick = false;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (arg == "--quick") {
+            quick = true;
+        } else if ((arg == "--only" || arg == "--json" || arg == "--csv" || arg == "--trace") && i + 1 < argc) {
+            (arg == "--only" ? only : arg == "--json" ? json_path : arg == "--csv" ? csv_path : trace_path) =
+                argv[++i];
+        } else {
+            std::fprintf(stderr, "usage: %s [--only NAME[,NAME...]] [--quick] [--json PATH] [--csv PATH] "
+                         "[--trace PATH]\n", argv[0]);
+            return 2;
+        }
+    }
+    auto selected = [&only](const char* name) {
+        return only.empty() || ("," + only + ",").find("," + std::string(name) + ",") != std::string::npos;
+    };
+
+    std::printf("LlamaLex benchmarks\n");
+    std::printf("===================\n");
+    std::printf("hardware threads: %u\n", std::thread::hardware_concurrency());
+
+    LlamaLexConfig demo;
+    demo.vocab_size = 5000;
+    demo.embedding_dim = 256;
+    demo.num_layers = 4;
+    demo.num_heads = 4;
+    demo.ff_dim = 1024;
+
+    if (selected("sweep")) {
+        std::vector<size_t> thread_counts(1, 1);
+        if (std::thread::hardware_concurrency() > 1) thread_counts.push_back(0);  // all cores
+        const std::vector<size_t> demo_lengths = quick ? std::vector<size_t>{128, 512}
+                                                       : std::vector<size_t>{128, 512, 2048};
+        const std::vector<size_t> base_lengths = quick ? std::vector<size_t>{128}
+                                                       : std::vector<size_t>{128, 512};
+        bench_sweep("4L/256d", demo, thread_counts, demo_lengths, quick ? 16 : 32);
+        bench_sweep("12L/768d", LlamaLexConfig(), thread_counts, base_lengths, quick ? 4 : 16);
+    }
+
+    if (selected("tokenizer")) bench_tokenizer(32);
+
+    if (selected("attention")) {
+        const size_t seq_lengths[] = {512, 2048, 8192};
+        for (size_t seq_len : seq_lengths) {
+            bench_attention(768, 12, seq_len);
+        }
+    }
+
+    if (selected("decode")) {
+        bench_decode("4L/256d", demo, 512, 32);
+        bench_decode("12L/768d", LlamaLexConfig(), 128, 16);
+    }
+
+    if (selected("encode_batch")) {
+        bench_encode_batch("4L/256d", demo, 256, 6);
+        bench_encode_batch("4L/256d", demo, 256, 30);
+        bench_encode_batch("12L/768d", LlamaLexConfig(), 64, 6);
+    }
+
+    if (selected("pooled")) bench_pooled("4L/256d", demo, 256, 30);
+    if (selected("cache")) bench_embedding_cache("4L/256d", demo, 200, 200);
+    if (selected("prefix_cache")) {
+        bench_prefix_cache("4L/256d", demo, 400, 64);
+        bench_prefix_cache("12L/768d", LlamaLexConfig(), 400, 16);
+    }
+    if (selected("index")) bench_index(100000, 256, 200, 10);
+
+    if (selected("legal_modes")) bench_legal_modes("4L/256d", demo, 1500);
+
+    if (selected("analyze_case")) {
+        bench_analyze_case("4L/256d", demo, 2000, 10);
+        bench_analyze_case("4L/256d", demo, 20000, 2);
+    }
+
+    if (selected("long_document")) {
+        bench_long_document("4L/256d", demo, 20000);
+        bench_long_document("4L/256d", demo, 80000);
+        bench_long_document("12L/768d", LlamaLexConfig(), 2000);
+    }
+
+    if (selected("threads")) bench_threads("12L/768d", LlamaLexConfig(), 128, 16);
+
+    if (selected("numa")) bench_numa("12L/768d", LlamaLexConfig(), 128, 16);
+
+    if (selected("kernels")) {
+        bench_kernels("4L/256d", demo, 512, 64);
+        bench_kernels("4L/256d", demo, 1536, 64);
+        bench_kernels("12L/768d", LlamaLexConfig(), 512, 16);
+    }
+
+#if defined(LLAMALEX_PROFILE)
+    if (selected("profile")) {
+        bench_profile("4L/256d", demo, 512, 32, trace_path);
+        bench_profile("12L/768d", LlamaLexConfig(), 128, 16, "");
+    }
+#endif
+
+    if (selected("scheduler")) bench_scheduler("4L/256d", demo, 32);
+
+    if (selected("sessions")) bench_sessions("4L/256d", demo, 64, 4);
+
+    if (selected("async")) bench_async("4L/256d", demo, quick ? 128 : 512, 16);
+
+    if (selected("sampler")) bench_sampler(50000, 200);
+
+    if (selected("speculative")) bench_speculative(LlamaLexConfig(), 4, 48);
+
+    if (selected("streaming")) {
+        bench_streaming("4L/256d", demo, 128);
+        bench_streaming("12L/768d", LlamaLexConfig(), 48);
+    }
+
+    if (selected("quantized")) {
+        bench_quantized("4L/256d", demo, 64);
+        bench_quantized("12L/768d", LlamaLexConfig(), 16);
+    }
+
+    std::printf("peak rss: %.1f MB\n", peak_rss_mb());
+    if (!json_path.empty() && !write_json(json_path)) {
+        std::fprintf(stderr, "cannot write %s\n", json_path.c_str());
+        return 1;
+    }
+    if (!csv_path.empty() && !write_csv(csv_path)) {
+        std::fprintf(stderr, "cannot write %s\n", csv_path.c_str());
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,456 @@
+/**
+ * llamalex_test.cpp - Regression checks for the LlamaLex engine
+ *
+ * Build (from models/ggmlex):
+ *   g++ -std=c++11 -O3 -march=native -pthread cpp/llamalex_test.cpp -o llamalex_test
+ *
+ * Each test prints PASS or FAIL per check on small random-init models.
+ * Steady-state tests assert that a warm workload does not touch the heap
+ * (neither operator new nor the engine's own aligned blocks); the others
+ * compare an optimized path with the plain one it must reproduce (layer
+ * offload, caches, ...). Exits non-zero if any check fails.
+ */
+
+#define LLAMALEX_NO_MAIN
+#include "llamalex.cpp"
+
+#include <cstdio>
+
+#include "llamalex_alloc_counter.h"
+
+namespace {
+
+using namespace llamalex;
+
+int g_failures = 0;
+
+void check(bool ok, const char* what) {
+    std::printf("%s  %s\n", ok ? "PASS" : "FAIL", what);
+    if (!ok) ++g_failures;
+}
+
+// operator new calls plus scratch arena growth and new KV pages
+size_t allocations(const LlamaLex& model) {
+    return g_allocations.load() + model.heap_allocations();
+}
+
+LlamaLexConfig small_config() {
+    LlamaLexConfig config;
+    config.vocab_size = 512;
+    config.embedding_dim = 128;
+    config.num_layers = 2;
+    config.num_heads = 2;
+    config.ff_dim = 256;
+    config.max_seq_length = 256;
+    config.n_threads = 1;
+    return config;
+}
+
+void test_encode_steady_state() {
+    LlamaLex model(small_config());
+    std::vector<int> tokens(64);
+    for (size_t i = 0; i < tokens.size(); ++i) tokens[i] = 3 + static_cast<int>(i % 500);
+    std::vector<float> out(tokens.size() * model.config().embedding_dim);
+
+    model.encode_tokens(tokens, out.data());
+    const size_t before = allocations(model);
+    for (int i = 0; i < 8; ++i) model.encode_tokens(tokens, out.data());
+    check(allocations(model) == before, "encode_tokens makes no heap allocations once warm");
+}
+
+void test_decode_steady_state() {
+    LlamaLex model(small_config());
+    std::vector<int> prompt(16);
+    for (size_t i = 0; i < prompt.size(); ++i) prompt[i] = 3 + static_cast<int>(i);
+
+    // The first steps grow the arena to its decode size; later steps may
+    // only allocate when the sequence crosses into a new KV page
+    std::vector<int> step(1, 5);
+    model.prefill(prompt);
+    model.evaluate(step);
+    const size_t before = allocations(model);
+    const size_t kv_before = model.heap_allocations();
+    for (int i = 0; i < 32; ++i) model.evaluate(step);
+    const size_t kv_pages = model.heap_allocations() - kv_before;
+    check(allocations(model) - before == kv_pages,
+          "decode allocates nothing but new KV pages once warm");
+}
+
+void test_analyze_case_steady_state() {
+    const LlamaLexConfig config = small_config();
+    LlamaLex model(config);
+    std::vector<float> vectors(500 * config.embedding_dim);
+    uint64_t state = 1;
+    for (float& v : vectors) {
+        state = state * 6364136223846793005ull + 1442695040888963407ull;
+        v = static_cast<float>(state >> 40) / (1 << 24) - 0.5f;
+    }
+    EmbeddingIndex flat(config.embedding_dim), ivf(config.embedding_dim);
+    flat.add(vectors.data(), 500);
+    ivf.add(vectors.data(), 500);
+    ivf.build_ivf(8);
+
+    const std::string text =
+        "The appellant was convicted in the High Court. In S v Makwanyane 1995 (3) SA 391 (CC) the "
+        "court held that section 277 of the Criminal Procedure Act 51 of 1977 was invalid. The "
+        "appeal against sentence succeeds and the matter is remitted to the trial court.";
+    const EmbeddingIndex* indexes[] = {&flat, &ivf};
+    for (const EmbeddingIndex* index : indexes) {
+        CaseAnalysisParams params;
+        params.precedents = index;
+        CaseAnalysis analysis;
+        model.analyze_case(text, analysis, params);
+        const size_t before = allocations(model);
+        for (int i = 0; i < 4; ++i) model.analyze_case(text, analysis, params);
+        check(allocations(model) == before && analysis.precedents.size() == params.n_precedents,
+              index == &flat ? "analyze_case with an exact index makes no heap allocations once warm"
+                             : "analyze_case with an IVF index makes no heap allocations once warm");
+    }
+}
+
+/**
+ * Stand-in device: runs its span with the CPU kernels over its own copy
+ * of the span's layers. Random-init weights are seeded by tensor name,
+ * so rebuilding the layers reproduces them; comparing that copy with the
+ * model's store is its upload.
+ */
+class HostDeviceBackend : public LayerBackend {
+public:
+    HostDeviceBackend(const LlamaLexConfig& config, const WeightStore& weights, size_t first, size_t last)
+        : LayerBackend(first, last), weights_(config.weight_type) {
+        layers_.reserve(last - first);
+        for (size_t l = first; l < last; ++l) layers_.emplace_back(config, weights_, l);
+        for (const auto& copy : weights_.tensors()) {
+            bool uploaded = false;
+            for (const auto& source : weights.tensors()) {
+                uploaded = uploaded || (source.first == copy.first && source.second.bytes() == copy.second.bytes() &&
+                                        std::memcmp(source.second.data, copy.second.data, copy.second.bytes()) == 0);
+            }
+            if (!uploaded) throw std::runtime_error("cannot upload " + copy.first);
+        }
+    }
+    
+    BackendType type() const override { return BackendType::CUDA; }
+    
+    void forward(float* hidden, size_t n_tokens, float* k, float* v, ScratchArena& arena) const override {
+        for (const TransformerLayer& layer : layers_) layer.forward(hidden, n_tokens, k, v, 0, arena);
+    }
+    
+    void forward_packed(float* hidden, const std::vector<size_t>& offsets, float* k, float* v,
+                        ScratchArena& arena) const override {
+        for (const TransformerLayer& layer : layers_) layer.forward_packed(hidden, offsets, k, v, arena);
+    }
+    
+    void forward_sequences(float* hidden, size_t n_tokens, const SequenceKV* seqs, size_t n_seqs,
+                           ScratchArena& arena) const override {
+        for (size_t l = 0; l < layers_.size(); ++l) {
+            layers_[l].forward_sequences(hidden, n_tokens, seqs + l * n_seqs, n_seqs, arena);
+        }
+    }
+
+private:
+    WeightStore weights_;
+    std::vector<TransformerLayer> layers_;
+};
+
+std::unique_ptr<LayerBackend> make_host_device(const LlamaLexConfig& config, const WeightStore& weights,
+                                               size_t first, size_t last) {
+    return std::unique_ptr<LayerBackend>(new HostDeviceBackend(config, weights, first, last));
+}
+
+std::unique_ptr<LayerBackend> make_missing_device(const LlamaLexConfig&, const WeightStore&, size_t, size_t) {
+    throw std::runtime_error("no device");
+}
+
+// What an engine produces through each LayerBackend entry point
+struct Outputs {
+    std::string generated;        // forward_sequences, one span slice per layer range
+    std::vector<float> encoded;   // forward
+    std::vector<float> batch;     // forward_packed
+    std::vector<size_t> offsets;
+    
+    bool operator==(const Outputs& other) const {
+        return generated == other.generated && encoded == other.encoded && batch == other.batch &&
+               offsets == other.offsets;
+    }
+};
+
+Outputs run(LlamaLex& model) {
+    const std::vector<std::string> docs = {"The appeal is dismissed with costs.",
+                                           "Section 34 of the Constitution guarantees access to courts.",
+                                           "The respondent shall pay the costs of the application."};
+    Outputs outputs;
+    outputs.generated = model.generate("The court held that", 16);
+    outputs.encoded = model.encode(docs[1]);
+    model.encode_batch(docs, outputs.batch, outputs.offsets);
+    return outputs;
+}
+
+void test_offload_matches_cpu() {
+    BackendRegistry::add(BackendType::CUDA, &make_host_device);
+    BackendRegistry::add(BackendType::VULKAN, &make_missing_device);
+    LlamaLexConfig config = small_config();
+    config.num_layers = 4;
+    LlamaLex cpu(config);
+    const Outputs reference = run(cpu);
+
+    const size_t gpu_layers[] = {1, 3, 4, 9};
+    for (size_t n : gpu_layers) {
+        config.backend = BackendType::CUDA;
+        config.gpu_layers = n;
+        LlamaLex model(config);
+        const LlamaLexModel& shared = *model.model();
+        const std::string what = "offloading " + std::to_string(n) + " of 4 layers matches the CPU engine";
+        check(shared.backend() == BackendType::CUDA && shared.offloaded_layers() == std::min<size_t>(n, 4) &&
+              run(model) == reference, what.c_str());
+    }
+
+    // A device that cannot start, and one that is not built in, fall back
+    const BackendType unavailable[] = {BackendType::VULKAN, BackendType::METAL};
+    for (BackendType type : unavailable) {
+        config.backend = type;
+        config.gpu_layers = 2;
+        LlamaLex model(config);
+        const std::string what = std::string("unavailable ") + backend_name(type) + " backend runs on the CPU";
+        check(model.model()->offloaded_layers() == 0 && model.model()->backend() == BackendType::CPU &&
+              run(model) == reference, what.c_str());
+    }
+
+    size_t offloaded = 0;
+    void* handle = llamalex_create_offloaded(512, 128, 4, 1, 2);
+    const uint32_t backend = handle ? llamalex_backend(handle, &offloaded) : 0;
+    llamalex_destroy(handle);
+    check(handle && backend == 1 && offloaded == 2, "llamalex_backend reports the offloaded span");
+    check(!llamalex_create_offloaded(512, 128, 4, 7, 2) && !llamalex_create_offloaded(512, 99, 4, 1, 2),
+          "llamalex_create_offloaded rejects an unknown backend and an unsplittable shape");
+
+    BackendRegistry::add(BackendType::CUDA, nullptr);
+    BackendRegistry::add(BackendType::VULKAN, nullptr);
+}
+
+void test_embedding_cache() {
+    const std::string path = "/tmp/llamalex_test_cache.bin";
+    std::remove(path.c_str());
+    const std::string text = "The court held that section 34 of the Constitution applies.";
+    LlamaLex model(small_config());
+    model.open_cache(path, 1 << 20);
+    const std::vector<float> miss = model.encode(text);
+    const std::vector<float> hit = model.encode(text);
+    check(model.cache_stats().hits == 1 && model.cache_stats().misses == 1 && hit.size() == miss.size() &&
+          std::memcmp(hit.data(), miss.data(), miss.size() * sizeof(float)) == 0,
+          "a repeated encode is an embedding cache hit, bit-identical to the miss");
+
+    LlamaLex other(small_config());
+    bool locked = false;
+    try {
+        other.open_cache(path, 1 << 20);
+    } catch (const std::runtime_error&) {
+        locked = true;
+    }
+    check(locked, "a second engine cannot open an embedding cache file in use");
+    std::remove(path.c_str());
+}
+
+void test_scheduler_matches_generate() {
+    // Small batches and pages split long prompts over several steps and
+    // let requests with a common opening share its pages
+    LlamaLexConfig config = small_config();
+    config.max_batch_tokens = 24;
+    config.kv_page_size = 8;
+    LlamaLex model(config);
+
+    const std::string opening = "In the matter between the applicant and the respondent, the court held that ";
+    const std::vector<std::string> prompts = {
+        opening + "the appeal is dismissed with costs.",
+        opening + "section 34 of the Constitution guarantees access to courts, and that the "
+                  "respondent was entitled to a fair public hearing before an independent tribunal.",
+        "Costs follow the result.",
+        opening + "the order of the court a quo is set aside.",
+        "The application is granted.",
+        opening + "the appeal is dismissed with costs.",
+    };
+    std::vector<SamplingParams> sampling(prompts.size());
+    for (size_t i = 1; i < sampling.size(); i += 2) {
+        sampling[i].temperature = 0.8f;
+        sampling[i].top_k = 40;
+        sampling[i].top_p = 0.9f;
+        sampling[i].seed = 7 + i;
+    }
+    std::vector<std::string> expected;
+    for (size_t i = 0; i < prompts.size(); ++i) {
+        expected.push_back(model.generate(prompts[i], 12 + 4 * i, sampling[i]));
+    }
+
+    const size_t max_active[] = {2, 3, 8};
+    for (size_t n : max_active) {
+        std::vector<std::string> generated;
+        {
+            Scheduler scheduler(model, n);
+            std::vector<std::future<std::string>> futures;
+            for (size_t i = 0; i < prompts.size(); ++i) {
+                futures.push_back(scheduler.submit_generate(prompts[i], 12 + 4 * i, sampling[i]));
+            }
+            for (auto& future : futures) generated.push_back(future.get());
+        }
+        const std::string what = "Scheduler with " + std::to_string(n) + " active requests matches generate";
+        check(generated == expected, what.c_str());
+    }
+}
+
+void test_speculative_matches_generate() {
+    const std::string prompt = "The court considered whether the restraint of trade clause was enforceable";
+    LlamaLex target(small_config());
+    const std::string expected = target.generate(prompt, 32);
+
+    // Random-init weights are seeded by name, so the draft is the target's first layer
+    LlamaLexConfig draft_config = small_config();
+    draft_config.num_layers = 1;
+    LlamaLex draft(draft_config);
+    const size_t n_drafts[] = {1, 4};
+    for (size_t n_draft : n_drafts) {
+        SpeculativeDecoder decoder(target, draft, n_draft);
+        const std::string what = "greedy speculative decoding with " + std::to_string(n_draft) +
+                                 "-token drafts matches generate";
+        check(decoder.generate(prompt, 32) == expected, what.c_str());
+    }
+
+    // A draft identical to the target has every proposal accepted
+    LlamaLex same(target.model());
+    SamplingParams sampling;
+    sampling.temperature = 0.8f;
+    sampling.top_k = 40;
+    sampling.top_p = 0.9f;
+    bool accepted = true, reproducible = true;
+    for (uint64_t seed = 1; seed <= 3; ++seed) {
+        sampling.seed = seed;
+        SpeculativeDecoder decoder(target, same, 4);
+        const std::string text = decoder.generate(prompt, 32, sampling);
+        accepted = accepted && decoder.stats().acceptance_rate() == 1.0;
+        SpeculativeDecoder again(target, same, 4);
+        reproducible = reproducible && again.generate(prompt, 32, sampling) == text;
+    }
+    check(accepted, "sampled speculative decoding accepts every proposal of an identical draft");
+    check(reproducible, "sampled speculative decoding is reproducible per seed");
+}
+
+// Suffix-only prefill may differ from a full one in the last bit of a logit
+int greedy_token(const std::vector<float>& logits) {
+    return static_cast<int>(std::max_element(logits.begin(), logits.end()) - logits.begin());
+}
+
+void test_prefix_cache_matches_prefill() {
+    // Prompts of several KV pages that share their opening pages
+    LlamaLexConfig config = small_config();
+    config.kv_page_size = 8;
+    config.reuse_kv_cache = false;
+    const std::string opening = "In the matter between the applicant and the respondent, the court held that ";
+    const std::vector<std::string> prompts = {opening + "the appeal is dismissed with costs.",
+                                              opening + "the order of the court a quo is set aside.",
+                                              opening + "section 34 of the Constitution guarantees access to courts.",
+                                              opening + "the appeal is dismissed with costs."};
+    LlamaLex plain(config);
+    std::vector<std::string> expected;
+    std::vector<int> expected_next;  // the greedy token after each prompt
+    for (const std::string& prompt : prompts) {
+        expected.push_back(plain.generate(prompt, 16));
+        expected_next.push_back(greedy_token(plain.prefill(plain.tokenizer().tokenize(prompt, false))));
+    }
+
+    // The second run's pool only fits the longest sequence, so its own
+    // pages have to come from evicted entries
+    size_t longest = 0;
+    for (const std::string& prompt : prompts) {
+        longest = std::max(longest, plain.tokenizer().tokenize(prompt, false).size());
+    }
+    const size_t max_pages[] = {0, (longest + 16 + config.kv_page_size - 1) / config.kv_page_size};
+    for (size_t pages : max_pages) {
+        config.kv_max_pages = pages;
+        LlamaLex model(config);
+        model.set_prefix_cache(1 << 20);
+        bool same = true;
+        for (size_t i = 0; i < prompts.size(); ++i) {
+            same = same && model.generate(prompts[i], 16) == expected[i] &&
+                   greedy_token(model.prefill(model.tokenizer().tokenize(prompts[i], false))) == expected_next[i];
+        }
+        const PrefixCache::Stats stats = model.prefix_cache_stats();
+        if (pages == 0) {
+            check(same && stats.hits > 0, "prefill and generate with a prefix cache match them without one");
+        } else {
+            check(same && stats.hits > 0 && stats.evictions > 0,
+                  "a prefix cache evicted for KV pages still matches prefill and generate");
+        }
+    }
+}
+
+// Byte pieces, printable ASCII, "▁" and a few whole words
+LegalTokenizer::Vocab small_vocab() {
+    const std::string space = "\xE2\x96\x81";
+    LegalTokenizer::Vocab vocab;
+    vocab.pieces = {"<unk>", "<s>", "</s>"};
+    char byte_piece[8];
+    for (int b = 0; b < 256; ++b) {
+        std::snprintf(byte_piece, sizeof(byte_piece), "<0x%02X>", b);
+        vocab.pieces.push_back(byte_piece);
+    }
+    for (char c = 33; c < 127; ++c) vocab.pieces.push_back(std::string(1, c));
+    vocab.pieces.push_back(space);
+    const char* words[] = {"the", "court", "appeal", "section", "Act", "held", "that"};
+    for (const char* word : words) vocab.pieces.push_back(space + word);
+    return vocab;
+}
+
+void test_tokenizer_round_trip() {
+    const std::string texts[] = {
+        "The appeal is dismissed with costs; see section 34 of the Act.",
+        "Caf\xC3\xA9 \xC2\xA7 12 \xE2\x80\x94 \xE2\x80\x9Cna\xC3\xAFve\xE2\x80\x9D r\xC3\xA9sum\xC3\xA9 \xE6\xB3\x95\xE9\x99\xA2 \xF0\x9F\x93\x9C",
+        "In Smith v. Jones 2019 (3) SA 123 (CC) the court applied s 34(1)(b) of Act 108 of 1996; see "
+        "[2019] ZACC 12 at para 41 and ss 25-27.",
+        "  leading spaces,\ttabs\nand newlines  ",
+    };
+    const bool modes[] = {false, true};
+    for (bool legal : modes) {
+        LegalTokenizer tokenizer(512, legal, legal);
+        tokenizer.set_vocab(small_vocab());
+        bool exact = true;
+        for (const std::string& text : texts) exact = exact && tokenizer.detokenize(tokenizer.tokenize(text)) == text;
+        check(exact, legal ? "detokenize reverses tokenize with citation atoms"
+                           : "detokenize reverses tokenize over ASCII and multi-byte UTF-8");
+    }
+
+    // The vocabulary travels with the weights in a saved GGUF file
+    const std::string vocab_path = "/tmp/llamalex_test_vocab.txt", path = "/tmp/llamalex_test_model.gguf";
+    {
+        std::ofstream out(vocab_path.c_str());
+        for (const std::string& piece : small_vocab().pieces) out << piece << '\n';
+    }
+    LlamaLexConfig config = small_config();
+    config.enable_case_law_mode = true;
+    LlamaLex model(config);
+    model.load_vocab(vocab_path);
+    model.save(path);
+    LlamaLex loaded(path, config);
+    bool same = loaded.tokenizer().has_vocab();
+    for (const std::string& text : texts) {
+        same = same && loaded.tokenizer().tokenize(text) == model.tokenizer().tokenize(text) &&
+               loaded.encode(text) == model.encode(text) && loaded.generate(text, 16) == model.generate(text, 16);
+    }
+    check(same, "a model saved to GGUF loads back with the same tokens, encodings and generations");
+    std::remove(vocab_path.c_str());
+    std::remove(path.c_str());
+}
+
+} // namespace
+
+int main() {
+    test_encode_steady_state();
+    test_decode_steady_state();
+    test_analyze_case_steady_state();
+    test_offload_matches_cpu();
+    test_embedding_cache();
+    test_scheduler_matches_generate();
+    test_speculative_matches_generate();
+    test_prefix_cache_matches_prefill();
+    test_tokenizer_round_trip();
+    if (g_failures) std::printf("%d check(s) failed\n", g_failures);
+    return g_failures ? 1 : 0;
+}